@@ -40,16 +40,17 @@
 #include <AggregateDictionary/ADClient.h>
 #include <syslog.h>
 #include "PrivateLib.h"
+#include "PMIOReportSampler.h"
 
 
 
-//channel subscription handle
-static dispatch_source_t                 gAggdMonitor = NULL;
 //interval between two collection
 static uint64_t                          gAggdMonitorInterval = (1 *3600LL * NSEC_PER_SEC);  // read events report every 1 hour
 //4 test
 //static uint64_t                            gAggdMonitorInterval = (20*NSEC_PER_SEC);  // report every 24
 
+//number of hourly deltas the sampler keeps per event
+#define AGGD_SAMPLE_HISTORY 24
 
 
 //Bundle of event name and aggd keys associated with the event
@@ -73,31 +74,8 @@ Daily_Report_Name_Keys = {{
 
 
 
-/* We use this structure to hold channel subscription to ioreporter. */
-static struct IOReporter_client_subscription {
-    IOReportSubscriptionRef subscription;
-    CFMutableDictionaryRef subscribed_channels;
-} *IOReporter_subscription = NULL;
-
-#define CHANNEL_NUMSTATES 2
-
-//the structure that collects data
 //we expect two state for each event, 0 when it is not occured and 1 for duration when it is occuring
-struct IOReport_Event_Buffer
-{
-    double Event_StateResidency[CHANNEL_NUMSTATES];
-    uint64_t Event_Triggered_Count;
-};
-
-//One buffer per event we are collecting
-static struct IOReport_DailySample
-{
-    struct IOReport_Event_Buffer DailyReportingEvent;
-    CFMutableDictionaryRef sampledData;
-    
-}
-//for holding total event values collected
-*IOReport_DailySample_Buffer = NULL;
+#define CHANNEL_NUMSTATES 2
 
 //Setup daily report
 void initializeAggdDailyReport(void);
@@ -37,6 +37,7 @@
 #include "RepeatingAutoWake.h"
 #include "PMAssertions.h"
 #include "PMSettings.h"
+#include "PMSnapshot.h"
 #include <libproc.h>
 
 
@@ -66,6 +67,9 @@ PowerEventBehavior          poweronBehavior;
 PowerEventBehavior          wakeorpoweronBehavior;
 
 static uint32_t     activeEventCnt = 0;
+static CFDictionaryRef  gPrefetchedPrefs = NULL;
+static dispatch_group_t gPrefetchGroup = NULL;
+
 static bool         wakePurgeAllowed = true;
 enum {
     kBehaviorsCount = 6
@@ -91,6 +95,7 @@ static bool             isEntryValidAndFuturistic(CFDictionaryRef, CFDateRef);
 static void             schedulePowerEvent(PowerEventBehavior *);
 static void             purgePastEvents(PowerEventBehavior *);
 static void             copyScheduledPowerChangeArrays(void);
+static void             waitForPrefetch(void);
 static CFDictionaryRef  copyEarliestUpcoming(PowerEventBehavior *);
 static CFDateRef        _getScheduledEventDate(CFDictionaryRef);
 static CFArrayRef       copyMergedEventArray(PowerEventBehavior *, 
@@ -147,6 +152,36 @@ void restartTimerExpiredCallout(CFDictionaryRef);
  *
  * The event array pointer gets modified. 
  */
+/*
+ * Serialized copy of the schedule served to readers on the read queue.
+ * scheduledEventsChanged() must be called whenever a behavior's event array changes.
+ */
+static PMSnapshotRef scheduledEventsSnapshot(void)
+{
+    static PMSnapshotRef    snapshot = NULL;
+    static dispatch_once_t  onceToken;
+
+    dispatch_once(&onceToken, ^{
+        snapshot = PMSnapshotCreate(^CFDataRef(void) {
+            CFArrayRef  events = copyScheduledPowerEvents();
+            CFDataRef   serialized = NULL;
+
+            if (events) {
+                serialized = CFPropertyListCreateData(0, events, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+                CFRelease(events);
+            }
+            return serialized;
+        });
+    });
+
+    return snapshot;
+}
+
+static void scheduledEventsChanged(void)
+{
+    PMSnapshotInvalidate(scheduledEventsSnapshot());
+}
+
 static void
 removeEventsByAppName(PowerEventBehavior *behave, CFStringRef appName)
 {
@@ -172,6 +207,7 @@ removeEventsByAppName(PowerEventBehavior *behave, CFStringRef appName)
 
             CFArrayRemoveValueAtIndex(behave->array, j);
             activeEventCnt--;
+            scheduledEventsChanged();
         }
     }
 
@@ -217,11 +253,18 @@ AutoWake_prime(void)
             poweronBehavior.sharedEvents = &wakeorpoweronBehavior;
 
 
-    // system bootup; read prefs from disk
+    // system bootup; read prefs from disk, unless AutoWake_prefetch() already did
     copyScheduledPowerChangeArrays();
     
     RepeatingAutoWake_prime();
 
+    // Later reloads always go to disk
+    waitForPrefetch();
+    if (gPrefetchedPrefs) {
+        CFRelease(gPrefetchedPrefs);
+        gPrefetchedPrefs = NULL;
+    }
+
     for(i=0; i<kBehaviorsCount; i++) 
     {
         this_behavior = behaviors[i];
@@ -284,6 +327,7 @@ __private_extern__ void AutoWakeCalendarChange(void)
     PowerEventBehavior      *this_behavior;
     int i;
     
+    RepeatingAutoWake_timeChanged(false);
     for(i=0; i<kBehaviorsCount; i++)
     {
         this_behavior = behaviors[i];
@@ -316,7 +360,7 @@ static void handleTimerExpiration(void *info)
     if(!behave) return;
 
     if (behave->timer) {
-        dispatch_release(behave->timer);
+        PMTimerCancel(behave->timer);
         behave->timer = NULL;
     }
     
@@ -353,7 +397,7 @@ schedulePowerEvent(PowerEventBehavior *behave)
 
     if(behave->timer) 
     {
-        dispatch_release(behave->timer);
+        PMTimerCancel(behave->timer);
         behave->timer = NULL;
     }
     
@@ -386,17 +430,13 @@ schedulePowerEvent(PowerEventBehavior *behave)
 
     fire_time = CFDateGetAbsoluteTime(temp_date);
 
-    int delta = (int)(fire_time - CFAbsoluteTimeGetCurrent());
+    CFAbsoluteTime now = PMClockAbsoluteTime();
+    int delta = (int)(fire_time - now);
     if (delta) {
-        behave->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-        dispatch_source_set_event_handler(behave->timer, ^{
+        behave->timer = PMTimerCreate(_getPMMainQueue(), ^{
             handleTimerExpiration(behave);
         });
-
-        if(behave->timer) {
-            dispatch_resume(behave->timer);
-            dispatch_source_set_timer(behave->timer, dispatch_walltime(DISPATCH_TIME_NOW, delta*NSEC_PER_SEC), DISPATCH_TIME_FOREVER, 0);
-        }
+        PMTimerScheduleAtDate(behave->timer, now + delta);
     }
 
 exit:
@@ -501,7 +541,7 @@ __private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave
     CFDictionaryRef     one_event = NULL;
     CFDictionaryRef     event = NULL;
     CFDictionaryRef     repeat_event = NULL;
-    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime      now = PMClockAbsoluteTime();
     CFAbsoluteTime      one_event_ts = 0;
     CFAbsoluteTime      wakeup_abs = 0;
     CFDictionaryRef     selected_event = NULL;
@@ -641,7 +681,7 @@ void wakeTimerExpiredCallout(CFDictionaryRef event)
 
 void sleepTimerExpiredCallout(CFDictionaryRef event)
 {
-    CFDateRef now = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+    CFDateRef now = CFDateCreate(0, PMClockAbsoluteTime());
     CFDateRef event_date = CFDateCreate(0, (CFDateGetAbsoluteTime(_getScheduledEventDate(event)) + MIN_EVENT_LEEWAY));
     bool expired = false;
     if (CFDateCompare(event_date, now, 0) == kCFCompareLessThan) {
@@ -748,7 +788,7 @@ purgePastEvents(PowerEventBehavior  *behave)
         return;
     }
     
-    date_now = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+    date_now = CFDateCreate(0, PMClockAbsoluteTime());
 
     // Loop over the array and remove any values that are in the past.
     // Since array is sorted by date already, we stop once we reach an event
@@ -765,6 +805,7 @@ purgePastEvents(PowerEventBehavior  *behave)
         // The rest of the array will shift down to fill index 0
         CFArrayRemoveValueAtIndex(behave->array, 0);
         activeEventCnt--;
+        scheduledEventsChanged();
     }
 
     CFRelease(date_now);
@@ -773,6 +814,80 @@ purgePastEvents(PowerEventBehavior  *behave)
 }
 
 
+/*
+ * AutoWake_prefetch
+ *
+ * Starts reading the AutoWake prefs file on a background queue during startup,
+ * so that AutoWake_prime() doesn't block on disk. The read doesn't touch any
+ * other state; gPrefetchedPrefs is only handed over through waitForPrefetch().
+ */
+__private_extern__ void
+AutoWake_prefetch(void)
+{
+    gPrefetchGroup = dispatch_group_create();
+    if (!gPrefetchGroup) return;
+
+    dispatch_group_async(gPrefetchGroup, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+        SCPreferencesRef        prefs;
+        CFArrayRef              keys;
+        CFMutableDictionaryRef  prefetched;
+        CFIndex                 i, count;
+
+        prefs = SCPreferencesCreate(0,
+                                    CFSTR("PM-configd-AutoWake"),
+                                    CFSTR(kIOPMAutoWakePrefsPath));
+        if(!prefs) return;
+
+        // NULL means the file couldn't be read, which is not the same as no
+        // schedules; leave gPrefetchedPrefs NULL so the prime reads it again.
+        keys = SCPreferencesCopyKeyList(prefs);
+        if (!keys) {
+            CFRelease(prefs);
+            return;
+        }
+
+        prefetched = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (prefetched) {
+            count = CFArrayGetCount(keys);
+            for (i = 0; i < count; i++) {
+                CFStringRef key = CFArrayGetValueAtIndex(keys, i);
+                CFPropertyListRef value = SCPreferencesGetValue(prefs, key);
+                if (value) {
+                    CFDictionarySetValue(prefetched, key, value);
+                }
+            }
+        }
+
+        CFRelease(keys);
+        CFRelease(prefs);
+
+        gPrefetchedPrefs = prefetched;
+    });
+}
+
+// Called on the main queue. Waits for AutoWake_prefetch() to finish, once.
+static void
+waitForPrefetch(void)
+{
+    if (!gPrefetchGroup) return;
+
+    dispatch_group_wait(gPrefetchGroup, DISPATCH_TIME_FOREVER);
+    dispatch_release(gPrefetchGroup);
+    gPrefetchGroup = NULL;
+}
+
+/*
+ * Returns the AutoWake prefs read by AutoWake_prefetch(), or NULL if the read
+ * failed or AutoWake_prime() has consumed them. Callers fall back to reading
+ * the prefs file themselves.
+ */
+__private_extern__ CFDictionaryRef
+AutoWakePrefetchedPrefs(void)
+{
+    waitForPrefetch();
+    return gPrefetchedPrefs;
+}
+
 /*
  *
  * copySchedulePowerChangeArrays
@@ -782,16 +897,19 @@ static void
 copyScheduledPowerChangeArrays(void)
 {
     CFArrayRef              tmp;
-    SCPreferencesRef        prefs;
+    SCPreferencesRef        prefs = NULL;
     PowerEventBehavior      *this_behavior;
     int                     i;
    
-    prefs = SCPreferencesCreate(0, 
-                                CFSTR("PM-configd-AutoWake"),
-                                CFSTR(kIOPMAutoWakePrefsPath));
-    if(!prefs) return;
+    if (!AutoWakePrefetchedPrefs()) {
+        prefs = SCPreferencesCreate(0,
+                                    CFSTR("PM-configd-AutoWake"),
+                                    CFSTR(kIOPMAutoWakePrefsPath));
+        if(!prefs) return;
+    }
 
     activeEventCnt = 0;
+    scheduledEventsChanged();
     // Loop through all sleep, wake, shutdown powerbehaviors
     for(i=0; i<kBehaviorsCount; i++) 
     {
@@ -802,10 +920,15 @@ copyScheduledPowerChangeArrays(void)
             this_behavior->array = NULL;
         }
 
-        tmp = isA_CFArray(SCPreferencesGetValue(prefs, this_behavior->title));
+        if (prefs) {
+            tmp = isA_CFArray(SCPreferencesGetValue(prefs, this_behavior->title));
+        } else {
+            tmp = isA_CFArray(CFDictionaryGetValue(gPrefetchedPrefs, this_behavior->title));
+        }
         if(tmp && (0 < CFArrayGetCount(tmp))) {
             this_behavior->array = CFArrayCreateMutableCopy(0, 0, tmp);
             activeEventCnt += CFArrayGetCount(tmp);
+            scheduledEventsChanged();
         } else {
             this_behavior->array = NULL;
         }
@@ -813,7 +936,7 @@ copyScheduledPowerChangeArrays(void)
 
 
 
-    CFRelease(prefs);
+    if (prefs) CFRelease(prefs);
 
 }
 
@@ -851,7 +974,7 @@ copyEarliestUpcoming(PowerEventBehavior *b)
     if (arr && (count = CFArrayGetCount(arr)) != 0) {
 
         
-        now = CFDateCreate(0, CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME);
+        now = CFDateCreate(0, PMClockAbsoluteTime() + MIN_SCHEDULE_TIME);
 
         // iterate through all past entries, stopping at one occurring  
         // >MIN_SCHEDULE_TIME seconds in the future, or at the end of the array
@@ -1037,6 +1160,7 @@ addEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
         CFArrayAppendValue(behave->array, event);
     }
     activeEventCnt++;
+    scheduledEventsChanged();
 
 }
 
@@ -1112,6 +1236,7 @@ removeEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
                 }
                 CFArrayRemoveValueAtIndex(behave->array, i);
                 activeEventCnt--;
+                scheduledEventsChanged();
                 return true;
             }
         }
@@ -1143,6 +1268,7 @@ removeAllEvents(audit_token_t token)
             behaviors[i]->currentEvent = NULL;
         }
         CFArrayRemoveAllValues(behaviors[i]->array);
+        scheduledEventsChanged();
         if((ret=updateToDisk(prefs, behaviors[i], behaviors[i]->title) != kIOReturnSuccess)) {
             ret=kIOReturnError;
             goto exit;
@@ -1165,6 +1291,7 @@ removeAllEvents(audit_token_t token)
 
     }
     activeEventCnt=0;
+    scheduledEventsChanged();
     ret=kIOReturnSuccess;
 exit:
     destroySCSession(prefs, 1);
@@ -1333,6 +1460,14 @@ exit:
     return KERN_SUCCESS;
 }
 
+/*
+ * Returns the serialized schedule published for the read queue.
+ */
+__private_extern__ CFDataRef copyScheduledPowerEventsData(void)
+{
+    return PMSnapshotCopyData(scheduledEventsSnapshot());
+}
+
 __private_extern__ CFArrayRef copyScheduledPowerEvents(void)
 {
 
@@ -1385,7 +1520,7 @@ __private_extern__ bool checkPendingWakeReqs(int options)
     CFAbsoluteTime      upperbound_ts = 0, lowerbound_ts = 0;
     CFAbsoluteTime      wakeup_abs = 0;
 
-    now_ts = CFAbsoluteTimeGetCurrent();
+    now_ts = PMClockAbsoluteTime();
     if (options & PREVENT_PURGING) {
         // First purge any past events and then prevent purging
         purgePastEvents(behave);
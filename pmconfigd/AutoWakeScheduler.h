@@ -32,6 +32,8 @@
 #ifndef _AutoWakeScheduler_h_
 #define _AutoWakeScheduler_h_
 
+#include "PMClock.h"
+
 #define kIOPMRepeatingAppName               "Repeating"
 
 /* Flags for checkPendingWakeReqs() */
@@ -60,7 +62,7 @@ struct PowerEventBehavior {
     // and upcoming power events
     CFMutableArrayRef       array;
     CFDictionaryRef         currentEvent;
-    dispatch_source_t       timer;
+    PMTimerRef              timer;
     
     CFStringRef             title;
     
@@ -75,7 +77,9 @@ struct PowerEventBehavior {
 typedef struct PowerEventBehavior PowerEventBehavior;
 
 
+__private_extern__ void             AutoWake_prefetch(void);
 __private_extern__ void             AutoWake_prime(void);
+__private_extern__ CFDictionaryRef  AutoWakePrefetchedPrefs(void);
 __private_extern__ void             AutoWakeCapabilitiesNotification(IOPMSystemPowerStateCapabilities old_cap, IOPMSystemPowerStateCapabilities new_cap);
 __private_extern__ void             AutoWakeCalendarChange(void);
 __private_extern__ IOReturn         createSCSession(SCPreferencesRef *prefs, uid_t euid, int lock);
@@ -86,6 +90,8 @@ __private_extern__ CFTimeInterval   getEarliestRequestAutoWake(void);
 __private_extern__ CFDictionaryRef copyEarliestRequestAutoWakeEvent(void);
 __private_extern__ CFDictionaryRef copyEarliestShutdownRestartEvent(void);
 __private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior *behav);
+__private_extern__ CFArrayRef       copyScheduledPowerEvents(void);
+__private_extern__ CFDataRef        copyScheduledPowerEventsData(void);
 
 
 __private_extern__ bool             checkPendingWakeReqs(int options);
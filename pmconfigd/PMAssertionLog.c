@@ -29,6 +29,8 @@
 #include "PMAssertions.h"
 #include "PrivateLib.h"
 #include "BatteryTimeRemaining.h"
+#include "PMLogQueue.h"
+#include "PMClock.h"
 
 #include <IOReport.h>
 
@@ -174,7 +176,7 @@ static void logAssertionActivity(assertLogAction  action,
     if (!entry) return;
 
     // Current time of this activity
-    time = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+    time = CFDateCreate(0, PMClockAbsoluteTime());
     if (time) {
         CFDictionarySetValue(entry, kIOPMAssertionActivityTime, time);
         CFRelease(time);
@@ -186,15 +188,17 @@ static void logAssertionActivity(assertLogAction  action,
     }
 
     // Creation time of assertion
-    if ((createTime = CFDictionaryGetValue(props, kIOPMAssertionCreateDateKey)) != NULL)
+    if (assertion->createDate && (createTime = CFDateCreate(0, assertion->createDate)) != NULL) {
         CFDictionarySetValue(entry, kIOPMAssertionCreateDateKey, createTime);
+        CFRelease(createTime);
+    }
 
     // Assertion type
-    if ((type = CFDictionaryGetValue(props, kIOPMAssertionTypeKey)) != NULL)
+    if ((type = PMInternGetString(assertion->typeStr)) != NULL)
         CFDictionarySetValue(entry, kIOPMAssertionTypeKey, type);
 
     // Assertion name
-    if ((name = CFDictionaryGetValue(props, kIOPMAssertionNameKey)) != NULL)
+    if ((name = PMInternGetString(assertion->nameStr)) != NULL)
         CFDictionarySetValue(entry, kIOPMAssertionNameKey, name);
 
     // Type of assertion action
@@ -213,8 +217,10 @@ static void logAssertionActivity(assertLogAction  action,
     }
 
     // Assertion ID
-    if ((uniqueAID = CFDictionaryGetValue(props, kIOPMAssertionGlobalUniqueIDKey)) != NULL) 
+    if (assertion->uniqueId && (uniqueAID = CFNumberCreate(NULL, kCFNumberSInt64Type, &assertion->uniqueId)) != NULL) {
         CFDictionarySetValue(entry, kIOPMAssertionGlobalUniqueIDKey, uniqueAID);
+        CFRelease(uniqueAID);
+    }
 
     // Assertion on behalf of PID
     if ((onBehalfPid = CFDictionaryGetValue(props, kIOPMAssertionOnBehalfOfPID)) != NULL) 
@@ -357,7 +363,6 @@ static void logAssertionToASL(assertLogAction  action,
     const int       kShortStringLen         = 10;
     CFStringRef     foundAssertionType      = NULL;
     CFStringRef     foundAssertionName      = NULL;
-    CFDateRef       foundDate               = NULL;
     CFStringRef     procName                = NULL;
     char            proc_name_buf[kProcNameBufLen];
     char            assertionTypeCString[kLongStringLen];
@@ -367,7 +372,6 @@ static void logAssertionToASL(assertLogAction  action,
     char            assertionsBuf[kLongStringLen];
     char            aslAssertionId[kLongStringLen];
     char            assertionQualifierBuf[kLongStringLen];
-    CFMutableDictionaryRef assertionDictionary;
     char            *assertionAction = NULL;
     assertionType_t         *assertType = NULL;
 
@@ -456,42 +460,37 @@ static void logAssertionToASL(assertLogAction  action,
 
     }
 
-    assertionDictionary = assertion->props;
-    if (assertionDictionary)
-    {
-        /* 
-         * Log the assertion type:
-         */
-        foundAssertionType = CFDictionaryGetValue(assertionDictionary, kIOPMAssertionTypeKey);        
-        if (foundAssertionType) {
-            CFStringGetCString(foundAssertionType, assertionTypeCString, 
-                               sizeof(assertionTypeCString), kCFStringEncodingUTF8);
-        }
-
-        foundAssertionName = CFDictionaryGetValue(assertionDictionary, kIOPMAssertionNameKey);
-        if (foundAssertionName) {
-            CFStringGetCString(foundAssertionName, assertionNameCString, 
-                               sizeof(assertionNameCString), kCFStringEncodingUTF8);            
-        }
+    /* 
+     * Log the assertion type:
+     */
+    foundAssertionType = PMInternGetString(assertion->typeStr);
+    if (foundAssertionType) {
+        CFStringGetCString(foundAssertionType, assertionTypeCString, 
+                           sizeof(assertionTypeCString), kCFStringEncodingUTF8);
+    }
 
-        /*
-         * Assertion's age
-         */
-        if ((foundDate = CFDictionaryGetValue(assertionDictionary, kIOPMAssertionCreateDateKey)))
-        {
-            CFAbsoluteTime createdCFTime    = CFDateGetAbsoluteTime(foundDate);
-            int createdSince                = (int)(CFAbsoluteTimeGetCurrent() - createdCFTime);
-            int hours                       = createdSince / 3600;
-            int minutes                     = (createdSince / 60) % 60;
-            int seconds                     = createdSince % 60;
-            snprintf(ageString, sizeof(ageString), "%02d:%02d:%02d ", hours, minutes, seconds);
-        }
+    foundAssertionName = PMInternGetString(assertion->nameStr);
+    if (foundAssertionName) {
+        CFStringGetCString(foundAssertionName, assertionNameCString, 
+                           sizeof(assertionNameCString), kCFStringEncodingUTF8);            
+    }
 
+    /*
+     * Assertion's age
+     */
+    if (assertion->createDate)
+    {
+        int createdSince                = (int)(PMClockAbsoluteTime() - assertion->createDate);
+        int hours                       = createdSince / 3600;
+        int minutes                     = (createdSince / 60) % 60;
+        int seconds                     = createdSince % 60;
+        snprintf(ageString, sizeof(ageString), "%02d:%02d:%02d ", hours, minutes, seconds);
+    }
 
-        if ((procName = CFDictionaryGetValue(assertionDictionary, kIOPMAssertionProcessNameKey)))
-        {
-            CFStringGetCString(procName, proc_name_buf, sizeof(proc_name_buf), kCFStringEncodingUTF8);
-        }
+    // Only client assertions that have been raised carry a process name
+    if (assertion->assertionId && assertion->pinfo && (procName = assertion->pinfo->name))
+    {
+        CFStringGetCString(procName, proc_name_buf, sizeof(proc_name_buf), kCFStringEncodingUTF8);
     }
     printAggregateAssertionsToBuf(assertionsBuf, sizeof(assertionsBuf), getKerAssertionBits());
     snprintf(aslMessageString, sizeof(aslMessageString), "%s", assertionsBuf);
@@ -503,31 +502,30 @@ static void logAssertionToASL(assertLogAction  action,
 
     if (gDebugFlags & kIOPMDebugAssertionASLLog) {
         char  pid_buf[kShortStringLen];
-        aslmsg m = new_msg_pmset_log();
-        asl_set(m, kPMASLAssertionTypeKey, assertionTypeCString);
-        asl_set(m, kPMASLAssertionNameKey, assertionNameCString);
-        asl_set(m, kPMASLAssertionAgeKey, ageString);
+        pmlogmsg_t m = pmlog_new(kPMLogCategoryAssertions);
+        pmlog_set(m, kPMASLAssertionTypeKey, assertionTypeCString);
+        pmlog_set(m, kPMASLAssertionNameKey, assertionNameCString);
+        pmlog_set(m, kPMASLAssertionAgeKey, ageString);
 
         if (1 != assertion->retainCnt)
         {
             char    retainCountBuf[kShortStringLen];
             snprintf(retainCountBuf, sizeof(retainCountBuf), "%d", assertion->retainCnt);
-            asl_set(m, "RetainCount", retainCountBuf);
+            pmlog_set(m, "RetainCount", retainCountBuf);
         }
 
 
-        asl_set(m, kPMASLProcessNameKey, proc_name_buf);
+        pmlog_set(m, kPMASLProcessNameKey, proc_name_buf);
         pid_buf[0] = 0;
         if (0 < snprintf(pid_buf, kShortStringLen, "%d", assertion->pinfo->pid)) {
-            asl_set(m, kPMASLPIDKey, pid_buf);
+            pmlog_set(m, kPMASLPIDKey, pid_buf);
         }
 
-        asl_set(m, kPMASLAssertionIdKey, aslAssertionId );
-        asl_set(m, ASL_KEY_MSG, aslMessageString);
-        asl_set(m, kPMASLActionKey, assertionAction);
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
-        asl_send(NULL, m);
-        asl_free(m);
+        pmlog_set(m, kPMASLAssertionIdKey, aslAssertionId );
+        pmlog_set(m, ASL_KEY_MSG, aslMessageString);
+        pmlog_set(m, kPMASLActionKey, assertionAction);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
+        pmlog_send(m);
     }
 
     if (gDebugFlags & kIOPMDebugLogAssertionActivity) {
@@ -576,12 +574,11 @@ void logASLAssertionsAggregate(void)
              capacityBuf);
 
     if (gDebugFlags & kIOPMDebugAssertionASLLog) {
-        aslmsg m = new_msg_pmset_log();
-        asl_set(m, ASL_KEY_MSG, aslMessageString);
-        asl_set(m, kPMASLActionKey, kPMASLAssertionActionSummary);
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
-        asl_send(NULL, m);
-        asl_free(m);
+        pmlogmsg_t m = pmlog_new(kPMLogCategoryAssertions);
+        pmlog_set(m, ASL_KEY_MSG, aslMessageString);
+        pmlog_set(m, kPMASLActionKey, kPMASLAssertionActionSummary);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
+        pmlog_send(m);
     }
 
     //
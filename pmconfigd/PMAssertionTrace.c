@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "PMAssertionTrace.h"
+#include "PMAssertions.h"
+#include "PMClock.h"
+#include "PrivateLib.h"
+
+#define kAssertionTraceEntitlement  CFSTR("com.apple.private.iokit.assertiontrace")
+#define kTraceBufSize               (64 * 1024)
+#define kTraceMaxBytes              (256ULL * 1024 * 1024)
+
+bool                                gAssertionTraceActive = false;
+
+static FILE                         *gTraceFile = NULL;
+static CFMutableDataRef             gTraceCapture = NULL;   // In-memory sink used by replay
+static uint64_t                     gTraceStartNs = 0;
+static uint64_t                     gTraceBytes = 0;
+static uint64_t                     gTraceRecords = 0;
+static mach_timebase_info_data_t    gTraceTimebase;
+
+static bool traceWrite(const void *bytes, size_t len)
+{
+    if (gTraceCapture) {
+        CFDataAppendBytes(gTraceCapture, bytes, (CFIndex)len);
+        return true;
+    }
+    if (fwrite(bytes, 1, len, gTraceFile) != len) {
+        ERROR_LOG("Failed to write assertion trace: %d\n", errno);
+        return false;
+    }
+    gTraceBytes += len;
+    return true;
+}
+
+void PMAssertionTraceRecord(pmTraceOp op, pid_t pid, IOPMAssertionID id,
+                            uint32_t value, uint64_t start, CFPropertyListRef payload)
+{
+    pmTraceRecord_t     rec;
+    CFDataRef           data = NULL;
+
+    if (!gAssertionTraceActive) {
+        return;
+    }
+
+    bzero(&rec, sizeof(rec));
+    rec.time = PMClockMonotonicNs() - gTraceStartNs;
+    rec.pid = pid;
+    rec.id = id;
+    rec.value = value;
+    rec.op = (uint16_t)op;
+    if (start) {
+        uint64_t ns = (mach_absolute_time() - start) * gTraceTimebase.numer / gTraceTimebase.denom;
+        rec.durationNs = (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)ns;
+    }
+    // The replay capture is compared record by record and never needs payloads
+    if (payload && !gTraceCapture) {
+        data = CFPropertyListCreateData(0, payload, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+        if (data) {
+            rec.payloadLen = (uint32_t)CFDataGetLength(data);
+        }
+    }
+
+    if (!gTraceCapture && (gTraceBytes + sizeof(rec) + rec.payloadLen > kTraceMaxBytes)) {
+        INFO_LOG("Assertion trace reached its size limit\n");
+        PMAssertionTraceStop();
+        goto exit;
+    }
+    if (!traceWrite(&rec, sizeof(rec)) ||
+        (data && !traceWrite(CFDataGetBytePtr(data), rec.payloadLen))) {
+        PMAssertionTraceStop();
+        goto exit;
+    }
+    gTraceRecords++;
+
+exit:
+    if (data) {
+        CFRelease(data);
+    }
+}
+
+IOReturn PMAssertionTraceStart(const char *path)
+{
+    pmTraceHeader_t     hdr;
+    int                 fd;
+
+    if (!path || !path[0]) {
+        return kIOReturnBadArgument;
+    }
+    if (gAssertionTraceActive) {
+        PMAssertionTraceStop();
+    }
+
+    fd = open(path, O_CREAT | O_EXCL | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ERROR_LOG("Failed to create assertion trace file: %d\n", errno);
+        return kIOReturnError;
+    }
+    gTraceFile = fdopen(fd, "w");
+    if (!gTraceFile) {
+        close(fd);
+        return kIOReturnNoMemory;
+    }
+    setvbuf(gTraceFile, NULL, _IOFBF, kTraceBufSize);
+
+    if (gTraceTimebase.denom == 0) {
+        mach_timebase_info(&gTraceTimebase);
+    }
+    gTraceStartNs = PMClockMonotonicNs();
+    gTraceBytes = 0;
+    gTraceRecords = 0;
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = kPMTraceMagic;
+    hdr.version = kPMTraceVersion;
+    hdr.headerSize = sizeof(hdr);
+    hdr.wallStart = PMClockAbsoluteTime();
+    hdr.monotonicStart = gTraceStartNs;
+    if (!traceWrite(&hdr, sizeof(hdr))) {
+        fclose(gTraceFile);
+        gTraceFile = NULL;
+        return kIOReturnIOError;
+    }
+
+    gAssertionTraceActive = true;
+    INFO_LOG("Assertion trace started\n");
+
+    return kIOReturnSuccess;
+}
+
+void PMAssertionTraceStop(void)
+{
+    gAssertionTraceActive = false;
+    if (gTraceFile) {
+        fclose(gTraceFile);
+        gTraceFile = NULL;
+        INFO_LOG("Assertion trace stopped after %llu records (%llu bytes)\n", gTraceRecords, gTraceBytes);
+    }
+}
+
+void setAssertionTrace(xpc_object_t remoteConnection, xpc_object_t msg)
+{
+    const char      *path;
+    IOReturn        rc;
+    xpc_object_t    respMsg;
+
+    if (!msg) {
+        ERROR_LOG("Invalid message\n");
+        return;
+    }
+    respMsg = xpc_dictionary_create_reply(msg);
+    if (!respMsg) {
+        ERROR_LOG("Failed to create response message\n");
+        return;
+    }
+
+    path = xpc_dictionary_get_string(msg, kAssertionTraceMsg);
+    if (!isSenderEntitled(remoteConnection, kAssertionTraceEntitlement, true)) {
+        ERROR_LOG("Ignoring assertion trace request from unprivileged sender\n");
+        rc = kIOReturnNotPrivileged;
+    }
+    else if (!path) {
+        rc = kIOReturnBadArgument;
+    }
+    else if (!path[0]) {
+        PMAssertionTraceStop();
+        rc = kIOReturnSuccess;
+    }
+    else {
+        rc = PMAssertionTraceStart(path);
+    }
+
+    xpc_dictionary_set_uint64(respMsg, kMsgReturnCode, rc);
+    xpc_connection_send_message(remoteConnection, respMsg);
+    xpc_release(respMsg);
+}
+
+#pragma mark -
+#pragma mark Replay
+#ifdef XCTEST
+
+// PMAssertions.c entry points exposed to XCTest
+IOReturn    doCreate(pid_t pid, CFMutableDictionaryRef newProperties, IOPMAssertionID *assertion_id,
+                     ProcessInfo **pinfo, int *enTrIntensity);
+IOReturn    doRetain(pid_t pid, IOPMAssertionID id, int *retainCnt);
+IOReturn    doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt);
+IOReturn    doSetProperties(pid_t pid, IOPMAssertionID id, CFDictionaryRef props, int *enTrIntensity);
+IOReturn    doUpdateProperties(pid_t pid, IOPMAssertionID id, const assertionUpdate_t *update);
+void        HandleProcessExit(pid_t deadPID);
+
+static IOReturn loadTrace(const char *path, uint8_t **outBuf, size_t *outLen)
+{
+    struct stat     st;
+    uint8_t         *buf = NULL;
+    int             fd;
+    IOReturn        ret = kIOReturnError;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return kIOReturnNotFound;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (st.st_size < (off_t)sizeof(pmTraceHeader_t))) {
+        goto exit;
+    }
+    buf = malloc((size_t)st.st_size);
+    if (!buf || (read(fd, buf, (size_t)st.st_size) != st.st_size)) {
+        goto exit;
+    }
+    if ((((pmTraceHeader_t *)buf)->magic != kPMTraceMagic) ||
+        (((pmTraceHeader_t *)buf)->version != kPMTraceVersion)) {
+        ret = kIOReturnUnsupported;
+        goto exit;
+    }
+
+    *outBuf = buf;
+    *outLen = (size_t)st.st_size;
+    buf = NULL;
+    ret = kIOReturnSuccess;
+
+exit:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+IOReturn PMAssertionTraceReadHeader(const char *path, pmTraceHeader_t *header)
+{
+    uint8_t     *buf = NULL;
+    size_t      len;
+    IOReturn    ret;
+
+    ret = loadTrace(path, &buf, &len);
+    if (ret == kIOReturnSuccess) {
+        memcpy(header, buf, sizeof(*header));
+        free(buf);
+    }
+    return ret;
+}
+
+static void replayCall(const pmTraceRecord_t *rec, const uint8_t *payload,
+                       CFMutableDictionaryRef idMap, pmTraceReplayResult_t *result)
+{
+    CFPropertyListRef   props = NULL;
+    IOPMAssertionID     id = kIOPMNullAssertionID;
+    IOReturn            ret = kIOReturnSuccess;
+    const void          *mapped = NULL;
+
+    if (payload) {
+        CFDataRef data = CFDataCreateWithBytesNoCopy(0, payload, rec->payloadLen, kCFAllocatorNull);
+        if (data) {
+            props = CFPropertyListCreateWithData(0, data, kCFPropertyListMutableContainers, NULL, NULL);
+            CFRelease(data);
+        }
+    }
+    if (rec->op != kPMTraceCreate &&
+        CFDictionaryGetValueIfPresent(idMap, (const void *)(uintptr_t)rec->id, &mapped)) {
+        id = (IOPMAssertionID)(uintptr_t)mapped;
+    }
+
+    switch (rec->op) {
+        case kPMTraceCreate:
+            if (!isA_CFDictionary(props)) {
+                result->skippedRecords++;
+                goto exit;
+            }
+            ret = doCreate(rec->pid, (CFMutableDictionaryRef)props, &id, NULL, NULL);
+            if ((ret == kIOReturnSuccess) && rec->id) {
+                CFDictionarySetValue(idMap, (const void *)(uintptr_t)rec->id, (const void *)(uintptr_t)id);
+            }
+            break;
+
+        case kPMTraceRetain:
+            ret = doRetain(rec->pid, id, NULL);
+            break;
+
+        case kPMTraceRelease:
+            ret = doRelease(rec->pid, id, NULL);
+            break;
+
+        case kPMTraceSetProperties:
+            if (!isA_CFDictionary(props)) {
+                result->skippedRecords++;
+                goto exit;
+            }
+            ret = doSetProperties(rec->pid, id, props, NULL);
+            break;
+
+        case kPMTraceUpdate: {
+            assertionUpdate_t   update = { 0 };
+            char                name[128];
+            CFNumberRef         num;
+            CFStringRef         str;
+
+            if (!isA_CFDictionary(props)) {
+                result->skippedRecords++;
+                goto exit;
+            }
+            if ((num = isA_CFNumber(CFDictionaryGetValue(props, kIOPMAssertionLevelKey)))) {
+                CFNumberGetValue(num, kCFNumberIntType, &update.level);
+                update.fields |= kAssertionUpdateLevel;
+            }
+            if ((num = isA_CFNumber(CFDictionaryGetValue(props, kIOPMAssertionTimeoutKey)))) {
+                CFNumberGetValue(num, kCFNumberDoubleType, &update.timeout);
+                update.fields |= kAssertionUpdateTimeout;
+            }
+            if ((str = isA_CFString(CFDictionaryGetValue(props, kIOPMAssertionNameKey))) &&
+                CFStringGetCString(str, name, sizeof(name), kCFStringEncodingUTF8)) {
+                update.name = name;
+                update.fields |= kAssertionUpdateName;
+            }
+            ret = doUpdateProperties(rec->pid, id, &update);
+            break;
+        }
+
+        case kPMTraceProcessExit:
+            HandleProcessExit(rec->pid);
+            break;
+
+        case kPMTraceSuspend:
+            handleAssertionSuspend(rec->pid);
+            break;
+
+        case kPMTraceResume:
+            handleAssertionResume(rec->pid);
+            break;
+
+        default:
+            result->skippedRecords++;
+            goto exit;
+    }
+
+    result->apiCalls++;
+    result->recordedCallNs += rec->durationNs;
+    if (rec->durationNs > result->recordedMaxCallNs) {
+        result->recordedMaxCallNs = rec->durationNs;
+    }
+    if (ret != (IOReturn)rec->value) {
+        result->returnMismatches++;
+    }
+
+exit:
+    if (props) {
+        CFRelease(props);
+    }
+}
+
+/*
+ * Walks the 'op' records of both timelines in order. Records the index of
+ * the first update whose value differs, and the largest time skew between
+ * matching updates before that.
+ */
+static void compareOutputs(CFDataRef expected, CFDataRef actual, pmTraceOp op,
+                           uint32_t *expectedCnt, uint32_t *actualCnt,
+                           int32_t *mismatchAt, uint64_t *maxSkewNs)
+{
+    const pmTraceRecord_t   *exp = (const pmTraceRecord_t *)CFDataGetBytePtr(expected);
+    const pmTraceRecord_t   *act = (const pmTraceRecord_t *)CFDataGetBytePtr(actual);
+    CFIndex                 expLen = CFDataGetLength(expected) / (CFIndex)sizeof(pmTraceRecord_t);
+    CFIndex                 actLen = CFDataGetLength(actual) / (CFIndex)sizeof(pmTraceRecord_t);
+    CFIndex                 i = 0, j = 0;
+    int32_t                 n = 0;
+
+    *expectedCnt = *actualCnt = 0;
+    *mismatchAt = -1;
+
+    for (;;) {
+        while ((i < expLen) && (exp[i].op != op)) i++;
+        while ((j < actLen) && (act[j].op != op)) j++;
+        if ((i == expLen) || (j == actLen)) {
+            break;
+        }
+
+        if ((*mismatchAt < 0) && (exp[i].value != act[j].value)) {
+            *mismatchAt = n;
+        }
+        else if (*mismatchAt < 0) {
+            uint64_t skew = (exp[i].time > act[j].time) ? (exp[i].time - act[j].time) : (act[j].time - exp[i].time);
+            if (skew > *maxSkewNs) {
+                *maxSkewNs = skew;
+            }
+        }
+        (*expectedCnt)++;
+        (*actualCnt)++;
+        n++;
+        i++;
+        j++;
+    }
+
+    // Whatever is left over on either side is a mismatch
+    for (; i < expLen; i++) {
+        if (exp[i].op == op) {
+            (*expectedCnt)++;
+            if (*mismatchAt < 0) {
+                *mismatchAt = n;
+            }
+        }
+    }
+    for (; j < actLen; j++) {
+        if (act[j].op == op) {
+            (*actualCnt)++;
+            if (*mismatchAt < 0) {
+                *mismatchAt = n;
+            }
+        }
+    }
+}
+
+IOReturn PMAssertionTraceReplay(const char *path, pmTraceReplayResult_t *result)
+{
+    uint8_t                 *buf = NULL;
+    size_t                  len = 0, off;
+    pmTraceHeader_t         hdr;
+    pmTraceRecord_t         rec;
+    CFMutableDataRef        expected = NULL;
+    CFMutableDictionaryRef  idMap = NULL;
+    uint64_t                base, wallStart;
+    IOReturn                ret;
+
+    if (!result) {
+        return kIOReturnBadArgument;
+    }
+    if (!PMClockIsVirtual()) {
+        return kIOReturnNotReady;
+    }
+    if ((ret = loadTrace(path, &buf, &len)) != kIOReturnSuccess) {
+        return ret;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    bzero(result, sizeof(*result));
+    result->kernelMismatchAt = result->aggregateMismatchAt = -1;
+
+    expected = CFDataCreateMutable(0, 0);
+    idMap = CFDictionaryCreateMutable(0, 0, NULL, NULL);
+
+    // Capture the calls and outputs of the replay in memory
+    PMAssertionTraceStop();
+    if (gTraceTimebase.denom == 0) {
+        mach_timebase_info(&gTraceTimebase);
+    }
+    gTraceCapture = CFDataCreateMutable(0, 0);
+    gTraceStartNs = base = PMClockMonotonicNs();
+    gAssertionTraceActive = true;
+
+    wallStart = mach_absolute_time();
+    for (off = hdr.headerSize; len - off >= sizeof(rec); off += sizeof(rec) + rec.payloadLen) {
+        uint64_t now = PMClockMonotonicNs();
+
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (len - off - sizeof(rec) < rec.payloadLen) {
+            // Truncated by a stop in the middle of a write
+            break;
+        }
+
+        if (base + rec.time > now) {
+            PMClockAdvance(base + rec.time - now);
+        }
+        result->tracedSpanNs = rec.time;
+
+        if ((rec.op == kPMTraceKernelBits) || (rec.op == kPMTraceAggregate)) {
+            CFDataAppendBytes(expected, (const UInt8 *)&rec, sizeof(rec));
+            continue;
+        }
+        replayCall(&rec, rec.payloadLen ? (buf + off + sizeof(rec)) : NULL, idMap, result);
+    }
+    result->replayWallNs = (mach_absolute_time() - wallStart) * gTraceTimebase.numer / gTraceTimebase.denom;
+    gAssertionTraceActive = false;
+
+    // Replayed call costs come from the records the replay itself produced
+    const pmTraceRecord_t *act = (const pmTraceRecord_t *)CFDataGetBytePtr(gTraceCapture);
+    for (CFIndex i = 0; i < CFDataGetLength(gTraceCapture) / (CFIndex)sizeof(rec); i++) {
+        if (act[i].op < kPMTraceKernelBits) {
+            result->replayedCallNs += act[i].durationNs;
+            if (act[i].durationNs > result->replayedMaxCallNs) {
+                result->replayedMaxCallNs = act[i].durationNs;
+            }
+        }
+    }
+
+    compareOutputs(expected, gTraceCapture, kPMTraceKernelBits,
+                   &result->recordedKernelUpdates, &result->replayedKernelUpdates,
+                   &result->kernelMismatchAt, &result->maxSkewNs);
+    compareOutputs(expected, gTraceCapture, kPMTraceAggregate,
+                   &result->recordedAggregateUpdates, &result->replayedAggregateUpdates,
+                   &result->aggregateMismatchAt, &result->maxSkewNs);
+
+    CFRelease(gTraceCapture);
+    gTraceCapture = NULL;
+    CFRelease(expected);
+    CFRelease(idMap);
+    free(buf);
+
+    return kIOReturnSuccess;
+}
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMAssertionTrace_h
+#define PMAssertionTrace_h
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <mach/mach_time.h>
+#include <xpc/xpc.h>
+
+/*
+ * Binary trace of assertion API traffic.
+ *
+ * When enabled (pmtool --assertiontrace <path>), every create, retain,
+ * release, property change, process exit and suspend/resume is appended to
+ * the trace with its pid, timestamp and cost. The resulting aggregate and
+ * kernel assertion bit changes are recorded too, so a replay of the inputs
+ * can be checked against what powerd actually did.
+ *
+ * File layout: one pmTraceHeader_t followed by pmTraceRecord_t entries.
+ * Create/set/update records are followed by 'payloadLen' bytes holding the
+ * request's properties as a binary plist. The in-memory capture taken
+ * during a replay holds records only, with payloadLen 0.
+ */
+
+/* XPC message key; value is the trace file path, or "" to stop tracing */
+#define kAssertionTraceMsg          "assertionTrace"
+
+#define kPMTraceMagic               0x504d4154      // 'PMAT'
+#define kPMTraceVersion             1
+
+typedef enum {
+    kPMTraceCreate = 1,
+    kPMTraceRetain,
+    kPMTraceRelease,
+    kPMTraceSetProperties,
+    kPMTraceUpdate,
+    kPMTraceProcessExit,
+    kPMTraceSuspend,
+    kPMTraceResume,
+
+    // Engine outputs
+    kPMTraceKernelBits,         // value: levels sent to the kernel
+    kPMTraceAggregate,          // value: aggregate assertion bitmap
+    kPMTracePowerSource,        // value: power source
+} pmTraceOp;
+
+typedef struct {
+    uint32_t        magic;
+    uint16_t        version;
+    uint16_t        headerSize;
+    CFAbsoluteTime  wallStart;
+    uint64_t        monotonicStart;     // ns
+} pmTraceHeader_t;
+
+typedef struct {
+    uint64_t        time;               // ns since the start of the trace
+    int32_t         pid;
+    uint32_t        id;                 // Assertion ID
+    uint32_t        value;              // IOReturn of API calls, op specific otherwise
+    uint32_t        durationNs;         // Time spent handling an API call
+    uint16_t        op;
+    uint16_t        reserved;
+    uint32_t        payloadLen;
+} pmTraceRecord_t;
+
+extern bool gAssertionTraceActive;
+
+/* Returns a start timestamp for PMAssertionTraceRecord(), or 0 if tracing is off */
+static inline uint64_t PMAssertionTraceBegin(void)
+{
+    return gAssertionTraceActive ? mach_absolute_time() : 0;
+}
+
+/*
+ * Appends a record. 'start' is the PMAssertionTraceBegin() value for API
+ * calls, 0 otherwise. 'payload' may be NULL. Must be called on the PM main
+ * queue.
+ */
+__private_extern__ void PMAssertionTraceRecord(pmTraceOp op, pid_t pid, IOPMAssertionID id,
+                                               uint32_t value, uint64_t start, CFPropertyListRef payload);
+
+__private_extern__ IOReturn PMAssertionTraceStart(const char *path);
+__private_extern__ void PMAssertionTraceStop(void);
+
+/* XPC handler for kAssertionTraceMsg; root and the assertiontrace entitlement only */
+__private_extern__ void setAssertionTrace(xpc_object_t remoteConnection, xpc_object_t msg);
+
+#ifdef XCTEST
+typedef struct {
+    uint32_t        apiCalls;           // API calls replayed
+    uint32_t        returnMismatches;   // Calls whose return code differs from the recording
+    uint32_t        skippedRecords;     // Records that can't be replayed (e.g. power source changes)
+    uint64_t        tracedSpanNs;       // Time covered by the recording
+    uint64_t        replayWallNs;       // Real time spent replaying
+    uint64_t        recordedCallNs;     // Total API call time in the recording
+    uint64_t        replayedCallNs;     // Total API call time during replay
+    uint32_t        recordedMaxCallNs;
+    uint32_t        replayedMaxCallNs;
+
+    uint32_t        recordedKernelUpdates;
+    uint32_t        replayedKernelUpdates;
+    int32_t         kernelMismatchAt;   // Index of the first differing kernel update; -1 if none
+    uint32_t        recordedAggregateUpdates;
+    uint32_t        replayedAggregateUpdates;
+    int32_t         aggregateMismatchAt;
+    uint64_t        maxSkewNs;          // Largest time difference between matching output records
+} pmTraceReplayResult_t;
+
+/*
+ * Reads the header of the trace at 'path', so the caller can start the
+ * virtual clock at the recording's wall time before priming the engine.
+ */
+__private_extern__ IOReturn PMAssertionTraceReadHeader(const char *path, pmTraceHeader_t *header);
+
+/*
+ * Feeds the API calls in the trace at 'path' to the assertion engine, moving
+ * the virtual clock to each record's timestamp, and compares the resulting
+ * kernel bit and aggregate timelines with the recorded ones.
+ * Requires PMClockSetVirtual(). Must be called on the PM main queue.
+ */
+__private_extern__ IOReturn PMAssertionTraceReplay(const char *path, pmTraceReplayResult_t *result);
+#endif
+
+#endif /* PMAssertionTrace_h */
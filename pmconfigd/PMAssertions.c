@@ -44,6 +44,7 @@
 #include <xpc/xpc.h>
 #include <os/state_private.h>
 #include <RunningBoardServices/RBSAssertionAdapter_Private.h>
+#include <os/lock.h>
 
 
 #include "PMConnection.h"
@@ -55,6 +56,11 @@
 #include "powermanagementServer.h"
 #include "SystemLoad.h"
 #include "Platform.h"
+#include "PMSnapshot.h"
+#include "PMClock.h"
+#include "PMLingerPolicy.h"
+#include "PMAssertionTrace.h"
+#include "PMXPCRouter.h"
 #if (TARGET_OS_OSX && TARGET_CPU_ARM64) || XCTEST
 #include "PMDisplay.h"
 #endif
@@ -95,15 +101,15 @@ os_log_t    assertions_log = NULL;
 
 uint32_t gSAAssertionBehaviorFlags = kIOPMSystemActivityAssertionEnabled;
 
-CFArrayRef copyScheduledPowerEvents(void);
-CFDictionaryRef copyRepeatPowerEvents(void);
+CFDataRef copyScheduledPowerEventsData(void);
+CFDataRef copyRepeatPowerEventsData(void);
 
 // forward
 
 static void                         sendSmartBatteryCommand(uint32_t which, uint32_t level);
 static void                         sendUserAssertionsToKernel(uint32_t user_assertions);
-static void                         evaluateForPSChange(void);
-static void                         HandleProcessExit(pid_t deadPID);
+STATIC void                         evaluateForPSChange(void);
+STATIC void                         HandleProcessExit(pid_t deadPID);
 
 static bool                         callerIsEntitledToAssertion(audit_token_t token,
                                                                 CFDictionaryRef newAssertionProperties);
@@ -118,9 +124,11 @@ STATIC IOReturn                     doSetProperties(pid_t pid,
                                                     IOPMAssertionID id, 
                                                     CFDictionaryRef props,
                                                     int *enTrIntensity);
+STATIC IOReturn                     doUpdateProperties(pid_t pid,
+                                                       IOPMAssertionID id,
+                                                       const assertionUpdate_t *update);
 
 STATIC CFArrayRef                   copyPIDAssertionDictionaryFlattened(int state);
-static CFArrayRef                   copyAssertionsByType(CFStringRef type);
 static CFDictionaryRef              copyAggregateValuesDictionary(void);
 
 STATIC IOReturn                     doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
@@ -128,6 +136,7 @@ STATIC IOReturn                     doCreate(pid_t pid, CFMutableDictionaryRef n
                                              int *enTrIntensity);
 STATIC IOReturn                     copyAssertionForID(pid_t inPID, int inID,
                                                        CFMutableDictionaryRef  *outAssertion);
+STATIC int                          assertionTypeIndexForName(CFStringRef type);
 
 static ProcessInfo*                 processInfoCreate(pid_t p);
 static ProcessInfo*                 processInfoRetain(pid_t p);
@@ -146,10 +155,16 @@ __private_extern__ void             logASLMessageSleepServiceTerminated(int forc
 
 // globals
 static uint32_t                     kerAssertionBits = 0;
+static uint32_t                     gKernelUpdateDeferCnt = 0;     // Set while configAssertionTypes() runs
+static bool                         gKernelUpdatePending = false;
 static int                          aggregate_assertions;
 static CFStringRef                  assertion_types_arr[kIOPMNumAssertionTypes];
 
 static CFMutableDictionaryRef       gAssertionsArray = NULL;
+static uint16_t                     gFreeAssertionIdx[kMaxAssertions];  /* FIFO of free gAssertionsArray indices */
+static uint32_t                     gFreeIdxHead = 0;
+static uint32_t                     gFreeIdxCnt = 0;
+static assertionAdmissionStats_t    gAdmissionStats;
 static CFMutableDictionaryRef       gKernelAssertionsArray =  NULL;
 static uint32_t                     gKernelAssertions = 0;
 static CFMutableDictionaryRef       gUserAssertionTypesDict = NULL;
@@ -172,11 +187,10 @@ static  uint32_t                    gTimeoutChange = 0;
 uint32_t                            gActivityAggCnt = 0; // Number of requests received to enable activity aggregation
 
 CFDictionaryRef                     gProcAssertionLimits = NULL;
-dispatch_source_t                   gProcAggregateMonitor = NULL;
+PMTimerRef                          gProcAggregateMonitor = NULL;
 uint64_t                            gProcMonitorFrequency = (2 *3600LL * NSEC_PER_SEC);  // Once every two hours
-CFDictionaryRef                     gProcAggregateBasis = NULL;
 
-dispatch_source_t                   gAggCleanupDispatch = NULL;  // Dispatch to release statsbuf of dead procs
+PMTimerRef                          gAggCleanupDispatch = NULL;  // Timer to release statsbuf of dead procs
 uint64_t                            gAggCleanupFrequency = (15 * NSEC_PER_SEC);  // Once every 4 hours
 sysQualifier_t                      gSysQualifier;
 
@@ -187,9 +201,201 @@ static uint32_t                     gPrevClamshellSleepState = 0;
 
 __private_extern__ void             sendSleepNotificationResponse(void *acknowledgementToken, bool allow);
 
-// list for storing idle and system sleep preventers
-LIST_HEAD(, assertion) gIdleSleepPreventersList = LIST_HEAD_INITIALIZER(gIdleSleepPreventersList);
-LIST_HEAD(, assertion) gSystemSleepPreventersList = LIST_HEAD_INITIALIZER(gSystemSleepPreventersList);
+static CFDataRef                    copySerializedAssertions(int state);
+static CFArrayRef                   copyAssertionsByTypeIndex(int idx);
+
+/*
+ * Serialized views served to _io_pm_assertion_copy_details() from the read
+ * queue: the active and inactive lists, the active list of each assertion
+ * type, and the aggregate status. The list views share gAssertionsGeneration;
+ * any change to an assertion's list membership or properties must call
+ * assertionsChanged(). The status view is invalidated by setAggregateLevel().
+ */
+static uint64_t                     gAssertionsGeneration = 0;
+
+static CFDataRef copySerializedCollection(CFTypeRef collection)
+{
+    CFDataRef data = NULL;
+
+    if (collection) {
+        data = CFPropertyListCreateData(0, collection, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+        CFRelease(collection);
+    }
+    return data;
+}
+
+static PMSnapshotRef assertionsSnapshot(int state)
+{
+    static PMSnapshotRef    activeSnapshot = NULL;
+    static PMSnapshotRef    inactiveSnapshot = NULL;
+    static dispatch_once_t  onceToken;
+
+    dispatch_once(&onceToken, ^{
+        activeSnapshot = PMSnapshotCreateShared(&gAssertionsGeneration, ^CFDataRef(void) {
+            return copySerializedAssertions(kIOPMActiveAssertions);
+        });
+        inactiveSnapshot = PMSnapshotCreateShared(&gAssertionsGeneration, ^CFDataRef(void) {
+            return copySerializedAssertions(kIOPMInactiveAssertions);
+        });
+    });
+
+    return (state == kIOPMActiveAssertions) ? activeSnapshot : inactiveSnapshot;
+}
+
+static PMSnapshotRef assertionsByTypeSnapshot(int idx)
+{
+    static PMSnapshotRef    typeSnapshots[kIOPMNumAssertionTypes];
+    static dispatch_once_t  onceToken;
+
+    dispatch_once(&onceToken, ^{
+        for (int i = 0; i < kIOPMNumAssertionTypes; i++) {
+            typeSnapshots[i] = PMSnapshotCreateShared(&gAssertionsGeneration, ^CFDataRef(void) {
+                return copySerializedCollection(copyAssertionsByTypeIndex(i));
+            });
+        }
+    });
+
+    return ((idx >= 0) && (idx < kIOPMNumAssertionTypes)) ? typeSnapshots[idx] : NULL;
+}
+
+/*
+ * Properties of every assertion for kIOPMAssertionMIGCopyOneAssertionProperties,
+ * indexed like gAssertionsArray. assertionsChanged() marks the assertion's slot
+ * dirty and publishAssertionProperties() copies only the dirty slots again.
+ */
+typedef struct {
+    pid_t                           pid;
+    CFDictionaryRef                 props;
+} publishedProps_t;
+
+static os_unfair_lock               gPublishedPropsLock = OS_UNFAIR_LOCK_INIT;
+static publishedProps_t             gPublishedProps[kMaxAssertions];
+static uint64_t                     gPublishedPropsGeneration = 0;
+static uint64_t                     gDirtyProps[(kMaxAssertions + 63) / 64];
+
+// Runs on the main queue
+static void publishAssertionProperties(void)
+{
+    uint64_t    generation = __atomic_load_n(&gAssertionsGeneration, __ATOMIC_ACQUIRE);
+
+    for (uint32_t w = 0; w < sizeof(gDirtyProps) / sizeof(gDirtyProps[0]); w++) {
+        while (gDirtyProps[w]) {
+            uint32_t        idx = (w * 64) + __builtin_ctzll(gDirtyProps[w]);
+            assertion_t     *assertion = NULL;
+            pid_t           pid = -1;
+            CFDictionaryRef props = NULL;
+            CFDictionaryRef old;
+
+            gDirtyProps[w] &= gDirtyProps[w] - 1;
+            if (CFDictionaryGetValueIfPresent(gAssertionsArray, (const void *)(uintptr_t)idx,
+                                              (const void **)&assertion) && assertion->pinfo) {
+                pid = assertion->pinfo->pid;
+                props = copyAssertionProperties(assertion);
+            }
+
+            os_unfair_lock_lock(&gPublishedPropsLock);
+            old = gPublishedProps[idx].props;
+            gPublishedProps[idx].pid = pid;
+            gPublishedProps[idx].props = props;
+            os_unfair_lock_unlock(&gPublishedPropsLock);
+
+            if (old) {
+                CFRelease(old);
+            }
+        }
+    }
+    __atomic_store_n(&gPublishedPropsGeneration, generation, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the properties of assertion 'id' owned by 'pid', retained, or NULL.
+ * Catches up on the main queue first if any assertion changed since the last
+ * publish, so a client sees its own changes.
+ */
+static CFDictionaryRef copyPublishedAssertionProperties(pid_t pid, IOPMAssertionID id)
+{
+    int             idx = INDEX_FROM_ID(id);
+    CFDictionaryRef props = NULL;
+
+    if ((idx < 0) || (idx >= kMaxAssertions)) {
+        return NULL;
+    }
+    if (__atomic_load_n(&gPublishedPropsGeneration, __ATOMIC_ACQUIRE) !=
+        __atomic_load_n(&gAssertionsGeneration, __ATOMIC_ACQUIRE)) {
+        PMPerformOnMainQueueSync(^{
+            publishAssertionProperties();
+        });
+    }
+
+    os_unfair_lock_lock(&gPublishedPropsLock);
+    if (gPublishedProps[idx].props && (gPublishedProps[idx].pid == pid)) {
+        props = CFRetain(gPublishedProps[idx].props);
+    }
+    os_unfair_lock_unlock(&gPublishedPropsLock);
+
+    return props;
+}
+
+/*
+ * Type name to kerAssertionType map for kIOPMAssertionMIGCopyByType.
+ * configAssertionType() re-maps names on the main queue and invalidates it.
+ */
+static PMSnapshotRef assertionTypeNamesSnapshot(void)
+{
+    static PMSnapshotRef    namesSnapshot = NULL;
+    static dispatch_once_t  onceToken;
+
+    dispatch_once(&onceToken, ^{
+        namesSnapshot = PMSnapshotCreateSharedValue(NULL, ^CFTypeRef(void) {
+            return gUserAssertionTypesDict ? CFDictionaryCreateCopy(0, gUserAssertionTypesDict) : NULL;
+        });
+    });
+
+    return namesSnapshot;
+}
+
+/*
+ * Maps a type name to its kerAssertionType from the published snapshot,
+ * without a hop to the main queue. Returns -1 for unknown names.
+ */
+STATIC int assertionTypeIndexForName(CFStringRef type)
+{
+    CFDictionaryRef typeNames = PMSnapshotCopyValue(assertionTypeNamesSnapshot());
+    CFNumberRef     numRef = typeNames ? CFDictionaryGetValue(typeNames, type) : NULL;
+    int             idx = -1;
+
+    if (isA_CFNumber(numRef)) {
+        CFNumberGetValue(numRef, kCFNumberIntType, &idx);
+    }
+    if (typeNames) {
+        CFRelease(typeNames);
+    }
+    return idx;
+}
+
+static PMSnapshotRef assertionsStatusSnapshot(void)
+{
+    static PMSnapshotRef    statusSnapshot = NULL;
+    static dispatch_once_t  onceToken;
+
+    dispatch_once(&onceToken, ^{
+        statusSnapshot = PMSnapshotCreate(^CFDataRef(void) {
+            return copySerializedCollection(copyAggregateValuesDictionary());
+        });
+    });
+
+    return statusSnapshot;
+}
+
+static inline void assertionsChanged(assertion_t *assertion)
+{
+    int idx = INDEX_FROM_ID(assertion->assertionId);
+
+    if ((idx >= 0) && (idx < kMaxAssertions)) {
+        gDirtyProps[idx / 64] |= (1ULL << (idx % 64));
+    }
+    PMSnapshotGenerationBump(&gAssertionsGeneration);
+}
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
@@ -384,6 +590,75 @@ exit:
 #endif
 }
 
+void asyncAssertionUpdate(xpc_object_t remoteConnection, xpc_object_t msg)
+{
+    pid_t               callerPID = -1;
+    IOPMAssertionID     assertionId = kIOPMNullAssertionID;
+    IOReturn            rc;
+    xpc_object_t        update, value;
+    assertionUpdate_t   fields = { 0 };
+
+    update = xpc_dictionary_get_value(msg, kAssertionUpdateMsg);
+    if (!update || (xpc_get_type(update) != XPC_TYPE_DICTIONARY)) {
+        ERROR_LOG("Failed to retrieve dictionary from Update message\n");
+        rc = kIOReturnBadArgument;
+        goto exit;
+    }
+
+    assertionId = (IOPMAssertionID)xpc_dictionary_get_uint64(update, kAssertionUpdateIdKey);
+    // A mistyped value would read as 0 and turn the assertion off; drop the whole update
+    if ((value = xpc_dictionary_get_value(update, kAssertionUpdateLevelKey))) {
+        if (xpc_get_type(value) != XPC_TYPE_INT64) {
+            ERROR_LOG("Assertion update for id 0x%x has a non-integer level\n", assertionId);
+            rc = kIOReturnBadArgument;
+            goto exit;
+        }
+        fields.fields |= kAssertionUpdateLevel;
+        fields.level = (int)xpc_int64_get_value(value);
+    }
+    if ((value = xpc_dictionary_get_value(update, kAssertionUpdateTimeoutKey))) {
+        if (xpc_get_type(value) != XPC_TYPE_DOUBLE) {
+            ERROR_LOG("Assertion update for id 0x%x has a non-double timeout\n", assertionId);
+            rc = kIOReturnBadArgument;
+            goto exit;
+        }
+        fields.fields |= kAssertionUpdateTimeout;
+        fields.timeout = xpc_double_get_value(value);
+    }
+    if ((fields.name = xpc_dictionary_get_string(update, kAssertionUpdateNameKey))) {
+        fields.fields |= kAssertionUpdateName;
+    }
+
+#ifndef XCTEST
+    callerPID = xpc_connection_get_pid(remoteConnection);
+#else
+    callerPID = XCTEST_PID;
+#endif
+    rc = doUpdateProperties(callerPID, assertionId, &fields);
+
+    DEBUG_LOG("Updated fields 0x%x for assertion id 0x%x(rc:0x%x)\n", fields.fields, assertionId, rc);
+
+exit:
+    if (rc != kIOReturnSuccess) {
+        ERROR_LOG("Failed to update assertion id 0x%x (rc:0x%x)\n", assertionId, rc);
+    }
+#if XCTEST
+    xpc_dictionary_set_uint64(msg, kMsgReturnCode, rc);
+#endif
+}
+
+/*
+ * Routes for the async assertion messages. Each message carries only its
+ * own key, so their order relative to the other powerd routes doesn't matter.
+ */
+__private_extern__ void PMAssertionsRegisterXPCRoutes(void)
+{
+    PMXPCRouterRegister(kAssertionCreateMsg, asyncAssertionCreate, 0);
+    PMXPCRouterRegister(kAssertionReleaseMsg, asyncAssertionRelease, 0);
+    PMXPCRouterRegister(kAssertionPropertiesMsg, asyncAssertionProperties, 0);
+    PMXPCRouterRegister(kAssertionUpdateMsg, asyncAssertionUpdate, 0);
+}
+
 void processSetAssertionState(xpc_connection_t peer, xpc_object_t msg)
 {
     pid_t pid = -1;
@@ -842,8 +1117,8 @@ kern_return_t _io_pm_assertion_copy_details (
                                              mach_msg_type_number_t  *assertionsCnt,
                                              int                 *return_val) 
 {
-    CFTypeRef           theCollection = NULL;
-    CFDataRef           serializedDetails = NULL;
+    __block CFDataRef   serializedDetails = NULL;
+    __block IOReturn    ret = kIOReturnSuccess;
     pid_t               callerPID = -1;
 
 
@@ -851,77 +1126,84 @@ kern_return_t _io_pm_assertion_copy_details (
     *assertions = 0;
     *return_val = kIOReturnNotFound;
 
+    // Served on the read queue from published snapshots. A snapshot that is
+    // behind the main queue catches up there before it is returned.
     if (kIOPMAssertionMIGCopyAll == whichData)
     {
-        theCollection = copyPIDAssertionDictionaryFlattened(kIOPMActiveAssertions);
+        serializedDetails = PMSnapshotCopyData(assertionsSnapshot(kIOPMActiveAssertions));
 
     } else if (kIOPMAssertionMIGCopyInactive == whichData)
     {
+        serializedDetails = PMSnapshotCopyData(assertionsSnapshot(kIOPMInactiveAssertions));
 
-        theCollection = copyPIDAssertionDictionaryFlattened(kIOPMInactiveAssertions);
-
-    } else if (kIOPMAssertionMIGCopyOneAssertionProperties == whichData) 
+    } else if (kIOPMAssertionMIGCopyStatus == whichData)
     {
-        audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
-
-        *return_val = copyAssertionForID(callerPID, assertion_id,  
-                                         (CFMutableDictionaryRef *)&theCollection);
+        serializedDetails = PMSnapshotCopyData(assertionsStatusSnapshot());
 
-    } else if (kIOPMAssertionMIGCopyStatus == whichData)
+    } else if (kIOPMAssertionMIGCopyByType == whichData)
     {
-        theCollection = copyAggregateValuesDictionary();
+        CFStringRef     assertionType = NULL;
+        int             idx = -1;
+
+        CFDataRef unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)props, propsCnt, kCFAllocatorNull);
+        if (unfolder) {
+            assertionType = (CFStringRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+            CFRelease(unfolder);
+        }
+        if (isA_CFString(assertionType)) {
+            idx = assertionTypeIndexForName(assertionType);
+        }
+        if (assertionType) {
+            CFRelease(assertionType);
+        }
+        serializedDetails = PMSnapshotCopyData(assertionsByTypeSnapshot(idx));
 
     } else if (kIOPMPowerEventsMIGCopyScheduledEvents == whichData)
     {
-        theCollection = copyScheduledPowerEvents();
+        serializedDetails = copyScheduledPowerEventsData();
     }
     else if (kIOPMPowerEventsMIGCopyRepeatEvents == whichData)
     {
-        theCollection = copyRepeatPowerEvents();
+        serializedDetails = copyRepeatPowerEventsData();
     }
-    else if (kIOPMAssertionMIGCopyByType == whichData)
+    else if (kIOPMAssertionMIGCopyOneAssertionProperties == whichData)
     {
-        CFStringRef  assertionType = NULL;
+        CFDictionaryRef theCollection = NULL;
 
-        CFDataRef unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)props, propsCnt, kCFAllocatorNull);
-        if (unfolder) {
-            assertionType = (CFStringRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
-            CFRelease(unfolder);
+        audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
+
+        theCollection = copyPublishedAssertionProperties(callerPID, assertion_id);
+        if (theCollection) {
+            serializedDetails = CFPropertyListCreateData(0, theCollection,
+                                                         kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+            if (!serializedDetails) {
+                ret = kIOReturnInternalError;
+            }
+            CFRelease(theCollection);
         }
-        theCollection = copyAssertionsByType(assertionType);
 
-        if (assertionType) {
-            CFRelease(assertionType);
+        if (kIOReturnSuccess != ret) {
+            *return_val = ret;
+            goto exit;
         }
     }
 
-    if (!theCollection) {
+    if (!serializedDetails) {
         *assertionsCnt = 0;
         *assertions = 0;
         *return_val = kIOReturnSuccess;
         goto exit;
     }
 
+    *assertionsCnt = (mach_msg_type_number_t)CFDataGetLength(serializedDetails);
 
-    serializedDetails = CFPropertyListCreateData(0, theCollection, 
-                                                 kCFPropertyListBinaryFormat_v1_0, 0, NULL);            
-
-    CFRelease(theCollection);        
+    vm_allocate(mach_task_self(), (vm_address_t *)assertions, *assertionsCnt, TRUE);
 
-    if (serializedDetails) 
-    {
-        *assertionsCnt = (mach_msg_type_number_t)CFDataGetLength(serializedDetails);
-
-        vm_allocate(mach_task_self(), (vm_address_t *)assertions, *assertionsCnt, TRUE);
+    memcpy((void *)*assertions, CFDataGetBytePtr(serializedDetails), *assertionsCnt);
 
-        memcpy((void *)*assertions, CFDataGetBytePtr(serializedDetails), *assertionsCnt);
+    CFRelease(serializedDetails);
 
-        CFRelease(serializedDetails);
-
-        *return_val = kIOReturnSuccess;
-    } else {
-        *return_val = kIOReturnInternalError;
-    }
+    *return_val = kIOReturnSuccess;
 
 exit:
 
@@ -1153,11 +1435,35 @@ __private_extern__ void sendActivityTickle ()
     return;
 
 }
+#ifdef XCTEST
+static uint64_t gKernelAssertionUpdates = 0;
+
+uint64_t getKernelAssertionUpdateCount(void)
+{
+    return gKernelAssertionUpdates;
+}
+#endif
+
 static void sendUserAssertionsToKernel(uint32_t user_assertions)
 {
     io_connect_t                connect = IO_OBJECT_NULL;
     const uint64_t              in = (uint64_t)user_assertions;
 
+    if (gKernelUpdateDeferCnt) {
+        // configAssertionTypes() sends the final levels once it's done
+        gKernelUpdatePending = true;
+        return;
+    }
+#ifdef XCTEST
+    gKernelAssertionUpdates++;
+#endif
+    if (gAssertionTraceActive) {
+        PMAssertionTraceRecord(kPMTraceKernelBits, 0, kIOPMNullAssertionID, user_assertions, 0, NULL);
+    }
+    if (PMClockIsVirtual()) {
+        // Simulated assertion levels never reach the kernel
+        return;
+    }
     if ( (connect = getRootDomainConnect()) == IO_OBJECT_NULL)
         return;
 
@@ -1532,8 +1838,8 @@ __private_extern__ void InternalEvaluateAssertions(void)
     });
 }
 
-__private_extern__ IOReturn 
-InternalCreateAssertionWithTimeout(CFStringRef type, CFStringRef name, int timerSecs, IOPMAssertionID *outID)
+static IOReturn internalCreateTimedAssertion(CFStringRef type, CFStringRef name, int timerSecs,
+                                             CFStringRef timeoutAction, IOPMAssertionID *outID)
 {
     CFMutableDictionaryRef          dict = NULL;
 
@@ -1542,7 +1848,7 @@ InternalCreateAssertionWithTimeout(CFStringRef type, CFStringRef name, int timer
     }
 
     if ( (dict = _IOPMAssertionDescriptionCreate(type, name, NULL, NULL, NULL,
-                                                 (CFTimeInterval)timerSecs, kIOPMAssertionTimeoutActionRelease)) )
+                                                 (CFTimeInterval)timerSecs, timeoutAction)) )
     {
         doCreate(getpid(), dict, outID, NULL, NULL);
         CFRelease(dict);
@@ -1551,6 +1857,54 @@ InternalCreateAssertionWithTimeout(CFStringRef type, CFStringRef name, int timer
     return kIOReturnSuccess;
 
 }
+
+__private_extern__ IOReturn 
+InternalCreateAssertionWithTimeout(CFStringRef type, CFStringRef name, int timerSecs, IOPMAssertionID *outID)
+{
+    return internalCreateTimedAssertion(type, name, timerSecs, kIOPMAssertionTimeoutActionRelease, outID);
+}
+
+/*
+ * Like InternalCreateAssertionWithTimeout(), but the assertion is only turned
+ * off when the timer runs out, so InternalRaiseAssertion() can turn it back
+ * on later without creating a new one. InternalRaiseAssertion() takes the
+ * same type and name and fails if the ID now belongs to another assertion.
+ */
+__private_extern__ IOReturn
+InternalCreateReusableAssertion(CFStringRef type, CFStringRef name, int timerSecs, IOPMAssertionID *outID)
+{
+    return internalCreateTimedAssertion(type, name, timerSecs, kIOPMAssertionTimeoutActionTurnOff, outID);
+}
+
+__private_extern__ IOReturn
+InternalRaiseAssertion(IOPMAssertionID id, CFStringRef type, CFStringRef name, int timerSecs)
+{
+    assertionUpdate_t   update = { 0 };
+    assertion_t         *assertion = NULL;
+    CFStringRef         str;
+
+    if ((id == kIOPMNullAssertionID) || !type || !name) {
+        return kIOReturnBadArgument;
+    }
+
+    // IDs are handed out again once released, so 'id' may now name another assertion
+    if (lookupAssertion(getpid(), id, &assertion) != kIOReturnSuccess) {
+        return kIOReturnNotFound;
+    }
+    str = PMInternGetString(assertion->typeStr);
+    if (!str || !CFEqual(str, type)) {
+        return kIOReturnNotFound;
+    }
+    str = PMInternGetString(assertion->nameStr);
+    if (!str || !CFEqual(str, name)) {
+        return kIOReturnNotFound;
+    }
+
+    update.fields = kAssertionUpdateLevel | kAssertionUpdateTimeout;
+    update.level = kIOPMAssertionLevelOn;
+    update.timeout = (CFTimeInterval)timerSecs;
+    return doUpdateProperties(getpid(), id, &update);
+}
 __private_extern__ IOReturn InternalReleaseAssertionSync(IOPMAssertionID outID)
 {
     IOReturn ret = kIOReturnError;
@@ -2070,106 +2424,202 @@ static bool callerIsEntitledToAssertion(
     return caller_is_allowed;
 }
 
-static void checkProcAggregates( )
+/*
+ * Aggregate assertion limits (ProcessInfo.aggAssertLength).
+ *
+ * updateAppStats() credits each hold of an effect to the holder's current
+ * window when it ends. While a process holds an effect on battery, its
+ * aggDeadline timer is armed for the moment the earliest held effect would
+ * reach the limit, so the exception is posted when the budget is crossed,
+ * once per effect and window. Every gProcMonitorFrequency on battery,
+ * checkProcAggregates() audits holds still in progress and starts a new
+ * window for all processes. Windows also restart on every power source
+ * change; only battery time counts.
+ */
+static uint32_t                     gProcAggWindowSeq = 1;
+
+static bool postAssertionException(uint64_t exception, pid_t pid)
 {
-    CFDictionaryRef update = NULL;
-    IOReportSampleRef   delta = NULL;
+    static int token = -1;
 
-    if (kBatteryPowered != _getPowerSource()) {
-        // Nothing to do when device is on external power source
-        return;
+    if ((token == -1) && (notify_register_check(kIOPMAssertionExceptionNotifyName, &token) != NOTIFY_STATUS_OK)) {
+        token = -1;
+        return false;
     }
-    if (gProcAggregateBasis == NULL) {
-        copyAssertionActivityAggregate(&gProcAggregateBasis);
-        return;
+    notify_set_state(token, (exception << 32) | (uint32_t)pid);
+    notify_post(kIOPMAssertionExceptionNotifyName);
+    return true;
+}
+
+// Resets the stats of a process that last counted in an earlier window
+static void syncProcAggregateWindow(ProcessInfo *pinfo)
+{
+    if (pinfo->aggWindowSeq != gProcAggWindowSeq) {
+        for (int i = 0; i < kMaxEffectStats; i++) {
+            pinfo->stats[i].windowDuration = 0;
+        }
+        pinfo->aggExceptionSent = 0;
+        pinfo->aggWindowSeq = gProcAggWindowSeq;
     }
+}
 
-    copyAssertionActivityAggregate(&update);
-    if (!update) {
-        goto exit;
+static void creditProcAggregate(ProcessInfo *pinfo, int effectIdx, uint64_t duration)
+{
+    effectStats_t *stats;
+
+    if ((pinfo->aggAssertLength == 0) || (effectIdx == kNoEffect) || (effectIdx >= kMaxEffectStats)) {
+        return;
     }
+    syncProcAggregateWindow(pinfo);
 
-    delta = IOReportCreateSamplesDelta(gProcAggregateBasis, update, NULL);
-    if (!delta) {
-        goto exit;
+    stats = &pinfo->stats[effectIdx];
+    stats->windowDuration += duration;
+    if (!(pinfo->aggExceptionSent & (1 << effectIdx)) && (stats->windowDuration >= pinfo->aggAssertLength)) {
+        pinfo->aggExceptionSent |= (1 << effectIdx);
+        if (postAssertionException(kIOPMAssertionAggregateException, pinfo->pid)) {
+            INFO_LOG("Aggregate assertion exception on pid %d for effect %d.\n", pinfo->pid, effectIdx);
+        }
     }
+}
 
-    IOReportIterate(delta, ^(IOReportChannelRef ch) {
-            int64_t     eff1, eff2, eff3;
-            uint64_t pid;
-            ProcessInfo *pinfo = NULL;
+// Credits the holds 'pinfo' has in progress up to now
+static void creditProcAggregateHolds(ProcessInfo *pinfo)
+{
+    uint64_t    now = getMonotonicTime();
 
-            pid = IOReportChannelGetChannelID(ch);
-            eff1 = IOReportArrayGetValueAtIndex(ch, 1); // Idle Sleep
-            eff2 = IOReportArrayGetValueAtIndex(ch, 2); // Demand Sleep
-            eff3 = IOReportArrayGetValueAtIndex(ch, 3); // Display Sleep
+    for (int i = 0; i < kMaxEffectStats; i++) {
+        effectStats_t *stats = &pinfo->stats[i];
 
+        if (stats->cnt == 0) {
+            continue;
+        }
+        creditProcAggregate(pinfo, i, now - stats->creditedUntil);
+        stats->creditedUntil = now;
+    }
+}
 
-            pinfo = processInfoGet((pid_t)pid);
-            if (!pinfo) {
-                return kIOReportIterOk;
-            }
+static void procAggregateDeadlineFired(pid_t pid);
 
-            if (pinfo->aggAssertLength == 0) {
-                return kIOReportIterOk;
-            }
-            if (
-                (eff1 >= pinfo->aggAssertLength)
-                || (eff2 >= pinfo->aggAssertLength) || (eff3 >= pinfo->aggAssertLength)
-                ) {
-
-                int token;
-                uint32_t  status = notify_register_check(kIOPMAssertionExceptionNotifyName, &token);
-                if (status == NOTIFY_STATUS_OK) {
-                    notify_set_state(token, (((uint64_t)kIOPMAssertionAggregateException << 32)) | pid);
-                    notify_post(kIOPMAssertionExceptionNotifyName);
-                    notify_cancel(token);
-                    INFO_LOG("Aggregate assertion exception on pid %llu.\n", pid);
-                }
+/*
+ * Arms pinfo->aggDeadline for the first held effect that will reach the
+ * limit, or disarms it when nothing is held on battery.
+ */
+static void armProcAggregateDeadline(ProcessInfo *pinfo)
+{
+    uint64_t    now, remaining = UINT64_MAX;
 
-           }
+    if (pinfo->aggAssertLength && (_getPowerSource() == kBatteryPowered)) {
+        syncProcAggregateWindow(pinfo);
+        now = getMonotonicTime();
 
-            return kIOReportIterOk;
-    });
-exit:
-    if (gProcAggregateBasis) {
-        CFRelease(gProcAggregateBasis);
-    }
-    gProcAggregateBasis = update;
+        for (int i = 0; i < kMaxEffectStats; i++) {
+            effectStats_t   *stats = &pinfo->stats[i];
+            uint64_t        held, left;
 
-    if (delta) {
-        CFRelease(delta);
+            if ((stats->cnt == 0) || (pinfo->aggExceptionSent & (1 << i))) {
+                continue;
+            }
+            held = stats->windowDuration + (now - stats->creditedUntil);
+            left = (held < pinfo->aggAssertLength) ? (pinfo->aggAssertLength - held) : 0;
+            if (left < remaining) {
+                remaining = left;
+            }
+        }
     }
 
+    if (remaining == UINT64_MAX) {
+        if (pinfo->aggDeadline) {
+            PMTimerDisarm(pinfo->aggDeadline);
+        }
+        return;
+    }
+    if (!pinfo->aggDeadline) {
+        pid_t pid = pinfo->pid;
+        pinfo->aggDeadline = PMTimerCreate(_getPMMainQueue(), ^{ procAggregateDeadlineFired(pid); });
+    }
+    PMTimerSchedule(pinfo->aggDeadline, remaining * NSEC_PER_SEC, kPMTimerForever);
 }
 
-static void setProcessAssertionLimits(ProcessInfo *pinfo)
+static void procAggregateDeadlineFired(pid_t pid)
 {
-    CFDictionaryRef defaultLimits, procLimit;
-    CFNumberRef cf_defaultAssertLimit, cf_defaultAggLimit;
-    CFNumberRef cf_assertionLimit, cf_aggAssertionLimit;
-    uint32_t defaultAssertLimit, defaultAggLimit;
+    ProcessInfo *pinfo = processInfoGet(pid);
 
-    if (!isA_CFDictionary(gProcAssertionLimits) || !isA_CFString(pinfo->name)) {
+    if (!pinfo || (_getPowerSource() != kBatteryPowered)) {
         return;
     }
+    creditProcAggregateHolds(pinfo);
+    armProcAggregateDeadline(pinfo);
+}
 
-    defaultAssertLimit = 0;
-    defaultAggLimit = 0;
+static void creditProcAggregateWindow(const void *key __unused, const void *value, void *context)
+{
+    ProcessInfo *pinfo = (ProcessInfo *)value;
+    bool        credit = *(bool *)context;
 
-    defaultLimits = CFDictionaryGetValue(gProcAssertionLimits, kIOPMDefaultLimtsKey);
-    if (isA_CFDictionary(defaultLimits)) {
-        cf_defaultAssertLimit = CFDictionaryGetValue(defaultLimits, kIOPMAssertionDurationLimit);
-        cf_defaultAggLimit = CFDictionaryGetValue(defaultLimits, kIOPMAggregateAssertionLimit);
-        if (isA_CFNumber(cf_defaultAssertLimit)) {
-            CFNumberGetValue(cf_defaultAssertLimit, kCFNumberIntType, &defaultAssertLimit);
-        }
-        if (isA_CFNumber(cf_defaultAggLimit)) {
-            CFNumberGetValue(cf_defaultAggLimit, kCFNumberIntType, &defaultAggLimit);
-        }
+    if (credit) {
+        creditProcAggregateHolds(pinfo);
     }
+    else {
+        uint64_t now = getMonotonicTime();
 
-    procLimit = CFDictionaryGetValue(gProcAssertionLimits, pinfo->name);
+        for (int i = 0; i < kMaxEffectStats; i++) {
+            pinfo->stats[i].creditedUntil = now;
+        }
+    }
+}
+
+static void armProcAggregateWindow(const void *key __unused, const void *value, void *context __unused)
+{
+    armProcAggregateDeadline((ProcessInfo *)value);
+}
+
+// 'credit' counts holds in progress against the window being closed
+static void restartProcAggregateWindows(bool credit)
+{
+    if (!gProcessDict) {
+        return;
+    }
+    CFDictionaryApplyFunction(gProcessDict, creditProcAggregateWindow, &credit);
+    gProcAggWindowSeq++;
+    CFDictionaryApplyFunction(gProcessDict, armProcAggregateWindow, NULL);
+}
+
+static void checkProcAggregates( )
+{
+    if (kBatteryPowered != _getPowerSource()) {
+        // Nothing to do when device is on external power source
+        return;
+    }
+    restartProcAggregateWindows(true);
+}
+
+static void setProcessAssertionLimits(ProcessInfo *pinfo)
+{
+    CFDictionaryRef defaultLimits, procLimit;
+    CFNumberRef cf_defaultAssertLimit, cf_defaultAggLimit;
+    CFNumberRef cf_assertionLimit, cf_aggAssertionLimit;
+    uint32_t defaultAssertLimit, defaultAggLimit;
+
+    if (!isA_CFDictionary(gProcAssertionLimits) || !isA_CFString(pinfo->name)) {
+        return;
+    }
+
+    defaultAssertLimit = 0;
+    defaultAggLimit = 0;
+
+    defaultLimits = CFDictionaryGetValue(gProcAssertionLimits, kIOPMDefaultLimtsKey);
+    if (isA_CFDictionary(defaultLimits)) {
+        cf_defaultAssertLimit = CFDictionaryGetValue(defaultLimits, kIOPMAssertionDurationLimit);
+        cf_defaultAggLimit = CFDictionaryGetValue(defaultLimits, kIOPMAggregateAssertionLimit);
+        if (isA_CFNumber(cf_defaultAssertLimit)) {
+            CFNumberGetValue(cf_defaultAssertLimit, kCFNumberIntType, &defaultAssertLimit);
+        }
+        if (isA_CFNumber(cf_defaultAggLimit)) {
+            CFNumberGetValue(cf_defaultAggLimit, kCFNumberIntType, &defaultAggLimit);
+        }
+    }
+
+    procLimit = CFDictionaryGetValue(gProcAssertionLimits, pinfo->name);
     if (isA_CFDictionary(procLimit)) {
         cf_assertionLimit = CFDictionaryGetValue(procLimit, kIOPMAssertionDurationLimit);
         cf_aggAssertionLimit = CFDictionaryGetValue(procLimit, kIOPMAggregateAssertionLimit);
@@ -2191,12 +2641,60 @@ static void setProcessAssertionLimits(ProcessInfo *pinfo)
 #ifdef XCTEST
 ProcessInfo* processInfoCreateForTest(pid_t p, CFStringRef name)
 {
-    
-    
     ProcessInfo             *proc =  processInfoCreate(p);
-    proc->name = name;
+
+    if (!proc || !name) {
+        return proc;
+    }
+    if (proc->name) {
+        CFRelease(proc->name);
+    }
+    proc->name = CFRetain(name);
     return proc;
 }
+
+/*
+ * Releases every process and its assertions and frees the tables set up by
+ * PMAssertions_prime(), so the next test class primes a clean engine.
+ */
+void PMAssertionsResetForTest(void)
+{
+    CFIndex         cnt;
+    ProcessInfo     **procs;
+
+    if (!gProcessDict) {
+        return;
+    }
+    cnt = CFDictionaryGetCount(gProcessDict);
+    procs = calloc(cnt ? cnt : 1, sizeof(*procs));
+    if (!procs) {
+        return;
+    }
+    CFDictionaryGetKeysAndValues(gProcessDict, NULL, (const void **)procs);
+    for (CFIndex i = 0; i < cnt; i++) {
+        HandleProcessExit(procs[i]->pid);
+    }
+    for (CFIndex i = 0; i < cnt; i++) {
+        if (procs[i]->disp_src) {
+            dispatch_release(procs[i]->disp_src);
+        }
+        if (procs[i]->aggDeadline) {
+            PMTimerCancel(procs[i]->aggDeadline);
+        }
+        if (procs[i]->name) CFRelease(procs[i]->name);
+        if (procs[i]->assertionExceptionAggdKey) CFRelease(procs[i]->assertionExceptionAggdKey);
+        if (procs[i]->aggregateExceptionAggdKey) CFRelease(procs[i]->aggregateExceptionAggdKey);
+        free(procs[i]);
+    }
+    free(procs);
+
+    CFRelease(gProcessDict);
+    gProcessDict = NULL;
+    CFRelease(gAssertionsArray);
+    gAssertionsArray = NULL;
+    CFRelease(gUserAssertionTypesDict);
+    gUserAssertionTypesDict = NULL;
+}
 #endif
 
 static ProcessInfo* processInfoCreate(pid_t p)
@@ -2324,6 +2822,9 @@ STATIC void processInfoRelease(pid_t p)
         if (proc->disp_src) {
             dispatch_release(proc->disp_src);
         }
+        if (proc->aggDeadline) {
+            PMTimerCancel(proc->aggDeadline);
+        }
         if (proc->name) CFRelease(proc->name);
         if (proc->assertionExceptionAggdKey) CFRelease(proc->assertionExceptionAggdKey);
         if (proc->aggregateExceptionAggdKey) CFRelease(proc->aggregateExceptionAggdKey);
@@ -2342,8 +2843,6 @@ STATIC void processInfoRelease(pid_t p)
 
 void handleProcAssertionTimeout(pid_t pid, IOPMAssertionID id)
 {
-    uint32_t status;
-    int token;
     assertion_t *assertion = NULL;
 
     ProcessInfo *pinfo = processInfoGet(pid);
@@ -2356,12 +2855,12 @@ void handleProcAssertionTimeout(pid_t pid, IOPMAssertionID id)
     if (!assertion) {
         return;
     }
-    status = notify_register_check(kIOPMAssertionExceptionNotifyName, &token);
-    if (status == NOTIFY_STATUS_OK) {
-        notify_set_state(token, (((uint64_t)kIOPMAssertionDurationException << 32)) | pid);
-        notify_post(kIOPMAssertionExceptionNotifyName);
-        notify_cancel(token);
-        INFO_LOG("Single assertion exception on pid %d. Assertion details: %@\n", pid, assertion->props);
+    if (postAssertionException(kIOPMAssertionDurationException, pid)) {
+        CFDictionaryRef props = copyAssertionProperties(assertion);
+        INFO_LOG("Single assertion exception on pid %d. Assertion details: %@\n", pid, props);
+        if (props) {
+            CFRelease(props);
+        }
     }
 
 
@@ -2479,12 +2978,147 @@ void updateSystemQualifiers(assertion_t *assertion, assertionOps op)
     }
 }
 
+/*
+ * Per-process assertion length limits (ProcessInfo.maxAssertLength).
+ *
+ * Limits count battery time only. Deadlines are stamped on a battery clock
+ * that stops while on external power, so a power source change pauses or
+ * resumes every pending limit at once. Queued assertions sit in a binary
+ * min-heap on procDeadline and one dispatch timer is armed for the root.
+ */
+#define kProcDeadlineFired      UINT64_MAX
+
+static assertion_t                  **gProcDeadlineHeap = NULL;
+static uint32_t                     gProcDeadlineCnt = 0;
+static uint32_t                     gProcDeadlineCap = 0;
+static PMTimerRef                   gProcDeadlineTimer = NULL;
+static bool                         gProcDeadlinesPaused = true;
+static uint64_t                     gBattClockNs = 0;           // Battery clock at gBattClockResumedAt
+static uint64_t                     gBattClockResumedAt = 0;    // PMClockMonotonicNs() of last resume
+
+static uint64_t battClockNow(void)
+{
+    if (gProcDeadlinesPaused) {
+        return gBattClockNs;
+    }
+    return gBattClockNs + (PMClockMonotonicNs() - gBattClockResumedAt);
+}
+
+static inline void procHeapSet(uint32_t i, assertion_t *assertion)
+{
+    gProcDeadlineHeap[i] = assertion;
+    assertion->procDeadlineIdx = i + 1;
+}
+
+static void procHeapSiftUp(uint32_t i)
+{
+    assertion_t *assertion = gProcDeadlineHeap[i];
+
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (gProcDeadlineHeap[parent]->procDeadline <= assertion->procDeadline) {
+            break;
+        }
+        procHeapSet(i, gProcDeadlineHeap[parent]);
+        i = parent;
+    }
+    procHeapSet(i, assertion);
+}
+
+static void procHeapSiftDown(uint32_t i)
+{
+    assertion_t *assertion = gProcDeadlineHeap[i];
+
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= gProcDeadlineCnt) {
+            break;
+        }
+        if ((child + 1 < gProcDeadlineCnt) &&
+            (gProcDeadlineHeap[child + 1]->procDeadline < gProcDeadlineHeap[child]->procDeadline)) {
+            child++;
+        }
+        if (assertion->procDeadline <= gProcDeadlineHeap[child]->procDeadline) {
+            break;
+        }
+        procHeapSet(i, gProcDeadlineHeap[child]);
+        i = child;
+    }
+    procHeapSet(i, assertion);
+}
+
+static void procHeapRemove(assertion_t *assertion)
+{
+    uint32_t i = assertion->procDeadlineIdx - 1;
+    assertion_t *last;
+
+    assertion->procDeadlineIdx = 0;
+    last = gProcDeadlineHeap[--gProcDeadlineCnt];
+    if (last == assertion) {
+        return;
+    }
+    procHeapSet(i, last);
+    if ((i > 0) && (gProcDeadlineHeap[(i - 1) / 2]->procDeadline > last->procDeadline)) {
+        procHeapSiftUp(i);
+    }
+    else {
+        procHeapSiftDown(i);
+    }
+}
+
+static void armProcDeadlineTimer(void)
+{
+    uint64_t now, deadline;
+
+    if (!gProcDeadlineTimer) {
+        return;
+    }
+    if (gProcDeadlinesPaused || (gProcDeadlineCnt == 0)) {
+        PMTimerDisarm(gProcDeadlineTimer);
+        return;
+    }
+
+    now = battClockNow();
+    deadline = gProcDeadlineHeap[0]->procDeadline;
+    PMTimerSchedule(gProcDeadlineTimer, (deadline > now) ? (deadline - now) : 0, kPMTimerForever);
+}
+
+static void procDeadlineTimerFired(void)
+{
+    uint64_t now = battClockNow();
+
+    while (gProcDeadlineCnt && (gProcDeadlineHeap[0]->procDeadline <= now)) {
+        assertion_t *assertion = gProcDeadlineHeap[0];
+
+        procHeapRemove(assertion);
+        assertion->procDeadline = kProcDeadlineFired;
+        handleProcAssertionTimeout(assertion->pinfo->pid, assertion->assertionId);
+    }
+    armProcDeadlineTimer();
+}
+
+static void setProcDeadlinesPaused(bool paused)
+{
+    if (paused == gProcDeadlinesPaused) {
+        return;
+    }
+    gBattClockNs = battClockNow();
+    gBattClockResumedAt = PMClockMonotonicNs();
+    gProcDeadlinesPaused = paused;
+    armProcDeadlineTimer();
+}
+
 void stopProcTimer(assertion_t *assertion)
 {
+    bool wasFirst;
 
-    if (assertion->procTimer && (assertion->state & kAssertionProcTimerActive)) {
-        dispatch_suspend(assertion->procTimer);
-        assertion->state &= ~kAssertionProcTimerActive;
+    if (assertion->procDeadlineIdx == 0) {
+        return;
+    }
+    wasFirst = (assertion->procDeadlineIdx == 1);
+    procHeapRemove(assertion);
+    if (wasFirst) {
+        armProcDeadlineTimer();
     }
 }
 
@@ -2493,7 +3127,6 @@ void startProcTimer(assertion_t *assertion)
 {
     assertionType_t     *assertType = NULL;
     ProcessInfo *pinfo = NULL;
-    dispatch_source_t disp;
 
     assertType = &gAssertionTypes[assertion->kassert];
     if (assertType->effectIdx == kNoEffect) {
@@ -2506,8 +3139,8 @@ void startProcTimer(assertion_t *assertion)
         return;
     }
 
-    if (_getPowerSource() != kBatteryPowered) {
-        // Time based assertion validation is done only on battery power
+    if (assertion->procDeadlineIdx || (assertion->procDeadline == kProcDeadlineFired)) {
+        // Already queued, or this assertion has already been reported
         return;
     }
     if (assertion->timeout) {
@@ -2520,22 +3153,32 @@ void startProcTimer(assertion_t *assertion)
         }
     }
 
-    stopProcTimer(assertion);
+    if (gProcDeadlineTimer == NULL) {
+        gProcDeadlineTimer = PMTimerCreate(_getPMMainQueue(), ^{ procDeadlineTimerFired(); });
 
-    if (assertion->procTimer == 0) {
-        // Saving the dispatch source to local variable 'disp', to make sure the value is
-        // copied into the cancel_handler block. That block gets executed after 'assertion'
-        // is released.
-        disp = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-        dispatch_source_set_event_handler(disp, ^{ handleProcAssertionTimeout(pinfo->pid, assertion->assertionId);});
-        dispatch_source_set_cancel_handler(disp, ^{ dispatch_release(disp);});
-        assertion->procTimer = disp;
-        dispatch_source_set_timer(assertion->procTimer, dispatch_time(DISPATCH_TIME_NOW, pinfo->maxAssertLength * NSEC_PER_SEC),
-                              DISPATCH_TIME_FOREVER, 0);
+        // Time based assertion validation is done only on battery power
+        setProcDeadlinesPaused(_getPowerSource() != kBatteryPowered);
+    }
+    if (gProcDeadlineCnt == gProcDeadlineCap) {
+        uint32_t newCap = gProcDeadlineCap ? (2 * gProcDeadlineCap) : 64;
+        assertion_t **newHeap = realloc(gProcDeadlineHeap, newCap * sizeof(assertion_t *));
+        if (!newHeap) {
+            ERROR_LOG("Failed to grow proc deadline heap to %u entries\n", newCap);
+            return;
+        }
+        gProcDeadlineHeap = newHeap;
+        gProcDeadlineCap = newCap;
     }
-    dispatch_resume(assertion->procTimer);
-    assertion->state |= kAssertionProcTimerActive;
 
+    if (assertion->procDeadline == 0) {
+        // Measured from the first time this assertion counts against the limit
+        assertion->procDeadline = battClockNow() + (uint64_t)pinfo->maxAssertLength * NSEC_PER_SEC;
+    }
+    gProcDeadlineHeap[gProcDeadlineCnt] = assertion;
+    procHeapSiftUp(gProcDeadlineCnt++);
+    if (assertion->procDeadlineIdx == 1) {
+        armProcDeadlineTimer();
+    }
 }
 
 
@@ -2694,6 +3337,8 @@ void updateAppStats(assertion_t *assertion, assertionOps op)
         if (stats && !(assertion->state & kAssertionStateAddsToProcStats)) {
             if (stats->cnt++ == 0) {
                 stats->startTime = getMonotonicTime();
+                stats->creditedUntil = stats->startTime;
+                armProcAggregateDeadline(pinfo);
             }
             assertion->state |= kAssertionStateAddsToProcStats;
         }
@@ -2702,8 +3347,14 @@ void updateAppStats(assertion_t *assertion, assertionOps op)
     case kAssertionOpRelease:
         if (stats && (stats->cnt) && (assertion->state & kAssertionStateAddsToProcStats)) {
             if (--stats->cnt == 0) {
-                duration = (getMonotonicTime() - stats->startTime);
+                uint64_t now = getMonotonicTime();
+
+                duration = (now - stats->startTime);
                 SIMPLEARRAY_INCREMENTVALUE(pinfo->reportBuf, assertType->effectIdx, duration);
+                if (_getPowerSource() == kBatteryPowered) {
+                    creditProcAggregate(pinfo, assertType->effectIdx, now - stats->creditedUntil);
+                }
+                armProcAggregateDeadline(pinfo);
             }
             assertion->state &= ~kAssertionStateAddsToProcStats;
         }
@@ -2735,6 +3386,103 @@ STATIC IOReturn lookupAssertion(pid_t pid, IOPMAssertionID id, assertion_t **ass
 
 }
 
+/*
+ * Free indices are handed out in the order they were released, so an ID
+ * is reused as late as possible, without probing the table for a free slot.
+ */
+static bool allocAssertionIndex(uint32_t *idx)
+{
+    if (!gFreeIdxCnt) {
+        return false;
+    }
+    *idx = gFreeAssertionIdx[gFreeIdxHead];
+    gFreeIdxHead = (gFreeIdxHead + 1) % kMaxAssertions;
+    gFreeIdxCnt--;
+
+    gAdmissionStats.liveCnt = kMaxAssertions - gFreeIdxCnt;
+    if (gAdmissionStats.liveCnt > gAdmissionStats.peakCnt) {
+        gAdmissionStats.peakCnt = gAdmissionStats.liveCnt;
+    }
+    return true;
+}
+
+static void freeAssertionIndex(uint32_t idx)
+{
+    gFreeAssertionIdx[(gFreeIdxHead + gFreeIdxCnt) % kMaxAssertions] = (uint16_t)idx;
+    gFreeIdxCnt++;
+    gAdmissionStats.liveCnt = kMaxAssertions - gFreeIdxCnt;
+}
+
+/*
+ * Checks the quotas before any work is done for a create. powerd's own
+ * assertions and entitled types draw on the reserved part of the table,
+ * so a flood from one process can't starve them.
+ */
+static IOReturn admitAssertion(pid_t pid, CFDictionaryRef props)
+{
+    static const char   *reasons[kAdmitRejectReasons] = { "table", "type", "process" };
+    int                 idx = getAssertionTypeIndex(CFDictionaryGetValue(props, kIOPMAssertionTypeKey));
+    assertionType_t     *assertType;
+    ProcessInfo         *pinfo;
+    admitRejectReason   reason;
+
+    if (idx < 0) {
+        // Unknown types are rejected by raiseAssertion()
+        return kIOReturnSuccess;
+    }
+    assertType = &gAssertionTypes[idx];
+    if ((pid == getpid()) || assertType->entitlement) {
+        return kIOReturnSuccess;
+    }
+
+    if (gAdmissionStats.liveCnt >= kMaxAssertions - kReservedAssertions) {
+        reason = kAdmitRejectTable;
+    }
+    else if (assertType->liveCnt >= kMaxAssertionsPerType) {
+        reason = kAdmitRejectType;
+    }
+    else if ((pinfo = processInfoGet(pid)) && (pinfo->assertionCnt >= kMaxAssertionsPerProcess)) {
+        reason = kAdmitRejectProcess;
+        pinfo->rejectCnt++;
+    }
+    else {
+        return kIOReturnSuccess;
+    }
+
+    gAdmissionStats.rejectCnt[reason]++;
+    assertType->rejectCnt++;
+    // Log the 1st, 2nd, 4th, 8th... refusal for the type
+    if (!(assertType->rejectCnt & (assertType->rejectCnt - 1))) {
+        ERROR_LOG("Refusing assertion type %@ from pid %d: %s limit reached(%u refused)\n",
+                  assertion_types_arr[idx], pid, reasons[reason], assertType->rejectCnt);
+    }
+    return kIOReturnNoResources;
+}
+
+__private_extern__ void getAssertionAdmissionStats(assertionAdmissionStats_t *stats)
+{
+    *stats = gAdmissionStats;
+}
+
+__private_extern__ void logAssertionAdmissionStats(void)
+{
+    uint32_t    internCnt = 0;
+    uint64_t    internRefs = 0;
+
+    INFO_LOG("Assertion table: live:%u peak:%u refused table:%llu type:%llu process:%llu\n",
+             gAdmissionStats.liveCnt, gAdmissionStats.peakCnt,
+             gAdmissionStats.rejectCnt[kAdmitRejectTable], gAdmissionStats.rejectCnt[kAdmitRejectType],
+             gAdmissionStats.rejectCnt[kAdmitRejectProcess]);
+    PMInternGetStats(&internCnt, &internRefs);
+    INFO_LOG("Assertion strings: distinct:%u references:%llu\n", internCnt, internRefs);
+    for (int i = 0; i < kIOPMNumAssertionTypes; i++) {
+        if (gAssertionTypes[i].rejectCnt) {
+            INFO_LOG("Assertion type %@: live:%u refused:%u\n",
+                     assertion_types_arr[i], gAssertionTypes[i].liveCnt, gAssertionTypes[i].rejectCnt);
+        }
+    }
+}
+
 kern_return_t _io_pm_change_sa_assertion_behavior (
                                                    mach_port_t             server  __unused,
                                                    audit_token_t           token,
@@ -3147,9 +3895,7 @@ void releaseStatsBufForDeadProcs( )
     CFIndex i, cnt;
 
     if (gAggCleanupDispatch) {
-        dispatch_source_set_timer(gAggCleanupDispatch,
-                dispatch_time(DISPATCH_TIME_NOW, gAggCleanupFrequency),
-                DISPATCH_TIME_FOREVER, 0);
+        PMTimerSchedule(gAggCleanupDispatch, gAggCleanupFrequency, kPMTimerForever);
     }
     cnt = CFDictionaryGetCount(gProcessDict);
     procs = malloc(cnt*(sizeof(ProcessInfo *)));
@@ -3239,14 +3985,8 @@ void setAssertionActivityAggregate(pid_t callerPID, int value)
             }
             // Set up a timer to frequently clean up the dead procs
             if (gAggCleanupDispatch == NULL) {
-                gAggCleanupDispatch = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-                dispatch_source_set_event_handler(gAggCleanupDispatch, ^{ releaseStatsBufForDeadProcs(); });
-                dispatch_source_set_cancel_handler(gAggCleanupDispatch, ^{
-                                                   dispatch_release(gAggCleanupDispatch);
-                                                   gAggCleanupDispatch = NULL;});
-                dispatch_source_set_timer(gAggCleanupDispatch,
-                                          dispatch_time(DISPATCH_TIME_NOW, gAggCleanupFrequency), DISPATCH_TIME_FOREVER, 0);
-                dispatch_resume(gAggCleanupDispatch);
+                gAggCleanupDispatch = PMTimerCreate(_getPMMainQueue(), ^{ releaseStatsBufForDeadProcs(); });
+                PMTimerSchedule(gAggCleanupDispatch, gAggCleanupFrequency, kPMTimerForever);
             }
         }
         pinfo->aggactivity = true;
@@ -3280,7 +4020,8 @@ void setAssertionActivityAggregate(pid_t callerPID, int value)
             }
 
             if (gAggCleanupDispatch) {
-                dispatch_source_cancel(gAggCleanupDispatch);
+                PMTimerCancel(gAggCleanupDispatch);
+                gAggCleanupDispatch = NULL;
             }
         }
         pinfo->aggactivity = false;
@@ -3371,29 +4112,17 @@ kern_return_t  _io_pm_set_exception_limits (
     CFDictionaryGetKeysAndValues(gProcessDict, NULL, (const void **)procs);
     for (int j = 0; (j < cnt) && (procs[j] != NULL); j++) {
         setProcessAssertionLimits(procs[j]);
+        armProcAggregateDeadline(procs[j]);
     }
 
     if (CFDictionaryGetCount(gProcAssertionLimits)) {
         if (gProcAggregateMonitor == NULL) {
-            gProcAggregateMonitor = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-
-            dispatch_source_set_event_handler(gProcAggregateMonitor, ^{ checkProcAggregates(); });
-
-            dispatch_source_set_cancel_handler(gProcAggregateMonitor, ^{
-                    dispatch_release(gProcAggregateMonitor);
-                    gProcAggregateMonitor = NULL;
-                    });
+            gProcAggregateMonitor = PMTimerCreate(_getPMMainQueue(), ^{ checkProcAggregates(); });
 
+            // No need to check aggregate stats periodically when external power source is connected
             if (_getPowerSource() == kBatteryPowered) {
-                dispatch_source_set_timer(gProcAggregateMonitor,
-                                          dispatch_time(DISPATCH_TIME_NOW, 0), gProcMonitorFrequency, 0);
+                PMTimerSchedule(gProcAggregateMonitor, 0, gProcMonitorFrequency);
             }
-            else {
-                // No need to check aggregate stats periodically when external power source is created
-                dispatch_source_set_timer(gProcAggregateMonitor,
-                                          dispatch_time(DISPATCH_TIME_FOREVER, 0), DISPATCH_TIME_FOREVER, 0);
-            }
-            dispatch_resume(gProcAggregateMonitor);
 
             // Enable process level assertion aggregate stats
             setAssertionActivityAggregate(getpid(), 1);
@@ -3403,12 +4132,9 @@ kern_return_t  _io_pm_set_exception_limits (
     else {
         // Empty gProcAssertionLimits means cancel all monitoring
         if (gProcAggregateMonitor) {
-            dispatch_source_cancel(gProcAggregateMonitor);
+            PMTimerCancel(gProcAggregateMonitor);
+            gProcAggregateMonitor = NULL;
             setAssertionActivityAggregate(getpid(), 0);
-            if (gProcAggregateBasis) {
-                CFRelease(gProcAggregateBasis);
-                gProcAggregateBasis = NULL;
-            }
         }
     }
 
@@ -3428,10 +4154,19 @@ uint8_t getAssertionLevel(kerAssertionType idx)
 
 void setAggregateLevel(kerAssertionType idx, uint8_t val)
 {
+    int prev = aggregate_assertions;
+
     if (val)
         aggregate_assertions |= (1 << idx);
     else
         aggregate_assertions &= ~(1<<idx);
+
+    if (prev != aggregate_assertions) {
+        PMSnapshotInvalidate(assertionsStatusSnapshot());
+        if (gAssertionTraceActive) {
+            PMAssertionTraceRecord(kPMTraceAggregate, 0, kIOPMNullAssertionID, aggregate_assertions, 0, NULL);
+        }
+    }
 }
 
 uint32_t getKerAssertionBits( )
@@ -3441,6 +4176,7 @@ uint32_t getKerAssertionBits( )
 
 void insertInactiveAssertion(assertion_t *assertion, assertionType_t *assertType) 
 {
+    assertionsChanged(assertion);
     LIST_INSERT_HEAD(&assertType->inactive, assertion, link);
     assertion->state &= ~kAssertionStateTimed;
     assertion->state |= kAssertionStateInactive;
@@ -3448,12 +4184,14 @@ void insertInactiveAssertion(assertion_t *assertion, assertionType_t *assertType
 
 void removeInactiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 {
+    assertionsChanged(assertion);
     LIST_REMOVE(assertion, link);
     assertion->state &= ~kAssertionStateInactive;
 }
 
 void insertActiveAssertion(assertion_t *assertion, assertionType_t *assertType, bool updates)
 {
+    assertionsChanged(assertion);
     LIST_INSERT_HEAD(&assertType->active, assertion, link);
     assertion->state &= ~(kAssertionStateTimed|kAssertionStateInactive|kAssertionSkipLogging);
 
@@ -3473,6 +4211,7 @@ void insertActiveAssertion(assertion_t *assertion, assertionType_t *assertType,
 
 void removeActiveAssertion(assertion_t *assertion, assertionType_t *assertType, bool updates)
 {
+    assertionsChanged(assertion);
     LIST_REMOVE(assertion, link);
 
     if ( (assertion->state & kAssertionStateValidOnBatt) && assertType->validOnBattCount)
@@ -3505,9 +4244,7 @@ void resetAssertionTimer(assertionType_t *assertType)
     }
     else {
 
-        dispatch_source_set_timer(assertType->timer, 
-                                  dispatch_time(DISPATCH_TIME_NOW, (nextAssertion->timeout-currTime)*NSEC_PER_SEC), 
-                                  DISPATCH_TIME_FOREVER, 0);
+        PMTimerSchedule(assertType->timer, (nextAssertion->timeout-currTime)*NSEC_PER_SEC, kPMTimerForever);
     }
 
 }
@@ -3528,9 +4265,14 @@ static void releaseAssertionMemory(assertion_t *assertion, assertLogAction logAc
     }
 
     assertion->retainCnt = 0;
+    assertionsChanged(assertion);
     logAssertionEvent(logAction, assertion);
     CFDictionaryRemoveValue(gAssertionsArray, (const void *)(uintptr_t)idx);
+    freeAssertionIndex(idx);
+    gAssertionTypes[assertion->kassert].liveCnt--;
+    assertion->pinfo->assertionCnt--;
     if (assertion->props) CFRelease(assertion->props);
+    releaseAssertionStrings(assertion);
 
 
     processInfoRelease(assertion->pinfo->pid);
@@ -3538,14 +4280,7 @@ static void releaseAssertionMemory(assertion_t *assertion, assertLogAction logAc
         processInfoRelease(assertion->causingPinfo->pid);
     }
 
-    if (assertion->procTimer) {
-        if ((assertion->state & kAssertionProcTimerActive) == 0) {
-            // If procTimer is suspended, resume it to allow its cancellation
-            assertion->state |= kAssertionProcTimerActive;
-            dispatch_resume(assertion->procTimer);
-        }
-        dispatch_source_cancel(assertion->procTimer);
-    }
+    stopProcTimer(assertion);
     memset(assertion, 0, sizeof(assertion_t));
     free(assertion);
 }
@@ -3582,7 +4317,7 @@ void handleAssertionTimeout(assertionType_t *assertType)
                      assertion->assertionId, kEnTrQualTimedOut, kEnTrValNone);
 #endif
 
-        if ((dateNow = CFDateCreate(0, CFAbsoluteTimeGetCurrent()))) {
+        if ((dateNow = CFDateCreate(0, PMClockAbsoluteTime()))) {
             CFDictionarySetValue(assertion->props, kIOPMAssertionTimedOutDateKey, dateNow);            
             CFRelease(dateNow);
         }
@@ -3635,6 +4370,7 @@ void removeTimedAssertion(assertion_t *assertion, assertionType_t *assertType, b
 {
     bool isTheFirstOne = false;
 
+    assertionsChanged(assertion);
     CFDictionaryRemoveValue(assertion->props, kIOPMAssertionTimeoutTimeLeftKey);
     if (LIST_FIRST(&assertType->activeTimed) == assertion) {
         isTheFirstOne = true;
@@ -3662,19 +4398,11 @@ void updateAssertionTimer(assertionType_t *assertType)
 
     if ((assertion = LIST_FIRST(&assertType->activeTimed)) == NULL) return;
 
-    /* Update/create the dispatch timer.  */
+    /* Update/create the timer.  */
     if (assertType->timer == NULL) {
-        assertType->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-
-        dispatch_source_set_event_handler(assertType->timer, ^{
+        assertType->timer = PMTimerCreate(_getPMMainQueue(), ^{
                                           handleAssertionTimeout(assertType);
                                           });
-
-        dispatch_source_set_cancel_handler(assertType->timer, ^{
-                                           dispatch_release(assertType->timer);
-                                           });
-
-        dispatch_resume(assertType->timer);
     }
 
     currTime = getMonotonicTime();
@@ -3687,9 +4415,7 @@ void updateAssertionTimer(assertionType_t *assertType)
         });
     }
     else {
-        dispatch_source_set_timer(assertType->timer, 
-                                  dispatch_time(DISPATCH_TIME_NOW, (assertion->timeout-currTime)*NSEC_PER_SEC), 
-                                  DISPATCH_TIME_FOREVER, 0);
+        PMTimerSchedule(assertType->timer, (assertion->timeout-currTime)*NSEC_PER_SEC, kPMTimerForever);
     }
 
 
@@ -3703,6 +4429,8 @@ static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
     uint64_t            currTime, timeLeft;
     CFDateRef           updateDate = NULL;
 
+    // Timer setting changes re-sort timed assertions through here too
+    assertionsChanged(assertion);
     currTime = getMonotonicTime();
     if (assertion->timeout > currTime) {
         /* Update timeout time left property */
@@ -3714,7 +4442,7 @@ static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
             CFRelease(timeLeftCF);
         }
 
-        updateDate = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+        updateDate = CFDateCreate(0, PMClockAbsoluteTime());
         if (updateDate) {
             CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutUpdateTimeKey, updateDate);
             CFRelease(updateDate);
@@ -3770,6 +4498,7 @@ void insertTimedAssertion(assertion_t *assertion, assertionType_t *assertType, b
 
 static void resumeAssertion(assertion_t *assertion)
 {
+    assertionsChanged(assertion);
     assertion->state &= ~kAssertionStateSuspended;
 
     CFDictionarySetValue(assertion->props, kIOPMAssertionIsStateSuspendedKey,
@@ -3860,6 +4589,7 @@ static void suspendAssertion(assertion_t *assertion)
 
     assertion->state |= kAssertionStateSuspended;
 
+    assertionsChanged(assertion);
     CFDictionarySetValue(assertion->props, kIOPMAssertionIsStateSuspendedKey,
                          (CFBooleanRef)kCFBooleanTrue);
 
@@ -3867,7 +4597,7 @@ static void suspendAssertion(assertion_t *assertion)
 
 }
 
-STATIC IOReturn doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt)
+static IOReturn _doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt)
 {
     IOReturn                    ret;
 
@@ -3895,6 +4625,17 @@ STATIC IOReturn doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt)
     return kIOReturnSuccess;
 }
 
+STATIC IOReturn doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt)
+{
+    uint64_t    traceStart = PMAssertionTraceBegin();
+    IOReturn    ret = _doRelease(pid, id, retainCnt);
+
+    if (traceStart) {
+        PMAssertionTraceRecord(kPMTraceRelease, pid, id, ret, traceStart, NULL);
+    }
+    return ret;
+}
+
 __private_extern__ void applyToAssertionsSync(assertionType_t *assertType,
                                               listSelectType_t assertionListSelect,
                                               void (^performOnAssertion)(assertion_t *))
@@ -3930,6 +4671,10 @@ __private_extern__ void HandleProcessExit(pid_t deadPID)
     __block LIST_HEAD(, assertion) list  = LIST_HEAD_INITIALIZER(list);     /* list of assertions released */
     ProcessInfo         *pinfo = NULL;
 
+    if (gAssertionTraceActive) {
+        PMAssertionTraceRecord(kPMTraceProcessExit, deadPID, kIOPMNullAssertionID, 0, 0, NULL);
+    }
+
     if ( (pinfo = processInfoGet(deadPID)) ) {
         pinfo->proc_exited = 1;
         if (pinfo->remoteConnection) {
@@ -3984,6 +4729,10 @@ void handleAssertionSuspend(pid_t pid)
 {
     ProcessInfo *pinfo = processInfoGet(pid);
 
+    if (gAssertionTraceActive) {
+        PMAssertionTraceRecord(kPMTraceSuspend, pid, kIOPMNullAssertionID, 0, 0, NULL);
+    }
+
     if (!pinfo) {
         ERROR_LOG("handleAssertionSuspend: Process with pid %d not found.\n", pid);
         return;
@@ -4027,6 +4776,10 @@ void handleAssertionResume(pid_t pid)
 {
     ProcessInfo *pinfo = processInfoGet(pid);
 
+    if (gAssertionTraceActive) {
+        PMAssertionTraceRecord(kPMTraceResume, pid, kIOPMNullAssertionID, 0, 0, NULL);
+    }
+
     if (!pinfo || !pinfo->isSuspended){
         ERROR_LOG("handleAssertionResume: Process with pid %d not found or not Suspended.\n", pid);
         return;
@@ -4074,170 +4827,433 @@ static int getAssertionTypeIndex(CFStringRef type)
     return idx;
 }
 
-static void forwardPropertiesToAssertion(const void *key, const void *value, void *context)
+/*
+ * Client property handlers, one per assertion property key that needs more
+ * than a copy into assertion->props. A handler returns false if the value
+ * must not be stored. forwardPropertiesToAssertion() finds the handler for a
+ * key with a single probe of gPropHandlerSlots, a collision-free table that
+ * is built the first time it is needed.
+ */
+typedef bool (*assertionPropHandler_t)(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value);
+
+static void setAssertionLevel(assertion_t *assertion, int level)
 {
-    assertion_t *assertion = (assertion_t *)context;
-    assertionType_t *assertType = NULL;
-    CFTimeInterval      timeout = 0;
-    int level;
+    if ( (assertion->state & kAssertionStateInactive) && (level == kIOPMAssertionLevelOn) )
+    {
+        assertion->state &= ~kAssertionStateInactive;
+        assertion->mods |= kAssertionModLevel;
+    }
+    else if ( !(assertion->state & kAssertionStateInactive) && (level == kIOPMAssertionLevelOff) )
+    {
+        assertion->state |= kAssertionStateInactive;
+        assertion->mods |= kAssertionModLevel;
+    }
+}
 
-    if (!isA_CFString(key))
-        return; /* Key has to be a string */
+static void setAssertionTimeout(assertion_t *assertion, assertionType_t *assertType, CFTimeInterval timeout)
+{
+    if (assertType->flags & kAssertionTypeAutoTimed) {
+        /* Restrict timeout to a max value of 'autoTimeout' */
+        if (!timeout || (timeout > assertType->autoTimeout))
+            timeout = assertType->autoTimeout;
+    }
 
+    if (timeout) {
+        assertion->timeout = (uint64_t)timeout + getMonotonicTime(); // Absolute time at which assertion expires
+    }
+    else  {
+        assertion->timeout = 0;
+    }
 
-    assertType = &gAssertionTypes[assertion->kassert];
-    if (CFEqual(key, kIOPMAssertionLevelKey)) {
-        if (!isA_CFNumber(value)) return;
-        CFNumberGetValue(value, kCFNumberIntType, &level);
-        if ( (assertion->state & kAssertionStateInactive) && (level == kIOPMAssertionLevelOn) )
-        {
-            assertion->state &= ~kAssertionStateInactive;
-            assertion->mods |= kAssertionModLevel;
-        }
-        else if ( !(assertion->state & kAssertionStateInactive) && (level == kIOPMAssertionLevelOff) )
-        {
-            assertion->state |= kAssertionStateInactive;
-            assertion->mods |= kAssertionModLevel;
-        }
+    /* Setting a timeout makes an inactive assertion active again */
+    if (assertion->state & kAssertionStateInactive) {
+        assertion->state &= ~kAssertionStateInactive;
+        assertion->mods |= kAssertionModLevel;
+    }
+    else {
+        assertion->mods |= kAssertionModTimer;
     }
-    else if (CFEqual(key, kIOPMAssertionTimeoutKey)) {
-        if (!isA_CFNumber(value)) return;
-        CFNumberGetValue(value, kCFNumberDoubleType, &timeout);
+}
 
-        if (assertType->flags & kAssertionTypeAutoTimed) {
-            /* Restrict timeout to a max value of 'autoTimeout' */
-            if (!timeout || (timeout > assertType->autoTimeout))
-                timeout = assertType->autoTimeout;
-        }
+static bool propLevel(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    int level;
 
-        if (timeout) {
-            assertion->timeout = (uint64_t)timeout + getMonotonicTime(); // Absolute time at which assertion expires
-        }
-        else  {
-            assertion->timeout = 0;
-        }
+    if (!isA_CFNumber(value)) return false;
+    CFNumberGetValue(value, kCFNumberIntType, &level);
+    setAssertionLevel(assertion, level);
+    return true;
+}
 
-        /* Setting a timeout makes an inactive assertion active again */
-        if (assertion->state & kAssertionStateInactive) {
-            assertion->state &= ~kAssertionStateInactive;
-            assertion->mods |= kAssertionModLevel;
-        }
-        else {
-            assertion->mods |= kAssertionModTimer;
-        }
+static bool propTimeout(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    CFTimeInterval      timeout = 0;
+
+    if (!isA_CFNumber(value)) return false;
+    CFNumberGetValue(value, kCFNumberDoubleType, &timeout);
+    setAssertionTimeout(assertion, assertType, timeout);
+    return true;
+}
+
+static bool propLimitedPower(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    if (!isA_CFBoolean(value)) return false;
+    if ((assertType->flags & kAssertionTypeNotValidOnBatt) == 0) return false;
+    if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionStateValidOnBatt))
+    {
+        assertType->validOnBattCount++;
+        assertion->state |= kAssertionStateValidOnBatt;
+        assertion->mods |= kAssertionModPowerConstraint;
     }
-    else if (CFEqual(key, kIOPMAssertionAppliesToLimitedPowerKey)) {
-        if (!isA_CFBoolean(value)) return;
-        if ((assertType->flags & kAssertionTypeNotValidOnBatt) == 0) return;
-        if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionStateValidOnBatt))
-        {
-            assertType->validOnBattCount++;
-            assertion->state |= kAssertionStateValidOnBatt;
-            assertion->mods |= kAssertionModPowerConstraint;
-        }
-        else if ((value == kCFBooleanFalse) && (assertion->state & kAssertionStateValidOnBatt) )
-        {
-            if (assertType->validOnBattCount) assertType->validOnBattCount--;
-            assertion->state &= ~kAssertionStateValidOnBatt;
-            assertion->mods |= kAssertionModPowerConstraint;
-        }
+    else if ((value == kCFBooleanFalse) && (assertion->state & kAssertionStateValidOnBatt) )
+    {
+        if (assertType->validOnBattCount) assertType->validOnBattCount--;
+        assertion->state &= ~kAssertionStateValidOnBatt;
+        assertion->mods |= kAssertionModPowerConstraint;
+    }
+    return true;
+}
 
+static bool propLidState(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    if (!isA_CFBoolean(value)) return false;
+    if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionLidStateModifier)) {
+        assertion->state |= kAssertionLidStateModifier;
+        assertion->mods |= kAssertionModLidState;
     }
-    else if (CFEqual(key, kIOPMAssertionAppliesOnLidClose)) {
-        if (!isA_CFBoolean(value)) return;
-        if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionLidStateModifier)) {
-            assertion->state |= kAssertionLidStateModifier;
-            assertion->mods |= kAssertionModLidState;
-        }
-        else if((value == kCFBooleanFalse) && (assertion->state & kAssertionLidStateModifier)) {
-            assertion->state &= ~kAssertionLidStateModifier;
-            assertion->mods |= kAssertionModLidState;
-        }
+    else if((value == kCFBooleanFalse) && (assertion->state & kAssertionLidStateModifier)) {
+        assertion->state &= ~kAssertionLidStateModifier;
+        assertion->mods |= kAssertionModLidState;
     }
+    return true;
+}
+
+static bool propExitSilentRunning(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    if (!isA_CFBoolean(value)) return false;
+    if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionExitSilentRunningMode)) {
+        assertion->state |= kAssertionExitSilentRunningMode;
+        assertion->mods |= kAssertionModSilentRunning;
+    }
+    return true;
+}
+
+static bool propCausingPid(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    if (!isA_CFNumber(value)) return false;
+    assertion->mods |= kAssertionModCausingPid;
+    return true;
+}
+
+static bool propType(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    /* Assertion type can't be modified */
+    return false;
+}
+
+static bool propName(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    assertion->mods |= kAssertionModName;
+    return !PMInternSet(&assertion->nameStr, value);
+}
+
+static bool propDetails(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    return !PMInternSet(&assertion->detailsStr, value);
+}
+
+static bool propReason(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    return !PMInternSet(&assertion->reasonStr, value);
+}
+
+static bool propBundlePath(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    return !PMInternSet(&assertion->bundlePathStr, value);
+}
+
+static bool propResources(assertion_t *assertion, assertionType_t *assertType, CFTypeRef value)
+{
+    assertion->mods |= kAssertionModResources;
+    return true;
+}
+
+static const struct {
+    CFStringRef             key;
+    assertionPropHandler_t  handler;
+} gPropHandlers[] = {
+    { kIOPMAssertionLevelKey,                   propLevel },
+    { kIOPMAssertionTimeoutKey,                 propTimeout },
+    { kIOPMAssertionAppliesToLimitedPowerKey,   propLimitedPower },
+    { kIOPMAssertionAppliesOnLidClose,          propLidState },
 #if (TARGET_OS_OSX && TARGET_CPU_ARM64)
-    else if (CFEqual(key, kIOPMAssertionProcessingHotPlug)) {
-        if (!isA_CFBoolean(value)) return;
-        if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionLidStateModifier)) {
-            assertion->state |= kAssertionLidStateModifier;
-            assertion->mods |= kAssertionModLidState;
+    { kIOPMAssertionProcessingHotPlug,          propLidState },
+#endif
+    { kIOPMAssertionExitSilentRunning,          propExitSilentRunning },
+    { kIOPMAssertionOnBehalfOfPID,              propCausingPid },
+    { kIOPMAssertionTypeKey,                    propType },
+    { kIOPMAssertionNameKey,                    propName },
+    { kIOPMAssertionDetailsKey,                 propDetails },
+    { kIOPMAssertionHumanReadableReasonKey,     propReason },
+    { kIOPMAssertionLocalizationBundlePathKey,  propBundlePath },
+    { kIOPMAssertionResourcesUsed,              propResources },
+    { kIOPMAssertionAllowsDeviceRestart,        propResources },
+};
+#define kPropHandlerCnt         (sizeof(gPropHandlers) / sizeof(gPropHandlers[0]))
+#define kPropHandlerSlotBits    6
+
+static uint8_t                      gPropHandlerSlots[1 << kPropHandlerSlotBits];  // 1-based gPropHandlers index
+static CFHashCode                   gPropHandlerHashes[kPropHandlerCnt];
+static uint64_t                     gPropHandlerSeed = 0;       // 0 if no collision-free seed was found
+
+static inline uint32_t propHandlerSlot(CFHashCode hash, uint64_t seed)
+{
+    return (uint32_t)(((uint64_t)hash * seed) >> (64 - kPropHandlerSlotBits));
+}
+
+static void buildPropHandlerTable(void)
+{
+    for (uint32_t i = 0; i < kPropHandlerCnt; i++) {
+        gPropHandlerHashes[i] = CFHash(gPropHandlers[i].key);
+    }
+
+    // Look for a multiplier that gives every key its own slot
+    for (uint64_t k = 1; k <= 1024; k++) {
+        uint64_t seed = (k * 0x9E3779B97F4A7C15ULL) | 1;
+        bool collision = false;
+
+        bzero(gPropHandlerSlots, sizeof(gPropHandlerSlots));
+        for (uint32_t i = 0; i < kPropHandlerCnt; i++) {
+            uint32_t slot = propHandlerSlot(gPropHandlerHashes[i], seed);
+            if (gPropHandlerSlots[slot]) {
+                collision = true;
+                break;
+            }
+            gPropHandlerSlots[slot] = i + 1;
         }
-        else if((value == kCFBooleanFalse) && (assertion->state & kAssertionLidStateModifier)) {
-            assertion->state &= ~kAssertionLidStateModifier;
-            assertion->mods |= kAssertionModLidState;
+        if (!collision) {
+            gPropHandlerSeed = seed;
+            return;
         }
     }
-#endif
-    else if (CFEqual(key, kIOPMAssertionExitSilentRunning)) {
-        if (!isA_CFBoolean(value)) return;
-        if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionExitSilentRunningMode)) {
-            assertion->state |= kAssertionExitSilentRunningMode;
-            assertion->mods |= kAssertionModSilentRunning;
+    ERROR_LOG("No collision-free seed for assertion property handlers\n");
+}
+
+static assertionPropHandler_t lookupPropHandler(CFStringRef key)
+{
+    static bool built = false;
+
+    if (!built) {
+        buildPropHandlerTable();
+        built = true;
+    }
+
+    if (gPropHandlerSeed) {
+        CFHashCode hash = CFHash(key);
+        uint8_t idx = gPropHandlerSlots[propHandlerSlot(hash, gPropHandlerSeed)];
+
+        if (idx && (gPropHandlerHashes[idx - 1] == hash) && CFEqual(key, gPropHandlers[idx - 1].key)) {
+            return gPropHandlers[idx - 1].handler;
         }
+        return NULL;
     }
-    else if (CFEqual(key, kIOPMAssertionOnBehalfOfPID)) {
-        if (!isA_CFNumber(value)) return;
-        assertion->mods |= kAssertionModCausingPid;
+
+    for (uint32_t i = 0; i < kPropHandlerCnt; i++) {
+        if (CFEqual(key, gPropHandlers[i].key)) {
+            return gPropHandlers[i].handler;
+        }
     }
-    else if (CFEqual(key, kIOPMAssertionTypeKey)) {
-        /* Assertion type can't be modified */
+    return NULL;
+}
+
+static void forwardPropertiesToAssertion(const void *key, const void *value, void *context)
+{
+    assertion_t *assertion = (assertion_t *)context;
+    assertionPropHandler_t handler;
+
+    if (!isA_CFString(key))
+        return; /* Key has to be a string */
+
+    handler = lookupPropHandler(key);
+    if (handler && !handler(assertion, &gAssertionTypes[assertion->kassert], value)) {
         return;
     }
-    else if (CFEqual(key, kIOPMAssertionNameKey)) {
-        assertion->mods |= kAssertionModName;
+
+    CFDictionarySetValue(assertion->props, key, value);
+}
+
+static IOReturn lookupModifiableAssertion(pid_t pid, IOPMAssertionID id, assertion_t **outAssertion)
+{
+    assertion_t                 *assertion = NULL;
+    ProcessInfo                 *pinfo = NULL;
+    ProcessInfo                 *causingPinfo = NULL;
+    IOReturn                    ret;
+
+    ret = lookupAssertion(pid, id, &assertion);
+
+    if ((kIOReturnSuccess != ret)) {
+        return ret;
+    }
+
+    // Assertions created by suspended pids are not allowed to be manipulated
+    pinfo = processInfoGet(pid);
+    if ( pinfo == NULL ) {
+        return kIOReturnBadArgument;
     }
-    else if (CFEqual(key, kIOPMAssertionResourcesUsed) ||
-             CFEqual(key, kIOPMAssertionAllowsDeviceRestart))  {
-        assertion->mods |= kAssertionModResources;
+
+    if ( pinfo->isSuspended ) {
+        return kIOReturnNotPermitted;
     }
 
-    CFDictionarySetValue(assertion->props, key, value);
+    // Assertions created on behalf of suspended pids are not allowed to be manipulated
+    causingPinfo = processInfoGet(assertion->causingPid);
+    if ( causingPinfo && causingPinfo->isSuspended) {
+        return kIOReturnNotPermitted;
+    }
+
+    *outAssertion = assertion;
+    return kIOReturnSuccess;
+}
 
+static IOReturn applyAssertionMods(assertion_t *assertion, uint32_t oldState, int *enTrIntensity);
+
+static IOReturn _doSetProperties(pid_t pid,
+                                 IOPMAssertionID id, 
+                                 CFDictionaryRef inProps,
+                                 int *enTrIntensity)
+{
+    assertion_t                 *assertion = NULL;
+    uint32_t                    oldState;
+    IOReturn                    ret;
+
+    // doSetProperties doesn't handle retain()/release() count. 
+    // Callers should use IOPMAssertionRetain() or IOPMAssertionRelease().
+
+    ret = lookupModifiableAssertion(pid, id, &assertion);
+    if (kIOReturnSuccess != ret) {
+        return ret;
+    }
+    assertionsChanged(assertion);
+
+    assertion->mods = 0;
+    oldState = assertion->state;
+    CFDictionaryApplyFunction(inProps, forwardPropertiesToAssertion,
+                              assertion);
+
+    return applyAssertionMods(assertion, oldState, enTrIntensity);
+}
+
+STATIC IOReturn doSetProperties(pid_t pid,
+                                IOPMAssertionID id,
+                                CFDictionaryRef inProps,
+                                int *enTrIntensity)
+{
+    uint64_t    traceStart = PMAssertionTraceBegin();
+    IOReturn    ret = _doSetProperties(pid, id, inProps, enTrIntensity);
+
+    if (traceStart) {
+        PMAssertionTraceRecord(kPMTraceSetProperties, pid, id, ret, traceStart, inProps);
+    }
+    return ret;
+}
+
+/*
+ * Same as doSetProperties() for the fields in 'update', without building
+ * or walking a property dictionary.
+ */
+static IOReturn _doUpdateProperties(pid_t pid,
+                                    IOPMAssertionID id,
+                                    const assertionUpdate_t *update)
+{
+    assertion_t                 *assertion = NULL;
+    uint32_t                    oldState;
+    IOReturn                    ret;
+
+    ret = lookupModifiableAssertion(pid, id, &assertion);
+    if (kIOReturnSuccess != ret) {
+        return ret;
+    }
+    assertionsChanged(assertion);
+
+    assertion->mods = 0;
+    oldState = assertion->state;
+
+    if (update->fields & kAssertionUpdateLevel) {
+        CFNumberRef level = CFNumberCreate(0, kCFNumberIntType, &update->level);
+        if (level) {
+            setAssertionLevel(assertion, update->level);
+            CFDictionarySetValue(assertion->props, kIOPMAssertionLevelKey, level);
+            CFRelease(level);
+        }
+    }
+    if (update->fields & kAssertionUpdateTimeout) {
+        CFNumberRef timeout = CFNumberCreate(0, kCFNumberDoubleType, &update->timeout);
+        if (timeout) {
+            setAssertionTimeout(assertion, &gAssertionTypes[assertion->kassert], update->timeout);
+            CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutKey, timeout);
+            CFRelease(timeout);
+        }
+    }
+    if ((update->fields & kAssertionUpdateName) && update->name) {
+        CFStringRef name = CFStringCreateWithCString(0, update->name, kCFStringEncodingUTF8);
+        if (name) {
+            assertion->mods |= kAssertionModName;
+            PMInternSet(&assertion->nameStr, name);
+            CFRelease(name);
+        }
+    }
 
+    return applyAssertionMods(assertion, oldState, NULL);
 }
 
-STATIC IOReturn doSetProperties(pid_t pid,
-                                IOPMAssertionID id, 
-                                CFDictionaryRef inProps,
-                                int *enTrIntensity)
+STATIC IOReturn doUpdateProperties(pid_t pid,
+                                   IOPMAssertionID id,
+                                   const assertionUpdate_t *update)
 {
-    assertion_t                 *assertion = NULL;
-    assertionType_t             *assertType;
-    uint32_t                    oldState;
-    ProcessInfo                 *pinfo = NULL;
-    ProcessInfo                 *causingPinfo = NULL;
-
-    IOReturn                    ret;
-
-    // doSetProperties doesn't handle retain()/release() count. 
-    // Callers should use IOPMAssertionRetain() or IOPMAssertionRelease().
-
-    ret = lookupAssertion(pid, id, &assertion);
+    uint64_t                traceStart = PMAssertionTraceBegin();
+    CFMutableDictionaryRef  fields = NULL;
+    IOReturn                ret;
 
-    if ((kIOReturnSuccess != ret)) {
+    ret = _doUpdateProperties(pid, id, update);
+    if (!traceStart) {
         return ret;
     }
 
-    // Assertions created by suspended pids are not allowed to be manipulated
-    pinfo = processInfoGet(pid);
-    if ( pinfo == NULL ) {
-        return kIOReturnBadArgument;
-    }
-
-    if ( pinfo->isSuspended ) {
-        return kIOReturnNotPermitted;
+    // Recorded in the same form as a doSetProperties() payload
+    fields = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (fields) {
+        if (update->fields & kAssertionUpdateLevel) {
+            CFNumberRef n = CFNumberCreate(0, kCFNumberIntType, &update->level);
+            if (n) {
+                CFDictionarySetValue(fields, kIOPMAssertionLevelKey, n);
+                CFRelease(n);
+            }
+        }
+        if (update->fields & kAssertionUpdateTimeout) {
+            CFNumberRef n = CFNumberCreate(0, kCFNumberDoubleType, &update->timeout);
+            if (n) {
+                CFDictionarySetValue(fields, kIOPMAssertionTimeoutKey, n);
+                CFRelease(n);
+            }
+        }
+        if ((update->fields & kAssertionUpdateName) && update->name) {
+            CFStringRef name = CFStringCreateWithCString(0, update->name, kCFStringEncodingUTF8);
+            if (name) {
+                CFDictionarySetValue(fields, kIOPMAssertionNameKey, name);
+                CFRelease(name);
+            }
+        }
     }
-
-    // Assertions created on behalf of suspended pids are not allowed to be manipulated
-    causingPinfo = processInfoGet(assertion->causingPid);
-    if ( causingPinfo && causingPinfo->isSuspended) {
-        return kIOReturnNotPermitted;
+    PMAssertionTraceRecord(kPMTraceUpdate, pid, id, ret, traceStart, fields);
+    if (fields) {
+        CFRelease(fields);
     }
+    return ret;
+}
 
-    assertion->mods = 0;
-    assertType = &gAssertionTypes[assertion->kassert];
-    oldState = assertion->state;
-    CFDictionaryApplyFunction(inProps, forwardPropertiesToAssertion,
-                              assertion);
+static IOReturn applyAssertionMods(assertion_t *assertion, uint32_t oldState, int *enTrIntensity)
+{
+    assertionType_t             *assertType = &gAssertionTypes[assertion->kassert];
 
     if (assertion->mods & kAssertionModCausingPid) {
         //TODO This cannot be enabled, until RunningBoard moves to new API
@@ -4278,7 +5294,7 @@ STATIC IOReturn doSetProperties(pid_t pid,
             /* An inactive assertion is made active now */
             removeInactiveAssertion(assertion, assertType);
             CFDictionaryRemoveValue(assertion->props, kIOPMAssertionTimedOutDateKey);            
-            CFDictionaryRemoveValue(assertion->props, kIOPMAssertionCreateDateKey);
+            assertion->createDate = 0;
             raiseAssertion(assertion);
             logAssertionEvent(kATurnOnLog, assertion);
         }
@@ -4301,11 +5317,7 @@ STATIC IOReturn doSetProperties(pid_t pid,
             removeActiveAssertion(assertion, assertType, false);
 
         assertion->createTime = getMonotonicTime();
-        CFDateRef start_date = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
-        if (start_date) {
-            CFDictionarySetValue(assertion->props, kIOPMAssertionCreateDateKey, start_date);
-            CFRelease(start_date);
-        }
+        assertion->createDate = PMClockAbsoluteTime();
         if (assertion->timeout != 0) {
             insertTimedAssertion(assertion, assertType, true, false);
         }
@@ -4683,9 +5695,15 @@ void setKernelAssertions(assertionType_t *assertType, assertionOps op)
         assertBit = kIOPMDriverAssertionCPUBit;
         break;
 
+    case kBackgroundTaskType:
+        // Tells a darkwake linger when the work it was kept for finished
+        if ( !activesForTheType && getAssertionLevel(assertType->kassert) )
+            PMLingerPolicyWorkDone(PMClockAbsoluteTime());
+        assertBit = kIOPMDriverAssertionCPUBit;
+        break;
+
     case kInteractivePushServiceType:
     case kPreventSleepType:
-    case kBackgroundTaskType:
     case kSRPreventSleepType:
     case kNetworkAccessType:
         assertBit = kIOPMDriverAssertionCPUBit;
@@ -4970,33 +5988,162 @@ void resetGlobalTimer(assertionType_t *assertType, uint64_t timeout)
         return;
     assertType->globalTimeout = timeout;
     if (assertType->globalTimeout == 0) {
-        if ( assertType->globalTimer)
-            dispatch_source_cancel(assertType->globalTimer);
+        if ( assertType->globalTimer) {
+            PMTimerCancel(assertType->globalTimer);
+            assertType->globalTimer = NULL;
+        }
         return;
     }
 
     if (assertType->globalTimer == NULL) {
-        assertType->globalTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-
-        dispatch_source_set_event_handler(assertType->globalTimer, ^{
+        assertType->globalTimer = PMTimerCreate(_getPMMainQueue(), ^{
                                           enforceAssertionTypeTimeCap(assertType);
                                           });
+    }
 
-        dispatch_source_set_cancel_handler(assertType->globalTimer, ^{
-                                           dispatch_release(assertType->globalTimer);
-                                           assertType->globalTimer = NULL;
-                                           });
+    PMTimerSchedule(assertType->globalTimer, assertType->globalTimeout * NSEC_PER_SEC, kPMTimerForever);
+
+}
+
+/*
+ * Common assertion properties are kept in interned fields of assertion_t
+ * instead of assertion->props; these are the keys they come from.
+ */
+static const struct {
+    CFStringRef     key;
+    size_t          offset;
+} gInternedProps[] = {
+    { kIOPMAssertionTypeKey,                    offsetof(assertion_t, typeStr) },
+    { kIOPMAssertionNameKey,                    offsetof(assertion_t, nameStr) },
+    { kIOPMAssertionDetailsKey,                 offsetof(assertion_t, detailsStr) },
+    { kIOPMAssertionHumanReadableReasonKey,     offsetof(assertion_t, reasonStr) },
+    { kIOPMAssertionLocalizationBundlePathKey,  offsetof(assertion_t, bundlePathStr) },
+};
+#define kInternedPropCnt        (sizeof(gInternedProps) / sizeof(gInternedProps[0]))
+
+static inline PMInternID *internedProp(assertion_t *assertion, uint32_t i)
+{
+    return (PMInternID *)((uint8_t *)assertion + gInternedProps[i].offset);
+}
+
+/*
+ * Copies one key of a newly supplied props dictionary into the assertion.
+ * Common properties go to their interned fields and derived keys are
+ * dropped; everything else, including values of an unexpected type, lands
+ * in assertion->props.
+ */
+static void takeAssertionProperty(const void *key, const void *value, void *context)
+{
+    assertion_t *assertion = (assertion_t *)context;
+
+    for (uint32_t i = 0; i < kInternedPropCnt; i++) {
+        if (CFEqual(key, gInternedProps[i].key)) {
+            if (PMInternSet(internedProp(assertion, i), value)) {
+                return;
+            }
+            break;
+        }
+    }
+
+    // Async clients pass in the time the assertion was created at
+    if (CFEqual(key, kIOPMAssertionCreateDateKey)) {
+        if (isA_CFDate(value)) {
+            assertion->createDate = CFDateGetAbsoluteTime(value);
+        }
+        return;
+    }
+
+    // Derived from the assertion in copyAssertionProperties()
+    if (CFEqual(key, kIOPMAssertionGlobalUniqueIDKey) || CFEqual(key, kIOPMAssertionIdKey)
+        || CFEqual(key, kIOPMAssertionProcessNameKey) || CFEqual(key, kIOPMAssertionPIDKey)) {
+        return;
+    }
+
+    CFDictionarySetValue(assertion->props, key, value);
+}
+
+/*
+ * Builds assertion->props from the caller's dictionary in one pass, so only
+ * the keys without a field in assertion_t are ever copied. The caller's
+ * dictionary is not modified.
+ */
+static bool takeAssertionProperties(assertion_t *assertion, CFDictionaryRef newProperties)
+{
+    assertion->props = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                 &kCFTypeDictionaryValueCallBacks);
+    if (!assertion->props) {
+        return false;
+    }
+    CFDictionaryApplyFunction(newProperties, takeAssertionProperty, assertion);
+    return true;
+}
+
+__private_extern__ void releaseAssertionStrings(assertion_t *assertion)
+{
+    for (uint32_t i = 0; i < kInternedPropCnt; i++) {
+        PMInternRelease(*internedProp(assertion, i));
+        *internedProp(assertion, i) = kPMInternNone;
+    }
+}
+
+/*
+ * Returns the assertion's properties as clients see them: assertion->props
+ * plus the interned and derived keys. The caller releases the dictionary.
+ */
+__private_extern__ CFMutableDictionaryRef copyAssertionProperties(assertion_t *assertion)
+{
+    CFMutableDictionaryRef  props;
+    CFTypeRef               value;
 
+    if (assertion->props) {
+        props = CFDictionaryCreateMutableCopy(0, 0, assertion->props);
     }
     else {
-        dispatch_suspend(assertType->globalTimer);
+        props = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    }
+    if (!props) {
+        return NULL;
     }
 
-    dispatch_source_set_timer(assertType->globalTimer, 
-                              dispatch_time(DISPATCH_TIME_NOW, assertType->globalTimeout * NSEC_PER_SEC), 
-                              DISPATCH_TIME_FOREVER, 0);
-    dispatch_resume(assertType->globalTimer);
+    for (uint32_t i = 0; i < kInternedPropCnt; i++) {
+        if ((value = PMInternGetString(*internedProp(assertion, i)))) {
+            CFDictionarySetValue(props, gInternedProps[i].key, value);
+        }
+    }
+    if (assertion->uniqueId) {
+        value = CFNumberCreate(0, kCFNumberSInt64Type, &assertion->uniqueId);
+        if (value) {
+            CFDictionarySetValue(props, kIOPMAssertionGlobalUniqueIDKey, value);
+            CFRelease(value);
+        }
+    }
+    if (assertion->createDate) {
+        value = CFDateCreate(0, assertion->createDate);
+        if (value) {
+            CFDictionarySetValue(props, kIOPMAssertionCreateDateKey, value);
+            CFRelease(value);
+        }
+    }
+    if (assertion->assertionId) {
+        value = CFNumberCreate(0, kCFNumberSInt32Type, &assertion->assertionId);
+        if (value) {
+            CFDictionarySetValue(props, kIOPMAssertionIdKey, value);
+            CFRelease(value);
+        }
+        if (assertion->pinfo->name) {
+            CFDictionarySetValue(props, kIOPMAssertionProcessNameKey, assertion->pinfo->name);
+        }
+        value = CFNumberCreate(0, kCFNumberIntType, &assertion->pinfo->pid);
+        if (value) {
+            CFDictionarySetValue(props, kIOPMAssertionPIDKey, value);
+            CFRelease(value);
+        }
+    }
+    if (assertion->kassert < kIOPMNumAssertionTypes) {
+        CFDictionarySetValue(props, kIOPMAssertionTrueTypeKey, assertion_types_arr[assertion->kassert]);
+    }
 
+    return props;
 }
 
 static IOReturn raiseAssertion(assertion_t *assertion)
@@ -5005,64 +6152,37 @@ static IOReturn raiseAssertion(assertion_t *assertion)
     int                 level;
     uint64_t            currTime = getMonotonicTime();
     uint32_t            levelInt = 0;
-    CFDateRef           start_date = NULL;
-    CFStringRef         assertionTypeRef;
     CFNumberRef         numRef = NULL;
     CFNumberRef         levelNum = NULL;
     CFTimeInterval      timeout = 0;
     assertionType_t     *assertType;
     uint64_t            assertion_id_64;
     CFBooleanRef        val = NULL;
-    CFNumberRef         pidCF = NULL;
-
-
-    assertionTypeRef = CFDictionaryGetValue(assertion->props, kIOPMAssertionTypeKey);
 
     /* Find index for this assertion type */
-    idx = getAssertionTypeIndex(assertionTypeRef);
+    idx = getAssertionTypeIndex(PMInternGetString(assertion->typeStr));
 
     if (idx < 0 )
         return kIOReturnBadArgument;
 
+    assertionsChanged(assertion);
+
     assertType = &gAssertionTypes[idx];
     assertion->kassert = idx;
 
     assertion_id_64 = MAKE_UNIQAID(currTime, idx, assertion->assertionId);
-    CFNumberRef uniqueAID = CFNumberCreate(0, kCFNumberSInt64Type, &assertion_id_64);
-
-    if (uniqueAID) {
-        CFDictionarySetValue(assertion->props, kIOPMAssertionGlobalUniqueIDKey, uniqueAID);
-        CFRelease(uniqueAID);
-    }
-    numRef = CFNumberCreate(0, kCFNumberSInt32Type, &assertion->assertionId);
-    if (numRef) {
-        CFDictionarySetValue(assertion->props, kIOPMAssertionIdKey, numRef);
-        CFRelease(numRef);
-    }
-    if (assertion->pinfo->name) {
-        CFDictionarySetValue(assertion->props, kIOPMAssertionProcessNameKey, assertion->pinfo->name);
-    }
-    pidCF = CFNumberCreate(0, kCFNumberIntType, &assertion->pinfo->pid);
-    if (pidCF) {
-        CFDictionarySetValue(assertion->props, kIOPMAssertionPIDKey, pidCF);
-        CFRelease(pidCF);
-    }
+    assertion->uniqueId = assertion_id_64;
 
     assertion->createTime = 0;
-    if (CFDictionaryGetValueIfPresent(assertion->props, kIOPMAssertionCreateDateKey, (const void **)&start_date) &&
-        isA_CFDate(start_date)) {
-        CFTimeInterval delta = CFAbsoluteTimeGetCurrent() - CFDateGetAbsoluteTime(start_date);
+    if (assertion->createDate) {
+        CFTimeInterval delta = PMClockAbsoluteTime() - assertion->createDate;
         if (delta > 0) {
             assertion->createTime = currTime - delta;
         }
     }
     if (!assertion->createTime) {
         /* Attach the Create Time */
-        start_date = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
-        if (start_date) {
-            CFDictionarySetValue(assertion->props, kIOPMAssertionCreateDateKey, start_date);
-            CFRelease(start_date);
-        }
+        assertion->createDate = PMClockAbsoluteTime();
         assertion->createTime = currTime;
     }
 
@@ -5149,7 +6269,7 @@ exit:
 }
 
 
-STATIC IOReturn doCreate(
+static IOReturn _doCreate(
                   pid_t                   pid,
                   CFMutableDictionaryRef  newProperties,
                   IOPMAssertionID         *assertion_id,
@@ -5157,18 +6277,20 @@ STATIC IOReturn doCreate(
                   int                     *enTrIntensity
                  ) 
 {
-    int                     i;
+    uint32_t                i;
     assertion_t             *assertion = NULL;
-    assertion_t             *tmp_a = NULL;
     IOReturn                result = kIOReturnSuccess;
     ProcessInfo             *pinfo = NULL;
     ProcessInfo             *causing_pinfo = NULL;
     assertionType_t         *assertType = NULL;
-    static uint32_t         gNextAssertionIdx = 0;
 
     // assertion_id will be set to kIOPMNullAssertionID on failure.
     *assertion_id = kIOPMNullAssertionID;
 
+    if ((result = admitAssertion(pid, newProperties)) != kIOReturnSuccess) {
+        return result;
+    }
+
     // Create a dispatch handler for process exit, if there isn't one
     if ( !(pinfo = processInfoRetain(pid)) ) {
         pinfo = processInfoCreate(pid);
@@ -5184,23 +6306,23 @@ STATIC IOReturn doCreate(
     }
 
     // Generate an id
-    for (i=gNextAssertionIdx; CFDictionaryGetValueIfPresent(gAssertionsArray, 
-                                                            (const void *)(uintptr_t)i, (const void **)&tmp_a) == true; ) {
-        i = (i+1) % kMaxAssertions;
-        if (i == gNextAssertionIdx) break;
-    }
-    if (CFDictionaryGetValueIfPresent(gAssertionsArray, (const void *)(uintptr_t)i, (const void **)&tmp_a) == true) {
+    if (!allocAssertionIndex(&i)) {
         processInfoRelease(pid);
         return kIOReturnNoMemory;
     }
 
     assertion = calloc(1, sizeof(assertion_t));
     if (assertion == NULL) {
+        freeAssertionIndex(i);
+        processInfoRelease(pid);
+        return kIOReturnNoMemory;
+    }
+    if (!takeAssertionProperties(assertion, newProperties)) {
+        free(assertion);
+        freeAssertionIndex(i);
         processInfoRelease(pid);
         return kIOReturnNoMemory;
     }
-    assertion->props = newProperties;
-    CFRetain(newProperties);
     assertion->retainCnt = 1;
     assertion->pinfo = pinfo;
 
@@ -5216,20 +6338,23 @@ STATIC IOReturn doCreate(
 
     assertion->assertionId = ID_FROM_INDEX(i);
     CFDictionarySetValue(gAssertionsArray, (const void *)(uintptr_t)i, (const void *)assertion);
-    gNextAssertionIdx = (i+1) % kMaxAssertions;
 
     result = raiseAssertion(assertion);
 
     if (result != kIOReturnSuccess) {
         processInfoRelease(pid);
         CFDictionaryRemoveValue(gAssertionsArray, (const void *)(uintptr_t)i);
+        freeAssertionIndex(i);
         CFRelease(assertion->props);
+        releaseAssertionStrings(assertion);
         free(assertion);
 
         return result;
     }
 
     assertType = &gAssertionTypes[assertion->kassert];
+    assertType->liveCnt++;
+    pinfo->assertionCnt++;
     if (!(assertion->state & kAssertionStateInactive))
         logAssertionEvent(kACreateLog, assertion);
     if (gAnyChange) notify_post( kIOPMAssertionsAnyChangedNotifyString );
@@ -5241,12 +6366,29 @@ STATIC IOReturn doCreate(
     return result;
 }
 
+STATIC IOReturn doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
+                         IOPMAssertionID *assertion_id, ProcessInfo **procInfo,
+                         int *enTrIntensity)
+{
+    uint64_t                traceStart = PMAssertionTraceBegin();
+    IOReturn                ret;
+
+    // _doCreate() only reads newProperties, so it is still what the caller asked for
+    ret = _doCreate(pid, newProperties, assertion_id, procInfo, enTrIntensity);
+    if (traceStart) {
+        PMAssertionTraceRecord(kPMTraceCreate, pid, assertion_id ? *assertion_id : kIOPMNullAssertionID,
+                               ret, traceStart, newProperties);
+    }
+    return ret;
+}
+
 static void copyAssertion(assertion_t *assertion, CFMutableDictionaryRef assertionsDict)
 {
     bool                    created = false;
     CFNumberRef             pidCF = NULL;
     CFMutableDictionaryRef  processDict = NULL;
     CFMutableArrayRef       pidAssertionsArr = NULL;
+    CFDictionaryRef         props = NULL;
 
     pidCF = CFNumberCreate(0, kCFNumberIntType, &assertion->pinfo->pid);
 
@@ -5273,11 +6415,11 @@ static void copyAssertion(assertion_t *assertion, CFMutableDictionaryRef asserti
         pidAssertionsArr = (CFMutableArrayRef)CFDictionaryGetValue(processDict, CFSTR("PerTaskAssertions"));
     }
 
-    if (assertion->kassert < kIOPMNumAssertionTypes) {
-        CFDictionarySetValue(assertion->props, kIOPMAssertionTrueTypeKey, assertion_types_arr[assertion->kassert]);
+    props = copyAssertionProperties(assertion);
+    if (props) {
+        CFArrayAppendValue(pidAssertionsArr, props);
+        CFRelease(props);
     }
-
-    CFArrayAppendValue(pidAssertionsArr, assertion->props);
     CFRelease(pidCF);
 
     if (created) {
@@ -5286,14 +6428,12 @@ static void copyAssertion(assertion_t *assertion, CFMutableDictionaryRef asserti
     }
 }
 
-static CFArrayRef copyAssertionsByType(CFStringRef assertionType)
+static CFArrayRef copyAssertionsByTypeIndex(int idx)
 {
     __block CFMutableArrayRef       returnArray = NULL;
     assertionType_t         *assertType = NULL;
-    int idx;
 
-    idx = getAssertionTypeIndex(assertionType);
-    if (idx == -1) {
+    if ((idx < 0) || (idx >= kIOPMNumAssertionTypes)) {
         return NULL;
     }
     assertType = &gAssertionTypes[idx];
@@ -5302,12 +6442,11 @@ static CFArrayRef copyAssertionsByType(CFStringRef assertionType)
                               if (returnArray == NULL) {
                                   returnArray = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
                               }
-                              if (assertion->kassert < kIOPMNumAssertionTypes) {
-                                  CFDictionarySetValue(assertion->props,
-                                                       kIOPMAssertionTrueTypeKey,
-                                                       assertion_types_arr[assertion->kassert]);
+                              CFDictionaryRef props = copyAssertionProperties(assertion);
+                              if (props) {
+                                  CFArrayAppendValue(returnArray, props);
+                                  CFRelease(props);
                               }
-                              CFArrayAppendValue(returnArray, assertion->props);
                           });
 
     return returnArray;
@@ -5367,6 +6506,21 @@ exit:
     return returnArray;
 }
 
+static CFDataRef copySerializedAssertions(int state)
+{
+    CFArrayRef  assertionsList = NULL;
+    CFDataRef   serialized = NULL;
+
+    assertionsList = copyPIDAssertionDictionaryFlattened(state);
+    if (assertionsList) {
+        serialized = CFPropertyListCreateData(0, assertionsList,
+                                              kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+        CFRelease(assertionsList);
+    }
+
+    return serialized;
+}
+
 STATIC IOReturn copyAssertionForID(
                                    pid_t inPID, int inID,
                                    CFMutableDictionaryRef  *outAssertion)
@@ -5385,14 +6539,13 @@ STATIC IOReturn copyAssertionForID(
         goto exit;
     }
 
-    CFRetain(assertion->props);
-    *outAssertion = assertion->props;
+    *outAssertion = copyAssertionProperties(assertion);
 
 exit:
     return ret;
 }
 
-STATIC IOReturn doRetain(pid_t pid, IOPMAssertionID id, int *retainCnt)
+static IOReturn _doRetain(pid_t pid, IOPMAssertionID id, int *retainCnt)
 {
     IOReturn        ret;
     assertion_t     *assertion = NULL;
@@ -5413,6 +6566,17 @@ STATIC IOReturn doRetain(pid_t pid, IOPMAssertionID id, int *retainCnt)
     return kIOReturnSuccess;
 }
 
+STATIC IOReturn doRetain(pid_t pid, IOPMAssertionID id, int *retainCnt)
+{
+    uint64_t    traceStart = PMAssertionTraceBegin();
+    IOReturn    ret = _doRetain(pid, id, retainCnt);
+
+    if (traceStart) {
+        PMAssertionTraceRecord(kPMTraceRetain, pid, id, ret, traceStart, NULL);
+    }
+    return ret;
+}
+
 
 
 /* 
@@ -5594,6 +6758,7 @@ __private_extern__ void evalAllInteractivePushAssertions()
 
                               if (assertion->timeout > newTimeout) {
                                   assertion->timeout = newTimeout;
+                                  assertionsChanged(assertion);
 
                                   timeLeftCF = CFNumberCreate(0, kCFNumberLongType, &assertType->autoTimeout);
                                   if (timeLeftCF) {
@@ -5601,7 +6766,7 @@ __private_extern__ void evalAllInteractivePushAssertions()
                                       CFRelease(timeLeftCF);
                                   }
 
-                                  updateDate = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+                                  updateDate = CFDateCreate(0, PMClockAbsoluteTime());
                                   if (updateDate) {
                                       CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutUpdateTimeKey, updateDate);
                                       CFRelease(updateDate);
@@ -5617,7 +6782,7 @@ __private_extern__ void evalAllInteractivePushAssertions()
 
 
 
-static void   evaluateForPSChange(void)
+STATIC void   evaluateForPSChange(void)
 {
     int         i, pwrSrc;
     static int  prevPwrSrc = -1;
@@ -5628,6 +6793,14 @@ static void   evaluateForPSChange(void)
         return; // If power source hasn't changed, there is nothing to do
 
     prevPwrSrc = pwrSrc;
+    if (gAssertionTraceActive) {
+        PMAssertionTraceRecord(kPMTracePowerSource, 0, kIOPMNullAssertionID, pwrSrc, 0, NULL);
+    }
+
+    if (gProcAggregateMonitor) {
+        // Holds up to now count against aggregate limits only if they were on battery
+        restartProcAggregateWindows(pwrSrc != kBatteryPowered);
+    }
 
     for (i=0; i < kIOPMNumAssertionTypes; i++)
     {
@@ -5655,30 +6828,22 @@ static void   evaluateForPSChange(void)
                 if ((!(assertion->state & kAssertionStateValidOnBatt)) && (assertType->flags & kAssertionTypeNotValidOnBatt)) {
                     updateAppStats(assertion, kAssertionOpRelease);
                 }
-                startProcTimer(assertion);
             }
             else if (pwrSrc != kBatteryPowered) {
                 if (assertType->flags & kAssertionTypeNotValidOnBatt) {
                     updateAppStats(assertion, kAssertionOpRaise);
                 }
-                stopProcTimer(assertion);
             }
         });
     }
+    setProcDeadlinesPaused(pwrSrc != kBatteryPowered);
     if (gProcAggregateMonitor) {
         if (pwrSrc == kBatteryPowered) {
-            dispatch_source_set_timer(gProcAggregateMonitor,
-                    dispatch_time(DISPATCH_TIME_NOW, 0), gProcMonitorFrequency, 0);
+            PMTimerSchedule(gProcAggregateMonitor, 0, gProcMonitorFrequency);
         }
         else {
-            // On external power source, clear any accumulated proc aggregate assertion data
-            // and set the timer not to fire
-            if (gProcAggregateBasis) {
-                CFRelease(gProcAggregateBasis);
-                gProcAggregateBasis = NULL;
-            }
-            dispatch_source_set_timer(gProcAggregateMonitor,
-                    dispatch_time(DISPATCH_TIME_FOREVER, 0), DISPATCH_TIME_FOREVER, 0);
+            // On external power source, set the timer not to fire
+            PMTimerDisarm(gProcAggregateMonitor);
         }
     }
     logASLAssertionsAggregate();
@@ -6010,8 +7175,10 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
     default:
         return;
     }
-    if (idxRef)
+    if (idxRef) {
         CFRelease(idxRef);
+        PMSnapshotInvalidate(assertionTypeNamesSnapshot());
+    }
 
     if (assertType->disableCnt) {
         newEffect = kNoEffect;
@@ -6058,6 +7225,18 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
 
 }
 
+__private_extern__ void configAssertionTypes(const kerAssertionType *types, uint32_t cnt)
+{
+    gKernelUpdateDeferCnt++;
+    for (uint32_t i = 0; i < cnt; i++) {
+        configAssertionType(types[i], false);
+    }
+    if ((--gKernelUpdateDeferCnt == 0) && gKernelUpdatePending) {
+        gKernelUpdatePending = false;
+        sendUserAssertionsToKernel(kerAssertionBits);
+    }
+}
+
 assertion_t * createKernelAssertion(CFDictionaryRef kAssertion)
 {
     // Create an assertion_t struct with kernel assertion details
@@ -6080,7 +7259,7 @@ assertion_t * createKernelAssertion(CFDictionaryRef kAssertion)
         if (id == NULL) {
             return NULL;
         }
-        CFDictionarySetValue(assertion->props, kIOPMAssertionGlobalUniqueIDKey, id);
+        CFNumberGetValue(id, kCFNumberSInt64Type, &assertion->uniqueId);
 
         // assertion name
         asserted = CFDictionaryGetValue(kAssertion, CFSTR(kIOPMDriverAssertionAssertedKey));
@@ -6090,13 +7269,13 @@ assertion_t * createKernelAssertion(CFDictionaryRef kAssertion)
             const char *assertionName = descriptiveKernelAssertions(n_asserted);
             CFStringRef name = CFStringCreateWithCString(0, assertionName, kCFStringEncodingUTF8);
             if (name) {
-                CFDictionarySetValue(assertion->props, kIOPMAssertionNameKey, name);
+                PMInternSet(&assertion->nameStr, name);
                 CFRelease(name);
             }
         }
 
         // assertion type
-        CFDictionarySetValue(assertion->props, kIOPMAssertionTypeKey, CFSTR(kKernelAssertionType));
+        PMInternSet(&assertion->typeStr, CFSTR(kKernelAssertionType));
 
         // owner service key
         owner_n = CFDictionaryGetValue(kAssertion, CFSTR(kIOPMDriverAssertionOwnerServiceKey));
@@ -6128,22 +7307,161 @@ assertion_t * createKernelAssertion(CFDictionaryRef kAssertion)
     return assertion;
 }
 
-assertion_t* createSleepPreventerAssertion(CFStringRef kextName, CFNumberRef id, int preventerType)
+/*
+ * Kernel sleep preventers reported by IOPMCopySleepPreventersListWithID().
+ *
+ * Each preventer type keeps its records in an open-addressed table keyed by
+ * registry entry ID, so a new kernel list is diffed against the previous one
+ * in linear time: entries seen in this pass are stamped with the pass epoch
+ * and anything left with an older epoch has stopped preventing sleep.
+ * Records are recycled through a free list along with their props dictionary.
+ */
+typedef struct sleepPreventer {
+    assertion_t                     assertion;      // Passed to logAssertionEvent()
+    uint64_t                        regID;
+    uint32_t                        epoch;
+    LIST_ENTRY(sleepPreventer)      link;
+} sleepPreventer_t;
+
+typedef struct {
+    sleepPreventer_t                **slots;
+    uint32_t                        size;           // Power of 2
+    uint32_t                        count;
+    uint32_t                        epoch;
+    LIST_HEAD(, sleepPreventer)     list;
+} sleepPreventerSet_t;
+
+static sleepPreventerSet_t          gIdleSleepPreventers = { .list = LIST_HEAD_INITIALIZER(gIdleSleepPreventers.list) };
+static sleepPreventerSet_t          gSystemSleepPreventers = { .list = LIST_HEAD_INITIALIZER(gSystemSleepPreventers.list) };
+static LIST_HEAD(, sleepPreventer)  gFreeSleepPreventers = LIST_HEAD_INITIALIZER(gFreeSleepPreventers);
+
+static inline uint32_t preventerSlot(sleepPreventerSet_t *set, uint64_t regID)
+{
+    // Registry IDs are sequential; spread them with a 64-bit multiplicative hash
+    return (uint32_t)((regID * 0x9E3779B97F4A7C15ULL) >> 32) & (set->size - 1);
+}
+
+static sleepPreventer_t *lookupSleepPreventer(sleepPreventerSet_t *set, uint64_t regID)
 {
-    assertion_t *assertion = NULL;
+    uint32_t i;
 
-    assertion = calloc(1, sizeof(assertion_t));
-    if (assertion != NULL) {
-        assertion->props = CFDictionaryCreateMutable(NULL, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        if (!assertion->props) {
-            ERROR_LOG("Unable to create assertion properties dictionary\n");
-            free(assertion);
-            return NULL;
+    if (!set->size) {
+        return NULL;
+    }
+    for (i = preventerSlot(set, regID); set->slots[i]; i = (i + 1) & (set->size - 1)) {
+        if (set->slots[i]->regID == regID) {
+            return set->slots[i];
         }
-    } else {
-        ERROR_LOG("Unable to calloc assertion struct\n");
+    }
+    return NULL;
+}
+
+static void placeSleepPreventer(sleepPreventerSet_t *set, sleepPreventer_t *sp)
+{
+    uint32_t i = preventerSlot(set, sp->regID);
+
+    while (set->slots[i]) {
+        i = (i + 1) & (set->size - 1);
+    }
+    set->slots[i] = sp;
+}
+
+static bool insertSleepPreventer(sleepPreventerSet_t *set, sleepPreventer_t *sp)
+{
+    // Keep the load factor at or below 1/2
+    if (2 * (set->count + 1) > set->size) {
+        uint32_t            newSize = set->size ? (2 * set->size) : 32;
+        sleepPreventer_t    **old = set->slots;
+        uint32_t            oldSize = set->size;
+
+        set->slots = calloc(newSize, sizeof(sleepPreventer_t *));
+        if (!set->slots) {
+            set->slots = old;
+            return false;
+        }
+        set->size = newSize;
+        for (uint32_t i = 0; i < oldSize; i++) {
+            if (old[i]) {
+                placeSleepPreventer(set, old[i]);
+            }
+        }
+        free(old);
+    }
+    placeSleepPreventer(set, sp);
+    set->count++;
+    LIST_INSERT_HEAD(&set->list, sp, link);
+    return true;
+}
+
+static void removeSleepPreventer(sleepPreventerSet_t *set, sleepPreventer_t *sp)
+{
+    uint32_t i, j, home;
+
+    for (i = preventerSlot(set, sp->regID); set->slots[i] != sp; i = (i + 1) & (set->size - 1));
+    set->slots[i] = NULL;
+
+    // Shift back any entry in the probe run that can now sit closer to its home slot
+    for (j = (i + 1) & (set->size - 1); set->slots[j]; j = (j + 1) & (set->size - 1)) {
+        home = preventerSlot(set, set->slots[j]->regID);
+        if (((j - home) & (set->size - 1)) >= ((j - i) & (set->size - 1))) {
+            set->slots[i] = set->slots[j];
+            set->slots[j] = NULL;
+            i = j;
+        }
+    }
+    set->count--;
+    LIST_REMOVE(sp, link);
+}
+
+static sleepPreventer_t *allocSleepPreventer(void)
+{
+    sleepPreventer_t        *sp;
+    CFMutableDictionaryRef  props;
+
+    sp = LIST_FIRST(&gFreeSleepPreventers);
+    if (sp) {
+        LIST_REMOVE(sp, link);
+        props = sp->assertion.props;
+        memset(sp, 0, sizeof(*sp));
+        CFDictionaryRemoveAllValues(props);
+        sp->assertion.props = props;
+        return sp;
+    }
+
+    sp = calloc(1, sizeof(*sp));
+    if (sp == NULL) {
+        ERROR_LOG("Unable to calloc sleep preventer record\n");
+        return NULL;
+    }
+    sp->assertion.props = CFDictionaryCreateMutable(NULL, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!sp->assertion.props) {
+        ERROR_LOG("Unable to create assertion properties dictionary\n");
+        free(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+static void freeSleepPreventer(sleepPreventer_t *sp)
+{
+    processInfoRelease(0);
+    releaseAssertionStrings(&sp->assertion);
+    sp->assertion.pinfo = NULL;
+    LIST_INSERT_HEAD(&gFreeSleepPreventers, sp, link);
+}
+
+static sleepPreventer_t *createSleepPreventer(CFStringRef kextName, CFNumberRef id, uint64_t regID, int preventerType)
+{
+    sleepPreventer_t *sp;
+    assertion_t *assertion;
+
+    sp = allocSleepPreventer();
+    if (!sp) {
         return NULL;
     }
+    sp->regID = regID;
+    assertion = &sp->assertion;
+
     /*
      * Type - Kernel idle sleep preventer/kernel system sleep preventer
      * Name - kext name
@@ -6151,37 +7469,31 @@ assertion_t* createSleepPreventerAssertion(CFStringRef kextName, CFNumberRef id,
      */
 
     // ID
-    CFDictionarySetValue(assertion->props, kIOPMAssertionGlobalUniqueIDKey, id);
+    if (id) {
+        CFNumberGetValue(id, kCFNumberSInt64Type, &assertion->uniqueId);
+    }
 
     // Name
-    CFDictionarySetValue(assertion->props, kIOPMAssertionNameKey, kextName);
+    if (kextName) {
+        PMInternSet(&assertion->nameStr, kextName);
+    }
 
     // Type
-    CFDictionarySetValue(assertion->props, kIOPMAssertionTypeKey, ((preventerType == kIOPMIdleSleepPreventers) ? CFSTR(kKernelIdleSleepPreventer): CFSTR(kKernelSystemSleepPreventer)));
+    PMInternSet(&assertion->typeStr, ((preventerType == kIOPMIdleSleepPreventers) ? CFSTR(kKernelIdleSleepPreventer): CFSTR(kKernelSystemSleepPreventer)));
 
     // process info - kernel
     if(!(assertion->pinfo = processInfoRetain(0))){
         assertion->pinfo = processInfoCreate(0);
     }
-
-    if (preventerType == kIOPMIdleSleepPreventers) {
-        LIST_INSERT_HEAD(&gIdleSleepPreventersList, assertion, link);
-    } else {
-        LIST_INSERT_HEAD(&gSystemSleepPreventersList, assertion, link);
-    }
-    return assertion;
-
+    return sp;
 }
 
 void logChangedSleepPreventers(int preventerType)
 {
-    int i = 0;
-    CFStringRef new_kext = NULL;
-    CFNumberRef old_id = NULL;
-    CFNumberRef new_id = NULL;
+    sleepPreventerSet_t *set;
+    sleepPreventer_t *sp, *next;
     CFArrayRef preventers = NULL;
     CFIndex new_count = 0;
-    CFDictionaryRef temp_preventer = NULL;
     IOReturn ret = IOPMCopySleepPreventersListWithID(preventerType, &preventers);
     if (ret != kIOReturnSuccess) {
         INFO_LOG("Could not read sleep preventers\n");
@@ -6192,75 +7504,55 @@ void logChangedSleepPreventers(int preventerType)
         new_count = CFArrayGetCount(preventers);
     }
 
-    assertion_t *first_a;
+    // Get the right set based on preventer type
+    set = (preventerType == kIOPMIdleSleepPreventers) ? &gIdleSleepPreventers : &gSystemSleepPreventers;
+    set->epoch++;
 
-    // Get the right list based on preventer type
-    if (preventerType == kIOPMIdleSleepPreventers) {
-        first_a = LIST_FIRST(&gIdleSleepPreventersList);
-    } else {
-        first_a = LIST_FIRST(&gSystemSleepPreventersList);
-    }
-
-    assertion_t *temp_a = NULL;
-    assertion_t *temp_b = NULL;
-
-    int found = 0;
-    for (i = 0; i < new_count; i++) {
-
-        // check for new kexts preventing sleep
-        found = 0 ;
-        temp_a = first_a;
-        temp_preventer = isA_CFDictionary(CFArrayGetValueAtIndex(preventers, i));
-        new_id = CFDictionaryGetValue(temp_preventer, CFSTR(kIOPMDriverAssertionRegistryEntryIDKey));
-        while(temp_a) {
-            if (temp_a->props) {
-                old_id = CFDictionaryGetValue(temp_a->props, kIOPMAssertionGlobalUniqueIDKey);
-                if (CFNumberCompare(old_id, new_id, 0) == kCFCompareEqualTo) {
-                    // still preventing sleep
-                    found = 1;
-                    break;
-                }
-            }
-            temp_a = LIST_NEXT(temp_a, link);
+    // check for new kexts preventing sleep
+    for (CFIndex i = 0; i < new_count; i++) {
+        CFDictionaryRef preventer = isA_CFDictionary(CFArrayGetValueAtIndex(preventers, i));
+        CFNumberRef new_id;
+        uint64_t regID = 0;
+
+        if (!preventer) {
+            continue;
+        }
+        new_id = isA_CFNumber(CFDictionaryGetValue(preventer, CFSTR(kIOPMDriverAssertionRegistryEntryIDKey)));
+        if (!new_id || !CFNumberGetValue(new_id, kCFNumberSInt64Type, &regID)) {
+            continue;
+        }
+
+        sp = lookupSleepPreventer(set, regID);
+        if (sp) {
+            // still preventing sleep
+            sp->epoch = set->epoch;
+            continue;
+        }
+
+        // new sleep preventer
+        sp = createSleepPreventer(CFDictionaryGetValue(preventer, CFSTR(kIOPMDriverAssertionOwnerStringKey)),
+                                  new_id, regID, preventerType);
+        if (!sp) {
+            continue;
         }
-        if (found == 0) {
-            // new sleep preventer
-            // add this
-            new_kext = CFDictionaryGetValue(temp_preventer, CFSTR(kIOPMDriverAssertionOwnerStringKey));
-            assertion_t *new_a = createSleepPreventerAssertion(new_kext, new_id, preventerType);
-            logAssertionEvent(kACreateLog, new_a);
+        if (!insertSleepPreventer(set, sp)) {
+            ERROR_LOG("Unable to track sleep preventer 0x%llx\n", regID);
+            freeSleepPreventer(sp);
+            continue;
         }
+        sp->epoch = set->epoch;
+        logAssertionEvent(kACreateLog, &sp->assertion);
     }
 
     // check which kexts have been removed
-    temp_a = first_a;
-    temp_b = temp_a;
-    while(temp_a) {
-        if (temp_a->props) {
-            old_id = CFDictionaryGetValue(temp_a->props, kIOPMAssertionGlobalUniqueIDKey);
-            found = 0;
-            for (i = 0; i < new_count; i++) {
-                temp_preventer = isA_CFDictionary(CFArrayGetValueAtIndex(preventers, i));
-                new_id = CFDictionaryGetValue(temp_preventer, CFSTR(kIOPMDriverAssertionRegistryEntryIDKey));
-                if (CFNumberCompare(old_id, new_id, 0) == kCFCompareEqualTo) {
-                    // still preventing sleep
-                    found = 1;
-                    break;
-                }
-            }
-        }
-        if (found == 0) {
-            // remove from list
-            temp_b = LIST_NEXT(temp_a, link);
-            LIST_REMOVE(temp_a, link);
-            logAssertionEvent(kAReleaseLog, temp_a);
-            CFRelease(temp_a->props);
-            processInfoRelease(0);
-            free(temp_a);
-            temp_a = temp_b;
-        } else {
-            temp_a = LIST_NEXT(temp_a, link);
+    for (sp = LIST_FIRST(&set->list); sp; sp = next) {
+        next = LIST_NEXT(sp, link);
+        if (sp->epoch == set->epoch) {
+            continue;
         }
+        removeSleepPreventer(set, sp);
+        logAssertionEvent(kAReleaseLog, &sp->assertion);
+        freeSleepPreventer(sp);
     }
 
     if (preventers) {
@@ -6317,6 +7609,7 @@ void logChangedKernelAssertions(CFNumberRef driverAssertions, CFArrayRef kernelA
                     logAssertionEvent(kAReleaseLog, tempA);
                     CFDictionaryRemoveValue(gKernelAssertionsArray, (const void *)id);
                     CFRelease(tempA->props);
+                    releaseAssertionStrings(tempA);
                     processInfoRelease(0);
                     free(tempA);
                     changed = 1;
@@ -6357,6 +7650,7 @@ void logChangedKernelAssertions(CFNumberRef driverAssertions, CFArrayRef kernelA
                logAssertionEvent(kAReleaseLog, tempA);
                CFDictionaryRemoveValue(gKernelAssertionsArray, (const void *)old_ids[i]);
                CFRelease(tempA->props);
+               releaseAssertionStrings(tempA);
                processInfoRelease(0);
                free(tempA);
                changed = 1;
@@ -6424,6 +7718,11 @@ __private_extern__ void PMAssertions_prime(void)
 
     assertions_log = os_log_create(PM_LOG_SYSTEM, ASSERTIONS_LOG);
     gAssertionsArray = CFDictionaryCreateMutable(NULL, kMaxAssertions, NULL, NULL); 
+    for (int i = 0; i < kMaxAssertions; i++) {
+        gFreeAssertionIdx[i] = i;
+    }
+    gFreeIdxHead = 0;
+    gFreeIdxCnt = kMaxAssertions;
     gProcessDict = CFDictionaryCreateMutable(0, 0, NULL, NULL);
 
     gUserAssertionTypesDict = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
@@ -6474,7 +7773,7 @@ __private_extern__ void PMAssertions_prime(void)
                              ^(int t) { /*Dummy registration to keep the key/value valid with notifyd */ });
 
     os_state_add_handler(_getPMMainQueue(), ^os_state_data_t(os_state_hints_t hints) {
-            logASLAllAssertions(); return NULL; });
+            logASLAllAssertions(); logAssertionAdmissionStats(); return NULL; });
     return;
 }
 
@@ -47,6 +47,8 @@ do {    \
 #include <IOKit/IOReportMacros.h>
 #include <IOKit/IOReportTypes.h>
 #include <xpc/xpc.h>
+#include "PMClock.h"
+#include "PMIntern.h"
 
 /* ExternalMedia assertion
  * This assertion is only defined here in PM configd. 
@@ -120,6 +122,30 @@ do {    \
  */
 #define kMaxAssertions              10240
 
+/*
+ * Admission limits. Assertions created by powerd itself and assertions of
+ * types that require an entitlement can use the whole table. All other
+ * assertions share what is left after kReservedAssertions, and are further
+ * capped per creating process and per assertion type. Creates over a limit
+ * fail with kIOReturnNoResources.
+ */
+#define kReservedAssertions         1024
+#define kMaxAssertionsPerProcess    2048
+#define kMaxAssertionsPerType       4096
+
+typedef enum {
+    kAdmitRejectTable = 0,          // Shared part of the table is full
+    kAdmitRejectType,               // kMaxAssertionsPerType reached
+    kAdmitRejectProcess,            // kMaxAssertionsPerProcess reached
+    kAdmitRejectReasons
+} admitRejectReason;
+
+typedef struct {
+    uint32_t        liveCnt;                        // Assertions currently in the table
+    uint32_t        peakCnt;
+    uint64_t        rejectCnt[kAdmitRejectReasons];
+} assertionAdmissionStats_t;
+
 /*
  * A 'assertion_t' stucture is created for each assertion created by the processes.
  *
@@ -204,6 +230,8 @@ typedef enum {
 typedef struct {
     uint32_t    cnt;            // Number of assertions of this effect currently held
     uint64_t    startTime;      // Time at which first assertion is taken after last reset
+    uint64_t    creditedUntil;  // Time up to which the current hold is counted in windowDuration
+    uint64_t    windowDuration; // Battery time held in the current aggregate limit window
 } effectStats_t;
 
 typedef struct {
@@ -230,6 +258,10 @@ typedef struct {
 
     uint32_t            maxAssertLength;    // Max assertion duration expected by this process
     uint32_t            aggAssertLength;    // Total duration assertions held since last reset
+    uint32_t            aggWindowSeq;       // Aggregate limit window the stats windowDuration values belong to
+    PMTimerRef          aggDeadline;        // Fires when a held effect reaches aggAssertLength
+    uint32_t            assertionCnt;       // Assertions created by this process that are still in the table
+    uint32_t            rejectCnt;          // Creates refused by admission control
 
     uint32_t            anychange:1;    // Interested in any assertion changes notification
     uint32_t            aggchange:1;    // Interested in assertion aggregates change notifications
@@ -239,11 +271,21 @@ typedef struct {
     uint32_t            proc_exited:1;      // True if PROC_EXIT notification is received
     uint32_t            aggactivity:1;      // Contributed to gActivityAggCnt. Subscribed to AssertionActivityAggregate
     uint32_t            isSuspended:1;      // Process assertions are suspended
+    uint32_t            aggExceptionSent:kMaxEffectStats; // Per effect: aggregate exception posted in the current window
 } ProcessInfo;
 
 typedef struct assertion {
     LIST_ENTRY(assertion) link;
-    CFMutableDictionaryRef props;       // client provided properties
+    CFMutableDictionaryRef props;       // client provided properties not kept in the fields below
+
+    // Common properties, kept out of 'props'. copyAssertionProperties() puts them back
+    PMInternID      typeStr;            // kIOPMAssertionTypeKey as given by the client
+    PMInternID      nameStr;            // kIOPMAssertionNameKey
+    PMInternID      detailsStr;         // kIOPMAssertionDetailsKey
+    PMInternID      reasonStr;          // kIOPMAssertionHumanReadableReasonKey
+    PMInternID      bundlePathStr;      // kIOPMAssertionLocalizationBundlePathKey
+    uint64_t        uniqueId;           // kIOPMAssertionGlobalUniqueIDKey
+    CFAbsoluteTime  createDate;         // kIOPMAssertionCreateDateKey; 0 if not set
     uint32_t        state;              // assertion state bits
     uint64_t        createTime;         // Time at which assertion is created
     uint64_t        timeout;            // absolute time at which assertion will timeout
@@ -263,8 +305,8 @@ typedef struct assertion {
     ProcessInfo     *causingPinfo;      // Corresponding ProcessInfo struct 
 
     
-    XCT_UNSAFE_UNRETAINED dispatch_source_t   procTimer;      // Timer set based on the value provided for this process.
-    // Ths timer triggers log collection
+    uint64_t        procDeadline;       // Battery clock deadline for pinfo->maxAssertLength; 0 until first queued
+    uint32_t        procDeadlineIdx;    // 1-based slot in the proc deadline heap; 0 if not queued
     // System Qualifiers
     uint32_t        audioin:1;
     uint32_t        audioout:1;
@@ -284,7 +326,6 @@ typedef struct assertion {
 #define kAssertionSkipLogging               0x020  // Avoid logging this assertion, even if type is set to kAssertionTypeLogOnCreate
 #define kAssertionStateLogged               0x040
 #define kAssertionStateAddsToProcStats      0x080
-#define kAssertionProcTimerActive           0x100
 #define kAssertionExitSilentRunningMode     0x200
 #define kAssertionStateSuspended            0x400
 
@@ -300,6 +341,30 @@ typedef struct assertion {
 #define kAssertionModSilentRunning      0x80
 #define kAssertionModCausingPid         0x100
 
+/*
+ * Typed update of the commonly changed assertion properties, sent as
+ * kAssertionUpdateMsg instead of a full property dictionary in
+ * kAssertionPropertiesMsg. The message value is an xpc dictionary holding
+ * kAssertionUpdateIdKey and any of the optional fields below.
+ */
+#define kAssertionUpdateMsg             "assertionUpdate"
+#define kAssertionUpdateIdKey           "id"            // uint64
+#define kAssertionUpdateLevelKey        "level"         // int64, kIOPMAssertionLevelOn/Off
+#define kAssertionUpdateTimeoutKey      "timeout"       // double, seconds
+#define kAssertionUpdateNameKey         "name"          // string
+
+/* Field bits for assertionUpdate_t */
+#define kAssertionUpdateLevel           0x1
+#define kAssertionUpdateTimeout         0x2
+#define kAssertionUpdateName            0x4
+
+typedef struct {
+    uint32_t        fields;
+    int             level;
+    double          timeout;
+    const char      *name;
+} assertionUpdate_t;
+
 typedef enum {
     kAssertionOpRaise,
     kAssertionOpRelease,
@@ -326,9 +391,9 @@ struct assertionType {
     LIST_HEAD(, assertion) suspended;    /* Assertions that are suspended */
 
     kerAssertionType    kassert;
-    XCT_UNSAFE_UNRETAINED dispatch_source_t   timer;          /* dispatch source for Per assertion timer */
-    
-    XCT_UNSAFE_UNRETAINED dispatch_source_t   globalTimer;    /* dispatch source for all assertions of this type */
+    PMTimerRef      timer;              /* Per assertion timer */
+
+    PMTimerRef      globalTimer;        /* Timer for all assertions of this type */
 
     CFStringRef     entitlement;        /* if set, caller must have this entitlement to create this assertion */
     uint64_t        globalTimeout;      /* Relative time at which assertion is timedout */
@@ -348,6 +413,9 @@ struct assertionType {
     uint32_t   validOnBattCount;        /* Count of assertions requesting to be active on Battery power */
 
     uint32_t   enTrQuality;             /* Quality or intensity for energy tracing */
+
+    uint32_t   liveCnt;                 /* Assertions of this type in the table */
+    uint32_t   rejectCnt;               /* Creates of this type refused by admission control */
 } ;
 
 typedef enum {
@@ -442,6 +510,10 @@ enum {
 __private_extern__ void logKernelAssertions(CFNumberRef, CFArrayRef);
 __private_extern__ void logChangedSleepPreventers(int preventerType);
 __private_extern__ void PMAssertions_prime(void);
+__private_extern__ void getAssertionAdmissionStats(assertionAdmissionStats_t *stats);
+__private_extern__ CFMutableDictionaryRef copyAssertionProperties(assertion_t *assertion);
+__private_extern__ void releaseAssertionStrings(assertion_t *assertion);
+__private_extern__ void logAssertionAdmissionStats(void);
 __private_extern__ void createOnBootAssertions(void);
 __private_extern__ void PMAssertions_SettingsHaveChanged(void);
                         
@@ -473,6 +545,10 @@ __private_extern__ void InternalReleaseAssertion(
 __private_extern__ IOReturn InternalReleaseAssertionSync(IOPMAssertionID outID);
 __private_extern__ IOReturn 
 InternalCreateAssertionWithTimeout(CFStringRef type, CFStringRef name, int timerSecs, IOPMAssertionID *outID);
+__private_extern__ IOReturn
+InternalCreateReusableAssertion(CFStringRef type, CFStringRef name, int timerSecs, IOPMAssertionID *outID);
+__private_extern__ IOReturn
+InternalRaiseAssertion(IOPMAssertionID id, CFStringRef type, CFStringRef name, int timerSecs);
 __private_extern__ IOReturn InternalSetAssertionTimeout(IOPMAssertionID id, CFTimeInterval timeout);
 
 __private_extern__ void InternalEvaluateAssertions(void);
@@ -503,10 +579,18 @@ __private_extern__ void applyToAssertionsSync(assertionType_t *assertType,
                                               listSelectType_t assertionListSelect,
                                               void (^performOnAssertion)(assertion_t *));
 __private_extern__ void configAssertionType(kerAssertionType idx, bool initialConfig);
+/* Reconfigures several types, sending the kernel at most one assertion level update */
+__private_extern__ void configAssertionTypes(const kerAssertionType *types, uint32_t cnt);
 __private_extern__ void logAssertionEvent(assertLogAction assertionAction, assertion_t *assertion);
 __private_extern__ uint8_t getAssertionLevel(kerAssertionType idx);
 __private_extern__ void setAggregateLevel(kerAssertionType idx, uint8_t val);
 __private_extern__ uint32_t getKerAssertionBits(void);
+#ifdef XCTEST
+// Number of user assertion level updates sent to the root domain
+uint64_t getKernelAssertionUpdateCount(void);
+// Tears down what PMAssertions_prime() set up, for the next test class
+void PMAssertionsResetForTest(void);
+#endif
 __private_extern__ void setAssertionActivityLog(int value);
 __private_extern__ void setAssertionActivityAggregate(pid_t pid, int value);
 __private_extern__ kern_return_t setReservePwrMode(int enable);
@@ -527,6 +611,8 @@ __private_extern__ void delayDisplayTurnOff(void);
 void asyncAssertionCreate(xpc_object_t remoteConnection, xpc_object_t msg);
 void asyncAssertionRelease(xpc_object_t remoteConnection, xpc_object_t msg);
 void asyncAssertionProperties(xpc_object_t remoteConnection, xpc_object_t msg);
+void asyncAssertionUpdate(xpc_object_t remoteConnection, xpc_object_t msg);
+__private_extern__ void PMAssertionsRegisterXPCRoutes(void);
 void releaseConnectionAssertions(xpc_object_t remoteConnection);
 void checkForAsyncAssertions(void *acknowledgementToken);
 void handleAssertionSuspend(pid_t pid);
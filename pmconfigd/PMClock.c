@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <Block.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+
+#include "PMClock.h"
+#include "PrivateLib.h"
+
+struct PMTimer {
+    dispatch_source_t   source;         // Real mode only
+    dispatch_block_t    handler;        // Virtual mode only
+    uint64_t            deadline;       // Virtual ns
+    uint64_t            interval;       // kPMTimerForever for one-shot
+    uint32_t            heapIdx;        // 1-based slot in gVirtualTimers; 0 when disarmed
+};
+
+static bool                 gVirtual = false;
+static bool                 gRealTimersCreated = false;
+static uint64_t             gVirtualNs = 0;
+static CFAbsoluteTime       gVirtualWallBase = 0;   // Wall clock at gVirtualNs == gVirtualNsBase
+static uint64_t             gVirtualNsBase = 0;
+
+// Min-heap of armed virtual timers, ordered by deadline
+static PMTimerRef           *gVirtualTimers = NULL;
+static uint32_t             gVirtualTimerCnt = 0;
+static uint32_t             gVirtualTimerCap = 0;
+
+static uint64_t realMonotonicNs(void)
+{
+    static mach_timebase_info_data_t    tb;
+
+    if (tb.denom == 0) {
+        mach_timebase_info(&tb);
+    }
+    return mach_absolute_time() * tb.numer / tb.denom;
+}
+
+uint64_t PMClockMonotonicNs(void)
+{
+    return gVirtual ? gVirtualNs : realMonotonicNs();
+}
+
+CFAbsoluteTime PMClockAbsoluteTime(void)
+{
+    if (!gVirtual) {
+        return CFAbsoluteTimeGetCurrent();
+    }
+    return gVirtualWallBase + (CFAbsoluteTime)(gVirtualNs - gVirtualNsBase) / NSEC_PER_SEC;
+}
+
+bool PMClockIsVirtual(void)
+{
+    return gVirtual;
+}
+
+bool PMClockSetVirtual(CFAbsoluteTime wallStart)
+{
+    if (gRealTimersCreated) {
+        ERROR_LOG("Virtual clock must be enabled before any timer is created\n");
+        return false;
+    }
+
+    // Already virtual: only move the wall clock, armed timers keep their deadlines
+    if (gVirtual) {
+        gVirtualNsBase = gVirtualNs;
+        gVirtualWallBase = wallStart;
+        return true;
+    }
+
+    // Start at the current uptime, so timestamps of zero keep meaning "unset"
+    gVirtualNs = gVirtualNsBase = realMonotonicNs();
+    gVirtualWallBase = wallStart;
+    gVirtual = true;
+    INFO_LOG("Virtual clock enabled\n");
+    return true;
+}
+
+#pragma mark -
+#pragma mark Virtual timer heap
+
+static inline void heapSet(uint32_t i, PMTimerRef timer)
+{
+    gVirtualTimers[i] = timer;
+    timer->heapIdx = i + 1;
+}
+
+static void heapSiftUp(uint32_t i)
+{
+    PMTimerRef timer = gVirtualTimers[i];
+
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (gVirtualTimers[parent]->deadline <= timer->deadline) {
+            break;
+        }
+        heapSet(i, gVirtualTimers[parent]);
+        i = parent;
+    }
+    heapSet(i, timer);
+}
+
+static void heapSiftDown(uint32_t i)
+{
+    PMTimerRef timer = gVirtualTimers[i];
+
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= gVirtualTimerCnt) {
+            break;
+        }
+        if ((child + 1 < gVirtualTimerCnt) &&
+            (gVirtualTimers[child + 1]->deadline < gVirtualTimers[child]->deadline)) {
+            child++;
+        }
+        if (timer->deadline <= gVirtualTimers[child]->deadline) {
+            break;
+        }
+        heapSet(i, gVirtualTimers[child]);
+        i = child;
+    }
+    heapSet(i, timer);
+}
+
+static void heapRemove(PMTimerRef timer)
+{
+    uint32_t i = timer->heapIdx - 1;
+    PMTimerRef last;
+
+    timer->heapIdx = 0;
+    last = gVirtualTimers[--gVirtualTimerCnt];
+    if (last == timer) {
+        return;
+    }
+    heapSet(i, last);
+    if ((i > 0) && (gVirtualTimers[(i - 1) / 2]->deadline > last->deadline)) {
+        heapSiftUp(i);
+    }
+    else {
+        heapSiftDown(i);
+    }
+}
+
+static void heapInsert(PMTimerRef timer)
+{
+    if (gVirtualTimerCnt == gVirtualTimerCap) {
+        uint32_t newCap = gVirtualTimerCap ? (2 * gVirtualTimerCap) : 32;
+        PMTimerRef *heap = realloc(gVirtualTimers, newCap * sizeof(PMTimerRef));
+        if (!heap) {
+            ERROR_LOG("Failed to grow virtual timer heap\n");
+            return;
+        }
+        gVirtualTimers = heap;
+        gVirtualTimerCap = newCap;
+    }
+    heapSet(gVirtualTimerCnt++, timer);
+    heapSiftUp(gVirtualTimerCnt - 1);
+}
+
+static void fireVirtualTimer(PMTimerRef timer)
+{
+    dispatch_block_t handler = timer->handler;
+
+    heapRemove(timer);
+    if (timer->interval != kPMTimerForever) {
+        timer->deadline += timer->interval;
+        heapInsert(timer);
+    }
+
+    // The handler may cancel the timer; keep the block alive until it returns
+    handler = Block_copy(handler);
+    handler();
+    Block_release(handler);
+}
+
+void PMClockAdvance(uint64_t ns)
+{
+    uint64_t target;
+
+    if (!gVirtual) {
+        return;
+    }
+    target = gVirtualNs + ns;
+    while (gVirtualTimerCnt && (gVirtualTimers[0]->deadline <= target)) {
+        PMTimerRef timer = gVirtualTimers[0];
+
+        if (timer->deadline > gVirtualNs) {
+            gVirtualNs = timer->deadline;
+        }
+        fireVirtualTimer(timer);
+    }
+    gVirtualNs = target;
+}
+
+bool PMClockAdvanceToNextTimer(void)
+{
+    if (!gVirtual || !gVirtualTimerCnt) {
+        return false;
+    }
+    PMClockAdvance((gVirtualTimers[0]->deadline > gVirtualNs) ? (gVirtualTimers[0]->deadline - gVirtualNs) : 0);
+    return true;
+}
+
+#pragma mark -
+#pragma mark Timers
+
+PMTimerRef PMTimerCreate(dispatch_queue_t queue, dispatch_block_t handler)
+{
+    PMTimerRef timer;
+
+    if (!handler) {
+        return NULL;
+    }
+    timer = calloc(1, sizeof(struct PMTimer));
+    if (!timer) {
+        return NULL;
+    }
+    timer->interval = kPMTimerForever;
+
+    if (gVirtual) {
+        timer->handler = Block_copy(handler);
+        return timer;
+    }
+    gRealTimersCreated = true;
+
+    timer->source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    if (!timer->source) {
+        free(timer);
+        return NULL;
+    }
+    dispatch_source_set_event_handler(timer->source, handler);
+    dispatch_source_set_timer(timer->source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    dispatch_resume(timer->source);
+    return timer;
+}
+
+void PMTimerSchedule(PMTimerRef timer, uint64_t delayNs, uint64_t intervalNs)
+{
+    if (!timer) {
+        return;
+    }
+    if (!gVirtual) {
+        dispatch_source_set_timer(timer->source,
+                                  (delayNs == kPMTimerForever) ? DISPATCH_TIME_FOREVER : dispatch_time(DISPATCH_TIME_NOW, delayNs),
+                                  (intervalNs == kPMTimerForever) ? DISPATCH_TIME_FOREVER : intervalNs, 0);
+        return;
+    }
+
+    if (timer->heapIdx) {
+        heapRemove(timer);
+    }
+    if (delayNs == kPMTimerForever) {
+        return;
+    }
+    timer->deadline = gVirtualNs + delayNs;
+    timer->interval = (intervalNs == 0) ? kPMTimerForever : intervalNs;
+    heapInsert(timer);
+}
+
+void PMTimerScheduleAtDate(PMTimerRef timer, CFAbsoluteTime fireTime)
+{
+    CFTimeInterval delta;
+
+    if (!timer) {
+        return;
+    }
+    delta = fireTime - PMClockAbsoluteTime();
+    if (delta < 0) {
+        delta = 0;
+    }
+    if (!gVirtual) {
+        // Wall clock timers keep counting across sleep and follow clock changes
+        dispatch_source_set_timer(timer->source, dispatch_walltime(DISPATCH_TIME_NOW, (int64_t)(delta * NSEC_PER_SEC)),
+                                  DISPATCH_TIME_FOREVER, 0);
+        return;
+    }
+    PMTimerSchedule(timer, (uint64_t)(delta * NSEC_PER_SEC), kPMTimerForever);
+}
+
+void PMTimerDisarm(PMTimerRef timer)
+{
+    PMTimerSchedule(timer, kPMTimerForever, kPMTimerForever);
+}
+
+void PMTimerCancel(PMTimerRef timer)
+{
+    if (!timer) {
+        return;
+    }
+    if (timer->source) {
+        dispatch_source_cancel(timer->source);
+        dispatch_release(timer->source);
+    }
+    if (timer->heapIdx) {
+        heapRemove(timer);
+    }
+    if (timer->handler) {
+        Block_release(timer->handler);
+    }
+    free(timer);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMClock_h
+#define PMClock_h
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+
+/*
+ * Time source and one-shot/repeating timers for the assertion engine,
+ * SystemLoad and AutoWakeScheduler.
+ *
+ * By default the clock is the system clock and timers are dispatch timer
+ * sources. In virtual mode time stands still until PMClockAdvance() moves it,
+ * and due timers fire in deadline order on the caller's stack. This lets a
+ * long trace of assertion traffic be replayed in seconds.
+ */
+
+#define kPMTimerForever         UINT64_MAX
+
+typedef struct PMTimer *PMTimerRef;
+
+/*
+ * Switches the clock to virtual time starting at 'wallStart'. Must be called
+ * on the PM main queue before any real-time PMTimer is created; returns false
+ * otherwise. Calling it again in virtual mode only resets the wall clock to
+ * 'wallStart', so that each test can start from a known date.
+ */
+__private_extern__ bool PMClockSetVirtual(CFAbsoluteTime wallStart);
+__private_extern__ bool PMClockIsVirtual(void);
+
+/*
+ * Moves virtual time forward by 'ns', firing every timer that comes due on
+ * the way. Must be called on the PM main queue.
+ */
+__private_extern__ void PMClockAdvance(uint64_t ns);
+
+/*
+ * Moves virtual time to the earliest armed deadline and fires it. Returns
+ * false, without moving time, when no timer is armed.
+ */
+__private_extern__ bool PMClockAdvanceToNextTimer(void);
+
+/* Monotonic time since boot (or since PMClockSetVirtual()) */
+__private_extern__ uint64_t PMClockMonotonicNs(void);
+
+/* Wall clock time; use in place of CFAbsoluteTimeGetCurrent() */
+__private_extern__ CFAbsoluteTime PMClockAbsoluteTime(void);
+
+/*
+ * Creates a disarmed timer. In real mode 'handler' runs on 'queue'. In
+ * virtual mode it runs from PMClockAdvance(), which runs on the PM main
+ * queue, so every timer must target that queue.
+ */
+__private_extern__ PMTimerRef PMTimerCreate(dispatch_queue_t queue, dispatch_block_t handler);
+
+/*
+ * Arms the timer to fire 'delayNs' from now and then every 'intervalNs'.
+ * Pass kPMTimerForever as the interval for a one-shot, or as the delay to
+ * disarm. Re-arming replaces the previous deadline.
+ */
+__private_extern__ void PMTimerSchedule(PMTimerRef timer, uint64_t delayNs, uint64_t intervalNs);
+
+/* Arms a one-shot timer at wall clock time 'fireTime' */
+__private_extern__ void PMTimerScheduleAtDate(PMTimerRef timer, CFAbsoluteTime fireTime);
+
+__private_extern__ void PMTimerDisarm(PMTimerRef timer);
+
+/*
+ * Disarms and frees the timer. When called on the timer's queue, the handler
+ * never runs after this returns.
+ */
+__private_extern__ void PMTimerCancel(PMTimerRef timer);
+
+#endif /* PMClock_h */
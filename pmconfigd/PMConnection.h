@@ -32,15 +32,6 @@
 
 
 #define LOG_SLEEPSERVICES 1
-/*
- * Struct for gSleepService 
- */
-typedef struct {
-    int                         notifyToken;
-    CFStringRef                 uuid;
-    long                        capTime;
-} SleepServiceStruct;
-
 // Bits for gPowerState
 #define kSleepState                     0x01
 #define kDarkWakeState                  0x02
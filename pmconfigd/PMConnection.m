@@ -67,6 +67,10 @@
 #include "Platform.h"
 #include "Platform.h"
 #include "StandbyTimer.h"
+#include "PMWakeArbiter.h"
+#include "PMSleepService.h"
+#include "PMLingerPolicy.h"
+#include "PMClock.h"
 #include "pmconfigd.h"
 
 /************************************************************************************/
@@ -100,15 +104,6 @@ enum {
     _kOnStateBits = 0xFFFF
 };
 
-/* Array indices & for PMChooseScheduledEvent */
-typedef enum {
-    kChooseFullWake         = 0,
-    kChooseMaintenance      = 1,
-    kChooseSleepServiceWake = 2,
-    kChooseTimerPlugin      = 3,
-    kChooseWakeTypeCount    = 4
-} wakeType_e;
-
 enum {
     kSilentRunningOff = 0,
     kSilentRunningOn  = 1
@@ -131,9 +126,8 @@ static int kPMDarkWakeLingerDuration = 15;
 static int kPMAlwaysOn = 0;
 #endif // (TARGET_OS_OSX && TARGET_CPU_ARM64)
 static int kPMACWakeLingerDuration = 45; // Defaults to 45 secs
-#if LOG_SLEEPSERVICES
+#define kDwLingerMaxSecs 60 // Longest darkwake linger that can be set
 static int                      gNotifySleepServiceToken = 0;
-#endif
 // Time at which system can wake for next PowerNap
 static CFAbsoluteTime      ts_nextPowerNap = 0;
 // Timer to fire kPMSleepDurationForBT after sleep to update capabilities if needed
@@ -239,11 +233,18 @@ typedef struct {
 
 
 #define VALID_DATE(x) (x!=0.0)
+
+// Dark wakes are never scheduled closer than this to the time of sleep
+#define kMinDarkWakeDelay               60
+
+// How late powerd's own dark wakes may be to share a wake with another request
+#define kInternalDarkWakeTolerance      60
+
 /* 
  * PMScheduleWakeEventChooseBest
  *
  * Expected to be called ONCE at each system sleep by PMConnection.c.
- * Compares maintenance, sleepservice, and autowake requests, and schedules the earliest event with the RTC.
+ * Schedules the wake picked by the wake arbiter (see PMWakeArbiter.h) with the RTC.
  */
 static IOReturn createConnectionWithID(
                     PMConnection **);
@@ -278,6 +279,10 @@ static void setSystemSleepStateTracking(IOPMCapabilityBits);
 
 static void scheduleSleepServiceCapTimerEnforcer(uint32_t cap_ms);
 
+static void publishSleepServiceState(bool active);
+static void sleepServiceSessionChanged(bool inSession);
+static void holdForSleepServiceClients(void);
+
 /* Hide SleepServices code for public OS seeds. 
  * We plan to re-enable this code for shipment.
  * ETB 1/24/12
@@ -339,8 +344,6 @@ static io_connect_t             gRootDomainConnect = IO_OBJECT_NULL;
 static PMResponseWrangler *     gLastResponseWrangler = NULL;
 static uint16_t                 gWranglerGenerationCount = 0;
 
-SleepServiceStruct              gSleepService;
-
 uint32_t                        gDebugFlags = kIOPMDebugAssertionASLLog|
                                                 kIOPMDebugEnableSpindumpOnFullwake|
                                                 kIOPMDebugLogAssertionActivity;
@@ -395,7 +398,13 @@ void PMConnection_prime()
     CFNumberRef                 caps_cf = NULL;
     
     sleepwake_log = os_log_create(PM_LOG_SYSTEM, SLEEPWAKE_LOG);
-    bzero(&gSleepService, sizeof(gSleepService));
+    static const PMSleepServiceOps sleepServiceOps = {
+        .publish            = publishSleepServiceState,
+        .setCap             = setSleepServicesTimeCap,
+        .sessionChanged     = sleepServiceSessionChanged,
+        .holdForClients     = holdForSleepServiceClients,
+    };
+    PMSleepServiceInit(&sleepServiceOps);
 
     gConnections = CFArrayCreateMutable(kCFAllocatorDefault, 100, &_CFArrayConnectionCallBacks);
                                         
@@ -1012,9 +1021,9 @@ int getBTWakeInterval()
 void setDwlInterval(uint32_t interval)
 {
 
-    if (interval > 60) {
+    if (interval > kDwLingerMaxSecs) {
         // Ignore ridiculously large values
-        interval = 60;
+        interval = kDwLingerMaxSecs;
     }
     kPMDarkWakeLingerDuration = interval;
 }
@@ -1241,9 +1250,10 @@ kern_return_t _io_pm_get_uuid(
 {
     if (kIOPMSleepServicesUUID == selector)
     {
-        if (gSleepService.uuid) 
+        CFStringRef uuid = PMSleepServiceGetUUID();
+        if (uuid) 
         {
-            if (CFStringGetCString(gSleepService.uuid, out_uuid, kPMMIGStringLength, kCFStringEncodingUTF8))
+            if (CFStringGetCString(uuid, out_uuid, kPMMIGStringLength, kCFStringEncodingUTF8))
             {
                 *return_code = kIOReturnSuccess;
                 return KERN_SUCCESS;
@@ -1272,82 +1282,22 @@ kern_return_t _io_pm_set_sleepservice_wake_time_cap(
         return KERN_SUCCESS;
     }
 
-    if (gSleepService.capTime == 0 ||
+    if (PMSleepServiceGetCapTime() == 0 ||
           !isA_SleepSrvcWake() )
     {
         *return_code = kIOReturnError;
         return KERN_SUCCESS;
     }
-    gSleepService.capTime = cap_ms;
-   setSleepServicesTimeCap(cap_ms);
+   PMSleepServiceSetCap(cap_ms);
    *return_code = kIOReturnSuccess;
    return KERN_SUCCESS;
 }
 
-static void scheduleSleepServiceCapTimerEnforcer(uint32_t cap_ms) 
+static void publishSleepServiceState(bool active)
 {
-    if(!cap_ms)
-        return;
-
-    
-    // Don't allow SS sessions when 'PreventSystemSleep' assertions are held
-    if (checkForActivesByType(kPreventSleepType)) 
-        return;
-
-    gSleepService.capTime = (long)cap_ms;
-    
-    setSleepServicesTimeCap(cap_ms);
-    /*
-     * Publish a SleepService UUID
-     */
-    
-    if (gSleepService.uuid) {
-        CFRelease(gSleepService.uuid);
-    }
-    CFUUIDRef   ssuuid = NULL;
-    ssuuid = CFUUIDCreate(0);
-    if (ssuuid) {
-        gSleepService.uuid = CFUUIDCreateString(0, ssuuid);
-        CFRelease(ssuuid);
-    }
-    
-    gPowerState |= kDarkWakeForSSState;
-    configAssertionType(kPushServiceTaskType, false);
-    configAssertionType(kInteractivePushServiceType, false);
-
-    // create assertion in sync
-    int assertion_timeout = (kPMAlwaysOn) ? 2 : 10;
-    IOPMAssertionID assertionID = kIOPMNullAssertionID;
-    InternalCreateAssertionWithTimeout(kIOPMAssertionTypeApplePushServiceTask,
-                    CFSTR("Powerd - Wait for client pushService assertions"), assertion_timeout, &assertionID);
-
-
     /*
      * Publish SleepService notify state under "com.apple.powermanagement.sleepservices"
      */
-
-    if (!gSleepService.notifyToken) {
-        int status;
-        status = notify_register_check(kIOPMSleepServiceActiveNotifyName, &gSleepService.notifyToken);
-        
-        if (NOTIFY_STATUS_OK != status) {
-            gSleepService.notifyToken = 0;            
-        }
-    }
-    
-    if (gSleepService.notifyToken) 
-    {
-        /* Interested clients will know that PM is in a SleepServices wake, as dictated by SleepServiceD */
-        notify_set_state(gSleepService.notifyToken, kIOPMSleepServiceActiveNotifyBit);
-        notify_post(kIOPMSleepServiceActiveNotifyName);
-    }
-    
-    /*
-     *  Announce to ASL & MessageTracer
-     */
-    logASLMessageSleepServiceBegins(gSleepService.capTime);
-
-
     if (!gNotifySleepServiceToken) {
         int status;
         status = notify_register_check(kIOPMSleepServiceActiveNotifyName, &gNotifySleepServiceToken);
@@ -1360,11 +1310,61 @@ static void scheduleSleepServiceCapTimerEnforcer(uint32_t cap_ms)
     if (gNotifySleepServiceToken) 
     {
         /* Interested clients will know that PM is in a SleepServices wake, as dictated by SleepServiceD */
-        notify_set_state(gNotifySleepServiceToken, kIOPMSleepServiceActiveNotifyBit);
+        notify_set_state(gNotifySleepServiceToken, active ? kIOPMSleepServiceActiveNotifyBit : 0);
         notify_post(kIOPMSleepServiceActiveNotifyName);
     }
 }
 
+static void sleepServiceSessionChanged(bool inSession)
+{
+    static const kerAssertionType pushServiceTypes[] = { kPushServiceTaskType, kInteractivePushServiceType };
+
+    if (inSession) {
+        gPowerState |= kDarkWakeForSSState;
+    }
+    else {
+        gPowerState &= ~kDarkWakeForSSState;
+    }
+    configAssertionTypes(pushServiceTypes, sizeof(pushServiceTypes) / sizeof(pushServiceTypes[0]));
+}
+
+static void holdForSleepServiceClients(void)
+{
+    static IOPMAssertionID holdID = kIOPMNullAssertionID;
+    CFStringRef holdName = CFSTR("Powerd - Wait for client pushService assertions");
+    int assertion_timeout = (kPMAlwaysOn) ? 2 : 10;
+
+    // The hold is only turned off when it times out; turn the last one back on if it is still ours
+    if (InternalRaiseAssertion(holdID, kIOPMAssertionTypeApplePushServiceTask,
+                               holdName, assertion_timeout) == kIOReturnSuccess) {
+        return;
+    }
+
+    // create assertion in sync
+    holdID = kIOPMNullAssertionID;
+    InternalCreateReusableAssertion(kIOPMAssertionTypeApplePushServiceTask,
+                    holdName, assertion_timeout, &holdID);
+}
+
+static void scheduleSleepServiceCapTimerEnforcer(uint32_t cap_ms) 
+{
+    if(!cap_ms)
+        return;
+
+    
+    // Don't allow SS sessions when 'PreventSystemSleep' assertions are held
+    if (checkForActivesByType(kPreventSleepType)) 
+        return;
+
+    if (!PMSleepServiceBegin(cap_ms))
+        return;
+
+    /*
+     *  Announce to ASL & MessageTracer
+     */
+    logASLMessageSleepServiceBegins(cap_ms);
+}
+
 static void updateCapabilitiesToAllowBackgroundTasks()
 {
     /* Its been kPMSleepDurationForBT since sleep. We can allow background task if not already
@@ -1420,8 +1420,8 @@ static void logASLMessageSleepServiceBegins(long withCapTime)
     
     /* com.apple.message.uuid2 = <SleepServices UUID>
      */
-    if (gSleepService.uuid
-        && CFStringGetCString(gSleepService.uuid, strbuf, sizeof(strbuf), kCFStringEncodingUTF8))
+    if (PMSleepServiceGetUUID()
+        && CFStringGetCString(PMSleepServiceGetUUID(), strbuf, sizeof(strbuf), kCFStringEncodingUTF8))
     {
         asl_set(m, kPMASLUUID2Key, strbuf);
     }
@@ -1450,9 +1450,7 @@ __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt
     if ( (gPowerState & kDarkWakeForSSState) == 0)
        return;
 
-    gPowerState &= ~kDarkWakeForSSState;
-    configAssertionType(kPushServiceTaskType, false);
-    configAssertionType(kInteractivePushServiceType, false);
+    PMSleepServiceEnd();
 
     m = new_msg_pmset_log();
     
@@ -1466,8 +1464,8 @@ __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt
     
     /* com.apple.message.uuid2 = <SleepServices UUID>
      */
-    if (gSleepService.uuid
-        && CFStringGetCString(gSleepService.uuid, strUUID2, sizeof(strUUID2), kCFStringEncodingUTF8))
+    if (PMSleepServiceGetUUID()
+        && CFStringGetCString(PMSleepServiceGetUUID(), strUUID2, sizeof(strUUID2), kCFStringEncodingUTF8))
     {
         asl_set(m, kPMASLUUID2Key, strUUID2);
     }
@@ -1599,8 +1597,7 @@ __private_extern__ void cancelPowerNapStates( )
 {
 
     if (isA_SleepSrvcWake()) {
-        gSleepService.capTime = 0;
-        setSleepServicesTimeCap(0);
+        PMSleepServiceExpire();
     }
 
     if (isA_BTMtnceWake() ) {
@@ -1805,11 +1802,9 @@ void evalForPSChange( )
 
     prevPwrSrc = pwrSrc;
 
-    if (gSleepService.capTime != 0 &&
+    if (PMSleepServiceGetCapTime() != 0 &&
         isA_SleepSrvcWake()) {
-        int capTimeout = getCurrentSleepServiceCapTimeout();
-        gSleepService.capTime = capTimeout;
-        setSleepServicesTimeCap(capTimeout);
+        PMSleepServiceSetCap(getCurrentSleepServiceCapTimeout());
     }
 
     if (pwrSrc == kBatteryPowered)
@@ -1999,6 +1994,41 @@ static void handleSleepPreventersMsg(natural_t msg, void *messageData)
     }
 }
 
+/*
+ * Assertion descriptions for darkwake lingers, built the first time each
+ * duration is used and never changed after that. InternalCreateAssertion()
+ * reads the description later on the main queue, so a template is not
+ * edited in place for a different duration.
+ */
+static CFMutableDictionaryRef   gDwLingerTemplates[kDwLingerMaxSecs + 1];
+
+static CFMutableDictionaryRef dwLingerDescription(uint32_t secs)
+{
+    CFMutableDictionaryRef desc;
+
+    if (secs > kDwLingerMaxSecs) {
+        secs = kDwLingerMaxSecs;
+    }
+    if ((desc = gDwLingerTemplates[secs])) {
+        return desc;
+    }
+
+    desc = _IOPMAssertionDescriptionCreate(
+                                           kIOPMAssertInternalPreventSleep,
+                                           CFSTR("com.apple.powermanagement.darkwakelinger"),
+                                           NULL, CFSTR("Proxy assertion to linger in darkwake"),
+                                           NULL, secs,
+                                           kIOPMAssertionTimeoutActionRelease);
+    if (desc) {
+        //This assertion should be applied even on battery power
+        CFDictionarySetValue(desc,
+                             kIOPMAssertionAppliesToLimitedPowerKey,
+                             (CFBooleanRef)kCFBooleanTrue);
+        gDwLingerTemplates[secs] = desc;
+    }
+    return desc;
+}
+
 static bool dwLinger(CFStringRef sleepReason)
 {
 
@@ -2009,49 +2039,36 @@ static bool dwLinger(CFStringRef sleepReason)
     // transition except emergency sleeps.
     // Non-Power Nap machines will linger on every FullWake --> DarkWake
     // transition except emergency sleeps, and clamshell close sleeps
-
-
-    bool isBTCapable = IOPMFeatureIsAvailable(CFSTR(kIOPMDarkWakeBackgroundTaskKey), NULL);
-
-    bool isEmergencySleep = IS_EMERGENCY_SLEEP(sleepReason);
-    bool isClamshellSleep = CFEqual(sleepReason, CFSTR(kIOPMClamshellSleepKey))?true:false;
-
-    if ((getSessionUserActivity(NULL) == false) ||
-        isEmergencySleep ||
-        (kPMDarkWakeLingerDuration == 0) ) {
-        // Don't linger if:
-        //      user wasn't active in last full wake, or
-        //      this is an emrgency sleep, or
-        //      user has set linger duration to 0
+    //
+    // kPMDarkWakeLingerDuration is the longest linger. PMLingerPolicy
+    // shortens it when recent lingers went unused.
+
+    PMLingerRequest         req;
+    CFMutableDictionaryRef  assertionDescription;
+    uint32_t                secs;
+
+    req.userWasActive = getSessionUserActivity(NULL);
+    req.emergencySleep = IS_EMERGENCY_SLEEP(sleepReason);
+    req.clamshellSleep = CFEqual(sleepReason, CFSTR(kIOPMClamshellSleepKey)) ? true : false;
+    req.btCapable = IOPMFeatureIsAvailable(CFSTR(kIOPMDarkWakeBackgroundTaskKey), NULL);
+    req.workPending = checkForActivesByType(kBackgroundTaskType);
+    req.maxSecs = (kPMDarkWakeLingerDuration > 0) ? kPMDarkWakeLingerDuration : 0;
+
+    secs = PMLingerPolicyBegin(&req, PMClockAbsoluteTime());
+    if (secs == 0) {
         return false;
     }
 
-    if((isBTCapable || (!isBTCapable && !isClamshellSleep)))
-    {
-
-        CFMutableDictionaryRef assertionDescription = NULL;
-        assertionDescription = _IOPMAssertionDescriptionCreate(
-                                                               kIOPMAssertInternalPreventSleep,
-                                                               CFSTR("com.apple.powermanagement.darkwakelinger"),
-                                                               NULL, CFSTR("Proxy assertion to linger in darkwake"),
-                                                               NULL, kPMDarkWakeLingerDuration,
-                                                               kIOPMAssertionTimeoutActionRelease);
-
-        if (assertionDescription)
-        {
-            //This assertion should be applied even on battery power
-            CFDictionarySetValue(assertionDescription,
-                                 kIOPMAssertionAppliesToLimitedPowerKey,
-                                 (CFBooleanRef)kCFBooleanTrue);
-            InternalCreateAssertion(assertionDescription, NULL);
-
-            CFRelease(assertionDescription);
-
-            return true;
-        }
+    assertionDescription = dwLingerDescription(secs);
+    if (!assertionDescription) {
+        return false;
     }
+    if (secs < req.maxSecs) {
+        DEBUG_LOG("Lingering in darkwake for %u secs (max %u secs)\n", secs, req.maxSecs);
+    }
+    InternalCreateAssertion(assertionDescription, NULL);
 
-    return false;
+    return true;
 }
 
 void setVMDarkwakeMode(bool darkwakeMode)
@@ -2068,9 +2085,7 @@ void updateWakeTime()
 {
     if (gCapabilityChangeDone == true) {
         if (gWakeFromDarkWake && gCurrentWakeTime == 0) {
-            CFStringRef wakeType = NULL;
-            getPlatformWakeReason(NULL, &wakeType);
-            if (wakeType && CFEqual(wakeType, kIOPMRootDomainWakeTypeNotification)) {
+            if (getWakeReasonInfo()->flags & kWakeTypeNotificationFlag) {
                 return;
             }
             uint64_t useractive = 0;
@@ -2293,6 +2308,7 @@ static void PMConnectionPowerCallBack(
         // We will clear kDarkWakeForSSState bit later when the SS session is closed.
         gPowerState &= ~(kPowerStateMask ^ kDarkWakeForSSState);
         gPowerState |= kSleepState;
+        PMLingerPolicySleep(checkForActivesByType(kBackgroundTaskType));
 
 
         /* We must acknowledge this sleep event within 30 second timeout, 
@@ -2386,7 +2402,7 @@ static void PMConnectionPowerCallBack(
         updateCurrentWakeEnd(mach_absolute_time());
 
         // if wake reason is rtc, track responsible process
-        if ((CFStringFind(wakeReason, CFSTR("RTC"), 0).location != kCFNotFound) || (CFStringFind(wakeReason, CFSTR("rtc"), 0).location != kCFNotFound)) {
+        if (getWakeReasonInfo()->flags & kWakeReasonRTCFlag) {
             if (gPendingScheduledWakeLog) {
 
                 CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
@@ -2443,6 +2459,7 @@ static void PMConnectionPowerCallBack(
             else {
                 cancelPowerNapStates();
                 _unclamp_silent_running(false);
+                PMLingerPolicyUserReturned(PMClockAbsoluteTime());
 
                 // kDarkWakeForSSState bit is removed when the SS session is closed.
                 gPowerState &= ~(kPowerStateMask ^ kDarkWakeForSSState);
@@ -3060,6 +3077,109 @@ bool validScheduledDate(CFAbsoluteTime event, int pid)
     return true;
 }
 
+static void registerWakeCandidate(const PMWakeCandidate *candidate)
+{
+    if (PMWakeArbiterRegister(candidate) < 0) {
+        ERROR_LOG("Failed to register %s wake candidate from pid %d\n", candidate->source, candidate->pid);
+    }
+}
+
+static void registerClientWakeCandidate(
+    PMResponse              *response,
+    const char              *source,
+    CFAbsoluteTime          deadline,
+    wakeType_e              type,
+    CFAbsoluteTime          notBefore)
+{
+    PMWakeCandidate     candidate;
+
+    bzero(&candidate, sizeof(candidate));
+    candidate.deadline = deadline;
+    candidate.notBefore = notBefore;
+    candidate.priority = kPMWakePriorityDarkWake;
+    candidate.flags = kPMWakeCandidateDarkWake;
+    candidate.type = type;
+    candidate.pid = response->connection->callerPID;
+    candidate.source = source;
+
+    if (response->connection->callerName) {
+        CFStringGetCString(response->connection->callerName, candidate.name, sizeof(candidate.name), kCFStringEncodingUTF8);
+    }
+    if (response->clientInfoString) {
+        CFStringGetCString(response->clientInfoString, candidate.info, sizeof(candidate.info), kCFStringEncodingUTF8);
+    } else if (response->clientInfoStringBGTask) {
+        CFStringGetCString(response->clientInfoStringBGTask, candidate.info, sizeof(candidate.info), kCFStringEncodingUTF8);
+    } else if (response->clientInfoStringAppRefresh) {
+        CFStringGetCString(response->clientInfoStringAppRefresh, candidate.info, sizeof(candidate.info), kCFStringEncodingUTF8);
+    }
+
+    registerWakeCandidate(&candidate);
+}
+
+static void registerInternalWakeCandidate(
+    const char              *source,
+    CFAbsoluteTime          deadline,
+    wakeType_e              type,
+    uint32_t                priority,
+    CFTimeInterval          tolerance,
+    CFAbsoluteTime          notBefore)
+{
+    PMWakeCandidate     candidate;
+
+    bzero(&candidate, sizeof(candidate));
+    candidate.deadline = deadline;
+    candidate.tolerance = tolerance;
+    candidate.notBefore = notBefore;
+    candidate.priority = priority;
+    candidate.flags = kPMWakeCandidateDarkWake;
+    candidate.type = type;
+    candidate.pid = getpid();
+    candidate.source = source;
+    snprintf(candidate.name, sizeof(candidate.name), "powerd");
+    snprintf(candidate.info, sizeof(candidate.info), "%s", source);
+
+    registerWakeCandidate(&candidate);
+}
+
+static void registerEventWakeCandidate(
+    CFDictionaryRef         event,
+    const char              *source,
+    CFAbsoluteTime          deadline,
+    wakeType_e              type,
+    uint32_t                priority,
+    CFStringRef             appInfo)
+{
+    PMWakeCandidate     candidate;
+    CFStringRef         appName;
+    CFNumberRef         appPID;
+
+    bzero(&candidate, sizeof(candidate));
+    candidate.deadline = deadline;
+    candidate.priority = priority;
+    candidate.type = type;
+    candidate.pid = getpid();
+    candidate.source = source;
+    candidate.eventType = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey));
+    snprintf(candidate.name, sizeof(candidate.name), "powerd");
+
+    // Shutdown/restart wakes are attributed to powerd, whoever scheduled them
+    if (priority == kPMWakePriorityUserWake) {
+        appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
+        appPID = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppPIDKey));
+        if (appPID) {
+            CFNumberGetValue(appPID, kCFNumberIntType, &candidate.pid);
+        }
+        if (appName) {
+            CFStringGetCString(appName, candidate.name, sizeof(candidate.name), kCFStringEncodingUTF8);
+        }
+    }
+    if (appInfo) {
+        CFStringGetCString(appInfo, candidate.info, sizeof(candidate.info), kCFStringEncodingUTF8);
+    }
+
+    registerWakeCandidate(&candidate);
+}
+
 static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
 {
     CFIndex                 i = 0;
@@ -3073,18 +3193,15 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
     wakeType_e              type = kChooseWakeTypeCount; // Invalid value
     CFBooleanRef            scheduleEvent = kCFBooleanFalse;
     bool                    userWakeReq = false, ssWakeReq = false, disableWakeReq = false;
-    int                     reqCnt = 0;
+    PMWakeChoice            choice;
 
+    // Dark wakes are scheduled at least a minute out
+    CFAbsoluteTime          darkWakeNotBefore = CFAbsoluteTimeGetCurrent() + kMinDarkWakeDelay;
 
     // for loggging
     CFNumberRef             chosen_cf_pid = NULL;
-    int                     chosen_pid = getpid();
-    char                    chosen_name[128];
-    char                    chosen_info[128];
     CFStringRef             chosen_cf_name = NULL;
-    CFStringRef             chosen_type = NULL;
     CFStringRef             chosen_cf_info = NULL;
-    PMResponse              *chosen_darkwake = NULL;
 
     if (wrangler) {
         responsesCount = CFArrayGetCount(wrangler->awaitingResponses);
@@ -3094,6 +3211,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
         gPendingScheduledWakeLog = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
     }
 
+    PMWakeArbiterReset();
+
     for (i=0; i<responsesCount; i++)
     {
         oneResponse = (PMResponse *)CFArrayGetValueAtIndex(wrangler->awaitingResponses, i);
@@ -3119,14 +3238,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                     "Maintenance",
                                     oneResponse->maintenanceRequested,
                                     oneResponse->clientInfoString);
-            if (oneResponse->maintenanceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->maintenanceRequested;
-                type = kChooseMaintenance;
-                chosenReq = reqCnt;
-                chosen_darkwake = oneResponse;
-            }
-            reqCnt++;
+            registerClientWakeCandidate(oneResponse, "Maintenance", oneResponse->maintenanceRequested,
+                                        kChooseMaintenance, darkWakeNotBefore);
         }
 
         if (validScheduledDate(oneResponse->sleepServiceRequested, oneResponse->connection->callerPID))
@@ -3142,16 +3255,9 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                         oneResponse->sleepServiceRequested,
                                         oneResponse->clientInfoString);
             }
-
-            if (oneResponse->sleepServiceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->sleepServiceRequested;
-                type = kChooseSleepServiceWake;
-                chosenReq = reqCnt;
-                chosen_darkwake = oneResponse;
-            }
+            registerClientWakeCandidate(oneResponse, "SleepService", oneResponse->sleepServiceRequested,
+                                        kChooseSleepServiceWake, darkWakeNotBefore);
             ssWakeReq = true;
-            reqCnt++;
         }
 
         if (validScheduledDate(oneResponse->timerPluginRequested, oneResponse->connection->callerPID))
@@ -3167,15 +3273,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                         oneResponse->timerPluginRequested,
                                         oneResponse->clientInfoString);
             }
-
-            if (oneResponse->timerPluginRequested < earliestWake)
-            {
-                earliestWake = oneResponse->timerPluginRequested;
-                type = kChooseTimerPlugin;
-                chosenReq = reqCnt;
-                chosen_darkwake = oneResponse;
-            }
-            reqCnt++;
+            registerClientWakeCandidate(oneResponse, "TimerPlugin", oneResponse->timerPluginRequested,
+                                        kChooseTimerPlugin, darkWakeNotBefore);
         }
     }
     
@@ -3188,19 +3287,6 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
             gPendingScheduledWakeLog = NULL;
         }
         goto exit;
-    } else {
-        if (chosen_darkwake) {
-            // we have the selected dark wake from clients
-            chosen_pid = chosen_darkwake->connection->callerPID;
-            CFStringGetCString(chosen_darkwake->connection->callerName, chosen_name, sizeof(chosen_name), kCFStringEncodingUTF8);
-            if (chosen_darkwake->clientInfoString) {
-                CFStringGetCString(chosen_darkwake->clientInfoString, chosen_info, sizeof(chosen_info), kCFStringEncodingUTF8);
-            } else if (chosen_darkwake->clientInfoStringBGTask) {
-                CFStringGetCString(chosen_darkwake->clientInfoStringBGTask, chosen_info, sizeof(chosen_info), kCFStringEncodingUTF8);
-            } else if (chosen_darkwake->clientInfoStringAppRefresh) {
-                CFStringGetCString(chosen_darkwake->clientInfoStringAppRefresh, chosen_info, sizeof(chosen_info), kCFStringEncodingUTF8);
-            }
-        }
     }
 
 #if !TARGET_OS_IPHONE && !(TARGET_OS_OSX && TARGET_CPU_ARM64)
@@ -3212,15 +3298,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
 
         INFO_LOG("Adaptive standby wake request after %f secs\n", standbyWakeTime - CFAbsoluteTimeGetCurrent());
         m = describeWakeRequest(m, getpid(), "AdaptiveWake", standbyWakeTime, NULL);
-        if (standbyWakeTime < earliestWake) {
-            earliestWake = standbyWakeTime;
-            type = kChooseSleepServiceWake;
-            chosenReq = reqCnt;
-            chosen_pid = getpid();
-            snprintf(chosen_name, sizeof(chosen_name), "powerd");
-            snprintf(chosen_info, sizeof(chosen_info), "AdaptiveWake");
-        }
-        reqCnt++;
+        registerInternalWakeCandidate("AdaptiveWake", standbyWakeTime, kChooseSleepServiceWake,
+                                      kPMWakePriorityDarkWake, kInternalDarkWakeTolerance, darkWakeNotBefore);
     }
     if ((proxSupportWakeTime = getNextWakeForProximitySupport())) {
         if (proxSupportWakeTime < ts_nextPowerNap) {
@@ -3229,59 +3308,34 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
 
         INFO_LOG("Prox support wake request after %f secs\n", proxSupportWakeTime - CFAbsoluteTimeGetCurrent());
         m = describeWakeRequest(m, getpid(), "ProxWakeSupport", proxSupportWakeTime, NULL);
-        if (proxSupportWakeTime < earliestWake) {
-            earliestWake = proxSupportWakeTime;
-            type = kChooseSleepServiceWake;
-            chosenReq = reqCnt;
-            chosen_pid = getpid();
-            snprintf(chosen_name, sizeof(chosen_name), "powerd");
-            snprintf(chosen_info, sizeof(chosen_info), "ProxWakeSupport");
-        }
-        reqCnt++;
+        registerInternalWakeCandidate("ProxWakeSupport", proxSupportWakeTime, kChooseSleepServiceWake,
+                                      kPMWakePriorityDarkWake, kInternalDarkWakeTolerance, darkWakeNotBefore);
     }
 
 
 #endif
 
-    if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-        // Make sure that wake request is at least 1 min from now
-        earliestWake = (CFAbsoluteTimeGetCurrent()+60);
-    }
-
     CFAbsoluteTime ts_tcpka_turnoff = getTcpkaTurnOffTime();
     if (validScheduledDate(ts_tcpka_turnoff, getpid())) {
         m = describeWakeRequest(m, getpid(), "TCPKATurnOff", ts_tcpka_turnoff, NULL);
-        if (ts_tcpka_turnoff <= earliestWake) {
-            earliestWake = ts_tcpka_turnoff;
-            type = kChooseMaintenance;
-            chosenReq = reqCnt;
-            chosen_pid = getpid();
-            snprintf(chosen_name, sizeof(chosen_name), "powerd");
-            snprintf(chosen_info, sizeof(chosen_info), "TCPKATurnOff");
-            if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-                // Make sure that wake request is at least 1 min from now
-                earliestWake = (CFAbsoluteTimeGetCurrent()+60);
-            }
-        }
-        reqCnt++;
-
+        registerInternalWakeCandidate("TCPKATurnOff", ts_tcpka_turnoff, kChooseMaintenance,
+                                      kPMWakePriorityTCPKA, 0, darkWakeNotBefore);
     }
 
 
     // Disable all dark wake requests if system is going to standby and kIOPMDestroyFVKeyOnStandbyKey
-    // is set. This is done by resetting earliestWake to kCFAbsoluteTimeIntervalSince1904
+    // is set.
 #if !(TARGET_OS_OSX && TARGET_CPU_ARM64)
     bool destroyFVKey = GetSystemPowerSettingBool(CFSTR(kIOPMDestroyFVKeyOnStandbyKey));
     if (getDeltaToStandby() == 0 && destroyFVKey) {
         INFO_LOG("Entering standby and kIOPMDestroyFVKeyOnStandbyKey is set. Disabling dark wakes");
         disableWakeReq = true;
-        earliestWake = kCFAbsoluteTimeIntervalSince1904;
+        PMWakeArbiterDisableDarkWakes();
         ssWakeReq = false;
-        chosenReq = -1;
     }
 #endif
 
-    /* Check for user wake requests in the end to give highest priority, in case of conflict */
+    /* User wake requests have the highest priority, in case of conflict */
     CFDictionaryRef event = copyEarliestRequestAutoWakeEvent();
     if (event)
     {
@@ -3291,6 +3345,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
             CFStringRef appName;
             CFNumberRef appPID;
             CFMutableStringRef appInfo=NULL;
+            wakeType_e userWakeType = kChooseFullWake;
+
             appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
             appPID = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppPIDKey));
             if (isA_CFString(appName) && isA_CFNumber(appPID))
@@ -3299,41 +3355,18 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                 CFStringAppendFormat(appInfo, NULL, CFSTR("%@,%@"),appName, appPID);
             }
             m = describeWakeRequest(m, getpid(), "UserWake", userWake, appInfo);
-            
-            if (userWake <= earliestWake) {
-                earliestWake = userWake;
 #if TARGET_OS_OSX
-                if (appInfo && CFStringFind(appInfo, CFSTR("com.apple.alarm"), 0).location != kCFNotFound) {
-                    INFO_LOG("Wake scheduled by com.apple.alarm");
-                    type = kChooseMaintenance;
-                } else {
-                    type = kChooseFullWake;
-                }
-#else
-                type = kChooseFullWake;
-#endif
-                chosenReq = reqCnt;
-                if (appPID) {
-                    CFNumberGetValue(appPID, kCFNumberIntType, &chosen_pid);
-                } else {
-                    chosen_pid = getpid();
-                }
-                if (appName) {
-                    CFStringGetCString(appName, chosen_name, sizeof(chosen_name), kCFStringEncodingUTF8);
-                } else {
-                    snprintf(chosen_name, sizeof(chosen_name), "powerd");
-                }
-                if (appInfo) {
-                    CFStringGetCString(appInfo, chosen_info, sizeof(chosen_info), kCFStringEncodingUTF8);
-                }
-                chosen_type = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey));
+            if (appInfo && CFStringFind(appInfo, CFSTR("com.apple.alarm"), 0).location != kCFNotFound) {
+                userWakeType = kChooseMaintenance;
             }
+#endif
+            registerEventWakeCandidate(event, "UserWake", userWake, userWakeType,
+                                       kPMWakePriorityUserWake, appInfo);
             if (appInfo)
             {
                 CFRelease(appInfo);
             }
             userWakeReq = true;
-            reqCnt++;
         }
         CFRelease(event);
     }
@@ -3357,29 +3390,35 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                 appInfo = CFStringCreateMutable(NULL, MAXPATHLEN);
                 CFStringAppendFormat(appInfo, NULL, CFSTR("%@,%@"),appName, appPID);
             }
-            
-            if (userWake <= earliestWake) {
-                earliestWake = userWake;
-                type = kChooseMaintenance;
-                chosenReq = reqCnt;
-                m = describeWakeRequest(m, getpid(), "Shutdown/Restart", userWake, appInfo);
-                chosen_pid = getpid();
-                snprintf(chosen_name, sizeof(chosen_name), "powerd");
-                if (appInfo) {
-                    CFStringGetCString(appInfo, chosen_info, sizeof(chosen_info), kCFStringEncodingUTF8);
-                }
-                chosen_type = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey));
-            }
+            m = describeWakeRequest(m, getpid(), "Shutdown/Restart", userWake, appInfo);
+            registerEventWakeCandidate(event, "Shutdown/Restart", userWake, kChooseMaintenance,
+                                       kPMWakePriorityShutdownRestart, appInfo);
             if (appInfo)
             {
                 CFRelease(appInfo);
             }
             userWakeReq = true;
-            reqCnt++;
         }
+    }
+    if (event) {
         CFRelease(event);
     }
 
+    if (PMWakeArbiterChoose(&choice)) {
+        earliestWake = choice.wakeTime;
+        type = choice.chosen->type;
+        chosenReq = choice.chosenIdx;
+
+#if TARGET_OS_OSX
+        if ((type == kChooseMaintenance) && (choice.chosen->priority == kPMWakePriorityUserWake)) {
+            INFO_LOG("Wake scheduled by com.apple.alarm");
+        }
+#endif
+        if (choice.mergedCnt > 1) {
+            INFO_LOG("%s wake after %f secs also serves %u other wake requests\n",
+                     choice.chosen->source, earliestWake - CFAbsoluteTimeGetCurrent(), choice.mergedCnt - 1);
+        }
+    }
 
     if (ts_apo != 0) {
         // Report existence of user wake request or SS request to IOPPF(thru rootDomain)
@@ -3402,22 +3441,22 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
         CFNumberRef cf_time = CFNumberCreate(NULL, kCFNumberDoubleType, &earliestWake);
         CFDictionarySetValue(gPendingScheduledWakeLog, CFSTR(kIOPMPowerEventTimeKey), cf_time);
         // pid
-        chosen_cf_pid = CFNumberCreate(NULL, kCFNumberIntType, &chosen_pid);
+        chosen_cf_pid = CFNumberCreate(NULL, kCFNumberIntType, &choice.chosen->pid);
         CFDictionarySetValue(gPendingScheduledWakeLog, CFSTR(kIOPMPowerEventAppPIDKey), chosen_cf_pid);
         //name
-        chosen_cf_name= CFStringCreateWithCString(0, chosen_name, kCFStringEncodingUTF8);
+        chosen_cf_name= CFStringCreateWithCString(0, choice.chosen->name, kCFStringEncodingUTF8);
         if (chosen_cf_name) {
             CFDictionarySetValue(gPendingScheduledWakeLog, CFSTR(kIOPMPowerEventAppNameKey), chosen_cf_name);
             CFRelease(chosen_cf_name);
         }
         // type
-        if (chosen_type) {
-            CFDictionarySetValue(gPendingScheduledWakeLog, CFSTR(kIOPMPowerEventTypeKey), chosen_type);
+        if (choice.chosen->eventType) {
+            CFDictionarySetValue(gPendingScheduledWakeLog, CFSTR(kIOPMPowerEventTypeKey), choice.chosen->eventType);
         } else {
             CFDictionarySetValue(gPendingScheduledWakeLog, CFSTR(kIOPMPowerEventTypeKey), CFSTR(kIOPMAutoWake));
         }
         //info
-        chosen_cf_info = CFStringCreateWithCString(0, chosen_info, kCFStringEncodingUTF8);
+        chosen_cf_info = CFStringCreateWithCString(0, choice.chosen->info, kCFStringEncodingUTF8);
         if (chosen_cf_info) {
             CFDictionarySetValue(gPendingScheduledWakeLog, CFSTR(kIOPMPowerEventInfoKey), chosen_cf_info);
             CFRelease(chosen_cf_info);
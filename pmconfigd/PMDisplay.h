@@ -46,7 +46,7 @@ __private_extern__ bool skylightDisplayOn(void);
 __private_extern__ bool isDesktopMode(void);
 __private_extern__ void evaluateClamshellSleepState(void);
 __private_extern__ void updateClamshellState(void *message);
-__private_extern__ uint64_t inFlightDimRequest(void);
+__private_extern__ bool inFlightDimRequest(void);
 __private_extern__ void resetDisplayState(void);
 
 void requestDisplayState(uint64_t state, int timeout);
@@ -38,6 +38,9 @@
 #include "PMConnection.h"
 
 #include "PMAssertions.h"
+#include "PMClock.h"
+#include "PMDisplayRequests.h"
+#include "PMDisplayCoalescer.h"
 
 os_log_t display_log = NULL;
 #undef  LOG_STREAM
@@ -64,12 +67,6 @@ IOPMAssertionID gLidOpenAssertionID = kIOPMNullAssertionID;
 CFMutableDictionaryRef    gAssertionDescription = NULL;
 SLSDisplayPowerControlClient *gSLPowerClient = nil;
 
-struct request_entry {
-    SLSDisplayControlRequestUUID uuid;
-    bool valid;
-    STAILQ_ENTRY(request_entry) entries;
-};
-
 SLSDisplayControlRequestUUID gDimRequest = 0;
 
 #if XCTEST
@@ -86,8 +83,25 @@ uint32_t xctGetClamshellState() {
 }
 #endif
 
-// list for storing display requests to WindowServer
-STAILQ_HEAD( , request_entry) gRequestUUIDs = STAILQ_HEAD_INITIALIZER(gRequestUUIDs);
+/*
+ * Request dictionaries sent to WindowServer. powerd only ever requests a
+ * handful of distinct states, so the requests without a timeout are built
+ * once per state and reused. Requests with a timeout are built each time.
+ */
+#define kMaxCachedRequests      8
+
+static struct {
+    bool            clamshell;
+    uint64_t        state;
+    NSDictionary    *request;
+} gCachedRequests[kMaxCachedRequests];
+static uint32_t gCachedRequestCnt = 0;
+
+static PMTimerRef gCoalesceTimer = NULL;
+
+static void sendDisplayState(uint64_t state, int timeout);
+static void armCoalesceTimer(uint64_t delayNs);
+static void disarmCoalesceTimer(void);
 
 __private_extern__ void dimDisplay()
 {
@@ -218,9 +232,15 @@ __private_extern__ void updateClamshellState(void *message)
     INFO_LOG("ClamshellState. Closed : %u. ClamshellSleepState: isSleepDisabled : %d\n", closed, getClamshellSleepState());
 }
 
-__private_extern__ uint64_t inFlightDimRequest()
+// Returns true if a dim was requested and hasn't completed yet
+__private_extern__ bool inFlightDimRequest()
 {
-    return gDimRequest;
+    uint64_t heldState;
+
+    if (gDimRequest) {
+        return true;
+    }
+    return (PMDisplayCoalescerHeld(&heldState) && (heldState == kDisplaysDim));
 }
 
 __private_extern__ void resetDisplayState()
@@ -243,33 +263,21 @@ void handleDesktopMode()
 void validateRequestUUID(uint64_t uuid)
 {
     // Called only for display state changes
-    bool found = false;
-    struct request_entry *entry;
-    STAILQ_FOREACH(entry, &gRequestUUIDs, entries){
-        if (entry->uuid == uuid) {
-            found = true;
+    switch (PMDisplayRequestAck(uuid, PMClockMonotonicNs())) {
+        case kPMDisplayAckValid:
+            INFO_LOG("Received callback for uuid %llu\n", uuid);
             break;
-        } else {
-            // When does an entry become invalid
+        case kPMDisplayAckSuperseded:
             /* When powerd requests displays dim followed by a displays undim
              * before the dim timer expires, we will never get an ack for the
-             * first request.
-             * Since requests are inserted in order any pending request before
-             * the current request becomes invalid
+             * first request. An ack for a request made before the last acked
+             * one is for such a request.
              */
-            entry->valid = false;
-        }
-    }
-    if (found) {
-        if (!entry->valid) {
             INFO_LOG("Received callback for invalid uuid %llu\n", uuid);
-        } else {
-            INFO_LOG("Received callback for uuid %llu\n", uuid);
-        }
-        STAILQ_REMOVE(&gRequestUUIDs, entry, request_entry, entries);
-        free(entry);
-    } else {
-        ERROR_LOG("Received callback for unknown uuid %llu", uuid);
+            break;
+        default:
+            ERROR_LOG("Received callback for unknown uuid %llu", uuid);
+            break;
     }
 }
 
@@ -418,6 +426,13 @@ void handleSkylightCheckIn()
     }
     dispatch_resume(gSLExit);
 
+    static const PMDisplayCoalescerOps coalescerOps = {
+        .emit   = sendDisplayState,
+        .arm    = armCoalesceTimer,
+        .disarm = disarmCoalesceTimer,
+    };
+    PMDisplayCoalescerInit(&coalescerOps);
+
     // create ws power control client
     NSError *err = nil;
     gSLPowerClient = [[SLSDisplayPowerControlClient alloc] initAsyncPowerControlClient:&err notifyQueue:_getPMMainQueue() notificationType:kSLDCNotificationTypeNone notificationBlock:^(void *dict) {
@@ -444,7 +459,75 @@ void handleSkylightCheckIn()
 }
 #endif
 
+// Returns a retained request dictionary
+static NSDictionary *copyStateRequest(bool clamshell, uint64_t state, int timeout)
+{
+    NSDictionary *request;
+    NSNumber *ns_state;
+
+    if (timeout != -1) {
+        // Timeouts differ from request to request; clamshell requests never have one
+        ns_state = [NSNumber numberWithUnsignedLongLong:state];
+        return [[NSDictionary alloc] initWithObjectsAndKeys:ns_state, kSLSDisplayControlRequestState,
+                [NSNumber numberWithInt:timeout], kSLSDisplayControlRequestTimeout, nil];
+    }
+
+    for (uint32_t i = 0; i < gCachedRequestCnt; i++) {
+        if ((gCachedRequests[i].clamshell == clamshell) && (gCachedRequests[i].state == state)) {
+            return [gCachedRequests[i].request retain];
+        }
+    }
+
+    if (clamshell) {
+        ns_state = [NSNumber numberWithUnsignedChar:(SLSClamshellState)state];
+        request = [[NSDictionary alloc] initWithObjectsAndKeys:ns_state, kSLSDisplayControlRequestClamshellState, nil];
+    }
+    else {
+        ns_state = [NSNumber numberWithUnsignedLongLong:state];
+        request = [[NSDictionary alloc] initWithObjectsAndKeys:ns_state, kSLSDisplayControlRequestState, nil];
+    }
+
+    if (request && (gCachedRequestCnt < kMaxCachedRequests)) {
+        gCachedRequests[gCachedRequestCnt].clamshell = clamshell;
+        gCachedRequests[gCachedRequestCnt].state = state;
+        gCachedRequests[gCachedRequestCnt].request = [request retain];
+        gCachedRequestCnt++;
+    }
+    return request;
+}
+
+static void armCoalesceTimer(uint64_t delayNs)
+{
+    if (!gCoalesceTimer) {
+        gCoalesceTimer = PMTimerCreate(_getPMMainQueue(), ^{
+            PMDisplayCoalescerFire();
+        });
+    }
+    PMTimerSchedule(gCoalesceTimer, delayNs, kPMTimerForever);
+}
+
+static void disarmCoalesceTimer(void)
+{
+    if (gCoalesceTimer) {
+        PMTimerDisarm(gCoalesceTimer);
+    }
+}
+
 void requestDisplayState(uint64_t state, int timeout)
+{
+    if (!gSLCheckIn || !gSLConnectionInitialized) {
+        ERROR_LOG("WindowServer has not checked in or connection not initialized. Refusing to change display state");
+        return;
+    }
+
+    /* Idle dims are held briefly so that an off or undim right behind
+     * them replaces them instead of following them to WindowServer.
+     * Everything else goes out right away.
+     */
+    PMDisplayCoalescerSubmit(state, timeout, (state == kDisplaysDim) && (timeout != 0));
+}
+
+static void sendDisplayState(uint64_t state, int timeout)
 {
     if (!gSLCheckIn || !gSLConnectionInitialized) {
         ERROR_LOG("WindowServer has not checked in or connection not initialized. Refusing to change display state");
@@ -454,34 +537,19 @@ void requestDisplayState(uint64_t state, int timeout)
      Clamshell state is requested through requestClamshellState*/
     
     NSError *err = nil;
-    NSMutableDictionary *request = [[NSMutableDictionary alloc] initWithCapacity:1];
-    NSNumber * ns_state = [[NSNumber alloc] initWithUnsignedLongLong:state];
-    [request setValue:ns_state forKey:kSLSDisplayControlRequestState];
+    NSDictionary *request = copyStateRequest(false, state, timeout);
 
-    // set timeout if present
-    if (timeout != -1) {
-        NSNumber * ns_timeout = [[NSNumber alloc] initWithInt:timeout];
-        [request setValue:ns_timeout forKey:kSLSDisplayControlRequestTimeout];
-        if (ns_timeout) {
-            [ns_timeout release];
-        }
-    }
-
-    SLSDisplayControlRequestUUID uuid = [gSLPowerClient requestStateChange:(NSDictionary *const)request error:&err];
+    SLSDisplayControlRequestUUID uuid = [gSLPowerClient requestStateChange:request error:&err];
     if ([err code] != 0) {
         ERROR_LOG("Display requestStateChange returned error %{public}@", err);
     } else {
         INFO_LOG("requestDisplayState: state %llu, Received uuid %llu", state, uuid);
-        struct request_entry *entry = (struct request_entry *)malloc(sizeof(struct request_entry));
-        entry->uuid = uuid;
-        entry->valid = true;
-        STAILQ_INSERT_TAIL(&gRequestUUIDs, entry, entries);
+        PMDisplayRequestAdd(uuid, PMClockMonotonicNs());
         if (state == kDisplaysDim) {
             gDimRequest = uuid;
         }
     }
     if (request) {
-        [ns_state release];
         [request release];
     }
     if (err) {
@@ -501,22 +569,19 @@ void requestClamshellState(SLSClamshellState state)
         return;
     }
 
+    // Keep display and clamshell requests in the order they were made
+    PMDisplayCoalescerFlush();
+
     NSError *err = nil;
-    NSMutableDictionary *request = [[NSMutableDictionary alloc] initWithCapacity:1];
-    NSNumber *ns_state = [[NSNumber alloc] initWithUnsignedChar:state];
-    [request setValue:ns_state forKey:kSLSDisplayControlRequestClamshellState];
-    SLSDisplayControlRequestUUID uuid = [gSLPowerClient requestStateChange:(NSDictionary *const)request error:&err];
+    NSDictionary *request = copyStateRequest(true, state, -1);
+    SLSDisplayControlRequestUUID uuid = [gSLPowerClient requestStateChange:request error:&err];
     if ([err code] != 0) {
        ERROR_LOG("Clamshell requestStateChange returned error %{public}@", err);
     } else {
        INFO_LOG("requestClamshellState: state %u, Received uuid %llu", state, uuid);
-        struct request_entry *entry = (struct request_entry *)malloc(sizeof(struct request_entry));
-        entry->uuid = uuid;
-        entry->valid = true;
-        STAILQ_INSERT_TAIL(&gRequestUUIDs, entry, entries);
+        PMDisplayRequestAdd(uuid, PMClockMonotonicNs());
     }
     if (request) {
-       [ns_state release];
        [request release];
     }
     if (err) {
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <string.h>
+
+#include "PMDisplayCoalescer.h"
+#include "PrivateLib.h"
+
+static struct {
+    const PMDisplayCoalescerOps *ops;
+    uint64_t                    windowNs;
+
+    bool                        held;
+    uint64_t                    heldState;
+    int                         heldTimeout;
+
+    PMDisplayCoalescerStats     stats;
+} gCoalescer = { .windowNs = kPMDisplayCoalesceWindowNs };
+
+static void emitRequest(uint64_t state, int timeout)
+{
+    if (!gCoalescer.ops) {
+        // Nothing to send it with; PMDisplay installs ops before its first request
+        gCoalescer.stats.dropped++;
+        ERROR_LOG("Display coalescer has no ops; dropped request for state %llu\n", state);
+        return;
+    }
+
+    gCoalescer.stats.emitted++;
+    gCoalescer.ops->emit(state, timeout);
+}
+
+// Drops the held request without sending it
+static void dropHeld(void)
+{
+    gCoalescer.held = false;
+    if (gCoalescer.ops) {
+        gCoalescer.ops->disarm();
+    }
+}
+
+void PMDisplayCoalescerInit(const PMDisplayCoalescerOps *ops)
+{
+    uint64_t windowNs = gCoalescer.windowNs;
+
+    if (gCoalescer.held) {
+        dropHeld();
+    }
+    bzero(&gCoalescer, sizeof(gCoalescer));
+    gCoalescer.ops = ops;
+    gCoalescer.windowNs = windowNs;
+}
+
+void PMDisplayCoalescerSetWindow(uint64_t windowNs)
+{
+    gCoalescer.windowNs = windowNs;
+    if (!windowNs) {
+        PMDisplayCoalescerFlush();
+    }
+}
+
+void PMDisplayCoalescerSubmit(uint64_t state, int timeout, bool hold)
+{
+    gCoalescer.stats.submitted++;
+
+    if (hold && gCoalescer.windowNs && gCoalescer.ops) {
+        if (gCoalescer.held) {
+            // Window keeps running from the first held request
+            gCoalescer.stats.superseded++;
+        }
+        else {
+            gCoalescer.ops->arm(gCoalescer.windowNs);
+        }
+        gCoalescer.held = true;
+        gCoalescer.heldState = state;
+        gCoalescer.heldTimeout = timeout;
+        return;
+    }
+
+    if (gCoalescer.held) {
+        dropHeld();
+        gCoalescer.stats.superseded++;
+    }
+    emitRequest(state, timeout);
+}
+
+bool PMDisplayCoalescerHeld(uint64_t *state)
+{
+    if (gCoalescer.held && state) {
+        *state = gCoalescer.heldState;
+    }
+    return gCoalescer.held;
+}
+
+void PMDisplayCoalescerFlush(void)
+{
+    if (!gCoalescer.held) {
+        return;
+    }
+    dropHeld();
+    emitRequest(gCoalescer.heldState, gCoalescer.heldTimeout);
+}
+
+void PMDisplayCoalescerFire(void)
+{
+    if (!gCoalescer.held) {
+        return;
+    }
+    gCoalescer.held = false;
+    emitRequest(gCoalescer.heldState, gCoalescer.heldTimeout);
+}
+
+void PMDisplayCoalescerGetStats(PMDisplayCoalescerStats *stats)
+{
+    *stats = gCoalescer.stats;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMDisplayCoalescer_h
+#define PMDisplayCoalescer_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <dispatch/dispatch.h>
+
+/*
+ * Coalesces display state requests on their way to WindowServer.
+ *
+ * A request submitted with 'hold' set waits up to the coalescing window
+ * before it is sent. Anything submitted in the meantime supersedes it: a
+ * later held request replaces it, and a request that isn't held drops it
+ * and goes out right away. So a dim followed by an off within the window
+ * sends only the off.
+ *
+ * Requests that are sent go out in the order they were submitted. Only
+ * superseded requests are dropped. Callers that send anything else to
+ * WindowServer call PMDisplayCoalescerFlush() first to keep that order.
+ *
+ * The coalescer calls 'arm' to have PMDisplayCoalescerFire() called after
+ * a delay, and 'disarm' when the held request goes out or is dropped first.
+ */
+
+#define kPMDisplayCoalesceWindowNs      (50 * NSEC_PER_MSEC)
+
+typedef struct {
+    void    (*emit)(uint64_t state, int timeout);
+    void    (*arm)(uint64_t delayNs);
+    void    (*disarm)(void);
+} PMDisplayCoalescerOps;
+
+typedef struct {
+    uint64_t    submitted;
+    uint64_t    emitted;
+    uint64_t    superseded;             // Held requests dropped for a later one
+    uint64_t    dropped;                // Requests submitted with no ops installed
+} PMDisplayCoalescerStats;
+
+/*
+ * Installs 'ops' and forgets any held request and stats. Requests made
+ * while no ops are installed are logged and counted as dropped.
+ */
+__private_extern__ void PMDisplayCoalescerInit(const PMDisplayCoalescerOps *ops);
+
+/* A window of 0 sends every request right away */
+__private_extern__ void PMDisplayCoalescerSetWindow(uint64_t windowNs);
+
+__private_extern__ void PMDisplayCoalescerSubmit(uint64_t state, int timeout, bool hold);
+
+/* Returns true and the held state if a request is waiting to be sent */
+__private_extern__ bool PMDisplayCoalescerHeld(uint64_t *state);
+
+/* Sends the held request, if any, now */
+__private_extern__ void PMDisplayCoalescerFlush(void);
+
+/* Coalescing window expired */
+__private_extern__ void PMDisplayCoalescerFire(void);
+
+__private_extern__ void PMDisplayCoalescerGetStats(PMDisplayCoalescerStats *stats);
+
+#endif /* PMDisplayCoalescer_h */
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <string.h>
+
+#include "PMDisplayRequests.h"
+
+#define kRequestTableSize       (2 * kPMDisplayRequestMax)     // Power of 2
+
+typedef struct {
+    uint64_t    uuid;
+    uint64_t    seq;
+    uint64_t    timeNs;
+    uint32_t    hash;
+    bool        used;
+} requestSlot_t;
+
+typedef struct {
+    uint64_t    uuid;
+    uint64_t    seq;
+} requestOrder_t;
+
+static struct {
+    requestSlot_t   table[kRequestTableSize];
+    uint32_t        inFlight;
+
+    // Requests in the order they were made; may still name acked requests
+    requestOrder_t  order[kPMDisplayRequestMax];
+    uint32_t        orderHead;
+    uint32_t        orderCnt;
+
+    uint64_t        nextSeq;
+    uint64_t        ackedSeq;           // Newest request acked so far; older ones are superseded
+
+    PMDisplayRequestStats stats;
+} gRequests = { .nextSeq = 1 };
+
+static inline uint32_t uuidHash(uint64_t uuid)
+{
+    uuid ^= uuid >> 33;
+    uuid *= 0xff51afd7ed558ccdULL;
+    uuid ^= uuid >> 33;
+    return (uint32_t)uuid;
+}
+
+static requestSlot_t *lookupRequest(uint64_t uuid)
+{
+    uint32_t hash = uuidHash(uuid);
+    uint32_t i = hash & (kRequestTableSize - 1);
+
+    // Table is never more than half full, so there is always an empty slot
+    while (gRequests.table[i].used) {
+        if (gRequests.table[i].uuid == uuid) {
+            return &gRequests.table[i];
+        }
+        i = (i + 1) & (kRequestTableSize - 1);
+    }
+    return NULL;
+}
+
+static void removeRequest(requestSlot_t *slot)
+{
+    uint32_t i = (uint32_t)(slot - gRequests.table);
+    uint32_t j = i;
+
+    // Shift later members of the probe run back so lookups don't need tombstones
+    for (;;) {
+        uint32_t home;
+
+        j = (j + 1) & (kRequestTableSize - 1);
+        if (!gRequests.table[j].used) {
+            break;
+        }
+        home = gRequests.table[j].hash & (kRequestTableSize - 1);
+        if (((i <= j) && ((home <= i) || (home > j))) ||
+            ((i > j) && (home <= i) && (home > j))) {
+            gRequests.table[i] = gRequests.table[j];
+            i = j;
+        }
+    }
+    gRequests.table[i].used = false;
+    gRequests.inFlight--;
+}
+
+// Returns the in-flight request named by the oldest ring entry, or NULL if it is gone
+static requestSlot_t *oldestOrderSlot(void)
+{
+    requestOrder_t  *o = &gRequests.order[gRequests.orderHead];
+    requestSlot_t   *slot = lookupRequest(o->uuid);
+
+    return (slot && (slot->seq == o->seq)) ? slot : NULL;
+}
+
+static void popOrder(void)
+{
+    gRequests.orderHead = (gRequests.orderHead + 1) % kPMDisplayRequestMax;
+    gRequests.orderCnt--;
+}
+
+/*
+ * Drops ring entries for requests that were acked or re-added since, so the
+ * ring only fills up when that many requests are really in flight.
+ */
+static void compactOrder(void)
+{
+    uint32_t kept = 0;
+
+    for (uint32_t n = 0; n < gRequests.orderCnt; n++) {
+        requestOrder_t  *o = &gRequests.order[(gRequests.orderHead + n) % kPMDisplayRequestMax];
+        requestSlot_t   *slot = lookupRequest(o->uuid);
+
+        if (slot && (slot->seq == o->seq)) {
+            gRequests.order[(gRequests.orderHead + kept) % kPMDisplayRequestMax] = *o;
+            kept++;
+        }
+    }
+    gRequests.orderCnt = kept;
+}
+
+static void expireRequests(uint64_t nowNs)
+{
+    while (gRequests.orderCnt) {
+        requestSlot_t *slot = oldestOrderSlot();
+
+        if (slot) {
+            if (nowNs - slot->timeNs < kPMDisplayRequestExpiryNs) {
+                break;
+            }
+            removeRequest(slot);
+            gRequests.stats.expired++;
+        }
+        popOrder();
+    }
+}
+
+void PMDisplayRequestAdd(uint64_t uuid, uint64_t nowNs)
+{
+    requestSlot_t   *slot;
+    uint32_t        i;
+
+    expireRequests(nowNs);
+    if (gRequests.orderCnt == kPMDisplayRequestMax) {
+        compactOrder();
+    }
+    if (gRequests.orderCnt == kPMDisplayRequestMax) {
+        // Every entry is in flight; make room by evicting the oldest
+        if ((slot = oldestOrderSlot())) {
+            removeRequest(slot);
+            gRequests.stats.evicted++;
+        }
+        popOrder();
+    }
+
+    if (!(slot = lookupRequest(uuid))) {
+        uint32_t hash = uuidHash(uuid);
+
+        i = hash & (kRequestTableSize - 1);
+        while (gRequests.table[i].used) {
+            i = (i + 1) & (kRequestTableSize - 1);
+        }
+        slot = &gRequests.table[i];
+        slot->used = true;
+        slot->uuid = uuid;
+        slot->hash = hash;
+        gRequests.inFlight++;
+    }
+    slot->seq = gRequests.nextSeq++;
+    slot->timeNs = nowNs;
+
+    i = (gRequests.orderHead + gRequests.orderCnt) % kPMDisplayRequestMax;
+    gRequests.order[i].uuid = uuid;
+    gRequests.order[i].seq = slot->seq;
+    gRequests.orderCnt++;
+
+    gRequests.stats.added++;
+    if (gRequests.inFlight > gRequests.stats.maxInFlight) {
+        gRequests.stats.maxInFlight = gRequests.inFlight;
+    }
+}
+
+PMDisplayAck PMDisplayRequestAck(uint64_t uuid, uint64_t nowNs)
+{
+    requestSlot_t   *slot = lookupRequest(uuid);
+    PMDisplayAck    ack;
+
+    if (!slot) {
+        gRequests.stats.unknown++;
+        return kPMDisplayAckUnknown;
+    }
+
+    if (slot->seq < gRequests.ackedSeq) {
+        ack = kPMDisplayAckSuperseded;
+        gRequests.stats.superseded++;
+    }
+    else {
+        ack = kPMDisplayAckValid;
+        gRequests.stats.acked++;
+        gRequests.ackedSeq = slot->seq;
+    }
+    removeRequest(slot);
+    expireRequests(nowNs);
+
+    return ack;
+}
+
+uint32_t PMDisplayRequestInFlight(void)
+{
+    return gRequests.inFlight;
+}
+
+void PMDisplayRequestReset(void)
+{
+    bzero(&gRequests, sizeof(gRequests));
+    gRequests.nextSeq = 1;
+}
+
+void PMDisplayRequestGetStats(PMDisplayRequestStats *stats)
+{
+    *stats = gRequests.stats;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMDisplayRequests_h
+#define PMDisplayRequests_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <dispatch/dispatch.h>
+
+/*
+ * Tracks display and clamshell state requests sent to WindowServer until
+ * they are acknowledged.
+ *
+ * In-flight requests live in a preallocated open-addressed table keyed by
+ * request UUID, so adding and acknowledging a request costs one probe
+ * sequence and no allocation. Requests are also kept in a ring in the order
+ * they were made:
+ *  - Acknowledging a request supersedes every request made before it.
+ *    WindowServer never acks a dim that is overridden by an undim before
+ *    the dim timer fires.
+ *  - Requests older than kPMDisplayRequestExpiryNs are dropped from the
+ *    oldest end of the ring, so requests that are never acked don't pile up.
+ *  - When the ring is full, entries for requests that are no longer in
+ *    flight are dropped from it first. Only when kPMDisplayRequestMax
+ *    requests are really in flight is the oldest one evicted.
+ *
+ * Expiry is checked against the 'nowNs' given to each add or ack; nothing
+ * is dropped between calls.
+ */
+
+#define kPMDisplayRequestMax            64
+#define kPMDisplayRequestExpiryNs       (60ULL * NSEC_PER_SEC)
+
+typedef enum {
+    kPMDisplayAckValid = 0,
+    kPMDisplayAckSuperseded,            // A later request was acked first
+    kPMDisplayAckUnknown                // Never added, or dropped already
+} PMDisplayAck;
+
+typedef struct {
+    uint64_t    added;
+    uint64_t    acked;
+    uint64_t    superseded;             // Acked after a later request
+    uint64_t    unknown;
+    uint64_t    expired;                // Dropped after kPMDisplayRequestExpiryNs
+    uint64_t    evicted;                // Dropped to make room
+    uint32_t    maxInFlight;
+} PMDisplayRequestStats;
+
+__private_extern__ void PMDisplayRequestAdd(uint64_t uuid, uint64_t nowNs);
+__private_extern__ PMDisplayAck PMDisplayRequestAck(uint64_t uuid, uint64_t nowNs);
+__private_extern__ uint32_t PMDisplayRequestInFlight(void);
+
+/* Forgets all requests and stats */
+__private_extern__ void PMDisplayRequestReset(void);
+
+__private_extern__ void PMDisplayRequestGetStats(PMDisplayRequestStats *stats);
+
+#endif /* PMDisplayRequests_h */
@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <IOKit/IOKitLib.h>
+#include <Block.h>
+#include <IOReport.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "PMIOReportSampler.h"
+#include "PMClock.h"
+#include "PrivateLib.h"
+
+#define kMaxHistoryDepth        256
+
+typedef struct {
+    bool                subscribed;
+    bool                haveRaw;
+    uint64_t            driverID;
+    uint64_t            channelID;
+    uint64_t            unit;
+
+    PMIOReportCounters  raw;            // Cumulative counters from the previous sample
+
+    PMIOReportDelta     total;
+    PMIOReportDelta     *history;       // Ring of config.historyDepth deltas
+    uint32_t            historyNext;
+    uint32_t            historyCount;
+} samplerChannel_t;
+
+struct PMIOReportSampler {
+    PMIOReportSamplerConfig     config;
+    IOReportSubscriptionRef     subscription;
+    CFMutableDictionaryRef      subscribedChannels;
+    bool                        (^reader)(uint32_t index, PMIOReportCounters *counters);
+    PMTimerRef                  timer;
+    void                        (^handler)(PMIOReportSamplerRef sampler);
+    samplerChannel_t            channels[];
+};
+
+static int32_t channelIndexForName(const PMIOReportSamplerConfig *config, CFStringRef name)
+{
+    if (!name) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < config->channelCount; i++) {
+        if (CFStringCompare(name, config->channelNames[i], kCFCompareCaseInsensitive) == kCFCompareEqualTo) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+static samplerChannel_t *channelForSample(PMIOReportSamplerRef s, IOReportSampleRef spl)
+{
+    uint64_t driverID = IOReportChannelGetDriverID(spl);
+    uint64_t channelID = IOReportChannelGetChannelID(spl);
+
+    for (uint32_t i = 0; i < s->config.channelCount; i++) {
+        samplerChannel_t *ch = &s->channels[i];
+        if (ch->subscribed && (ch->channelID == channelID) && (ch->driverID == driverID)) {
+            return ch;
+        }
+    }
+    return NULL;
+}
+
+/* Counters may be reset underneath us, e.g. when the driver restarts */
+static inline uint64_t counterDelta(uint64_t prev, uint64_t cur)
+{
+    return (cur >= prev) ? (cur - prev) : cur;
+}
+
+static bool subscribe(PMIOReportSamplerRef s)
+{
+    const PMIOReportSamplerConfig   *config = &s->config;
+    CFMutableDictionaryRef          matching = NULL;
+    CFMutableDictionaryRef          channels = NULL;
+    bool                            found = false;
+
+    matching = IOServiceMatching(config->driverClass);
+    if (!matching) {
+        goto exit;
+    }
+
+    channels = IOReportCopyChannelsForDrivers(matching, kIOReportOptGroupSubs, NULL);
+    if (!channels) {
+        ERROR_LOG("Failed to copy IOReport channels for %s\n", config->driverClass);
+        goto exit;
+    }
+
+    // Channel names are only compared here, never when sampling
+    IOReportPrune(channels, (IOReportIteratorBlock)^(IOReportChannelRef ch) {
+        if (config->categories && !(IOReportChannelGetCategories(ch) & config->categories)) {
+            return kIOReportIterSkipped;
+        }
+        if (channelIndexForName(config, IOReportChannelGetChannelName(ch)) < 0) {
+            return kIOReportIterSkipped;
+        }
+        return kIOReportIterOk;
+    });
+    if (IOReportGetChannelCount(channels) == 0) {
+        DEBUG_LOG("No matching IOReport channels on %s\n", config->driverClass);
+        goto exit;
+    }
+
+    s->subscription = IOReportCreateSubscription(NULL, channels, &s->subscribedChannels, kIOReportSubOptsNone, NULL);
+    if (!s->subscription || !s->subscribedChannels) {
+        ERROR_LOG("Failed to subscribe to IOReport channels on %s\n", config->driverClass);
+        goto exit;
+    }
+
+    IOReportIterate(s->subscribedChannels, (IOReportIteratorBlock)^(IOReportChannelRef ch) {
+        int32_t idx = channelIndexForName(config, IOReportChannelGetChannelName(ch));
+        if ((idx >= 0) && !s->channels[idx].subscribed) {
+            s->channels[idx].subscribed = true;
+            s->channels[idx].driverID = IOReportChannelGetDriverID(ch);
+            s->channels[idx].channelID = IOReportChannelGetChannelID(ch);
+            s->channels[idx].unit = IOReportChannelGetUnit(ch);
+            INFO_LOG("Sampling IOReport channel %@\n", IOReportChannelGetChannelName(ch));
+        }
+        return kIOReportIterOk;
+    });
+    found = true;
+
+exit:
+    if (channels) CFRelease(channels);
+    if (matching) CFRelease(matching);
+    return found;
+}
+
+static void samplerFree(PMIOReportSamplerRef s)
+{
+    for (uint32_t i = 0; i < s->config.channelCount; i++) {
+        if (s->channels[i].history) free(s->channels[i].history);
+    }
+    if (s->subscribedChannels) CFRelease(s->subscribedChannels);
+    if (s->subscription) CFRelease(s->subscription);
+    if (s->reader) Block_release(s->reader);
+    free(s);
+}
+
+static PMIOReportSamplerRef samplerAlloc(const PMIOReportSamplerConfig *config)
+{
+    PMIOReportSamplerRef s;
+
+    s = calloc(1, sizeof(struct PMIOReportSampler) + config->channelCount * sizeof(samplerChannel_t));
+    if (!s) {
+        return NULL;
+    }
+    s->config = *config;
+    if (s->config.historyDepth > kMaxHistoryDepth) {
+        s->config.historyDepth = kMaxHistoryDepth;
+    }
+    if (s->config.historyDepth == 0) {
+        s->config.historyDepth = 1;
+    }
+
+    for (uint32_t i = 0; i < config->channelCount; i++) {
+        s->channels[i].history = calloc(s->config.historyDepth, sizeof(PMIOReportDelta));
+        if (!s->channels[i].history) {
+            samplerFree(s);
+            return NULL;
+        }
+    }
+
+    return s;
+}
+
+PMIOReportSamplerRef PMIOReportSamplerCreate(const PMIOReportSamplerConfig *config)
+{
+    PMIOReportSamplerRef s;
+
+    if (!config || !config->driverClass || !config->channelNames || !config->channelCount || !config->queue) {
+        return NULL;
+    }
+
+    s = samplerAlloc(config);
+    if (!s) {
+        return NULL;
+    }
+
+    if (!subscribe(s)) {
+        samplerFree(s);
+        return NULL;
+    }
+
+    // Names are only needed to resolve channels
+    s->config.channelNames = NULL;
+
+    // Baseline, so that the first interval only reports what happened during it
+    PMIOReportSamplerSampleNow(s);
+    return s;
+}
+
+PMIOReportSamplerRef PMIOReportSamplerCreateWithReader(const PMIOReportSamplerConfig *config,
+                                                       bool (^reader)(uint32_t index, PMIOReportCounters *counters))
+{
+    PMIOReportSamplerRef s;
+
+    if (!config || !config->channelCount || !config->queue || !reader) {
+        return NULL;
+    }
+
+    s = samplerAlloc(config);
+    if (!s) {
+        return NULL;
+    }
+    s->config.channelNames = NULL;
+    s->reader = Block_copy(reader);
+    for (uint32_t i = 0; i < config->channelCount; i++) {
+        s->channels[i].subscribed = true;
+    }
+
+    PMIOReportSamplerSampleNow(s);
+    return s;
+}
+
+static void recordCounters(samplerChannel_t *ch, const PMIOReportCounters *cur, uint32_t historyDepth)
+{
+    PMIOReportDelta     delta;
+
+    bzero(&delta, sizeof(delta));
+    delta.valid = cur->valid;
+
+    if (ch->haveRaw) {
+        delta.value = cur->value - ch->raw.value;
+        delta.stateCount = cur->stateCount;
+        for (uint32_t i = 0; i < cur->stateCount; i++) {
+            delta.residencyMs[i] = counterDelta(ch->raw.residencyMs[i], cur->residencyMs[i]);
+            delta.transitions[i] = counterDelta(ch->raw.transitions[i], cur->transitions[i]);
+        }
+
+        ch->history[ch->historyNext] = delta;
+        ch->historyNext = (ch->historyNext + 1) % historyDepth;
+        if (ch->historyCount < historyDepth) {
+            ch->historyCount++;
+        }
+
+        if (delta.valid) {
+            ch->total.valid = true;
+            ch->total.value += delta.value;
+            ch->total.stateCount = cur->stateCount;
+            for (uint32_t i = 0; i < cur->stateCount; i++) {
+                ch->total.residencyMs[i] += delta.residencyMs[i];
+                ch->total.transitions[i] += delta.transitions[i];
+            }
+        }
+    }
+
+    ch->raw = *cur;
+    ch->haveRaw = true;
+}
+
+static void readSample(samplerChannel_t *ch, IOReportSampleRef spl, PMIOReportCounters *cur)
+{
+    bzero(cur, sizeof(*cur));
+    cur->valid = true;
+
+    switch (IOReportChannelGetFormat(spl)) {
+        case kIOReportFormatSimple:
+            cur->value = IOReportSimpleGetIntegerValue(spl, NULL);
+            break;
+
+        case kIOReportFormatState:
+            cur->stateCount = (uint32_t)IOReportStateGetCount(spl);
+            if (cur->stateCount > kPMIOReportSamplerMaxStates) {
+                cur->stateCount = kPMIOReportSamplerMaxStates;
+            }
+            for (uint32_t i = 0; i < cur->stateCount; i++) {
+                cur->residencyMs[i] = IOReportScaleValue(IOReportStateGetResidency(spl, i), ch->unit, kIOReportUnit_ms);
+                cur->transitions[i] = IOReportStateGetInTransitions(spl, i);
+                if (cur->transitions[i] == kIOReportInvalidValue) {
+                    cur->valid = false;
+                    cur->transitions[i] = 0;
+                }
+            }
+            break;
+
+        default:
+            cur->valid = false;
+            break;
+    }
+}
+
+bool PMIOReportSamplerSampleNow(PMIOReportSamplerRef s)
+{
+    CFDictionaryRef samples;
+
+    if (!s) {
+        return false;
+    }
+
+    if (s->reader) {
+        for (uint32_t i = 0; i < s->config.channelCount; i++) {
+            PMIOReportCounters cur;
+
+            bzero(&cur, sizeof(cur));
+            if (s->reader(i, &cur)) {
+                recordCounters(&s->channels[i], &cur, s->config.historyDepth);
+            }
+        }
+        return true;
+    }
+
+    if (!s->subscription) {
+        return false;
+    }
+
+    samples = IOReportCreateSamples(s->subscription, s->subscribedChannels, NULL);
+    if (!samples) {
+        ERROR_LOG("Failed to sample IOReport channels on %s\n", s->config.driverClass);
+        return false;
+    }
+
+    IOReportIterate(samples, (IOReportIteratorBlock)^(IOReportSampleRef spl) {
+        samplerChannel_t    *ch = channelForSample(s, spl);
+        PMIOReportCounters  cur;
+
+        if (ch) {
+            readSample(ch, spl, &cur);
+            recordCounters(ch, &cur, s->config.historyDepth);
+        }
+        return kIOReportIterOk;
+    });
+
+    CFRelease(samples);
+    return true;
+}
+
+void PMIOReportSamplerStart(PMIOReportSamplerRef s, void (^handler)(PMIOReportSamplerRef sampler))
+{
+    CFTimeInterval interval;
+
+    if (!s || s->timer || !s->config.intervalNs) {
+        return;
+    }
+
+    if (handler) {
+        s->handler = Block_copy(handler);
+    }
+    interval = (CFTimeInterval)s->config.intervalNs / NSEC_PER_SEC;
+
+    // Re-armed by wall clock date on every firing, so that time spent asleep counts
+    s->timer = PMTimerCreate(s->config.queue, ^{
+        PMTimerScheduleAtDate(s->timer, PMClockAbsoluteTime() + interval);
+        if (PMIOReportSamplerSampleNow(s) && s->handler) {
+            s->handler(s);
+        }
+    });
+    if (!s->timer) {
+        return;
+    }
+    PMTimerScheduleAtDate(s->timer, PMClockAbsoluteTime() + interval);
+}
+
+void PMIOReportSamplerDestroy(PMIOReportSamplerRef s)
+{
+    if (!s) {
+        return;
+    }
+    if (s->timer) {
+        PMTimerCancel(s->timer);
+    }
+    if (s->handler) {
+        Block_release(s->handler);
+    }
+    samplerFree(s);
+}
+
+bool PMIOReportSamplerHasChannel(PMIOReportSamplerRef s, uint32_t index)
+{
+    return (s && (index < s->config.channelCount) && s->channels[index].subscribed);
+}
+
+bool PMIOReportSamplerGetLastDelta(PMIOReportSamplerRef s, uint32_t index, PMIOReportDelta *delta)
+{
+    samplerChannel_t *ch;
+
+    if (!PMIOReportSamplerHasChannel(s, index) || !delta) {
+        return false;
+    }
+    ch = &s->channels[index];
+    if (!ch->historyCount) {
+        return false;
+    }
+    *delta = ch->history[(ch->historyNext + s->config.historyDepth - 1) % s->config.historyDepth];
+    return true;
+}
+
+bool PMIOReportSamplerGetTotal(PMIOReportSamplerRef s, uint32_t index, PMIOReportDelta *total)
+{
+    if (!PMIOReportSamplerHasChannel(s, index) || !total) {
+        return false;
+    }
+    *total = s->channels[index].total;
+    return total->valid;
+}
+
+void PMIOReportSamplerResetTotals(PMIOReportSamplerRef s)
+{
+    if (!s) {
+        return;
+    }
+    for (uint32_t i = 0; i < s->config.channelCount; i++) {
+        bzero(&s->channels[i].total, sizeof(PMIOReportDelta));
+    }
+}
+
+static int compareInt64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+bool PMIOReportSamplerGetQuantile(PMIOReportSamplerRef s, uint32_t index,
+                                  PMIOReportField field, uint32_t state,
+                                  double q, int64_t *result)
+{
+    int64_t             values[kMaxHistoryDepth];
+    uint32_t            n = 0;
+    uint32_t            rank;
+    samplerChannel_t    *ch;
+
+    if (!PMIOReportSamplerHasChannel(s, index) || !result || (q < 0.0) || (q > 1.0)) {
+        return false;
+    }
+    if ((field != kPMIOReportFieldValue) && (state >= kPMIOReportSamplerMaxStates)) {
+        return false;
+    }
+
+    ch = &s->channels[index];
+    for (uint32_t i = 0; i < ch->historyCount; i++) {
+        PMIOReportDelta *d = &ch->history[i];
+        if (!d->valid) {
+            continue;
+        }
+        switch (field) {
+            case kPMIOReportFieldValue:
+                values[n++] = d->value;
+                break;
+            case kPMIOReportFieldResidency:
+                values[n++] = (int64_t)d->residencyMs[state];
+                break;
+            case kPMIOReportFieldTransitions:
+                values[n++] = (int64_t)d->transitions[state];
+                break;
+        }
+    }
+    if (!n) {
+        return false;
+    }
+
+    // Nearest rank
+    qsort(values, n, sizeof(values[0]), compareInt64);
+    rank = (uint32_t)ceil(q * n);
+    *result = values[rank ? rank - 1 : 0];
+    return true;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMIOReportSampler_h
+#define PMIOReportSampler_h
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+
+/*
+ * Periodic IOReport sampler.
+ *
+ * Subscribes once to a configured set of channels and, on every interval,
+ * folds the kernel's cumulative counters into per-channel deltas kept in a
+ * fixed-size ring. No sample dictionaries are retained between intervals;
+ * consumers read typed deltas, running totals and quantiles instead of
+ * re-sampling IOReport themselves.
+ */
+
+#define kPMIOReportSamplerMaxStates     4
+
+typedef struct PMIOReportSampler *PMIOReportSamplerRef;
+
+/*
+ * Change in one channel over one sampling interval.
+ * Simple channels only use 'value'. State channels use 'residencyMs' and
+ * 'transitions' (entries into each state) for up to
+ * kPMIOReportSamplerMaxStates states.
+ */
+typedef struct {
+    int64_t         value;
+    uint64_t        residencyMs[kPMIOReportSamplerMaxStates];
+    uint64_t        transitions[kPMIOReportSamplerMaxStates];
+    uint32_t        stateCount;
+    bool            valid;
+} PMIOReportDelta;
+
+typedef enum {
+    kPMIOReportFieldValue = 0,
+    kPMIOReportFieldResidency,
+    kPMIOReportFieldTransitions
+} PMIOReportField;
+
+typedef struct {
+    const char      *driverClass;       // IOService class publishing the channels, e.g. "IOPMGR"
+    uint64_t        categories;         // kIOReportCategory* mask; 0 for any
+    const CFStringRef *channelNames;    // Channels to sample, matched case-insensitively. Only used by Create
+    uint32_t        channelCount;
+    uint64_t        intervalNs;         // 0 to sample only on PMIOReportSamplerSampleNow()
+    uint32_t        historyDepth;       // Deltas kept per channel for quantiles
+    dispatch_queue_t queue;             // Timer and callback queue
+} PMIOReportSamplerConfig;
+
+/*
+ * Returns NULL if none of the configured channels could be subscribed to.
+ * Channel indices used below follow config->channelNames.
+ */
+__private_extern__ PMIOReportSamplerRef PMIOReportSamplerCreate(const PMIOReportSamplerConfig *config);
+
+/*
+ * Cumulative counters of one channel at one point in time. Residency is in
+ * ms; IOReport samples are converted from the channel's own unit.
+ */
+typedef struct {
+    int64_t         value;
+    uint64_t        residencyMs[kPMIOReportSamplerMaxStates];
+    uint64_t        transitions[kPMIOReportSamplerMaxStates];
+    uint32_t        stateCount;
+    bool            valid;
+} PMIOReportCounters;
+
+/*
+ * Same as PMIOReportSamplerCreate(), but counters come from 'reader' instead
+ * of an IOReport subscription, e.g. to run the sampler on the virtual clock.
+ * 'reader' fills in the counters of channel 'index' and returns false if the
+ * channel has nothing to report. config->driverClass and channelNames are
+ * not used.
+ */
+__private_extern__ PMIOReportSamplerRef PMIOReportSamplerCreateWithReader(const PMIOReportSamplerConfig *config,
+                                                                          bool (^reader)(uint32_t index, PMIOReportCounters *counters));
+
+/*
+ * Starts periodic sampling on a PMClock wall clock timer, so that time spent
+ * asleep counts. 'handler' runs on config->queue after each interval's deltas
+ * have been recorded.
+ */
+__private_extern__ void PMIOReportSamplerStart(PMIOReportSamplerRef sampler, void (^handler)(PMIOReportSamplerRef sampler));
+
+/* Stops sampling and frees the sampler. Must be called on config->queue. */
+__private_extern__ void PMIOReportSamplerDestroy(PMIOReportSamplerRef sampler);
+
+/* Takes a sample right away. Must be called on config->queue. */
+__private_extern__ bool PMIOReportSamplerSampleNow(PMIOReportSamplerRef sampler);
+
+/* Whether channel 'index' was found when subscribing. */
+__private_extern__ bool PMIOReportSamplerHasChannel(PMIOReportSamplerRef sampler, uint32_t index);
+
+/* Delta for channel 'index' over the most recent interval. */
+__private_extern__ bool PMIOReportSamplerGetLastDelta(PMIOReportSamplerRef sampler, uint32_t index, PMIOReportDelta *delta);
+
+/* Sum of the deltas for channel 'index' since creation or the last reset. */
+__private_extern__ bool PMIOReportSamplerGetTotal(PMIOReportSamplerRef sampler, uint32_t index, PMIOReportDelta *total);
+__private_extern__ void PMIOReportSamplerResetTotals(PMIOReportSamplerRef sampler);
+
+/*
+ * 'q' quantile (0.0 - 1.0) of 'field' for 'state' over the retained
+ * per-interval deltas of channel 'index'. 'state' is ignored for
+ * kPMIOReportFieldValue.
+ */
+__private_extern__ bool PMIOReportSamplerGetQuantile(PMIOReportSamplerRef sampler, uint32_t index,
+                                                     PMIOReportField field, uint32_t state,
+                                                     double q, int64_t *result);
+
+#endif /* PMIOReportSampler_h */
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdlib.h>
+
+#include "PMIntern.h"
+#include "PrivateLib.h"
+
+typedef struct {
+    CFStringRef     str;            // NULL when the entry is free
+    uint32_t        refCnt;
+    uint32_t        nextFree;       // 1-based index of the next free entry
+} internEntry_t;
+
+static internEntry_t            *gInternEntries = NULL;
+static uint32_t                 gInternCapacity = 0;
+static uint32_t                 gInternFree = 0;        // 1-based head of the free list
+static uint32_t                 gInternCnt = 0;
+static uint64_t                 gInternRefs = 0;
+static CFMutableDictionaryRef   gInternIDs = NULL;      // CFString -> ID
+
+static inline internEntry_t *internEntry(PMInternID id)
+{
+    if ((id == kPMInternNone) || (id > gInternCapacity) || !gInternEntries[id - 1].str) {
+        return NULL;
+    }
+    return &gInternEntries[id - 1];
+}
+
+static PMInternID allocInternEntry(void)
+{
+    PMInternID id;
+
+    if (!gInternFree) {
+        uint32_t        capacity = gInternCapacity ? (gInternCapacity * 2) : 256;
+        internEntry_t   *entries = realloc(gInternEntries, capacity * sizeof(internEntry_t));
+
+        if (!entries) {
+            return kPMInternNone;
+        }
+        for (uint32_t i = capacity; i > gInternCapacity; i--) {
+            entries[i - 1].str = NULL;
+            entries[i - 1].refCnt = 0;
+            entries[i - 1].nextFree = gInternFree;
+            gInternFree = i;
+        }
+        gInternEntries = entries;
+        gInternCapacity = capacity;
+    }
+
+    id = gInternFree;
+    gInternFree = gInternEntries[id - 1].nextFree;
+    return id;
+}
+
+PMInternID PMInternString(CFTypeRef str)
+{
+    const void  *value = NULL;
+    PMInternID  id;
+
+    if (!isA_CFString(str)) {
+        return kPMInternNone;
+    }
+    if (!gInternIDs) {
+        gInternIDs = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        if (!gInternIDs) {
+            return kPMInternNone;
+        }
+    }
+
+    if (CFDictionaryGetValueIfPresent(gInternIDs, str, &value)) {
+        id = (PMInternID)(uintptr_t)value;
+        gInternEntries[id - 1].refCnt++;
+        gInternRefs++;
+        return id;
+    }
+
+    if ((id = allocInternEntry()) == kPMInternNone) {
+        ERROR_LOG("Failed to grow the string table\n");
+        return kPMInternNone;
+    }
+    // Keep an immutable copy; clients may hand in mutable strings
+    if (!(gInternEntries[id - 1].str = CFStringCreateCopy(0, str))) {
+        gInternEntries[id - 1].nextFree = gInternFree;
+        gInternFree = id;
+        return kPMInternNone;
+    }
+    gInternEntries[id - 1].refCnt = 1;
+    CFDictionarySetValue(gInternIDs, gInternEntries[id - 1].str, (const void *)(uintptr_t)id);
+    gInternCnt++;
+    gInternRefs++;
+
+    return id;
+}
+
+void PMInternRetain(PMInternID id)
+{
+    internEntry_t *e = internEntry(id);
+
+    if (e) {
+        e->refCnt++;
+        gInternRefs++;
+    }
+}
+
+void PMInternRelease(PMInternID id)
+{
+    internEntry_t *e = internEntry(id);
+
+    if (!e) {
+        return;
+    }
+    gInternRefs--;
+    if (--e->refCnt) {
+        return;
+    }
+
+    CFDictionaryRemoveValue(gInternIDs, e->str);
+    CFRelease(e->str);
+    e->str = NULL;
+    e->nextFree = gInternFree;
+    gInternFree = id;
+    gInternCnt--;
+}
+
+CFStringRef PMInternGetString(PMInternID id)
+{
+    internEntry_t *e = internEntry(id);
+
+    return e ? e->str : NULL;
+}
+
+bool PMInternSet(PMInternID *slot, CFTypeRef str)
+{
+    PMInternID id = PMInternString(str);
+
+    PMInternRelease(*slot);
+    *slot = id;
+    return (id != kPMInternNone);
+}
+
+void PMInternGetStats(uint32_t *strings, uint64_t *references)
+{
+    if (strings) {
+        *strings = gInternCnt;
+    }
+    if (references) {
+        *references = gInternRefs;
+    }
+}
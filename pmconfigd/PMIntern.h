@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+#ifndef PMIntern_h
+#define PMIntern_h
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * Reference counted table of strings shared by assertions.
+ *
+ * Assertion names, types, details and bundle paths repeat across the
+ * assertions a process creates. Each distinct string is kept once and
+ * assertions hold a 32-bit ID for it instead of their own CFString.
+ */
+typedef uint32_t PMInternID;
+
+#define kPMInternNone           0
+
+/*
+ * Returns the ID for 'str' with one reference taken, adding it to the table
+ * if needed. Returns kPMInternNone if 'str' is not a CFString.
+ */
+__private_extern__ PMInternID PMInternString(CFTypeRef str);
+
+__private_extern__ void PMInternRetain(PMInternID id);
+__private_extern__ void PMInternRelease(PMInternID id);
+
+/* Not retained; valid while a reference to 'id' is held. NULL for kPMInternNone */
+__private_extern__ CFStringRef PMInternGetString(PMInternID id);
+
+/*
+ * Replaces the ID in '*slot' with the one for 'str', releasing the old one.
+ * Returns false, leaving '*slot' empty, if 'str' is not a CFString.
+ */
+__private_extern__ bool PMInternSet(PMInternID *slot, CFTypeRef str);
+
+/* Distinct strings in the table and the references held on them */
+__private_extern__ void PMInternGetStats(uint32_t *strings, uint64_t *references);
+
+#endif /* PMIntern_h */
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <math.h>
+
+#include "PMLingerPolicy.h"
+#include "PrivateLib.h"
+
+#define kLingerHistoryLen       16
+#define kLingerWarmupCnt        4       // Lingers to see before shortening any
+#define kLingerFloorSecs        2
+#define kLingerSlackSecs        2
+
+typedef enum {
+    kLingerUnused = 0,
+    kLingerUserReturned,
+    kLingerWorkDone
+} lingerOutcome_e;
+
+typedef struct {
+    uint8_t             outcome;
+    uint8_t             usedSecs;       // Seconds of the linger that were needed
+} lingerRecord_t;
+
+static struct {
+    lingerRecord_t      history[kLingerHistoryLen];
+    uint32_t            next;
+    uint32_t            cnt;
+
+    // Linger whose outcome isn't known yet
+    bool                pending;
+    bool                workAtStart;
+    bool                workDone;
+    bool                slept;
+    CFAbsoluteTime      start;
+    uint32_t            granted;
+    uint32_t            maxSecs;
+    uint32_t            workSecs;       // How long the work ran into the linger; 0 if unknown
+
+    PMLingerStats       stats;
+} gLinger;
+
+static void recordOutcome(lingerOutcome_e outcome, uint32_t usedSecs)
+{
+    lingerRecord_t *r = &gLinger.history[gLinger.next];
+
+    r->outcome = outcome;
+    r->usedSecs = (usedSecs > UINT8_MAX) ? UINT8_MAX : usedSecs;
+    gLinger.next = (gLinger.next + 1) % kLingerHistoryLen;
+    if (gLinger.cnt < kLingerHistoryLen) {
+        gLinger.cnt++;
+    }
+}
+
+// Closes the pending linger when the user didn't come back within its window
+static void closePendingLinger(void)
+{
+    if (!gLinger.pending) {
+        return;
+    }
+    if (gLinger.workDone) {
+        // Without a finish time, assume the work needed the longest linger
+        recordOutcome(kLingerWorkDone, gLinger.workSecs ? gLinger.workSecs : gLinger.maxSecs);
+    }
+    else {
+        recordOutcome(kLingerUnused, 0);
+    }
+    gLinger.pending = false;
+}
+
+static uint32_t chooseDuration(uint32_t maxSecs)
+{
+    uint32_t used = 0;
+    uint32_t secs;
+
+    if (gLinger.cnt < kLingerWarmupCnt) {
+        return maxSecs;
+    }
+    for (uint32_t i = 0; i < gLinger.cnt; i++) {
+        if ((gLinger.history[i].outcome != kLingerUnused) && (gLinger.history[i].usedSecs > used)) {
+            used = gLinger.history[i].usedSecs;
+        }
+    }
+
+    secs = used ? (used + kLingerSlackSecs) : kLingerFloorSecs;
+    if (secs < kLingerFloorSecs) {
+        secs = kLingerFloorSecs;
+    }
+    return (secs < maxSecs) ? secs : maxSecs;
+}
+
+uint32_t PMLingerPolicyBegin(const PMLingerRequest *req, CFAbsoluteTime now)
+{
+    uint32_t secs;
+
+    closePendingLinger();
+
+    // Don't linger if:
+    //      user wasn't active in last full wake, or
+    //      this is an emergency sleep, or
+    //      user has set linger duration to 0, or
+    //      this is a clamshell close sleep on a machine without background tasks
+    if (!req->userWasActive || req->emergencySleep || (req->maxSecs == 0) ||
+        (!req->btCapable && req->clamshellSleep)) {
+        return 0;
+    }
+
+    secs = chooseDuration(req->maxSecs);
+
+    gLinger.pending = true;
+    gLinger.workAtStart = req->workPending;
+    gLinger.workDone = false;
+    gLinger.workSecs = 0;
+    gLinger.slept = false;
+    gLinger.start = now;
+    gLinger.granted = secs;
+    gLinger.maxSecs = req->maxSecs;
+
+    gLinger.stats.lingerCnt++;
+    gLinger.stats.lingerSecs += secs;
+    if (secs < req->maxSecs) {
+        gLinger.stats.shortenedCnt++;
+    }
+    return secs;
+}
+
+void PMLingerPolicySleep(bool workPending)
+{
+    if (!gLinger.pending || gLinger.slept) {
+        return;
+    }
+    gLinger.slept = true;
+    if (gLinger.workAtStart && !workPending) {
+        gLinger.workDone = true;
+        gLinger.stats.workDoneCnt++;
+    }
+}
+
+void PMLingerPolicyWorkDone(CFAbsoluteTime now)
+{
+    CFTimeInterval  elapsed;
+
+    if (!gLinger.pending || !gLinger.workAtStart || gLinger.slept || gLinger.workSecs) {
+        return;
+    }
+
+    elapsed = now - gLinger.start;
+    if (elapsed < 0) {
+        return;
+    }
+    gLinger.workSecs = (elapsed > gLinger.maxSecs) ? gLinger.maxSecs : (uint32_t)ceil(elapsed);
+    if (!gLinger.workSecs) {
+        gLinger.workSecs = 1;
+    }
+}
+
+void PMLingerPolicyUserReturned(CFAbsoluteTime now)
+{
+    CFTimeInterval  elapsed;
+
+    if (!gLinger.pending) {
+        return;
+    }
+
+    elapsed = now - gLinger.start;
+    if ((elapsed < 0) || (elapsed > gLinger.maxSecs)) {
+        closePendingLinger();
+        return;
+    }
+
+    if (gLinger.slept) {
+        gLinger.stats.returnsMissed++;
+    }
+    else {
+        gLinger.stats.returnsCaught++;
+    }
+    recordOutcome(kLingerUserReturned, (uint32_t)ceil(elapsed));
+    gLinger.pending = false;
+}
+
+void PMLingerPolicyReset(void)
+{
+    bzero(&gLinger, sizeof(gLinger));
+}
+
+void PMLingerPolicyGetStats(PMLingerStats *stats)
+{
+    *stats = gLinger.stats;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMLingerPolicy_h
+#define PMLingerPolicy_h
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * Picks how long to linger in darkwake after a FullWake --> DarkWake
+ * transition.
+ *
+ * The configured linger duration is an upper bound. The policy remembers how
+ * the last few lingers were used: whether the user came back within that
+ * bound, and how soon, and whether background work that was running when the
+ * linger started finished before the system slept. The next linger is made
+ * just long enough to cover the longest recent use. When recent lingers went
+ * unused it falls back to a short floor. A user coming back soon after the
+ * system slept counts as a use too, so a linger that turned out too short
+ * grows again.
+ *
+ * Uses are measured between the 'now' passed to PMLingerPolicyBegin() and the
+ * one passed when the work finishes or the user returns.
+ */
+
+typedef struct {
+    bool            userWasActive;      // User was active during the last full wake
+    bool            emergencySleep;
+    bool            clamshellSleep;
+    bool            btCapable;          // Background tasks can run in darkwake
+    bool            workPending;        // Background work is running now
+    uint32_t        maxSecs;            // Configured linger duration; 0 disables lingering
+} PMLingerRequest;
+
+typedef struct {
+    uint64_t        lingerCnt;
+    uint64_t        lingerSecs;         // Sum of granted durations
+    uint64_t        shortenedCnt;       // Lingers granted less than maxSecs
+    uint64_t        returnsCaught;      // User came back while still lingering
+    uint64_t        returnsMissed;      // User came back within maxSecs, but after the linger
+    uint64_t        workDoneCnt;        // Background work finished before sleep
+} PMLingerStats;
+
+/*
+ * Returns the number of seconds to linger for 'req', or 0 if the system
+ * should not linger. A nonzero return starts tracking a new linger.
+ */
+__private_extern__ uint32_t PMLingerPolicyBegin(const PMLingerRequest *req, CFAbsoluteTime now);
+
+/* System is going to sleep. 'workPending' is true if background work is still running */
+__private_extern__ void PMLingerPolicySleep(bool workPending);
+
+/*
+ * Background work that was running when the linger started has finished.
+ * Lets the policy record how long the work needed instead of the whole linger.
+ */
+__private_extern__ void PMLingerPolicyWorkDone(CFAbsoluteTime now);
+
+/* System went to full wake for the user */
+__private_extern__ void PMLingerPolicyUserReturned(CFAbsoluteTime now);
+
+/* Forgets history and stats */
+__private_extern__ void PMLingerPolicyReset(void);
+
+__private_extern__ void PMLingerPolicyGetStats(PMLingerStats *stats);
+
+#endif /* PMLingerPolicy_h */
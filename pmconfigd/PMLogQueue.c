@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <dispatch/dispatch.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <asl.h>
+
+#include "PMLogQueue.h"
+#include "PMClock.h"
+#include "PrivateLib.h"
+
+#define kLogRecordCnt           64      // One bit each in gFreeRecords
+#define kLogRecordHeap          UINT32_MAX  // 'index' of a record allocated outside the pool
+#define kLogRecordMaxFields     24
+#define kLogRecordBufSize       1024
+
+struct pmLogRecord {
+    PMLogCategory   category;
+    uint32_t        index;
+    struct timespec time;           // Wall clock at pmlog_new()
+    uint16_t        fieldCnt;
+    uint16_t        used;
+    struct {
+        uint16_t    key;
+        uint16_t    value;
+    } fields[kLogRecordMaxFields];
+    char            buf[kLogRecordBufSize];
+};
+
+typedef struct {
+    const char          *name;
+    uint32_t            perSecLimit;    // 0 for no limit
+    bool                exempt;         // Never dropped; uses the heap when the pool is empty
+    _Atomic uint64_t    window;         // Monotonic second the count belongs to
+    _Atomic uint32_t    count;
+    _Atomic uint32_t    dropped;
+} logCategory_t;
+
+static struct pmLogRecord   gRecords[kLogRecordCnt];
+static _Atomic uint64_t     gFreeRecords = UINT64_MAX;
+
+static logCategory_t gCategories[kPMLogCategoryCount] = {
+    [kPMLogCategorySleepWake]       = { .name = "SleepWake",        .perSecLimit = 0,   .exempt = true },
+    [kPMLogCategoryAppResponse]     = { .name = "AppResponse",      .perSecLimit = 32 },
+    [kPMLogCategoryAssertions]      = { .name = "Assertions",       .perSecLimit = 64 },
+    [kPMLogCategorySleepPreventers] = { .name = "SleepPreventers",  .perSecLimit = 8 },
+};
+
+static dispatch_queue_t logEmitQueue(void)
+{
+    static dispatch_once_t  once;
+    static dispatch_queue_t q;
+
+    dispatch_once(&once, ^{
+        q = dispatch_queue_create("com.apple.powerd.logq",
+                                  dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_BACKGROUND, 0));
+    });
+    return q;
+}
+
+static bool categoryAdmit(logCategory_t *cat)
+{
+    uint64_t now = PMClockMonotonicNs() / NSEC_PER_SEC;
+    uint64_t window = atomic_load_explicit(&cat->window, memory_order_relaxed);
+
+    if ((window != now) &&
+        atomic_compare_exchange_strong_explicit(&cat->window, &window, now,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        atomic_store_explicit(&cat->count, 0, memory_order_relaxed);
+    }
+    return (atomic_fetch_add_explicit(&cat->count, 1, memory_order_relaxed) < cat->perSecLimit);
+}
+
+static void releaseRecord(struct pmLogRecord *rec)
+{
+    if (rec->index == kLogRecordHeap) {
+        free(rec);
+        return;
+    }
+    atomic_fetch_or_explicit(&gFreeRecords, 1ULL << rec->index, memory_order_release);
+}
+
+pmlogmsg_t pmlog_new(PMLogCategory category)
+{
+    struct pmLogRecord  *rec;
+    logCategory_t       *cat;
+    uint64_t            mask;
+    uint32_t            index;
+
+    if (category >= kPMLogCategoryCount) {
+        return NULL;
+    }
+    cat = &gCategories[category];
+    if (cat->perSecLimit && !categoryAdmit(cat)) {
+        atomic_fetch_add_explicit(&cat->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    mask = atomic_load_explicit(&gFreeRecords, memory_order_relaxed);
+    do {
+        if (!mask) {
+            break;
+        }
+        index = __builtin_ctzll(mask);
+    } while (!atomic_compare_exchange_weak_explicit(&gFreeRecords, &mask, mask & ~(1ULL << index),
+                                                    memory_order_acquire, memory_order_relaxed));
+
+    if (mask) {
+        rec = &gRecords[index];
+    }
+    else if (cat->exempt && (rec = malloc(sizeof(*rec)))) {
+        index = kLogRecordHeap;
+    }
+    else {
+        atomic_fetch_add_explicit(&cat->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    rec->category = category;
+    rec->index = index;
+    rec->fieldCnt = 0;
+    rec->used = 0;
+    // Stamped here, so records keep the order and time of the events they describe
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    return rec;
+}
+
+void pmlog_set(pmlogmsg_t m, const char *key, const char *value)
+{
+    size_t klen, vlen;
+
+    if (!m || !key || !value || (m->fieldCnt >= kLogRecordMaxFields)) {
+        return;
+    }
+    klen = strlen(key) + 1;
+    vlen = strlen(value) + 1;
+    if (m->used + klen + vlen > sizeof(m->buf)) {
+        return;
+    }
+
+    m->fields[m->fieldCnt].key = m->used;
+    memcpy(m->buf + m->used, key, klen);
+    m->used += klen;
+    m->fields[m->fieldCnt].value = m->used;
+    memcpy(m->buf + m->used, value, vlen);
+    m->used += vlen;
+    m->fieldCnt++;
+}
+
+#ifdef XCTEST
+static void (^gLogSink)(aslmsg m) = NULL;
+
+void pmlog_set_sink(void (^sink)(aslmsg m))
+{
+    gLogSink = sink;
+}
+
+void pmlog_flush(void)
+{
+    dispatch_sync(logEmitQueue(), ^{ });
+}
+
+uint32_t pmlog_dropped(PMLogCategory category)
+{
+    return atomic_load_explicit(&gCategories[category].dropped, memory_order_relaxed);
+}
+#endif
+
+static void emit(aslmsg m)
+{
+#ifdef XCTEST
+    if (gLogSink) {
+        gLogSink(m);
+        return;
+    }
+#endif
+    asl_send(NULL, m);
+}
+
+static void emitRecord(void *context)
+{
+    struct pmLogRecord  *rec = (struct pmLogRecord *)context;
+    logCategory_t       *cat = &gCategories[rec->category];
+    uint32_t            dropped;
+    char                timeBuf[32];
+    aslmsg              m;
+
+    dropped = atomic_exchange_explicit(&cat->dropped, 0, memory_order_relaxed);
+    if (dropped) {
+        char buf[100];
+
+        snprintf(buf, sizeof(buf), "%u %s log messages were dropped", dropped, cat->name);
+        INFO_LOG("%{public}s\n", buf);
+        m = new_msg_pmset_log();
+        asl_set(m, ASL_KEY_MSG, buf);
+        emit(m);
+        asl_release(m);
+    }
+
+    m = new_msg_pmset_log();
+    snprintf(timeBuf, sizeof(timeBuf), "%ld", (long)rec->time.tv_sec);
+    asl_set(m, ASL_KEY_TIME, timeBuf);
+    snprintf(timeBuf, sizeof(timeBuf), "%ld", (long)rec->time.tv_nsec);
+    asl_set(m, ASL_KEY_TIME_NSEC, timeBuf);
+    for (uint16_t i = 0; i < rec->fieldCnt; i++) {
+        asl_set(m, rec->buf + rec->fields[i].key, rec->buf + rec->fields[i].value);
+    }
+    emit(m);
+    asl_release(m);
+
+    releaseRecord(rec);
+}
+
+void pmlog_send(pmlogmsg_t m)
+{
+    if (!m) {
+        return;
+    }
+    dispatch_async_f(logEmitQueue(), m, emitRecord);
+}
+
+void pmlog_discard(pmlogmsg_t m)
+{
+    if (!m) {
+        return;
+    }
+    releaseRecord(m);
+}
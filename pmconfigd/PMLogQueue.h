@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMLogQueue_h
+#define PMLogQueue_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Staging queue for pmset/ASL log records.
+ *
+ * Callers on the PM main queue capture key/value strings into a record from
+ * a fixed pool; the aslmsg is built and sent later on a background queue.
+ * pmlog_new() stamps the record with the current time, so emitted records
+ * carry the time of the event, not the time they were sent.
+ *
+ * Allocation never blocks: if the pool is exhausted or the record's category
+ * is over its per-second budget, pmlog_new() returns NULL and the record is
+ * counted as dropped. The drop count is reported with the next record of the
+ * same category that makes it through. Sleep/wake records are never dropped:
+ * they have no budget and fall back to the heap when the pool is empty.
+ *
+ * pmlog_set(), pmlog_send() and pmlog_discard() accept NULL, so callers can
+ * stage fields unconditionally.
+ */
+
+typedef enum {
+    kPMLogCategorySleepWake = 0,        // Sleep, wake and failure records
+    kPMLogCategoryAppResponse,          // Sleep/wake notification responses
+    kPMLogCategoryAssertions,           // Assertion activity and summaries
+    kPMLogCategorySleepPreventers,      // Kernel sleep preventer lists
+    kPMLogCategoryCount
+} PMLogCategory;
+
+typedef struct pmLogRecord *pmlogmsg_t;
+
+__private_extern__ pmlogmsg_t   pmlog_new(PMLogCategory category);
+
+/*
+ * Copies 'key' and 'value' into the record. Fields that no longer fit are
+ * dropped; the record is still sent with the fields staged so far.
+ */
+__private_extern__ void         pmlog_set(pmlogmsg_t m, const char *key, const char *value);
+
+/* Hands the record off for emission. 'm' must not be used afterwards. */
+__private_extern__ void         pmlog_send(pmlogmsg_t m);
+
+/* Returns an unsent record to the pool. */
+__private_extern__ void         pmlog_discard(pmlogmsg_t m);
+
+#ifdef XCTEST
+#include <asl.h>
+/* Emitted records go to 'sink' instead of ASL; NULL restores ASL. */
+void        pmlog_set_sink(void (^sink)(aslmsg m));
+/* Waits until every record sent so far has been emitted. */
+void        pmlog_flush(void);
+/* Records dropped in 'category' and not yet reported. */
+uint32_t    pmlog_dropped(PMLogCategory category);
+#endif
+
+#endif /* PMLogQueue_h */
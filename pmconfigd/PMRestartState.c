@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "PMRestartState.h"
+#include "PrivateLib.h"
+
+/*
+ * File layout:
+ *      stateFileHeader_t
+ *      { stateSectionHeader_t, <length> bytes of binary plist } * sectionCount
+ *
+ * /var/run is cleared on reboot; the boot session UUID check additionally
+ * guards against a file left over from a different boot.
+ */
+#ifndef XCTEST
+#define kRestartStatePath           "/var/run/powerd.state"
+#define kRestartStateTmpPath        "/var/run/powerd.state.tmp"
+#else
+#define kRestartStatePath           "/tmp/powerd-test.state"
+#define kRestartStateTmpPath        "/tmp/powerd-test.state.tmp"
+#endif
+#define kRestartStateMagic          0x504d5253      // 'PMRS'
+#define kRestartStateVersion        1
+#define kRestartStateMaxFileSize    (512 * 1024)
+#define kRestartStateFlushDelay     (2 * NSEC_PER_SEC)
+
+typedef struct {
+    uint32_t        magic;
+    uint16_t        version;
+    uint16_t        sectionCount;
+    char            bootSession[40];
+} stateFileHeader_t;
+
+typedef struct {
+    uint32_t            section;
+    uint32_t            length;
+    PMRestartSource     fingerprint;
+} stateSectionHeader_t;
+
+typedef struct {
+    PMRestartSource     fingerprint;
+    CFDataRef           payload;
+} stateSection_t;
+
+static stateSection_t   gSections[kPMRestartSectionCount];
+static char             gBootSession[40];
+static bool             gFlushPending = false;
+
+static bool copyBootSession(char *buf, size_t len)
+{
+    size_t size = len;
+
+    bzero(buf, len);
+    if (sysctlbyname("kern.bootsessionuuid", buf, &size, NULL, 0) || !buf[0]) {
+        return false;
+    }
+    buf[len - 1] = 0;
+    return true;
+}
+
+/*
+ * A source that can't be stat'ed, including one that doesn't exist, has no
+ * fingerprint, so nothing derived from it is ever saved or handed back.
+ */
+bool PMRestartStateFingerprintSource(const char *path, PMRestartSource *fp)
+{
+    struct stat st;
+
+    bzero(fp, sizeof(*fp));
+    if (stat(path, &st)) {
+        return false;
+    }
+    fp->dev = (uint64_t)st.st_dev;
+    fp->ino = (uint64_t)st.st_ino;
+    fp->size = (uint64_t)st.st_size;
+    fp->mtimeSec = (int64_t)st.st_mtimespec.tv_sec;
+    fp->mtimeNsec = (int64_t)st.st_mtimespec.tv_nsec;
+    return true;
+}
+
+static void loadStateFile(void)
+{
+    stateFileHeader_t       hdr;
+    stateSectionHeader_t    *sec;
+    struct stat             st;
+    uint8_t                 *buf = NULL;
+    size_t                  off;
+    int                     fd;
+
+    if (!copyBootSession(gBootSession, sizeof(gBootSession))) {
+        ERROR_LOG("Failed to read boot session UUID. Restart state is disabled\n");
+        return;
+    }
+
+    fd = open(kRestartStatePath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (st.st_uid != 0) ||
+        (st.st_size < (off_t)sizeof(hdr)) || (st.st_size > kRestartStateMaxFileSize)) {
+        goto exit;
+    }
+
+    buf = malloc((size_t)st.st_size);
+    if (!buf || (read(fd, buf, (size_t)st.st_size) != st.st_size)) {
+        goto exit;
+    }
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    if ((hdr.magic != kRestartStateMagic) || (hdr.version != kRestartStateVersion)) {
+        INFO_LOG("Ignoring restart state with version %u\n", hdr.version);
+        goto exit;
+    }
+    if (strncmp(hdr.bootSession, gBootSession, sizeof(gBootSession))) {
+        INFO_LOG("Ignoring restart state from a previous boot session\n");
+        goto exit;
+    }
+
+    off = sizeof(hdr);
+    for (uint16_t i = 0; i < hdr.sectionCount; i++) {
+        if ((size_t)st.st_size - off < sizeof(*sec)) {
+            break;
+        }
+        sec = (stateSectionHeader_t *)(buf + off);
+        off += sizeof(*sec);
+        if ((size_t)st.st_size - off < sec->length) {
+            break;
+        }
+        if ((sec->section < kPMRestartSectionCount) && !gSections[sec->section].payload) {
+            gSections[sec->section].fingerprint = sec->fingerprint;
+            gSections[sec->section].payload = CFDataCreate(0, buf + off, sec->length);
+        }
+        off += sec->length;
+    }
+    INFO_LOG("Loaded restart state (%u sections)\n", hdr.sectionCount);
+
+exit:
+    if (buf) {
+        free(buf);
+    }
+    close(fd);
+}
+
+static void flushStateFile(void)
+{
+    stateFileHeader_t       hdr;
+    stateSectionHeader_t    sec;
+    bool                    ok = true;
+    int                     fd;
+
+    gFlushPending = false;
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = kRestartStateMagic;
+    hdr.version = kRestartStateVersion;
+    strlcpy(hdr.bootSession, gBootSession, sizeof(hdr.bootSession));
+    for (int i = 0; i < kPMRestartSectionCount; i++) {
+        if (gSections[i].payload) {
+            hdr.sectionCount++;
+        }
+    }
+
+    if (!hdr.sectionCount) {
+        unlink(kRestartStatePath);
+        return;
+    }
+
+    unlink(kRestartStateTmpPath);
+    fd = open(kRestartStateTmpPath, O_CREAT | O_EXCL | O_WRONLY | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        ERROR_LOG("Failed to create restart state file: %d\n", errno);
+        return;
+    }
+
+    ok = (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+    for (int i = 0; ok && (i < kPMRestartSectionCount); i++) {
+        CFDataRef payload = gSections[i].payload;
+        if (!payload) {
+            continue;
+        }
+        sec.section = i;
+        sec.length = (uint32_t)CFDataGetLength(payload);
+        sec.fingerprint = gSections[i].fingerprint;
+        ok = (write(fd, &sec, sizeof(sec)) == sizeof(sec)) &&
+             (write(fd, CFDataGetBytePtr(payload), sec.length) == (ssize_t)sec.length);
+    }
+    close(fd);
+
+    if (!ok || rename(kRestartStateTmpPath, kRestartStatePath)) {
+        ERROR_LOG("Failed to write restart state file: %d\n", errno);
+        unlink(kRestartStateTmpPath);
+    }
+}
+
+/*
+ * Serializes access to gSections and to the state file. The existing file
+ * is read in on first use.
+ */
+static dispatch_queue_t restartStateQueue(void)
+{
+    static dispatch_once_t  onceToken;
+    static dispatch_queue_t q;
+
+    dispatch_once(&onceToken, ^{
+        q = dispatch_queue_create("com.apple.powerd.restartstate",
+                                  dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+        loadStateFile();
+    });
+    return q;
+}
+
+CFPropertyListRef PMRestartStateCopySection(PMRestartSection section, const char *sourcePath)
+{
+    __block CFDataRef       payload = NULL;
+    CFPropertyListRef       plist = NULL;
+    PMRestartSource         fp;
+
+    if ((section >= kPMRestartSectionCount) || !sourcePath) {
+        return NULL;
+    }
+    if (!PMRestartStateFingerprintSource(sourcePath, &fp)) {
+        return NULL;
+    }
+
+    dispatch_sync(restartStateQueue(), ^{
+        stateSection_t *s = &gSections[section];
+        if (s->payload && !memcmp(&s->fingerprint, &fp, sizeof(fp))) {
+            payload = CFRetain(s->payload);
+        }
+    });
+
+    if (payload) {
+        plist = CFPropertyListCreateWithData(0, payload, kCFPropertyListImmutable, NULL, NULL);
+        CFRelease(payload);
+    }
+    return plist;
+}
+
+void PMRestartStateSetSection(PMRestartSection section, const PMRestartSource *source, CFPropertyListRef plist)
+{
+    CFDataRef               payload = NULL;
+    PMRestartSource         fp = { 0 };
+
+    if (section >= kPMRestartSectionCount) {
+        return;
+    }
+
+    if (plist && source) {
+        fp = *source;
+        payload = CFPropertyListCreateData(0, plist, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    }
+
+    dispatch_async(restartStateQueue(), ^{
+        stateSection_t *s = &gSections[section];
+
+        if (s->payload) {
+            CFRelease(s->payload);
+        }
+        s->payload = payload;
+        if (payload) {
+            s->fingerprint = fp;
+        }
+
+        if (!gFlushPending && gBootSession[0]) {
+            gFlushPending = true;
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kRestartStateFlushDelay),
+                           restartStateQueue(), ^{ flushStateFile(); });
+        }
+    });
+}
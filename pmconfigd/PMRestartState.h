@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMRestartState_h
+#define PMRestartState_h
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * Derived state that powerd persists across a daemon restart within the
+ * same boot session.
+ *
+ * Each section is stored together with a fingerprint (device, inode, size
+ * and mtime) of the file it was derived from. A section is handed back only
+ * if the boot session matches and the source file still has the same
+ * fingerprint; otherwise the caller rebuilds from scratch as before. A
+ * missing source file counts as stale.
+ */
+
+typedef enum {
+    kPMRestartSectionSettings = 0,      // Energy settings, all power sources
+    kPMRestartSectionCount
+} PMRestartSection;
+
+typedef struct {
+    uint64_t        dev;
+    uint64_t        ino;
+    uint64_t        size;
+    int64_t         mtimeSec;
+    int64_t         mtimeNsec;
+} PMRestartSource;
+
+/*
+ * Fingerprints 'sourcePath' into 'source'. Returns false if it can't be
+ * stat'ed, e.g. because it doesn't exist. Take the fingerprint before
+ * reading the file: a change that lands during the read then leaves the
+ * saved section stale instead of matching the new file.
+ */
+__private_extern__ bool PMRestartStateFingerprintSource(const char *sourcePath, PMRestartSource *source);
+
+/*
+ * Returns a copy of the saved section, or NULL if there is none or if it
+ * is stale with respect to 'sourcePath'. Safe to call from any queue.
+ */
+__private_extern__ CFPropertyListRef PMRestartStateCopySection(PMRestartSection section, const char *sourcePath);
+
+/*
+ * Replaces the saved section with 'plist', derived from the file 'source'
+ * was taken from. A NULL 'plist' or 'source' clears it. The snapshot file
+ * is written out lazily on a background queue.
+ */
+__private_extern__ void PMRestartStateSetSection(PMRestartSection section, const PMRestartSource *source, CFPropertyListRef plist);
+
+#endif /* PMRestartState_h */
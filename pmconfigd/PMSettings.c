@@ -49,6 +49,7 @@
 #include "PMConnection.h"
 #include "StandbyTimer.h"
 #include "adaptiveDisplay.h"
+#include "PMRestartState.h"
 
 
 #define kIOPMSCPrefsPath    CFSTR("com.apple.PowerManagement.xml")
@@ -1159,8 +1160,18 @@ __private_extern__ void PMSettings_prime(void)
         currentPowerSource = CFSTR(kIOPMACPowerKey);
     }
 
-    // load the initial configuration from the database
-    energySettings = IOPMCopyActivePMPreferences();
+    // load the initial configuration; after a daemon restart the settings
+    // saved by the previous instance are reused if the prefs file is unchanged
+    energySettings = PMRestartStateCopySection(kPMRestartSectionSettings, kIOPMSCPrefsFile);
+    if (!isA_CFDictionary(energySettings)) {
+        PMRestartSource source;
+        bool            haveSource;
+
+        if (energySettings) CFRelease(energySettings);
+        haveSource = PMRestartStateFingerprintSource(kIOPMSCPrefsFile, &source);
+        energySettings = IOPMCopyActivePMPreferences();
+        PMRestartStateSetSection(kPMRestartSectionSettings, haveSource ? &source : NULL, energySettings);
+    }
 
     // send the initial configuration to the kernel
     if(energySettings) {
@@ -1362,6 +1373,9 @@ exit:
 __private_extern__ void 
 PMSettingsPrefsHaveChanged(void) 
 {
+    PMRestartSource source;
+    bool            haveSource;
+
     INFO_LOG("Energy Saver Prefs have changed");
     // re-blast system-wide settings
     PMActivateSystemPowerSettings();
@@ -1369,6 +1383,7 @@ PMSettingsPrefsHaveChanged(void)
     // re-read preferences into memory
     if(energySettings) CFRelease(energySettings);
 
+    haveSource = PMRestartStateFingerprintSource(kIOPMSCPrefsFile, &source);
     energySettings = IOPMCopyPMPreferences();
 
     // push new preferences out to the kernel
@@ -1382,6 +1397,7 @@ PMSettingsPrefsHaveChanged(void)
         }
         energySettings = NULL;
     }
+    PMRestartStateSetSection(kPMRestartSectionSettings, haveSource ? &source : NULL, energySettings);
     PMAssertions_SettingsHaveChanged();
     
     return;
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "PMSleepService.h"
+#include "PrivateLib.h"
+
+static const char *gStateNames[kPMSleepServiceStateCount] = {
+    "Idle", "Capped", "Extended", "Expired"
+};
+
+static struct {
+    PMSleepServiceOps       ops;
+    PMSleepServiceState     state;
+    bool                    published;      // Last state written to the notify token
+    uint32_t                capTime;
+    CFStringRef             uuid;
+    CFStringRef             nextUUID;       // Made ahead of the next session
+} gSession;
+
+static CFStringRef createSessionUUID(void)
+{
+    CFStringRef uuidString = NULL;
+    CFUUIDRef   uuid = CFUUIDCreate(0);
+
+    if (uuid) {
+        uuidString = CFUUIDCreateString(0, uuid);
+        CFRelease(uuid);
+    }
+    return uuidString;
+}
+
+static void setState(PMSleepServiceState state)
+{
+    bool active = (state == kPMSleepServiceCapped) || (state == kPMSleepServiceExtended);
+
+    if (state != gSession.state) {
+        DEBUG_LOG("SleepService: %s -> %s\n", gStateNames[gSession.state], gStateNames[state]);
+        gSession.state = state;
+    }
+    if (active != gSession.published) {
+        gSession.published = active;
+        if (gSession.ops.publish) {
+            gSession.ops.publish(active);
+        }
+    }
+}
+
+void PMSleepServiceInit(const PMSleepServiceOps *ops)
+{
+    if (ops) {
+        gSession.ops = *ops;
+    }
+    else {
+        bzero(&gSession.ops, sizeof(gSession.ops));
+    }
+    gSession.state = kPMSleepServiceIdle;
+    gSession.published = false;
+    gSession.capTime = 0;
+    if (!gSession.nextUUID) {
+        gSession.nextUUID = createSessionUUID();
+    }
+}
+
+bool PMSleepServiceBegin(uint32_t capMs)
+{
+    if (!capMs) {
+        return false;
+    }
+
+    // Every wake gets its own UUID and client hold, even one that lands
+    // before the previous window closed
+    gSession.capTime = capMs;
+    if (gSession.ops.setCap) {
+        gSession.ops.setCap(capMs);
+    }
+
+    if (gSession.uuid) {
+        CFRelease(gSession.uuid);
+    }
+    if (gSession.nextUUID) {
+        gSession.uuid = gSession.nextUUID;
+        gSession.nextUUID = NULL;
+    }
+    else {
+        // Only if making one ahead of time failed
+        gSession.uuid = createSessionUUID();
+    }
+
+    // An active or expired session is still in the SleepService power state until End
+    if ((gSession.state == kPMSleepServiceIdle) && gSession.ops.sessionChanged) {
+        gSession.ops.sessionChanged(true);
+    }
+    if (gSession.ops.holdForClients) {
+        gSession.ops.holdForClients();
+    }
+    setState(kPMSleepServiceCapped);
+
+    return true;
+}
+
+bool PMSleepServiceSetCap(uint32_t capMs)
+{
+    if ((gSession.state != kPMSleepServiceCapped) && (gSession.state != kPMSleepServiceExtended)) {
+        return false;
+    }
+    if (!capMs) {
+        PMSleepServiceExpire();
+        return true;
+    }
+    if (capMs == gSession.capTime) {
+        return true;
+    }
+
+    gSession.capTime = capMs;
+    if (gSession.ops.setCap) {
+        gSession.ops.setCap(capMs);
+    }
+    setState(kPMSleepServiceExtended);
+    return true;
+}
+
+void PMSleepServiceExpire(void)
+{
+    if ((gSession.state == kPMSleepServiceIdle) || (gSession.state == kPMSleepServiceExpired)) {
+        return;
+    }
+
+    gSession.capTime = 0;
+    if (gSession.ops.setCap) {
+        gSession.ops.setCap(0);
+    }
+    setState(kPMSleepServiceExpired);
+
+    // The next wake may begin a session without an End first
+    if (!gSession.nextUUID) {
+        gSession.nextUUID = createSessionUUID();
+    }
+}
+
+void PMSleepServiceEnd(void)
+{
+    if (gSession.state == kPMSleepServiceIdle) {
+        return;
+    }
+
+    gSession.capTime = 0;
+    if (gSession.ops.sessionChanged) {
+        gSession.ops.sessionChanged(false);
+    }
+    setState(kPMSleepServiceIdle);
+
+    // Off the wake path; have the next session's UUID ready
+    if (!gSession.nextUUID) {
+        gSession.nextUUID = createSessionUUID();
+    }
+}
+
+PMSleepServiceState PMSleepServiceGetState(void)
+{
+    return gSession.state;
+}
+
+uint32_t PMSleepServiceGetCapTime(void)
+{
+    return gSession.capTime;
+}
+
+CFStringRef PMSleepServiceGetUUID(void)
+{
+    return gSession.uuid;
+}
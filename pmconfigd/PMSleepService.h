@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMSleepService_h
+#define PMSleepService_h
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * SleepService session state.
+ *
+ *   Idle ----Begin----> Capped ----SetCap(>0)----> Extended
+ *                         |                           |
+ *                         +----SetCap(0)/Expire-------+---> Expired
+ *   Any session ----End----> Idle
+ *
+ * A session is active (published through kIOPMSleepServiceActiveNotifyName)
+ * while Capped or Extended. The published state is only written and posted
+ * when it changes. A session keeps the SleepService power state from Begin
+ * until End, including while Expired. Each Begin, including one on an active
+ * session, takes a new UUID and a new client hold. Session UUIDs are created
+ * ahead of time, off the wake path, when the previous session expires or ends.
+ *
+ * Side effects go through PMSleepServiceOps; PMConnection.m supplies the
+ * real ones.
+ */
+
+typedef enum {
+    kPMSleepServiceIdle = 0,
+    kPMSleepServiceCapped,
+    kPMSleepServiceExtended,
+    kPMSleepServiceExpired,
+    kPMSleepServiceStateCount
+} PMSleepServiceState;
+
+typedef struct {
+    // Writes the active bit to the notify state and posts it
+    void    (*publish)(bool active);
+
+    // Sets the time cap on ApplePushServiceTask assertions; 0 ends the window
+    void    (*setCap)(uint32_t capMs);
+
+    // Enters or leaves the SleepService power state and reconfigures the assertion types that depend on it
+    void    (*sessionChanged)(bool inSession);
+
+    // Holds the system briefly while clients take their assertions
+    void    (*holdForClients)(void);
+} PMSleepServiceOps;
+
+/* Installs 'ops' and resets to Idle. Called again by tests to install fakes */
+__private_extern__ void PMSleepServiceInit(const PMSleepServiceOps *ops);
+
+/*
+ * Starts a new session capped at 'capMs'. A session that is still active is
+ * restarted rather than extended. Returns false if 'capMs' is 0.
+ */
+__private_extern__ bool PMSleepServiceBegin(uint32_t capMs);
+
+/*
+ * Changes the cap of the current session. Returns false if no session is
+ * running. A cap of 0 expires the session.
+ */
+__private_extern__ bool PMSleepServiceSetCap(uint32_t capMs);
+
+/* Cap time ran out or PowerNap was cancelled */
+__private_extern__ void PMSleepServiceExpire(void);
+
+/* The window has terminated; SleepService assertions are gone. No-op when Idle */
+__private_extern__ void PMSleepServiceEnd(void);
+
+__private_extern__ PMSleepServiceState PMSleepServiceGetState(void);
+
+/* Cap of the current session in ms; 0 when none is running */
+__private_extern__ uint32_t PMSleepServiceGetCapTime(void);
+
+/* UUID of the current or last session; not retained. NULL before the first session */
+__private_extern__ CFStringRef PMSleepServiceGetUUID(void);
+
+#endif /* PMSleepService_h */
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+#include <os/lock.h>
+#include <Block.h>
+#include <stdlib.h>
+
+#include "PMSnapshot.h"
+#include "PrivateLib.h"
+
+struct PMSnapshot {
+    os_unfair_lock      lock;
+    uint64_t            generation;         // Bumped on the main queue
+    uint64_t            *generationRef;     // &generation, or a counter shared with other snapshots
+    uint64_t            builtGeneration;    // Generation 'value' was built from
+    bool                valid;
+    CFTypeRef           value;
+    CFTypeRef           (^builder)(void);
+};
+
+static const void *kPMMainQueueKey = &kPMMainQueueKey;
+
+static void markMainQueue(void)
+{
+    static dispatch_once_t onceToken;
+
+    dispatch_once(&onceToken, ^{
+        dispatch_queue_set_specific(_getPMMainQueue(), kPMMainQueueKey, (void *)kPMMainQueueKey, NULL);
+    });
+}
+
+static inline bool onMainQueue(void)
+{
+    return (dispatch_get_specific(kPMMainQueueKey) == kPMMainQueueKey);
+}
+
+void PMPerformOnMainQueueSync(dispatch_block_t block)
+{
+    markMainQueue();
+    if (onMainQueue()) {
+        block();
+    }
+    else {
+        dispatch_sync(_getPMMainQueue(), block);
+    }
+}
+
+// Runs on the main queue, where the state can't change underneath the builder
+static void rebuild(PMSnapshotRef snapshot)
+{
+    uint64_t    builtGeneration = __atomic_load_n(snapshot->generationRef, __ATOMIC_ACQUIRE);
+    CFTypeRef   value = snapshot->builder();
+    CFTypeRef   old = NULL;
+
+    os_unfair_lock_lock(&snapshot->lock);
+    if (!snapshot->valid || (builtGeneration > snapshot->builtGeneration)) {
+        old = snapshot->value;
+        snapshot->value = value;
+        value = NULL;
+        snapshot->builtGeneration = builtGeneration;
+        snapshot->valid = true;
+    }
+    os_unfair_lock_unlock(&snapshot->lock);
+
+    if (old) {
+        CFRelease(old);
+    }
+    if (value) {
+        CFRelease(value);
+    }
+}
+
+PMSnapshotRef PMSnapshotCreateSharedValue(uint64_t *generation, CFTypeRef (^builder)(void))
+{
+    PMSnapshotRef snapshot;
+
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot) {
+        return NULL;
+    }
+    snapshot->lock = OS_UNFAIR_LOCK_INIT;
+    snapshot->generationRef = generation ? generation : &snapshot->generation;
+    snapshot->builder = Block_copy(builder);
+    markMainQueue();
+
+    return snapshot;
+}
+
+PMSnapshotRef PMSnapshotCreateShared(uint64_t *generation, CFDataRef (^builder)(void))
+{
+    return PMSnapshotCreateSharedValue(generation, ^CFTypeRef(void) {
+        return builder();
+    });
+}
+
+PMSnapshotRef PMSnapshotCreate(CFDataRef (^builder)(void))
+{
+    return PMSnapshotCreateShared(NULL, builder);
+}
+
+void PMSnapshotGenerationBump(uint64_t *generation)
+{
+    __atomic_add_fetch(generation, 1, __ATOMIC_RELEASE);
+}
+
+void PMSnapshotInvalidate(PMSnapshotRef snapshot)
+{
+    if (!snapshot) {
+        return;
+    }
+    PMSnapshotGenerationBump(snapshot->generationRef);
+}
+
+CFTypeRef PMSnapshotCopyValue(PMSnapshotRef snapshot)
+{
+    __block CFTypeRef   value = NULL;
+    uint64_t            generation;
+
+    if (!snapshot) {
+        return NULL;
+    }
+
+    generation = __atomic_load_n(snapshot->generationRef, __ATOMIC_ACQUIRE);
+    os_unfair_lock_lock(&snapshot->lock);
+    if (snapshot->valid && (snapshot->builtGeneration == generation)) {
+        value = snapshot->value;
+        if (value) {
+            CFRetain(value);
+        }
+        os_unfair_lock_unlock(&snapshot->lock);
+        return value;
+    }
+    os_unfair_lock_unlock(&snapshot->lock);
+
+    // Stale. Rebuild on the main queue, so a client reading right after its
+    // own change sees it. Readers that queue up behind one rebuild share it.
+    PMPerformOnMainQueueSync(^{
+        rebuild(snapshot);
+
+        os_unfair_lock_lock(&snapshot->lock);
+        value = snapshot->value;
+        if (value) {
+            CFRetain(value);
+        }
+        os_unfair_lock_unlock(&snapshot->lock);
+    });
+
+    return value;
+}
+
+CFDataRef PMSnapshotCopyData(PMSnapshotRef snapshot)
+{
+    return (CFDataRef)PMSnapshotCopyValue(snapshot);
+}
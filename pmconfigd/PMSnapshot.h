@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef PMSnapshot_h
+#define PMSnapshot_h
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+
+/*
+ * Serialized state published by the main queue for the read queue.
+ *
+ * Mutations happen on the PM main queue and only bump the snapshot generation.
+ * Readers on _getPMReadQueue() get the last published value while it is
+ * current; a stale snapshot is rebuilt once on the main queue and then shared
+ * by all readers until the next change.
+ */
+typedef struct PMSnapshot *PMSnapshotRef;
+
+// 'builder' runs on the PM main queue and returns a retained CFData, or NULL if empty
+__private_extern__ PMSnapshotRef PMSnapshotCreate(CFDataRef (^builder)(void));
+
+/*
+ * Same as PMSnapshotCreate(), but staleness is tracked by '*generation', which
+ * may be shared by several snapshots built from the same state. Bumping it
+ * with PMSnapshotGenerationBump() invalidates all of them at once.
+ */
+__private_extern__ PMSnapshotRef PMSnapshotCreateShared(uint64_t *generation, CFDataRef (^builder)(void));
+
+/*
+ * Same as PMSnapshotCreateShared(), but publishes an arbitrary immutable CF
+ * object instead of serialized bytes, for readers that only need part of it.
+ */
+__private_extern__ PMSnapshotRef PMSnapshotCreateSharedValue(uint64_t *generation, CFTypeRef (^builder)(void));
+
+// Called on the PM main queue whenever the state behind the snapshot changes
+__private_extern__ void PMSnapshotInvalidate(PMSnapshotRef snapshot);
+
+// Called on the PM main queue whenever the state behind a shared generation changes
+__private_extern__ void PMSnapshotGenerationBump(uint64_t *generation);
+
+// Returns the current serialized state, retained. NULL if the state is empty.
+__private_extern__ CFDataRef PMSnapshotCopyData(PMSnapshotRef snapshot);
+
+// Returns the current value, retained. NULL if the state is empty.
+__private_extern__ CFTypeRef PMSnapshotCopyValue(PMSnapshotRef snapshot);
+
+// Runs 'block' on the PM main queue and waits for it. Runs inline if already on the main queue.
+__private_extern__ void PMPerformOnMainQueueSync(dispatch_block_t block);
+
+#endif /* PMSnapshot_h */
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+
+#include "PMStartup.h"
+#include "PrivateLib.h"
+
+void PMStartupRun(const PMStartupStep *steps, size_t count)
+{
+    uint64_t            *startTS = NULL;
+    uint64_t            *endTS = NULL;
+    uint64_t            begin;
+
+    startTS = calloc(count, sizeof(*startTS));
+    endTS = calloc(count, sizeof(*endTS));
+    if (!startTS || !endTS) {
+        // Run everything without timing
+        for (size_t i = 0; i < count; i++) {
+            steps[i].func();
+        }
+        goto exit;
+    }
+
+    begin = mach_absolute_time();
+    for (size_t i = 0; i < count; i++) {
+        startTS[i] = mach_absolute_time();
+        steps[i].func();
+        endTS[i] = mach_absolute_time();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        INFO_LOG("Startup step %{public}s: started at %lluus, took %lluus\n",
+                 steps[i].name,
+                 intervalInNanoseconds(begin, startTS[i]) / NSEC_PER_USEC,
+                 intervalInNanoseconds(startTS[i], endTS[i]) / NSEC_PER_USEC);
+    }
+    INFO_LOG("Startup completed in %lluus\n", intervalInNanoseconds(begin, mach_absolute_time()) / NSEC_PER_USEC);
+
+exit:
+    free(startTS);
+    free(endTS);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef PMStartup_h
+#define PMStartup_h
+
+/*
+ * Timed powerd startup.
+ *
+ * Steps run in table order on the calling (PM main) queue, and the start
+ * offset and duration of each one are logged. A step that can overlap with
+ * the rest of startup starts its own background work and hands the result
+ * over to the step that consumes it (see AutoWake_prefetch()).
+ */
+
+typedef struct {
+    const char      *name;
+    void            (*func)(void);
+} PMStartupStep;
+
+__private_extern__ void PMStartupRun(const PMStartupStep *steps, size_t count);
+
+#endif /* PMStartup_h */
@@ -45,42 +45,58 @@
 static int              thermalState = kIOPMThermalLevelUnknown;
 static int              perfState    = kIOPMPerformanceNormal;
 
-static CFStringRef createSCKeyForIOKitString(CFStringRef str)
+/*
+ * Known keys of the root domain's power status dictionary, with the
+ * SCDynamicStore key and notify(3) key each one is published under. SC keys
+ * are created once; 'lastValue' holds what was last published so that
+ * unchanged values are not re-published on every power event.
+ */
+typedef enum {
+    kPowerStatusThermalWarning = 0,
+    kPowerStatusCPUPower,
+    kPowerStatusPerformanceWarning,
+    kPowerStatusKeyCount
+} powerStatusKey_t;
+
+typedef struct {
+    CFStringRef     ioKitKey;
+    CFStringRef     scName;
+    const char      *notifyKey;
+    CFStringRef     scKey;
+    CFTypeRef       lastValue;
+} powerStatusKeyMap_t;
+
+static powerStatusKeyMap_t  powerStatusKeys[kPowerStatusKeyCount];
+static SCDynamicStoreRef    powerStatusStore = NULL;
+
+static void initPowerStatusKeyMap(void)
 {
-    CFStringRef     keyForString = NULL;
+    static bool initialized = false;
 
-    if (CFEqual(str, CFSTR(kIOPMThermalLevelWarningKey))) 
-    {
-        keyForString = CFSTR("ThermalWarning");
-    } else if (CFEqual(str, CFSTR(kIOPMCPUPowerLimitsKey))) {
-        keyForString = CFSTR("CPUPower");
-    } else if (CFEqual(str, CFSTR(kIOPMPerformanceWarningKey))) {
-        keyForString = CFSTR("PerformanceWarning");
+    if (initialized) {
+        return;
     }
 
-    if (!keyForString)
-        return NULL;
+    powerStatusKeys[kPowerStatusThermalWarning].ioKitKey = CFSTR(kIOPMThermalLevelWarningKey);
+    powerStatusKeys[kPowerStatusThermalWarning].scName = CFSTR("ThermalWarning");
+    powerStatusKeys[kPowerStatusThermalWarning].notifyKey = kIOPMThermalWarningNotificationKey;
 
-    return SCDynamicStoreKeyCreate(kCFAllocatorDefault, 
-                        CFSTR("%@%@/%@"),
-                        kSCDynamicStoreDomainState, 
-                        CFSTR("/IOKit/Power"),
-                        keyForString);
-}
+    powerStatusKeys[kPowerStatusCPUPower].ioKitKey = CFSTR(kIOPMCPUPowerLimitsKey);
+    powerStatusKeys[kPowerStatusCPUPower].scName = CFSTR("CPUPower");
+    powerStatusKeys[kPowerStatusCPUPower].notifyKey = kIOPMCPUPowerNotificationKey;
 
-static const char * getNotifyKeyForIOKitString(CFStringRef str)
-{
-    if (CFEqual(str, CFSTR(kIOPMThermalLevelWarningKey))) 
-    {
-        return kIOPMThermalWarningNotificationKey;
-    } else if (CFEqual(str, CFSTR(kIOPMCPUPowerLimitsKey))) 
-    {
-        return kIOPMCPUPowerNotificationKey;
-    } else if (CFEqual(str, CFSTR(kIOPMPerformanceWarningKey))) 
-    {
-        return kIOPMPerformanceWarningNotificationKey;
+    powerStatusKeys[kPowerStatusPerformanceWarning].ioKitKey = CFSTR(kIOPMPerformanceWarningKey);
+    powerStatusKeys[kPowerStatusPerformanceWarning].scName = CFSTR("PerformanceWarning");
+    powerStatusKeys[kPowerStatusPerformanceWarning].notifyKey = kIOPMPerformanceWarningNotificationKey;
+
+    for (int i = 0; i < kPowerStatusKeyCount; i++) {
+        powerStatusKeys[i].scKey = SCDynamicStoreKeyCreate(kCFAllocatorDefault,
+                                        CFSTR("%@%@/%@"),
+                                        kSCDynamicStoreDomainState,
+                                        CFSTR("/IOKit/Power"),
+                                        powerStatusKeys[i].scName);
     }
-    return NULL;
+    initialized = true;
 }
 
     
@@ -94,112 +110,121 @@ PMSystemEvents_prime(void)
 __private_extern__ void 
 PMSystemEventsRootDomainInterest(void)
 {
-    CFDictionaryRef         thermalStatus;
+    CFDictionaryRef         powerStatus;
     CFMutableDictionaryRef  setTheseDSKeys = NULL;
-    CFStringRef             *keys = NULL;
-    CFNumberRef             *vals = NULL;
-    SCDynamicStoreRef       store = NULL;
-    CFIndex                 count = 0;
-    CFIndex                 i;
-    int                     thermNewState = -1;
-    int                     perfNewState = -1;
+    CFTypeRef               newValues[kPowerStatusKeyCount] = {0};
+    uint32_t                changed = 0;
+    Boolean                 published;
+    int                     i;
+    int                     thermNewState = thermalState;
+    int                     perfNewState = perfState;
     int                     create_file = 0;
 
+    initPowerStatusKeyMap();
+
     // Read dictionary from IORegistry
-    thermalStatus = IORegistryEntryCreateCFProperty(
+    powerStatus = IORegistryEntryCreateCFProperty(
                             getRootDomain(),
                             CFSTR(kIOPMRootDomainPowerStatusKey),
                             kCFAllocatorDefault,
                             kNilOptions);
 
-    if (!thermalStatus
-        || !(count = CFDictionaryGetCount(thermalStatus)))
-    {
+    if (!isA_CFDictionary(powerStatus)) {
         goto exit;
     }
-    
-    // Publish dictionary in SCDynamicStore
-    keys = (CFStringRef *)malloc(count*sizeof(CFStringRef));
-    vals = (CFNumberRef *)malloc(count*sizeof(CFNumberRef));
-    if (!keys||!vals) 
-        goto exit;
-        
-    CFDictionaryGetKeysAndValues(thermalStatus, 
-                    (const void **)keys, (const void **)vals);
-    
-    setTheseDSKeys = CFDictionaryCreateMutable(0, count, 
-                    &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-    if (!setTheseDSKeys)
-        goto exit;
-    
-    for (i=0; i<count; i++) 
+
+    // Only the values that changed since the last event are published
+    for (i = 0; i < kPowerStatusKeyCount; i++)
     {
-        CFStringRef writeToKey = createSCKeyForIOKitString(keys[i]);
-        if (writeToKey) {
-            CFDictionarySetValue(setTheseDSKeys, writeToKey, vals[i]);
-            CFRelease(writeToKey);
+        newValues[i] = CFDictionaryGetValue(powerStatus, powerStatusKeys[i].ioKitKey);
+        if (!newValues[i] || !powerStatusKeys[i].scKey
+            || (powerStatusKeys[i].lastValue && CFEqual(newValues[i], powerStatusKeys[i].lastValue)))
+        {
+            continue;
         }
-        if (CFStringCompare(keys[i], CFSTR(kIOPMThermalLevelWarningKey), 0) == kCFCompareEqualTo) {
-            if (isA_CFNumber(vals[i])) {
-                CFNumberGetValue(vals[i], kCFNumberIntType, &thermNewState);
-                if (thermNewState != thermalState) {
-                    int opVal = ((thermNewState == kIOPMThermalLevelWarning) || 
-                                 (thermNewState == kIOPMThermalLevelTrap)) ? 1 : 0;
-                    overrideSetting(kPMPreventWakeOnLan, opVal);
-                    activateSettingOverrides();
-                    if (thermNewState != kIOPMThermalLevelUnknown) {
-                        logASLThermalState(thermNewState);
-                    }
-                }
-            }
+        if (!setTheseDSKeys) {
+            setTheseDSKeys = CFDictionaryCreateMutable(0, kPowerStatusKeyCount,
+                            &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            if (!setTheseDSKeys)
+                goto exit;
         }
-        else if (CFStringCompare(keys[i], CFSTR(kIOPMPerformanceWarningKey), 0) == kCFCompareEqualTo) {
-            if (isA_CFNumber(vals[i])) {
-                CFNumberGetValue(vals[i], kCFNumberIntType, &perfNewState);
-                if (perfNewState != perfState) {
-                    logASLPerforamceState(perfNewState);
-                }
+        CFDictionarySetValue(setTheseDSKeys, powerStatusKeys[i].scKey, newValues[i]);
+        changed |= (1 << i);
+    }
+
+    if (!changed) {
+        goto exit;
+    }
+
+    if ((changed & (1 << kPowerStatusThermalWarning))
+        && isA_CFNumber(newValues[kPowerStatusThermalWarning]))
+    {
+        CFNumberGetValue(newValues[kPowerStatusThermalWarning], kCFNumberIntType, &thermNewState);
+        if (thermNewState != thermalState) {
+            int opVal = ((thermNewState == kIOPMThermalLevelWarning) || 
+                         (thermNewState == kIOPMThermalLevelTrap)) ? 1 : 0;
+            overrideSetting(kPMPreventWakeOnLan, opVal);
+            activateSettingOverrides();
+            if (thermNewState != kIOPMThermalLevelUnknown) {
+                logASLThermalState(thermNewState);
             }
         }
     }
+    if ((changed & (1 << kPowerStatusPerformanceWarning))
+        && isA_CFNumber(newValues[kPowerStatusPerformanceWarning]))
+    {
+        CFNumberGetValue(newValues[kPowerStatusPerformanceWarning], kCFNumberIntType, &perfNewState);
+        if (perfNewState != perfState) {
+            logASLPerforamceState(perfNewState);
+        }
+    }
 
-    store = SCDynamicStoreCreate(0, kMySCIdentity, NULL, NULL);
-    if (!store)
-        goto exit;
+    if (!powerStatusStore) {
+        powerStatusStore = SCDynamicStoreCreate(0, kMySCIdentity, NULL, NULL);
+        if (!powerStatusStore)
+            goto exit;
+    }
 
-    SCDynamicStoreSetMultiple(store, setTheseDSKeys, NULL, NULL);
+    // On failure nothing is recorded as published, so the next event retries the write
+    published = SCDynamicStoreSetMultiple(powerStatusStore, setTheseDSKeys, NULL, NULL);
+    if (!published) {
+        ERROR_LOG("Failed to publish power status: %{public}s\n", SCErrorString(SCError()));
+    }
 
-    for (i=0; i<count; i++)
+    for (i = 0; i < kPowerStatusKeyCount; i++)
     {
-        if (CFStringCompare(keys[i], CFSTR(kIOPMThermalLevelWarningKey), 0) == kCFCompareEqualTo) {
-            if (thermNewState != thermalState) {
-                thermalState = thermNewState;
-
-                if ((thermalState == kIOPMThermalLevelWarning) || (thermalState == kIOPMThermalLevelTrap)) {
-                    create_file = 1;
-                }
+        if (!(changed & (1 << i))) {
+            continue;
+        }
+        if (published) {
+            if (powerStatusKeys[i].lastValue) {
+                CFRelease(powerStatusKeys[i].lastValue);
             }
-            else {
+            powerStatusKeys[i].lastValue = CFRetain(newValues[i]);
+        }
+
+        if (i == kPowerStatusThermalWarning) {
+            if (thermNewState == thermalState) {
                 // Avoid notify_post call when thermal warning level hasn't changed
                 continue;
             }
-        }
-        else if (CFStringCompare(keys[i], CFSTR(kIOPMPerformanceWarningKey), 0) == kCFCompareEqualTo) {
-            if (perfNewState != perfState) {
-                perfState = perfNewState;
-                if (perfState == kIOPMPerformanceWarning) {
-                    create_file = 1;
-                }
+            thermalState = thermNewState;
+            if ((thermalState == kIOPMThermalLevelWarning) || (thermalState == kIOPMThermalLevelTrap)) {
+                create_file = 1;
             }
-            else {
+        }
+        else if (i == kPowerStatusPerformanceWarning) {
+            if (perfNewState == perfState) {
                 // Avoid notify_post call when performance  warning level hasn't changed
                 continue;
             }
+            perfState = perfNewState;
+            if (perfState == kIOPMPerformanceWarning) {
+                create_file = 1;
+            }
         }
 
-        const char *notify3Key = getNotifyKeyForIOKitString(keys[i]);
-        if (notify3Key) 
-            notify_post(notify3Key);
+        notify_post(powerStatusKeys[i].notifyKey);
     }
     if (create_file) {
         int fd;
@@ -220,18 +245,11 @@ PMSystemEventsRootDomainInterest(void)
     }
 
 exit:    
-    if (keys)
-        free(keys);
-    if (vals)
-        free(vals);
     if (setTheseDSKeys)
         CFRelease(setTheseDSKeys);
-    if (store)
-        CFRelease(store);
-    if (thermalStatus)
-        CFRelease(thermalStatus);
+    if (powerStatus)
+        CFRelease(powerStatus);
     return;
 }
 
-
 #endif //_PMSystemEvents_h_
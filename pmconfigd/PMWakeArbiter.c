@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdlib.h>
+
+#include "PMWakeArbiter.h"
+
+typedef struct {
+    PMWakeCandidate     c;
+    CFAbsoluteTime      due;            // max(deadline, notBefore)
+    bool                dropped;
+} wakeEntry_t;
+
+static wakeEntry_t          *gWakeEntries = NULL;
+static uint32_t             gWakeEntryCnt = 0;
+static uint32_t             gWakeEntryCap = 0;
+
+// Min-heap of indices into gWakeEntries, ordered by due time, then registration order
+static uint32_t             *gWakeHeap = NULL;
+static uint32_t             gWakeHeapCnt = 0;
+
+static inline bool entryBefore(uint32_t a, uint32_t b)
+{
+    if (gWakeEntries[a].due != gWakeEntries[b].due) {
+        return (gWakeEntries[a].due < gWakeEntries[b].due);
+    }
+    return (a < b);
+}
+
+static void heapSiftUp(uint32_t i)
+{
+    uint32_t idx = gWakeHeap[i];
+
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!entryBefore(idx, gWakeHeap[parent])) {
+            break;
+        }
+        gWakeHeap[i] = gWakeHeap[parent];
+        i = parent;
+    }
+    gWakeHeap[i] = idx;
+}
+
+static void heapSiftDown(uint32_t i)
+{
+    uint32_t idx = gWakeHeap[i];
+
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= gWakeHeapCnt) {
+            break;
+        }
+        if ((child + 1 < gWakeHeapCnt) && entryBefore(gWakeHeap[child + 1], gWakeHeap[child])) {
+            child++;
+        }
+        if (!entryBefore(gWakeHeap[child], idx)) {
+            break;
+        }
+        gWakeHeap[i] = gWakeHeap[child];
+        i = child;
+    }
+    gWakeHeap[i] = idx;
+}
+
+static uint32_t heapPop(void)
+{
+    uint32_t top = gWakeHeap[0];
+
+    if (--gWakeHeapCnt) {
+        gWakeHeap[0] = gWakeHeap[gWakeHeapCnt];
+        heapSiftDown(0);
+    }
+    return top;
+}
+
+// Top of the heap, skipping dropped entries. NULL when the heap is empty.
+static wakeEntry_t *heapPeek(void)
+{
+    while (gWakeHeapCnt) {
+        wakeEntry_t *e = &gWakeEntries[gWakeHeap[0]];
+        if (!e->dropped) {
+            return e;
+        }
+        heapPop();
+    }
+    return NULL;
+}
+
+void PMWakeArbiterReset(void)
+{
+    for (uint32_t i = 0; i < gWakeEntryCnt; i++) {
+        if (gWakeEntries[i].c.eventType) {
+            CFRelease(gWakeEntries[i].c.eventType);
+        }
+    }
+    gWakeEntryCnt = 0;
+    gWakeHeapCnt = 0;
+}
+
+int PMWakeArbiterRegister(const PMWakeCandidate *candidate)
+{
+    wakeEntry_t *e;
+
+    if (!candidate) {
+        return -1;
+    }
+    if (gWakeEntryCnt == gWakeEntryCap) {
+        uint32_t    newCap = gWakeEntryCap ? (2 * gWakeEntryCap) : 16;
+        wakeEntry_t *entries = realloc(gWakeEntries, newCap * sizeof(wakeEntry_t));
+        uint32_t    *heap;
+
+        if (!entries) {
+            return -1;
+        }
+        gWakeEntries = entries;
+        if (!(heap = realloc(gWakeHeap, newCap * sizeof(uint32_t)))) {
+            return -1;
+        }
+        gWakeHeap = heap;
+        gWakeEntryCap = newCap;
+    }
+
+    e = &gWakeEntries[gWakeEntryCnt];
+    e->c = *candidate;
+    if (e->c.eventType) {
+        CFRetain(e->c.eventType);
+    }
+    if (e->c.tolerance < 0) {
+        e->c.tolerance = 0;
+    }
+    e->due = (e->c.deadline < e->c.notBefore) ? e->c.notBefore : e->c.deadline;
+    e->dropped = false;
+
+    gWakeHeap[gWakeHeapCnt++] = gWakeEntryCnt;
+    heapSiftUp(gWakeHeapCnt - 1);
+
+    return (int)gWakeEntryCnt++;
+}
+
+void PMWakeArbiterDisableDarkWakes(void)
+{
+    for (uint32_t i = 0; i < gWakeEntryCnt; i++) {
+        if (gWakeEntries[i].c.flags & kPMWakeCandidateDarkWake) {
+            gWakeEntries[i].dropped = true;
+        }
+    }
+}
+
+bool PMWakeArbiterChoose(PMWakeChoice *choice)
+{
+    wakeEntry_t     *e, *best;
+    CFAbsoluteTime  windowEnd;
+
+    if (!choice || !(e = heapPeek())) {
+        return false;
+    }
+    heapPop();
+
+    best = e;
+    choice->wakeTime = e->due;
+    choice->mergedCnt = 1;
+    windowEnd = e->due + e->c.tolerance;
+
+    // Take every candidate that can still be served by a wake inside the window
+    while ((e = heapPeek()) && (e->due <= windowEnd)) {
+        heapPop();
+
+        // Heap order makes this the latest due time so far; the wake moves out to it
+        choice->wakeTime = e->due;
+        if (e->due + e->c.tolerance < windowEnd) {
+            windowEnd = e->due + e->c.tolerance;
+        }
+        if (e->c.priority > best->c.priority) {
+            best = e;
+        }
+        choice->mergedCnt++;
+    }
+
+    choice->chosen = &best->c;
+    choice->chosenIdx = (int)(best - gWakeEntries);
+    return true;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef PMWakeArbiter_h
+#define PMWakeArbiter_h
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <sys/types.h>
+
+/*
+ * Picks the wake to schedule with the RTC when the system goes to sleep.
+ *
+ * Every source of a wake deadline (client maintenance, SleepService and
+ * TimerPlugin requests, adaptive standby, proximity support, TCPKA turn off,
+ * user and shutdown/restart events) registers one candidate per sleep.
+ * Candidates are kept in a min-heap ordered by the earliest time they can be
+ * served at. A wake serves every candidate whose window [deadline, deadline +
+ * tolerance] it falls in, so nearby candidates with some tolerance share one
+ * wake instead of each waking the system.
+ *
+ * A round runs from PMWakeArbiterReset() to PMWakeArbiterChoose(). The choice
+ * depends only on the candidates registered in it, not on the current time.
+ */
+
+/* Array indices & for PMChooseScheduledEvent */
+typedef enum {
+    kChooseFullWake         = 0,
+    kChooseMaintenance      = 1,
+    kChooseSleepServiceWake = 2,
+    kChooseTimerPlugin      = 3,
+    kChooseWakeTypeCount    = 4
+} wakeType_e;
+
+/*
+ * Candidate priorities. When candidates share a wake, the one with the
+ * highest priority decides the wake type; equal priorities go to the one
+ * that comes due first, then to the one registered first.
+ */
+enum {
+    kPMWakePriorityDarkWake         = 0,
+    kPMWakePriorityTCPKA            = 1,
+    kPMWakePriorityUserWake         = 2,
+    kPMWakePriorityShutdownRestart  = 3
+};
+
+/* Candidate flags */
+#define kPMWakeCandidateDarkWake    0x1     // Dropped by PMWakeArbiterDisableDarkWakes()
+
+#define kPMWakeNameLen              128
+
+typedef struct {
+    CFAbsoluteTime  deadline;
+    CFTimeInterval  tolerance;              // How late the wake may be and still serve this candidate
+    CFAbsoluteTime  notBefore;              // Deadlines before this are moved up to it
+    uint32_t        priority;
+    uint32_t        flags;
+    wakeType_e      type;
+    pid_t           pid;
+    const char      *source;                // "Maintenance", "UserWake", ...
+    CFStringRef     eventType;              // Retained until the next PMWakeArbiterReset()
+    char            name[kPMWakeNameLen];
+    char            info[kPMWakeNameLen];
+} PMWakeCandidate;
+
+typedef struct {
+    CFAbsoluteTime          wakeTime;
+    const PMWakeCandidate   *chosen;        // Valid until the next PMWakeArbiterReset()
+    int                     chosenIdx;      // Registration index of 'chosen'
+    uint32_t                mergedCnt;      // Candidates served by this wake, including 'chosen'
+} PMWakeChoice;
+
+/* Drops all candidates and starts a new round */
+__private_extern__ void PMWakeArbiterReset(void);
+
+/*
+ * Copies 'candidate' into the current round. Returns its registration index,
+ * or -1 if the table could not grow. Logging is left to the caller.
+ */
+__private_extern__ int PMWakeArbiterRegister(const PMWakeCandidate *candidate);
+
+/* Drops the dark wake candidates registered so far in this round */
+__private_extern__ void PMWakeArbiterDisableDarkWakes(void);
+
+/*
+ * Takes the next wake off the heap along with every candidate it serves.
+ * Returns false when no candidates are left. Calling it again returns the
+ * wake after that one.
+ */
+__private_extern__ bool PMWakeArbiterChoose(PMWakeChoice *choice);
+
+#endif /* PMWakeArbiter_h */
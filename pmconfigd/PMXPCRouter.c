@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <os/log.h>
+
+#include "PMXPCRouter.h"
+#include "PrivateLib.h"
+
+#define kRouteTableSize         64      // Power of 2, at least 2x kMaxRoutes
+#define kMaxRoutes              32
+#define kRouteHistBuckets       16      // log2(usecs) buckets; last one is open ended
+
+typedef struct {
+    const char          *key;
+    uint32_t            hash;
+    uint32_t            order;
+    uint32_t            flags;
+    PMXPCRouteHandler   handler;
+
+    uint64_t            count;
+    uint64_t            totalNs;
+    uint64_t            maxNs;
+    uint32_t            histogram[kRouteHistBuckets];
+} xpcRoute_t;
+
+static xpcRoute_t       gRoutes[kMaxRoutes];
+static uint32_t         gRouteCnt = 0;
+static xpcRoute_t       *gRouteTable[kRouteTableSize];
+static uint64_t         gUnroutedCnt = 0;
+
+static mach_timebase_info_data_t gRouterTimebase;
+
+/* FNV-1a; keys are short constant strings */
+static inline uint32_t routeKeyHash(const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    while (*key) {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static xpcRoute_t *lookupRoute(const char *key)
+{
+    uint32_t hash = routeKeyHash(key);
+    uint32_t i = hash & (kRouteTableSize - 1);
+
+    for (uint32_t probe = 0; probe < kRouteTableSize; probe++) {
+        xpcRoute_t *r = gRouteTable[i];
+        if (!r) {
+            return NULL;
+        }
+        if ((r->hash == hash) && !strcmp(r->key, key)) {
+            return r;
+        }
+        i = (i + 1) & (kRouteTableSize - 1);
+    }
+    return NULL;
+}
+
+bool PMXPCRouterRegister(const char *key, PMXPCRouteHandler handler, uint32_t flags)
+{
+    xpcRoute_t *r;
+    uint32_t i;
+
+    if (!key || !handler) {
+        return false;
+    }
+    if (lookupRoute(key)) {
+        ERROR_LOG("XPC route for \"%s\" is already registered\n", key);
+        return false;
+    }
+    if (gRouteCnt >= kMaxRoutes) {
+        ERROR_LOG("Failed to register XPC route \"%s\". Route table is full\n", key);
+        return false;
+    }
+
+    r = &gRoutes[gRouteCnt];
+    r->key = key;
+    r->hash = routeKeyHash(key);
+    r->order = gRouteCnt;
+    r->flags = flags;
+    r->handler = handler;
+
+    i = r->hash & (kRouteTableSize - 1);
+    while (gRouteTable[i]) {
+        i = (i + 1) & (kRouteTableSize - 1);
+    }
+    gRouteTable[i] = r;
+    gRouteCnt++;
+
+    return true;
+}
+
+static inline uint32_t histBucket(uint64_t ns)
+{
+    uint64_t us = ns / NSEC_PER_USEC;
+    uint32_t b = 0;
+
+    while (us && (b < kRouteHistBuckets - 1)) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+bool PMXPCRouterDispatch(xpc_connection_t peer, xpc_object_t msg)
+{
+    __block xpcRoute_t      *route = NULL;
+    __block xpc_object_t    value = NULL;
+    uint64_t                start, elapsed;
+
+    // Messages carry a handful of keys; probe the table once for each of them
+    xpc_dictionary_apply(msg, ^bool(const char *key, xpc_object_t v) {
+        xpcRoute_t *r = lookupRoute(key);
+        if (r && (!route || (r->order < route->order))) {
+            route = r;
+            value = v;
+        }
+        return (!route || (route->order != 0));
+    });
+
+    if (!route) {
+        gUnroutedCnt++;
+        return false;
+    }
+
+    start = mach_absolute_time();
+    route->handler(peer, (route->flags & kPMXPCRoutePassValue) ? value : msg);
+    elapsed = mach_absolute_time() - start;
+
+    if (gRouterTimebase.denom == 0) {
+        mach_timebase_info(&gRouterTimebase);
+    }
+    elapsed = elapsed * gRouterTimebase.numer / gRouterTimebase.denom;
+
+    route->count++;
+    route->totalNs += elapsed;
+    if (elapsed > route->maxNs) {
+        route->maxNs = elapsed;
+    }
+    route->histogram[histBucket(elapsed)]++;
+
+    return true;
+}
+
+void PMXPCRouterLogStats(void)
+{
+    char    hist[kRouteHistBuckets * 11 + 1];
+    size_t  len;
+
+    for (uint32_t i = 0; i < gRouteCnt; i++) {
+        xpcRoute_t *r = &gRoutes[i];
+        if (!r->count) {
+            continue;
+        }
+
+        len = 0;
+        hist[0] = 0;
+        for (uint32_t b = 0; b < kRouteHistBuckets; b++) {
+            len += snprintf(hist + len, sizeof(hist) - len, "%s%u", b ? "," : "", r->histogram[b]);
+            if (len >= sizeof(hist)) {
+                break;
+            }
+        }
+        INFO_LOG("XPC route \"%{public}s\": count:%llu avg:%lluus max:%lluus log2(us) hist:[%{public}s]\n",
+                 r->key, r->count, (r->totalNs / r->count) / NSEC_PER_USEC,
+                 r->maxNs / NSEC_PER_USEC, hist);
+    }
+    if (gUnroutedCnt) {
+        INFO_LOG("XPC router: %llu messages without a matching route\n", gUnroutedCnt);
+    }
+}
+
+static void setRouteNumber(CFMutableDictionaryRef dict, CFStringRef key, uint64_t value)
+{
+    CFNumberRef num = CFNumberCreate(0, kCFNumberSInt64Type, &value);
+
+    if (num) {
+        CFDictionarySetValue(dict, key, num);
+        CFRelease(num);
+    }
+}
+
+// Bucket b counts calls that took [2^(b-1), 2^b) usecs, bucket 0 those under 1us
+static void setRouteHistogram(CFMutableDictionaryRef dict, CFStringRef key, const uint32_t *histogram)
+{
+    CFMutableArrayRef   buckets = CFArrayCreateMutable(0, kRouteHistBuckets, &kCFTypeArrayCallBacks);
+
+    if (!buckets) {
+        return;
+    }
+    for (uint32_t b = 0; b < kRouteHistBuckets; b++) {
+        CFNumberRef num = CFNumberCreate(0, kCFNumberSInt32Type, &histogram[b]);
+
+        if (num) {
+            CFArrayAppendValue(buckets, num);
+            CFRelease(num);
+        }
+    }
+    CFDictionarySetValue(dict, key, buckets);
+    CFRelease(buckets);
+}
+
+os_state_data_t PMXPCRouterCopyStateData(void)
+{
+    CFMutableDictionaryRef  state = NULL;
+    CFMutableDictionaryRef  route = NULL;
+    CFDataRef               data = NULL;
+    CFStringRef             key = NULL;
+    os_state_data_t         osd = NULL;
+    CFIndex                 len;
+
+    state = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!state) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < gRouteCnt; i++) {
+        xpcRoute_t *r = &gRoutes[i];
+
+        route = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        key = CFStringCreateWithCString(0, r->key, kCFStringEncodingUTF8);
+        if (route && key) {
+            setRouteNumber(route, CFSTR("Count"), r->count);
+            setRouteNumber(route, CFSTR("AvgUsecs"), r->count ? (r->totalNs / r->count) / NSEC_PER_USEC : 0);
+            setRouteNumber(route, CFSTR("MaxUsecs"), r->maxNs / NSEC_PER_USEC);
+            setRouteHistogram(route, CFSTR("Log2UsecsHistogram"), r->histogram);
+            CFDictionarySetValue(state, key, route);
+        }
+        if (route) {
+            CFRelease(route);
+        }
+        if (key) {
+            CFRelease(key);
+        }
+    }
+    setRouteNumber(state, CFSTR("Unrouted"), gUnroutedCnt);
+
+    data = CFPropertyListCreateData(0, state, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    CFRelease(state);
+    if (!data) {
+        return NULL;
+    }
+
+    len = CFDataGetLength(data);
+    osd = calloc(1, OS_STATE_DATA_SIZE_NEEDED(len));
+    if (osd) {
+        osd->osd_type = OS_STATE_DATA_SERIALIZED_NSCF_OBJECT;
+        osd->osd_data_size = (uint32_t)len;
+        strlcpy(osd->osd_title, "powerd XPC routes", sizeof(osd->osd_title));
+        CFDataGetBytes(data, CFRangeMake(0, len), (UInt8 *)osd->osd_data);
+    }
+    CFRelease(data);
+
+    return osd;
+}
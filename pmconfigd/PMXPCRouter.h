@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef PMXPCRouter_h
+#define PMXPCRouter_h
+
+#include <xpc/xpc.h>
+#include <os/state_private.h>
+
+/*
+ * Routes incoming powerd XPC dictionaries to their handlers.
+ *
+ * Each message is identified by the one well-known key it carries
+ * (kAssertionCreateMsg, kClaimSystemWakeEvent, ...). Routes are kept in
+ * an open-addressed table keyed by that string, so dispatch costs one
+ * hash probe per key present in the message instead of one
+ * xpc_dictionary_get_value() per registered message type.
+ */
+
+// Handler receives the value stored under the route key instead of the
+// whole message dictionary.
+#define kPMXPCRoutePassValue        0x1
+
+typedef void (*PMXPCRouteHandler)(xpc_object_t peer, xpc_object_t msg);
+
+/*
+ * Registers a handler for messages carrying 'key'. 'key' must be a string
+ * constant that outlives the daemon. Routes registered earlier win when a
+ * message carries more than one registered key.
+ * Must be called on the PM main queue.
+ */
+__private_extern__ bool PMXPCRouterRegister(const char *key, PMXPCRouteHandler handler, uint32_t flags);
+
+/*
+ * Dispatches 'msg' to the matching route. Returns false if no route matched.
+ */
+__private_extern__ bool PMXPCRouterDispatch(xpc_connection_t peer, xpc_object_t msg);
+
+__private_extern__ void PMXPCRouterLogStats(void);
+
+/*
+ * Returns per-route call counts, latencies and log2(usecs) latency
+ * histograms for an os_state handler. Caller frees the result.
+ */
+__private_extern__ os_state_data_t PMXPCRouterCopyStateData(void);
+
+#endif /* PMXPCRouter_h */
@@ -58,6 +58,8 @@
 #include "PrivateLib.h"
 #include "BatteryTimeRemaining.h"
 #include "PMAssertions.h"
+#include "PMLogQueue.h"
+#include "PMClock.h"
 #include "PMSettings.h"
 #include "PMAssertions.h"
 #include "adaptiveDisplay.h"
@@ -119,6 +121,7 @@ static uint64_t nextFDREventDue = 0;
 static void logASLMessageHibernateStatistics(void);
 
 static void logASLAppWakeReason(const char * ident, const char * reason);
+STATIC void decodeWakeReasonInfo(CFStringRef reason, CFStringRef type, CFStringRef claimedBy);
 
 
 typedef struct {
@@ -128,7 +131,6 @@ typedef struct {
     CFArrayRef      claimedWakeEventsArray;
     CFStringRef     claimedWake;
     CFStringRef     interpretedWake;
-    CFMutableArrayRef      appWakeReasonArray;
 } PowerEventReasons;
 
 static PowerEventReasons     reasons = {
@@ -137,10 +139,28 @@ static PowerEventReasons     reasons = {
         CFSTR(""),
         NULL,
         NULL,
-        NULL,
         NULL
         };
 
+/*
+ * Wake reasons claimed by apps during the current wake, hashed by reason and
+ * truncated to whole UTF-8 characters that fit kWakeReasonStrLen. Cleared by
+ * _resetWakeReason(). The table doubles whenever it would be more than half
+ * full and keeps its size across wakes.
+ */
+#define kAppWakeClaimMinSlots   16
+
+typedef struct {
+    uint32_t        hash;
+    uint32_t        count;
+    char            reason[kWakeReasonStrLen];
+} appWakeClaim_t;
+
+static PMWakeReasonInfo     wakeInfo;
+static appWakeClaim_t       *appWakeClaims = NULL;
+static uint32_t             appWakeClaimSlots = 0;      // Power of 2
+static uint32_t             appWakeClaimReasons = 0;
+
 /******
  * Do not remove DUMMY macros
  *
@@ -208,6 +228,25 @@ __private_extern__ dispatch_queue_t         _getPMMainQueue(void)
     return pmRLS;
 }
 
+/*
+ * Concurrent queue serving read-only MIG requests from published snapshots.
+ * Created inactive; powerd_init() activates it once all subsystems are primed.
+ */
+__private_extern__ dispatch_queue_t         _getPMReadQueue(void)
+{
+    static dispatch_queue_t     pmReadQ = NULL;
+    static dispatch_once_t      onceToken;
+
+    dispatch_once(&onceToken, ^{
+        dispatch_queue_attr_t attr;
+
+        attr = dispatch_queue_attr_make_initially_inactive(DISPATCH_QUEUE_CONCURRENT);
+        pmReadQ = dispatch_queue_create("Power Management read queue", attr);
+    });
+
+    return pmReadQ;
+}
+
 
 asl_object_t getSleepCntObject(char *store)
 {
@@ -451,14 +490,18 @@ __private_extern__ void _resetWakeReason( )
     if (reasons.platformWakeType)           CFRelease(reasons.platformWakeType);
     if (reasons.claimedWake)        CFRelease(reasons.claimedWake);
     if (isA_CFArray(reasons.claimedWakeEventsArray))   CFRelease(reasons.claimedWakeEventsArray);
-    if (reasons.appWakeReasonArray)     CFRelease(reasons.appWakeReasonArray);
 
     reasons.interpretedWake         = NULL;
     reasons.claimedWake             = NULL;
     reasons.claimedWakeEventsArray  = NULL;
     reasons.platformWakeReason              = CFSTR("");
     reasons.platformWakeType                = CFSTR("");
-    reasons.appWakeReasonArray              = NULL;
+
+    bzero(&wakeInfo, sizeof(wakeInfo));
+    if (appWakeClaims) {
+        bzero(appWakeClaims, appWakeClaimSlots * sizeof(appWakeClaim_t));
+    }
+    appWakeClaimReasons = 0;
 }
 
 #ifndef  kIOPMDriverWakeEventsKey
@@ -542,42 +585,193 @@ __private_extern__ void _updateWakeReason
         mt2PublishSleepWakeInfo(reasons.platformWakeType, reasons.platformWakeType, true);
     }
 
+    decodeWakeReasonInfo(reasons.platformWakeReason, reasons.platformWakeType, reasons.claimedWake);
+
     getPlatformWakeReason(wakeReason, wakeType);
     return ;
 }
 
-// Checks if the specified wakeReason exists in the current claimed app wake reasons
-bool checkForAppWakeReason(CFStringRef wakeReason)
+/*
+ * Copies as much of 'str' as fits into 'buf', always NUL terminated and never
+ * splitting a UTF-8 sequence. Wake reasons can be longer than the buffers.
+ */
+static void copyTruncatedCString(CFStringRef str, char *buf, size_t len)
 {
-    CFIndex count;
+    CFIndex used = 0;
 
-    if (!isA_CFArray(reasons.appWakeReasonArray) || !isA_CFString(wakeReason)) {
-        return false;
+    buf[0] = 0;
+    if (!isA_CFString(str) || !len) {
+        return;
+    }
+    CFStringGetBytes(str, CFRangeMake(0, CFStringGetLength(str)), kCFStringEncodingUTF8, 0, false,
+                     (UInt8 *)buf, (CFIndex)len - 1, &used);
+    buf[used] = 0;
+}
+
+static bool stringContains(CFStringRef str, CFStringRef substr)
+{
+    return (CFStringFind(str, substr, 0).location != kCFNotFound);
+}
+
+/*
+ * Fills in wakeInfo from the CF wake reasons, leaving app claims untouched.
+ */
+STATIC void decodeWakeReasonInfo(CFStringRef reason, CFStringRef type, CFStringRef claimedBy)
+{
+    copyTruncatedCString(reason, wakeInfo.reason, sizeof(wakeInfo.reason));
+    copyTruncatedCString(type, wakeInfo.type, sizeof(wakeInfo.type));
+    copyTruncatedCString(claimedBy, wakeInfo.claimedBy, sizeof(wakeInfo.claimedBy));
+
+    wakeInfo.flags = 0;
+    if (CFEqual(type, kIOPMRootDomainWakeTypeMaintenance)) {
+        wakeInfo.flags |= kWakeTypeMaintenanceFlag;
+    } else if (CFEqual(type, kIOPMRootDomainWakeTypeSleepService)) {
+        wakeInfo.flags |= kWakeTypeSleepServiceFlag;
+    } else if (CFEqual(type, kIOPMRootDomainWakeTypeNotification)) {
+        wakeInfo.flags |= kWakeTypeNotificationFlag;
+    } else if (CFEqual(type, kIOPMRootDomainWakeTypeNetwork)) {
+        wakeInfo.flags |= kWakeTypeNetworkFlag;
+    }
+    // Checked on the full reason, which may not fit in wakeInfo.reason
+    if (stringContains(reason, CFSTR("RTC")) || stringContains(reason, CFSTR("rtc"))) {
+        wakeInfo.flags |= kWakeReasonRTCFlag;
+    }
+    wakeInfo.wakeTime = mach_absolute_time();
+}
+
+__private_extern__ const PMWakeReasonInfo *getWakeReasonInfo(void)
+{
+    return &wakeInfo;
+}
+
+/* FNV-1a */
+static uint32_t appWakeClaimHash(const char *reason)
+{
+    uint32_t h = 2166136261u;
+
+    while (*reason) {
+        h ^= (uint8_t)*reason++;
+        h *= 16777619u;
     }
-    count = CFArrayGetCount(reasons.appWakeReasonArray);
+    return h;
+}
 
-    for (CFIndex i = 0; i < count; i++) {
-        CFTypeRef value = CFArrayGetValueAtIndex(reasons.appWakeReasonArray, i);
+/*
+ * Copies 'str' into 'buf', cut at the last whole UTF-8 character that fits.
+ * Matches what copyTruncatedCString() does for CF strings, so a reason claimed
+ * as a C string and looked up as a CFString land in the same slot.
+ */
+static void copyTruncatedReason(const char *str, char *buf, size_t len)
+{
+    size_t n = strnlen(str, len);
 
-        if (isA_CFString(value) && (CFStringCompare(wakeReason, value, 0) == kCFCompareEqualTo)) {
-            return true;
+    if (n == len) {
+        n = len - 1;
+        while (n && ((str[n] & 0xC0) == 0x80)) {
+            n--;
         }
     }
-    return false;
+    memcpy(buf, str, n);
+    buf[n] = 0;
 }
 
-STATIC void setAppWakeReason(CFStringRef reasonStr)
+/*
+ * Returns the slot holding 'reason', or the empty slot it would go into.
+ * The table is never more than half full, so the probe always terminates.
+ */
+static appWakeClaim_t *lookupAppWakeClaim(const char *reason, uint32_t hash)
+{
+    uint32_t i = hash & (appWakeClaimSlots - 1);
+
+    while (appWakeClaims[i].count) {
+        if ((appWakeClaims[i].hash == hash) && !strncmp(appWakeClaims[i].reason, reason, kWakeReasonStrLen)) {
+            break;
+        }
+        i = (i + 1) & (appWakeClaimSlots - 1);
+    }
+    return &appWakeClaims[i];
+}
+
+// Doubles the claim table and rehashes the claims made so far
+static bool growAppWakeClaims(void)
 {
-    if (reasons.appWakeReasonArray == NULL) {
-        reasons.appWakeReasonArray = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    uint32_t        oldSlots = appWakeClaimSlots;
+    appWakeClaim_t  *old = appWakeClaims;
+    appWakeClaim_t  *claims;
+
+    claims = calloc(oldSlots ? (2 * oldSlots) : kAppWakeClaimMinSlots, sizeof(appWakeClaim_t));
+    if (!claims) {
+        return false;
     }
-    if (!reasons.appWakeReasonArray) {
-        ERROR_LOG("Failed to create array to hold app wake reasons\n");
+    appWakeClaims = claims;
+    appWakeClaimSlots = oldSlots ? (2 * oldSlots) : kAppWakeClaimMinSlots;
+    for (uint32_t i = 0; i < oldSlots; i++) {
+        if (old[i].count) {
+            *lookupAppWakeClaim(old[i].reason, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+// Checks if the specified wakeReason exists in the current claimed app wake reasons
+bool checkForAppWakeReasonCString(const char *wakeReason)
+{
+    char    buf[kWakeReasonStrLen];
+
+    if (!wakeReason || !appWakeClaimReasons) {
+        return false;
+    }
+    copyTruncatedReason(wakeReason, buf, sizeof(buf));
+    return (lookupAppWakeClaim(buf, appWakeClaimHash(buf))->count != 0);
+}
+
+bool checkForAppWakeReason(CFStringRef wakeReason)
+{
+    char    buf[kWakeReasonStrLen];
+
+    if (!appWakeClaimReasons || !isA_CFString(wakeReason)) {
+        return false;
+    }
+    copyTruncatedCString(wakeReason, buf, sizeof(buf));
+    return checkForAppWakeReasonCString(buf);
+}
+
+static void recordAppWakeClaim(const char *reason)
+{
+    char            buf[kWakeReasonStrLen];
+    uint32_t        hash;
+    appWakeClaim_t  *claim;
+
+    wakeInfo.appClaimCount++;
+    wakeInfo.lastAppClaimTime = mach_absolute_time();
+
+    if ((appWakeClaimReasons >= appWakeClaimSlots / 2) && !growAppWakeClaims()) {
+        ERROR_LOG("Failed to grow app wake reason table. Dropping \"%s\"\n", reason);
         return;
     }
+    copyTruncatedReason(reason, buf, sizeof(buf));
+    hash = appWakeClaimHash(buf);
+    claim = lookupAppWakeClaim(buf, hash);
 
-    CFArrayAppendValue(reasons.appWakeReasonArray, reasonStr);
+    if (!claim->count) {
+        claim->hash = hash;
+        strlcpy(claim->reason, buf, sizeof(claim->reason));
+        appWakeClaimReasons++;
+    }
+    claim->count++;
+}
+
+STATIC void setAppWakeReason(CFStringRef reasonStr)
+{
+    char    buf[kWakeReasonStrLen];
 
+    if (!isA_CFString(reasonStr)) {
+        ERROR_LOG("Invalid app wake reason\n");
+        return;
+    }
+    copyTruncatedCString(reasonStr, buf, sizeof(buf));
+    recordAppWakeClaim(buf);
 }
 __private_extern__ void appClaimWakeReason(xpc_connection_t peer, xpc_object_t claim)
 {
@@ -587,7 +781,6 @@ __private_extern__ void appClaimWakeReason(xpc_connection_t peer, xpc_object_t c
     CFTypeRef  entitled_DarkWakeControl = NULL;
     audit_token_t token;
     pid_t   pid;
-    CFStringRef reasonStr = NULL;
 
     if (!claim || !peer) {
         return;
@@ -610,12 +803,10 @@ __private_extern__ void appClaimWakeReason(xpc_connection_t peer, xpc_object_t c
     logASLAppWakeReason(id, reason);
     INFO_LOG("Wake reason: \"%s\"  identity: \"%s\" \n", reason, id);
 
-    reasonStr = CFStringCreateWithCString(NULL, reason, kCFStringEncodingUTF8);
-    if (!reasonStr) {
-        ERROR_LOG("Failed to create string to hold app wake reason\n");
+    if (!reason) {
         goto exit;
     }
-    setAppWakeReason(reasonStr);
+    recordAppWakeClaim(reason);
 
 exit:
     if (secTask) {
@@ -624,9 +815,6 @@ exit:
     if (entitled_DarkWakeControl) {
         CFRelease(entitled_DarkWakeControl);
     }
-    if (reasonStr) {
-        CFRelease(reasonStr);
-    }
 }
 
 __private_extern__ void getPlatformWakeReason
@@ -1017,7 +1205,7 @@ __private_extern__ void logASLMessageSMCShutdownCause(int shutdownCause)
 
 
 static void attachTCPKeepAliveKeys(
-                                   aslmsg m,
+                                   pmlogmsg_t m,
                                    char *tcpString,
                                    unsigned int tcpStringLen)
 
@@ -1028,11 +1216,11 @@ static void attachTCPKeepAliveKeys(
     IOPlatformCopyFeatureDefault(kIOPlatformTCPKeepAliveDuringSleep, &platformSupport);
     if (kCFBooleanTrue == platformSupport)
     {
-        asl_set(m, kPMASLTCPKeepAlive, "supported");
+        pmlog_set(m, kPMASLTCPKeepAlive, "supported");
         
         getTCPKeepAliveState(keepAliveString, sizeof(keepAliveString));
 
-        asl_set(m, kPMASLTCPKeepAliveExpired, keepAliveString);
+        pmlog_set(m, kPMASLTCPKeepAliveExpired, keepAliveString);
         snprintf(tcpString, tcpStringLen, "TCPKeepAlive=%s", keepAliveString);
     }
 
@@ -1049,7 +1237,7 @@ __private_extern__ void logASLMessageSleep(
     int   sleepType
 )
 {
-    aslmsg                  m;
+    pmlogmsg_t              m;
     char                    uuidString[150];
     char                    source[10];
     uint32_t                percentage = 0;
@@ -1086,35 +1274,34 @@ __private_extern__ void logASLMessageSleep(
 
     getPowerState(&pwrSrc, &percentage);
     INFO_LOG("%{public}s", messageString);
-    m = new_msg_pmset_log();
+    m = pmlog_new(kPMLogCategorySleepWake);
     if (success) {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMSleep);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMSleep);
 
         snprintf(numbuf, 10, "%d", percentage);
-        asl_set(m, kPMASLBatteryPercentageKey, numbuf);
+        pmlog_set(m, kPMASLBatteryPercentageKey, numbuf);
 
-        asl_set(m, kPMASLPowerSourceKey, (pwrSrc == kACPowered) ? "AC" : "Batt");
+        pmlog_set(m, kPMASLPowerSourceKey, (pwrSrc == kACPowered) ? "AC" : "Batt");
 
         attachTCPKeepAliveKeys(m, tcpKeepAliveString, sizeof(tcpKeepAliveString));
         snprintf(messageString, sizeof(messageString), "%s:%s",
                 messageString, tcpKeepAliveString);
     }
     else {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
     }
 
     // UUID
     if (uuidStr) {
-        asl_set(m, kPMASLUUIDKey, uuidStr);  // Caller Provided
+        pmlog_set(m, kPMASLUUIDKey, uuidStr);  // Caller Provided
     } else if (_getUUIDString(uuidString, sizeof(uuidString))) {
-        asl_set(m, kPMASLUUIDKey, uuidString);
+        pmlog_set(m, kPMASLUUIDKey, uuidString);
     }
     
     
-    asl_set(m, kPMASLSignatureKey, sig);
-    asl_set(m, ASL_KEY_MSG, messageString);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, kPMASLSignatureKey, sig);
+    pmlog_set(m, ASL_KEY_MSG, messageString);
+    pmlog_send(m);
 
     if (isA_installEnvironment()) {
         syslog(LOG_INFO | LOG_INSTALL, "%s battCap:%s pwrSrc: %s\n",
@@ -1133,7 +1320,7 @@ __private_extern__ void logASLMessageWake(
     WakeTypeEnum dark_wake
 )
 {
-    aslmsg                  m;
+    pmlogmsg_t              m;
     char                    numbuf[15];
     CFStringRef             tmpStr = NULL;
     char                    claimed[255];
@@ -1151,11 +1338,11 @@ __private_extern__ void logASLMessageWake(
     bool                    success = true;
     PowerSources            pwrSrc = kACPowered;
 
-    m = new_msg_pmset_log();
-    asl_set(m, kPMASLSignatureKey, sig);
+    m = pmlog_new(kPMLogCategorySleepWake);
+    pmlog_set(m, kPMASLSignatureKey, sig);
 
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
         if (strncmp(buf, prev_uuid, sizeof(prev_uuid))) {
               // New sleep/wake cycle.
               snprintf(prev_uuid, sizeof(prev_uuid), "%s", buf);
@@ -1180,8 +1367,8 @@ __private_extern__ void logASLMessageWake(
         detailString = wakeReasonBuf;
 
         snprintf(battCap, 10, "%d", percentage);
-        asl_set(m, kPMASLBatteryPercentageKey, battCap);
-        asl_set(m, kPMASLPowerSourceKey, (pwrSrc == kACPowered) ? "AC" : "BATT");
+        pmlog_set(m, kPMASLBatteryPercentageKey, battCap);
+        pmlog_set(m, kPMASLPowerSourceKey, (pwrSrc == kACPowered) ? "AC" : "BATT");
     } else {
         snprintf(buf, sizeof(buf), "Failure during wake: %s : %s", 
                  failureStr, (sig) ? sig : "");
@@ -1230,22 +1417,22 @@ __private_extern__ void logASLMessageWake(
             
             snprintf(key, sizeof(key), "%s-%d", kPMASLClaimedEventKey, keyIndex);
             
-            asl_set(m, key, claimed);
+            pmlog_set(m, key, claimed);
             keyIndex++;
         }
     }
 
     if (!success)
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
     }
     else if (dark_wake == kIsDarkWake)
     {
         darkWakeCnt++;
         snprintf(buf, sizeof(buf), "%s", "DarkWake");
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMDarkWake);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMDarkWake);
         snprintf(numbuf, sizeof(numbuf), "%d", darkWakeCnt);
-        asl_set(m, kPMASLValueKey, numbuf);
+        pmlog_set(m, kPMASLValueKey, numbuf);
     }
     else if (dark_wake == kIsDarkToFullWake)
     {
@@ -1256,12 +1443,12 @@ __private_extern__ void logASLMessageWake(
         if (wakeType) {
             CFRelease(wakeType);
         }
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
         snprintf(buf, sizeof(buf), "%s", "DarkWake to FullWake");
     }
     else
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
         snprintf(buf, sizeof(buf), "%s", "Wake");
     }
 
@@ -1282,12 +1469,11 @@ __private_extern__ void logASLMessageWake(
 
     INFO_LOG("%{public}s\n", buf);
     INFO_LOG("WakeDetails: %s", claimed);
-    asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    pmlog_set(m, ASL_KEY_MSG, buf);
+    pmlog_send(m);
     if (success) {
         logASLMessageHibernateStatistics( );
     }
-    asl_release(m);
 
     if (isA_installEnvironment()) {
         syslog(LOG_INFO | LOG_INSTALL, "%s battCap:%s pwrSrc: %s\n",
@@ -1507,7 +1693,7 @@ __private_extern__ void logASLMessagePMConnectionResponse(
     int             notificationBits
 )
 {
-    aslmsg                  m;
+    pmlogmsg_t              m;
     char                    appName[128];
     char                    *appNamePtr = NULL;
     int                     time = 0;
@@ -1519,35 +1705,35 @@ __private_extern__ void logASLMessagePMConnectionResponse(
     if (!logSourceString)
         return;
     
-    m = new_msg_pmset_log();
+    m = pmlog_new(kPMLogCategoryAppResponse);
 
     if (responseTypeString && CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseTimedOut)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseTimedOut);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseTimedOut);
         snprintf(qualifier, sizeof(qualifier), "timed out");
         timeout = true;
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseCancel)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseCancel);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseCancel);
         snprintf(qualifier, sizeof(qualifier), "is to cancel state change");
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseSlow)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseSlow);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseSlow);
         snprintf(qualifier, sizeof(qualifier), "is slow");
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kPMASLDomainSleepServiceCapApp)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceCapApp);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceCapApp);
         snprintf(qualifier, sizeof(qualifier), "exceeded SleepService cap");
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kPMASLDomainAppResponse)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseReceived);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseReceived);
         snprintf(qualifier, sizeof(qualifier), "received");
     } else {
-        asl_release(m);
+        pmlog_discard(m);
         return;
     }
 
@@ -1563,18 +1749,18 @@ __private_extern__ void logASLMessagePMConnectionResponse(
         appNamePtr = "AppNameUnknown";
     }
 
-    asl_set(m, kPMASLSignatureKey, appNamePtr);
+    pmlog_set(m, kPMASLSignatureKey, appNamePtr);
 
     // UUID
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
     }
 
     // Value == Time
     if (responseTime) {
         if (CFNumberGetValue(responseTime, kCFNumberIntType, &time)) {
             snprintf(buf, sizeof(buf), "%d", time);
-            asl_set(m, kPMASLValueKey, buf);
+            pmlog_set(m, kPMASLValueKey, buf);
         }
     }
 
@@ -1589,15 +1775,14 @@ __private_extern__ void logASLMessagePMConnectionResponse(
     if (notificationBits != -1)
        snprintf(buf, sizeof(buf), "%s (powercaps:0x%x)", buf, notificationBits);
 
-    asl_set(m, ASL_KEY_MSG, buf);
+    pmlog_set(m, ASL_KEY_MSG, buf);
 
     if (time != 0) {
        snprintf(buf, sizeof(buf), "%d ms", time);
-       asl_set(m, kPMASLDelayKey, buf);
+       pmlog_set(m, kPMASLDelayKey, buf);
     }
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 
     if (timeout) {
         mt2RecordAppTimeouts(reasons.sleepReason, appNameString);
@@ -1786,26 +1971,25 @@ __private_extern__ void logASLMessageExecutedWakeupEvent(CFStringRef requestedMa
 
 __private_extern__ void logASLMessageIgnoredDWTEmergency(void)
 {
-    aslmsg      m;
+    pmlogmsg_t  m;
     char        strbuf[125];
     char        tcpKeepAliveString[50];
 
     bzero(strbuf, sizeof(strbuf));
     bzero(tcpKeepAliveString, sizeof(tcpKeepAliveString));
 
-    m = new_msg_pmset_log();
+    m = pmlog_new(kPMLogCategorySleepWake);
     attachTCPKeepAliveKeys(m, tcpKeepAliveString, sizeof(tcpKeepAliveString));
     
-    asl_set(m, kPMASLDomainKey, kPMASLDomainThermalEvent);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainThermalEvent);
 
     snprintf(
         strbuf,
         sizeof(strbuf),
         "Ignored DarkWake thermal emergency signal %s", tcpKeepAliveString);
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 }
 
 __private_extern__ void logASLMessageSleepCanceledAtLastCall(
@@ -1813,19 +1997,19 @@ __private_extern__ void logASLMessageSleepCanceledAtLastCall(
                                bool sys_active,
                                bool pending_wakes)
 {
-    aslmsg      m;
+    pmlogmsg_t  m;
     char        strbuf[250];
     char        tcpKeepAliveString[50];
 
     bzero(strbuf, sizeof(strbuf));
     bzero(tcpKeepAliveString, sizeof(tcpKeepAliveString));
 
-    m = new_msg_pmset_log();
+    m = pmlog_new(kPMLogCategorySleepWake);
 
     if (tcpka_active)
         attachTCPKeepAliveKeys(m, tcpKeepAliveString, sizeof(tcpKeepAliveString));
 
-    asl_set(m, kPMASLDomainKey, kPMASLDomainSleepRevert);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainSleepRevert);
 
     snprintf( strbuf, sizeof(strbuf),
         "Sleep in process aborted due to ");
@@ -1836,10 +2020,9 @@ __private_extern__ void logASLMessageSleepCanceledAtLastCall(
     if (pending_wakes)
         snprintf(strbuf, sizeof(strbuf), "%s (Pending system wake request)", strbuf);
 
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 }
 
 __private_extern__ void logASLBatteryHealthChanged(const char *health,
@@ -1899,7 +2082,7 @@ __private_extern__ void logASLLowBatteryWarning(IOPSLowBatteryWarningLevel level
 
 __private_extern__ void logASLSleepPreventers(int preventerType)
 {
-    aslmsg      m;
+    pmlogmsg_t  m;
     char        strbuf[125];
     CFArrayRef  preventers;
     IOReturn    ret;
@@ -1920,8 +2103,8 @@ __private_extern__ void logASLSleepPreventers(int preventerType)
         count = CFArrayGetCount(preventers);
     }
 
-    m = new_msg_pmset_log();
-    asl_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
+    m = pmlog_new(kPMLogCategorySleepPreventers);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
 
     snprintf(strbuf, sizeof(strbuf), "Kernel %s sleep preventers: ",
              (preventerType == kIOPMIdleSleepPreventers) ? "Idle" : "System");
@@ -1946,10 +2129,9 @@ __private_extern__ void logASLSleepPreventers(int preventerType)
         strbuf[sizeof(strbuf)-4] = strbuf[sizeof(strbuf)-3] = strbuf[sizeof(strbuf)-2] = '.';
         strbuf[sizeof(strbuf)-1] = '\0';
     }
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 
     if (preventers)
     {
@@ -1971,6 +2153,31 @@ __private_extern__ void logASLSleepPreventers(int preventerType)
  * MessageTracer2 DarkWake Keys
  */
 
+/*
+ * Per-process MT2 counters. Process names are interned into MT2Aggregator's
+ * procs[] the first time they are seen in a reporting period; records then
+ * bump a fixed counter slot, and the CF/ASL payload is only built when the
+ * reports are published.
+ */
+typedef enum {
+    kMT2ProcBackgroundTasks = 0,        /* com.apple.darkwake.backgroundtasks */
+    kMT2ProcPushTasks,                  /* com.apple.darkwake.pushservicetasks */
+    kMT2ProcPushTimeouts,               /* com.apple.darkwake.pushservicetimeouts */
+    kMT2ProcIdleSleepAckTimeouts,       /* com.apple.ackto.idlesleep */
+    kMT2ProcDemandSleepAckTimeouts,     /* com.apple.ackto.demandsleep */
+    kMT2ProcDarkWakeSleepAckTimeouts,   /* com.apple.ackto.demandsleep, dark wake */
+    kMT2ProcDomainCount
+} MT2ProcDomain;
+
+#define kMT2MaxProcesses            256     /* Multiple of 64 */
+#define kMT2ProcessSlots            512     /* Power of 2, 2x kMT2MaxProcesses */
+
+typedef struct {
+    CFStringRef                 name;
+    CFHashCode                  hash;
+    uint32_t                    counts[kMT2ProcDomainCount];
+} MT2Process;
+
 typedef struct {
     CFAbsoluteTime              startedPeriod;
     dispatch_source_t           nextFireSource;
@@ -1985,18 +2192,13 @@ typedef struct {
     uint16_t                    wakeEvents[kWakeStateCount];
     /* for domain com.apple.darkwake.thermal */
     uint16_t                    thermalEvents[kThermalStateCount];
-    /* for domain com.apple.darkwake.backgroundtasks */
-    CFMutableSetRef             alreadyRecordedBackground;
-    CFMutableDictionaryRef      tookBackground;
-    /* for domain com.apple.darkwake.pushservicetasks */
-    CFMutableSetRef             alreadyRecordedPush;
-    CFMutableDictionaryRef      tookPush;
-    /* for domain com.apple.darkwake.pushservicetasktimeout */
-    CFMutableSetRef             alreadyRecordedPushTimeouts;
-    CFMutableDictionaryRef      timeoutPush;
-    CFMutableDictionaryRef      idleSleepAppTimeouts;
-    CFMutableDictionaryRef      demandSleepAppTimeouts;
-    CFMutableDictionaryRef      darkwakeSleepAppTimeouts;
+    /* per-process counters for the MT2ProcDomain domains */
+    uint32_t                    procCount;
+    bool                        procTableFull;
+    MT2Process                  procs[kMT2MaxProcesses];
+    uint16_t                    procSlots[kMT2ProcessSlots];    /* 1-based index into procs, 0 if empty */
+    /* processes already counted in the current dark wake, one bitset per domain */
+    uint64_t                    alreadyRecorded[kMT2ProcDomainCount][kMT2MaxProcesses / 64];
 } MT2Aggregator;
 
 static const uint64_t   kMT2CheckIntervalTimer = 4ULL*60ULL*60ULL*NSEC_PER_SEC;     /* Check every 4 hours */
@@ -2013,15 +2215,9 @@ void initializeMT2Aggregator(void)
         if (mt2->nextFireSource) {
             dispatch_release(mt2->nextFireSource);
         }
-        CFRelease(mt2->alreadyRecordedBackground);
-        CFRelease(mt2->tookBackground);
-        CFRelease(mt2->alreadyRecordedPush);
-        CFRelease(mt2->tookPush);
-        CFRelease(mt2->alreadyRecordedPushTimeouts);
-        CFRelease(mt2->timeoutPush);
-        CFRelease(mt2->idleSleepAppTimeouts);
-        CFRelease(mt2->demandSleepAppTimeouts);
-        CFRelease(mt2->darkwakeSleepAppTimeouts);
+        for (uint32_t i = 0; i < mt2->procCount; i++) {
+            CFRelease(mt2->procs[i].name);
+        }
 
         bzero(mt2, sizeof(MT2Aggregator));
     } else {
@@ -2029,15 +2225,6 @@ void initializeMT2Aggregator(void)
         mt2 = calloc(1, sizeof(MT2Aggregator));
     }
     mt2->startedPeriod                      = CFAbsoluteTimeGetCurrent();
-    mt2->alreadyRecordedBackground          = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPush                = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPushTimeouts        = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->tookBackground                     = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->tookPush                           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->timeoutPush                        = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->idleSleepAppTimeouts               = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->demandSleepAppTimeouts             = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->darkwakeSleepAppTimeouts           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
 
     mt2->nextFireSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
     if (mt2->nextFireSource) {
@@ -2201,41 +2388,33 @@ static int mt2PublishDomainThermals(void)
     return sentCount;
 }
 
-static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
+static int mt2PublishDomainProcess(const char *appdomain, MT2ProcDomain domain)
 {
 #define kMT2KeyApp                      "com.apple.message.process"
 
-    CFStringRef         *keys;
-    uintptr_t           *counts;
     char                buf[2*kProcNameBufLen];
     int                 sendCount = 0;
-    long                appcount = 0;
-    int                 i = 0;
+    uint32_t            i = 0;
 
-    if (!mt2 || !apps || (0 == (appcount = CFDictionaryGetCount(apps))))
+    if (!mt2)
     {
         return 0;
     }
 
-    keys = (CFStringRef *)calloc(sizeof(CFStringRef), appcount);
-    counts = (uintptr_t *)calloc(sizeof(uintptr_t), appcount);
-
-    CFDictionaryGetKeysAndValues(apps, (const void **)keys, (const void **)counts);
-
-    for (i=0; i<appcount; i++)
+    for (i=0; i<mt2->procCount; i++)
     {
-        if (0 == counts[i]) {
+        if (0 == mt2->procs[i].counts[domain]) {
             continue;
         }
         aslmsg m = asl_new(ASL_TYPE_MSG);
         asl_set(m, "com.apple.message.domain", appdomain);
 
-        if (!CFStringGetCString(keys[i], buf, sizeof(buf), kCFStringEncodingUTF8)) {
+        if (!CFStringGetCString(mt2->procs[i].name, buf, sizeof(buf), kCFStringEncodingUTF8)) {
             snprintf(buf, sizeof(buf), "com.apple.message.%s", "Unknown");
         }
         asl_set(m, kMT2KeyApp, buf);
 
-        snprintf(buf, sizeof(buf), "%d", (int)counts[i]);
+        snprintf(buf, sizeof(buf), "%u", mt2->procs[i].counts[domain]);
         asl_set(m, "com.apple.message.count", buf);
 
         asl_log(NULL, m, ASL_LEVEL_ERR,"");
@@ -2244,9 +2423,6 @@ static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
 
     }
 
-    free(keys);
-    free(counts);
-
     return sendCount;
 }
 
@@ -2279,12 +2455,12 @@ void mt2PublishReports(void)
     {
         mt2PublishDomainWakes();
         mt2PublishDomainThermals();
-        mt2PublishDomainProcess(kMT2DomainPushTasks, mt2->tookPush);
-        mt2PublishDomainProcess(kMT2DomainPushTimeouts, mt2->timeoutPush);
-        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, mt2->tookBackground);
-        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, mt2->idleSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, mt2->demandSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, mt2->darkwakeSleepAppTimeouts);
+        mt2PublishDomainProcess(kMT2DomainPushTasks, kMT2ProcPushTasks);
+        mt2PublishDomainProcess(kMT2DomainPushTimeouts, kMT2ProcPushTimeouts);
+        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, kMT2ProcBackgroundTasks);
+        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, kMT2ProcIdleSleepAckTimeouts);
+        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, kMT2ProcDemandSleepAckTimeouts);
+        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, kMT2ProcDarkWakeSleepAckTimeouts);
 
         // Recyle the data structure for the next reporting.
         initializeMT2Aggregator();
@@ -2302,9 +2478,7 @@ void mt2DarkWakeEnded(void)
     if (!mt2) {
         return;
     }
-    CFSetRemoveAllValues(mt2->alreadyRecordedBackground);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPush);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPushTimeouts);
+    bzero(mt2->alreadyRecorded, sizeof(mt2->alreadyRecorded));
 }
 
 void mt2EvaluateSystemSupport(void)
@@ -2397,6 +2571,63 @@ void mt2RecordThermalEvent(uint32_t description)
     return;
 }
 
+/*
+ * Returns the index of 'name' in mt2->procs, adding it if needed, or -1 if
+ * the table is full for this reporting period.
+ */
+static int mt2InternProcess(CFStringRef name)
+{
+    CFHashCode  hash = CFHash(name);
+    uint32_t    i = (uint32_t)hash & (kMT2ProcessSlots - 1);
+    uint16_t    idx;
+
+    while ((idx = mt2->procSlots[i])) {
+        MT2Process *p = &mt2->procs[idx - 1];
+        if ((p->hash == hash) && CFEqual(p->name, name)) {
+            return idx - 1;
+        }
+        i = (i + 1) & (kMT2ProcessSlots - 1);
+    }
+
+    if (mt2->procCount >= kMT2MaxProcesses) {
+        if (!mt2->procTableFull) {
+            ERROR_LOG("MT2 process table is full. Dropping counts for %{public}@\n", name);
+            mt2->procTableFull = true;
+        }
+        return -1;
+    }
+
+    idx = mt2->procCount++;
+    mt2->procs[idx].name = CFRetain(name);
+    mt2->procs[idx].hash = hash;
+    mt2->procSlots[i] = idx + 1;
+    return idx;
+}
+
+/*
+ * Bumps 'name's counter for 'domain'. With 'oncePerDarkWake' set, a process
+ * is counted at most once until the next mt2DarkWakeEnded().
+ */
+static void mt2CountProcess(CFStringRef name, MT2ProcDomain domain, bool oncePerDarkWake)
+{
+    int         idx;
+    uint64_t    bit, *word;
+
+    if ((idx = mt2InternProcess(name)) < 0) {
+        return;
+    }
+
+    if (oncePerDarkWake) {
+        word = &mt2->alreadyRecorded[domain][idx / 64];
+        bit = 1ULL << (idx % 64);
+        if (*word & bit) {
+            return;
+        }
+        *word |= bit;
+    }
+    mt2->procs[idx].counts[domain]++;
+}
+
 /* PMConnection.c */
 bool isA_DarkWakeState(void);
 
@@ -2413,45 +2644,31 @@ void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
         return;
     }
 
-    if (!(processName = processInfoGetName(theAssertion->pinfo->pid))) {
-        processName = CFSTR("Unknown");
-    }
-
-    if (!(assertionType = CFDictionaryGetValue(theAssertion->props, kIOPMAssertionTypeKey))
+    // PushServiceTask may be aliased to the BackgroundTask kassert, so go by the type name
+    if (!(assertionType = PMInternGetString(theAssertion->typeStr))
         || (!CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask)
          && !CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask)))
     {
         return;
     }
 
+    if (!(processName = processInfoGetName(theAssertion->pinfo->pid))) {
+        processName = CFSTR("Unknown");
+    }
+
     if (CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask))
     {
         if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedBackground, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookBackground, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookBackground, processName, (void *)(uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedBackground, processName);
-            }
+            mt2CountProcess(processName, kMT2ProcBackgroundTasks, true);
         }
     }
-    else if (CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask))
+    else
     {
         if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPush, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookPush, processName, (void *)(uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPush, processName);
-            }
+            mt2CountProcess(processName, kMT2ProcPushTasks, true);
         }
         else if (kAssertionOpGlobalTimeout == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPushTimeouts, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->timeoutPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->timeoutPush, (const void *)processName, (void *)(uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPushTimeouts, processName);
-            }
+            mt2CountProcess(processName, kMT2ProcPushTimeouts, true);
         }
     }
 
@@ -2460,26 +2677,23 @@ void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
 
 void mt2RecordAppTimeouts(CFStringRef sleepReason, CFStringRef procName)
 {
-    CFMutableDictionaryRef dict;
+    MT2ProcDomain domain;
 
     if ( !mt2 || !isA_CFString(procName)) return;
 
     if (CFStringCompare(sleepReason, CFSTR(kIOPMIdleSleepKey), 0) == kCFCompareEqualTo) {
-        dict = mt2->idleSleepAppTimeouts;
+        domain = kMT2ProcIdleSleepAckTimeouts;
     }
     else  if ((CFStringCompare(sleepReason, CFSTR(kIOPMClamshellSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMPowerButtonSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMSoftwareSleepKey), 0) == kCFCompareEqualTo)) {
-        dict = mt2->demandSleepAppTimeouts;
+        domain = kMT2ProcDemandSleepAckTimeouts;
     }
     else {
-        dict = mt2->darkwakeSleepAppTimeouts;
+        domain = kMT2ProcDarkWakeSleepAckTimeouts;
     }
 
-    int x = (int)CFDictionaryGetValue(dict, procName);
-    x++;
-    CFDictionarySetValue(dict, (const void *)procName, (void *)(uintptr_t)x);
-
+    mt2CountProcess(procName, domain, false);
 }
 
 
@@ -2908,6 +3122,9 @@ __private_extern__ uint64_t monotonicTS2Secs(uint64_t tsc)
 /* Returns monotonic continuous time in secs */
 __private_extern__ uint64_t getMonotonicContinuousTime( )
 {
+    if (PMClockIsVirtual()) {
+        return PMClockMonotonicNs() / NSEC_PER_SEC;
+    }
     return monotonicTS2Secs(mach_continuous_time());
 }
 #endif
@@ -2915,6 +3132,9 @@ __private_extern__ uint64_t getMonotonicContinuousTime( )
 /* Returns monotonic time in secs */
 __private_extern__ uint64_t getMonotonicTime( )
 {
+    if (PMClockIsVirtual()) {
+        return PMClockMonotonicNs() / NSEC_PER_SEC;
+    }
     return monotonicTS2Secs(mach_absolute_time());
 }
 
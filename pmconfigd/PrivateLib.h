@@ -510,6 +510,32 @@ __private_extern__ void                 _updateWakeReason(CFStringRef *wakeReaso
 __private_extern__ void                 getPlatformWakeReason(CFStringRef *wakeReason, CFStringRef *wakeType);
 __private_extern__ void                 appClaimWakeReason(xpc_connection_t peer, xpc_object_t claim);
 __private_extern__ bool                 checkForAppWakeReason(CFStringRef wakeReason);
+__private_extern__ bool                 checkForAppWakeReasonCString(const char *wakeReason);
+
+/*
+ * Reasons for the current wake, decoded once per wake by _updateWakeReason()
+ * so that callers don't need to go through CF to ask why the system woke.
+ */
+#define kWakeReasonStrLen                   64
+
+// PMWakeReasonInfo flags
+#define kWakeTypeMaintenanceFlag            0x01
+#define kWakeTypeSleepServiceFlag           0x02
+#define kWakeTypeNotificationFlag           0x04
+#define kWakeTypeNetworkFlag                0x08
+#define kWakeReasonRTCFlag                  0x10    // Reason mentions "RTC" or "rtc"
+
+typedef struct {
+    char            reason[kWakeReasonStrLen];      // kIOPMRootDomainWakeReasonKey
+    char            type[kWakeReasonStrLen];        // kIOPMRootDomainWakeTypeKey
+    char            claimedBy[kWakeReasonStrLen];   // WiFi/Enet driver claim, empty if none
+    uint32_t        flags;
+    uint32_t        appClaimCount;
+    uint64_t        wakeTime;                       // mach_absolute_time() at decode
+    uint64_t        lastAppClaimTime;               // mach_absolute_time() of latest app claim
+} PMWakeReasonInfo;
+
+__private_extern__ const PMWakeReasonInfo *getWakeReasonInfo(void);
 
 
 __private_extern__ IOReturn             _setRootDomainProperty(CFStringRef key, CFTypeRef val);
@@ -525,6 +551,7 @@ __private_extern__ void                 _PortInvalidatedCallout(CFMachPortRef po
 __private_extern__ CFTimeInterval       _getHIDIdleTime(void);
 
 __private_extern__ dispatch_queue_t     _getPMMainQueue(void);
+__private_extern__ dispatch_queue_t     _getPMReadQueue(void);
 
 __private_extern__ bool auditTokenHasEntitlement(
                                                  audit_token_t token,
@@ -554,6 +581,7 @@ __private_extern__ int pluginExecCommand(const char *path, char *const argv[],
 
 #ifdef XCTEST
 void setAppWakeReason(CFStringRef reasonStr);
+void decodeWakeReasonInfo(CFStringRef reason, CFStringRef type, CFStringRef claimedBy);
 
 #endif
 
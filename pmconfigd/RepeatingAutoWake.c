@@ -26,6 +26,7 @@
 #include "RepeatingAutoWake.h"
 #include "PrivateLib.h"
 #include "AutoWakeScheduler.h"
+#include "PMSnapshot.h"
 
 /*
  * These are the days of the week as provided by
@@ -61,6 +62,61 @@ enum {
 static CFDictionaryRef  repeatingPowerOff = 0;
 static CFDictionaryRef  repeatingPowerOn = 0;
 
+/*
+ * Serialized copy of the repeating events served to readers on the read queue.
+ * repeatEventsChanged() must be called whenever repeatingPowerOn/Off change.
+ */
+static PMSnapshotRef repeatEventsSnapshot(void)
+{
+    static PMSnapshotRef    snapshot = NULL;
+    static dispatch_once_t  onceToken;
+
+    dispatch_once(&onceToken, ^{
+        snapshot = PMSnapshotCreate(^CFDataRef(void) {
+            CFDictionaryRef events = copyRepeatPowerEvents();
+            CFDataRef       serialized = NULL;
+
+            if (events) {
+                serialized = CFPropertyListCreateData(0, events, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+                CFRelease(events);
+            }
+            return serialized;
+        });
+    });
+
+    return snapshot;
+}
+
+/*
+ * Next occurrence of each repeating event, computed by
+ * computeNextOccurrence() and reused by copyNextRepeatingEvent() until that
+ * occurrence is inside the scheduling window. Dropped whenever the repeat
+ * events, the wall clock or the time zone change.
+ */
+typedef struct {
+    CFAbsoluteTime      nextTime;
+    CFDictionaryRef     event;          // Repeat event with nextTime as its date
+} repeatOccurrence_t;
+
+static repeatOccurrence_t   nextPowerOff;
+static repeatOccurrence_t   nextPowerOn;
+
+static void invalidateNextOccurrence(repeatOccurrence_t *occ)
+{
+    if (occ->event) {
+        CFRelease(occ->event);
+    }
+    occ->event = NULL;
+    occ->nextTime = 0.0;
+}
+
+static void repeatEventsChanged(void)
+{
+    invalidateNextOccurrence(&nextPowerOff);
+    invalidateNextOccurrence(&nextPowerOn);
+    PMSnapshotInvalidate(repeatEventsSnapshot());
+}
+
 
 
 static bool 
@@ -137,10 +193,14 @@ getRepeatingDictionaryType(CFDictionaryRef event)
 
 // returns false if event occurs at 8PM and now it's 10PM
 // returns true if event occurs at 8PM, now it's 9AM
+// Initially, we required a 2 minute safety window before scheduling the next
+// power event. Now, we throw caution to the wind and try a 5 second window.
+// Lost events will simply be lost events.
+static const int kAllowScheduleWindowSeconds = 5;
+
 static bool
 upcomingToday(CFDictionaryRef event, int today_cf)
 {
-    static const int        kAllowScheduleWindowSeconds = 5;
     uint32_t                secondsToday;
     int                     secondsScheduled;
 	int						days_mask;
@@ -157,9 +217,6 @@ upcomingToday(CFDictionaryRef event, int today_cf)
     secondsToday = 60 * (hour*60 + minute);
     secondsScheduled = 60 * getRepeatingDictionaryMinutes(event);
 
-    // Initially, we required a 2 minute safety window before scheduling the next
-    // power event. Now, we throw caution to the wind and try a 5 second window.
-    // Lost events will simply be lost events.
     if(secondsScheduled >= (secondsToday + kAllowScheduleWindowSeconds))
         return true;
     else 
@@ -209,39 +266,48 @@ daysUntil(CFDictionaryRef event, int today_cf_day_of_week)
 static void
 copyScheduledRepeatPowerEvents(void)
 {
-    SCPreferencesRef        prefs;
+    SCPreferencesRef        prefs = NULL;
+    CFDictionaryRef         prefetched;
     CFDictionaryRef         tmp;
    
-    prefs = SCPreferencesCreate(0, 
-                               CFSTR("PM-configd-AutoWake"),
-                                CFSTR(kIOPMAutoWakePrefsPath));
-    if(!prefs) return;
+    // Startup may already have read the prefs file off the main queue
+    prefetched = AutoWakePrefetchedPrefs();
+    if (!prefetched) {
+        prefs = SCPreferencesCreate(0,
+                                   CFSTR("PM-configd-AutoWake"),
+                                    CFSTR(kIOPMAutoWakePrefsPath));
+        if(!prefs) return;
+    }
 
     if (repeatingPowerOff) CFRelease(repeatingPowerOff);
     if (repeatingPowerOn) CFRelease(repeatingPowerOn);
 
-    tmp = (CFDictionaryRef)SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey));
+    if (prefs) {
+        tmp = (CFDictionaryRef)SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey));
+    } else {
+        tmp = (CFDictionaryRef)CFDictionaryGetValue(prefetched, CFSTR(kIOPMRepeatingPowerOffKey));
+    }
     if (tmp && isA_CFDictionary(tmp))
         repeatingPowerOff = CFDictionaryCreateMutableCopy(0,0,tmp);
 
-    tmp = (CFDictionaryRef)SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey));
+    if (prefs) {
+        tmp = (CFDictionaryRef)SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey));
+    } else {
+        tmp = (CFDictionaryRef)CFDictionaryGetValue(prefetched, CFSTR(kIOPMRepeatingPowerOnKey));
+    }
     if (tmp && isA_CFDictionary(tmp))
         repeatingPowerOn = CFDictionaryCreateMutableCopy(0,0,tmp);
 
-    CFRelease(prefs);
+    repeatEventsChanged();
+    if (prefs) CFRelease(prefs);
 }
 
 /*
- * Returns a copy of repeat event after changing the repeat date
- * into next event date.
- *
- * Caller is responsible for releasing the copy after use.
+ * Fills in 'occ' with the next occurrence of 'repeatDict' after now.
  */
-__private_extern__ CFDictionaryRef
-copyNextRepeatingEvent(CFStringRef type)
+static void
+computeNextOccurrence(CFDictionaryRef repeatDict, repeatOccurrence_t *occ)
 {
-    CFDictionaryRef         repeatDict = NULL;
-    CFStringRef             repeatDictType = NULL;
     CFMutableDictionaryRef  repeatDictCopy = NULL;
     CFAbsoluteTime          ev_time = 0.0;
     CFAbsoluteTime          adjustedForDays = 0.0;
@@ -256,6 +322,57 @@ copyNextRepeatingEvent(CFStringRef type)
     int                     mysecond = 0;
     int                     days_until_event = 0;
 
+    invalidateNextOccurrence(occ);
+
+    repeatDictCopy = CFDictionaryCreateMutableCopy(0,0,repeatDict);
+    if (!repeatDictCopy)
+        return;
+
+    CFCalendarDecomposeAbsoluteTime(_gregorian(), CFAbsoluteTimeGetCurrent(), "E", &day_of_week);
+
+    // CFCalendarDecomposeAbsoluteTime starts week with Sunday as "1".
+    // IOPMScheduleRepeatingPowerEvent() is defined to start week with Monday as "1".
+    // Reduce day_of_week by 1 to match with week used by IOPMScheduleRepeatingPowerEvent.
+    
+    day_of_week = (day_of_week == 1) ? 7 : (day_of_week - 1);
+    days_until_event = daysUntil(repeatDict, day_of_week);
+
+    adjustedForDays = CFAbsoluteTimeGetCurrent();
+    CFCalendarAddComponents(_gregorian(), &adjustedForDays, 0, "d", days_until_event);
+    CFCalendarDecomposeAbsoluteTime(_gregorian(), adjustedForDays, "yMd", &year, &month, &day);
+
+    minutes_scheduled = getRepeatingDictionaryMinutes(repeatDict);
+
+    myhour = minutes_scheduled/60;
+    myminute = minutes_scheduled%60;
+    mysecond = 0;
+
+    CFCalendarComposeAbsoluteTime(_gregorian(), &ev_time, "yMdHms", year, month, day, myhour, myminute, mysecond);
+    
+    ev_date = CFDateCreate(0, ev_time);
+    if (ev_date) {
+        CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventTimeKey), ev_date);
+        CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventAppNameKey), CFSTR(kIOPMRepeatingAppName));
+        CFRelease(ev_date);
+    }
+
+    occ->event = repeatDictCopy;
+    occ->nextTime = ev_time;
+}
+
+/*
+ * Returns a copy of repeat event after changing the repeat date
+ * into next event date.
+ *
+ * Caller is responsible for releasing the copy after use.
+ */
+__private_extern__ CFDictionaryRef
+copyNextRepeatingEvent(CFStringRef type)
+{
+    CFDictionaryRef         repeatDict = NULL;
+    CFStringRef             repeatDictType = NULL;
+    repeatOccurrence_t      *occ = NULL;
+
     /*
      * 'WakeOrPowerOn' repeat events are returned when caller asks
      * for 'Wake' events or 'PowerOn' events.
@@ -267,12 +384,14 @@ copyNextRepeatingEvent(CFStringRef type)
         || CFEqual(type, CFSTR(kIOPMAutoRestart)) )
     {
         repeatDict = repeatingPowerOff;
+        occ = &nextPowerOff;
     }
     else if (
         CFEqual(type, CFSTR(kIOPMAutoPowerOn)) ||
         CFEqual(type, CFSTR(kIOPMAutoWake)) )
     {
         repeatDict = repeatingPowerOn;
+        occ = &nextPowerOn;
     }
     else
         return NULL;
@@ -284,40 +403,35 @@ copyNextRepeatingEvent(CFStringRef type)
             )
        )
     {
-        repeatDictCopy = CFDictionaryCreateMutableCopy(0,0,repeatDict);
-        if (!repeatDictCopy)
-            return NULL;
-
-        CFCalendarDecomposeAbsoluteTime(_gregorian(), CFAbsoluteTimeGetCurrent(), "E", &day_of_week);
-
-        // CFCalendarDecomposeAbsoluteTime starts week with Sunday as "1".
-        // IOPMScheduleRepeatingPowerEvent() is defined to start week with Monday as "1".
-        // Reduce day_of_week by 1 to match with week used by IOPMScheduleRepeatingPowerEvent.
-        
-        day_of_week = (day_of_week == 1) ? 7 : (day_of_week - 1);
-        days_until_event = daysUntil(repeatDict, day_of_week);
-
-        adjustedForDays = CFAbsoluteTimeGetCurrent();
-        CFCalendarAddComponents(_gregorian(), &adjustedForDays, 0, "d", days_until_event);
-        CFCalendarDecomposeAbsoluteTime(_gregorian(), adjustedForDays, "yMd", &year, &month, &day);
-
-        minutes_scheduled = getRepeatingDictionaryMinutes(repeatDict);
-
-        myhour = minutes_scheduled/60;
-        myminute = minutes_scheduled%60;
-        mysecond = 0;
-
-        CFCalendarComposeAbsoluteTime(_gregorian(), &ev_time, "yMdHms", year, month, day, myhour, myminute, mysecond);
-        
-        ev_date = CFDateCreate(0, ev_time);
-        if (ev_date) {
-            CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventTimeKey), ev_date);
-            CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventAppNameKey), CFSTR(kIOPMRepeatingAppName));
-            CFRelease(ev_date);
+        // The cached occurrence stays next until it falls inside the schedule window
+        if (!occ->event
+            || (occ->nextTime < CFAbsoluteTimeGetCurrent() + kAllowScheduleWindowSeconds))
+        {
+            computeNextOccurrence(repeatDict, occ);
+        }
+        if (occ->event) {
+            return CFRetain(occ->event);
         }
     }
 
-    return repeatDictCopy;
+    return NULL;
+}
+
+/*
+ * Wall clock or time zone changed; next occurrences have to be recomputed.
+ */
+__private_extern__ void
+RepeatingAutoWake_timeChanged(bool timeZoneChanged)
+{
+    if (timeZoneChanged) {
+        CFTimeZoneRef tz = CFTimeZoneCopySystem();
+        if (tz) {
+            CFCalendarSetTimeZone(_gregorian(), tz);
+            CFRelease(tz);
+        }
+    }
+    invalidateNextOccurrence(&nextPowerOff);
+    invalidateNextOccurrence(&nextPowerOn);
 }
 
 
@@ -439,6 +553,7 @@ _io_pm_schedule_repeat_event
     if (onEvents) {
         repeatingPowerOn = CFDictionaryCreateMutableCopy(0,0,onEvents);
     }
+    repeatEventsChanged();
 
 
     if ((*return_code = updateRepeatEventsOnDisk(prefs)) != kIOReturnSuccess)
@@ -512,6 +627,7 @@ _io_pm_cancel_repeat_events
         CFRelease(repeatingPowerOn); 
 
     repeatingPowerOff = repeatingPowerOn = NULL;
+    repeatEventsChanged();
 
     if ((*return_code = updateRepeatEventsOnDisk(prefs)) != kIOReturnSuccess)
         goto exit;
@@ -530,6 +646,14 @@ exit:
     return KERN_SUCCESS;
 }
 
+/*
+ * Returns the serialized repeating events published for the read queue.
+ */
+__private_extern__ CFDataRef copyRepeatPowerEventsData(void)
+{
+    return PMSnapshotCopyData(repeatEventsSnapshot());
+}
+
 __private_extern__ CFDictionaryRef copyRepeatPowerEvents( )
 {
 
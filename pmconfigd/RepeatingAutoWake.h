@@ -28,5 +28,9 @@
 __private_extern__ CFDictionaryRef copyNextRepeatingEvent(CFStringRef type);
 
 __private_extern__ void RepeatingAutoWake_prime(void);
+__private_extern__ void RepeatingAutoWake_timeChanged(bool timeZoneChanged);
+
+__private_extern__ CFDictionaryRef copyRepeatPowerEvents(void);
+__private_extern__ CFDataRef copyRepeatPowerEventsData(void);
 
 #endif // _RepeatingAutoWake_h_
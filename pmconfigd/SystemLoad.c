@@ -33,6 +33,7 @@
 #include "SystemLoad.h"
 #include "PMStore.h"
 #include "PMAssertions.h"
+#include "PMClock.h"
 #include "PMSettings.h"
 #include "PMConnection.h"
 #include "Platform.h"
@@ -129,7 +130,7 @@ bool userActiveRootDomain(void)
 void userActiveHandleSleep(void)
 {
     if (gUserActive.rootDomain) {
-        gUserActive.sleepFromUserWakeTime = CFAbsoluteTimeGetCurrent();
+        gUserActive.sleepFromUserWakeTime = PMClockAbsoluteTime();
     }
     gUserActive.rootDomain = false;
 }
@@ -571,8 +572,7 @@ static void shareTheSystemLoad(bool shouldNotify)
 static void evaluateHidIdleNotification()
 {
 
-    static dispatch_source_t hidIdleEval = 0;
-    static bool hidIdleEvalSuspended = true;
+    static PMTimerRef hidIdleEval = NULL;
     uint32_t    nextIdleTimeout;
     uint32_t inactiveDuration = 0;
     uint32_t legacyNextIdleTimeout = 0;
@@ -593,21 +593,12 @@ static void evaluateHidIdleNotification()
     }
 
     if (!hidIdleEval) {
-        hidIdleEval = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-
-        dispatch_source_set_event_handler(hidIdleEval, ^{ evaluateHidIdleNotification(); });
-
-        dispatch_source_set_cancel_handler(hidIdleEval, ^{
-                dispatch_release(hidIdleEval);
-                hidIdleEval = 0;
-                });
+        hidIdleEval = PMTimerCreate(_getPMMainQueue(), ^{ evaluateHidIdleNotification(); });
     }
 
     nextIdleTimeout = updateUserActivityLevels();
     DEBUG_LOG("nextIdleTimeout: %d legacyNextIdleTimeout:%d\n", nextIdleTimeout, legacyNextIdleTimeout);
     if (nextIdleTimeout || legacyNextIdleTimeout) {
-        dispatch_time_t delta2NextIdleTimeout;
-
         if ( !nextIdleTimeout || (legacyNextIdleTimeout && (nextIdleTimeout > legacyNextIdleTimeout))) {
             nextIdleTimeout = legacyNextIdleTimeout;
         }
@@ -617,17 +608,10 @@ static void evaluateHidIdleNotification()
             return;
         }
 
-        delta2NextIdleTimeout = dispatch_time(DISPATCH_TIME_NOW, (nextIdleTimeout-inactiveDuration)*NSEC_PER_SEC);
-
-        dispatch_source_set_timer(hidIdleEval, delta2NextIdleTimeout, DISPATCH_TIME_FOREVER, 0);
-        if (hidIdleEvalSuspended) {
-            dispatch_resume(hidIdleEval);
-            hidIdleEvalSuspended = false;
-        }
+        PMTimerSchedule(hidIdleEval, (uint64_t)(nextIdleTimeout-inactiveDuration)*NSEC_PER_SEC, kPMTimerForever);
     }
-    else if (!hidIdleEvalSuspended) {
-        dispatch_suspend(hidIdleEval);
-        hidIdleEvalSuspended = true;
+    else {
+        PMTimerDisarm(hidIdleEval);
     }
 
 }
@@ -1079,8 +1063,7 @@ __private_extern__ void SystemLoadSystemPowerStateHasChanged(void)
  */
 static void setAssertionIdleNotificationTimer()
 {
-    static dispatch_source_t assertionEval = 0;
-    static bool assertionEvalSuspended = true;
+    static PMTimerRef assertionEval = NULL;
     uint64_t now = getMonotonicContinuousTime();
 
     if (!gUserActive.lastAssertion_ts) {
@@ -1088,24 +1071,13 @@ static void setAssertionIdleNotificationTimer()
         return;
     }
     if (!assertionEval) {
-        assertionEval = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
-
-        dispatch_source_set_event_handler(assertionEval, ^{ SystemLoadUserActiveAssertions( false ); });
-
-        dispatch_source_set_cancel_handler(assertionEval, ^{
-                dispatch_release(assertionEval);
-                assertionEval = 0;
-                });
+        assertionEval = PMTimerCreate(_getPMMainQueue(), ^{ SystemLoadUserActiveAssertions( false ); });
     }
 
     if (gUserActive.idleTimeout > (now - gUserActive.lastAssertion_ts)) {
-        dispatch_time_t delta = dispatch_time(DISPATCH_TIME_NOW,
-                              (gUserActive.idleTimeout - ( now - gUserActive.lastAssertion_ts))*NSEC_PER_SEC);
-        dispatch_source_set_timer(assertionEval, delta, DISPATCH_TIME_FOREVER, 0);
-        if (assertionEvalSuspended) {
-            dispatch_resume(assertionEval);
-            assertionEvalSuspended = false;
-        }
+        PMTimerSchedule(assertionEval,
+                        (gUserActive.idleTimeout - ( now - gUserActive.lastAssertion_ts))*NSEC_PER_SEC,
+                        kPMTimerForever);
     }
 }
 
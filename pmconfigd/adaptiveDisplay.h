@@ -24,5 +24,6 @@
 #ifndef adaptiveDisplay_h
 #define adaptiveDisplay_h
 
+void ads_prime(void);
 
 #endif /* adaptiveDisplay_h */
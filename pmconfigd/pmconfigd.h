@@ -32,6 +32,7 @@
 #include <grp.h>
 #include <pwd.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #include <servers/bootstrap.h>
 #include <notify.h>
 #include <asl.h>
@@ -51,6 +52,7 @@
 
 #include <Security/SecTask.h>
 #include <os/log.h>
+#include <os/state_private.h>
 
 #include <System/sys/kdebug.h>
 
@@ -73,6 +75,9 @@
 #include "StandbyTimer.h"
 #include "PrivateLib.h"
 #include "BatteryDataCollectionManager.h"
+#include "PMXPCRouter.h"
+#include "PMAssertionTrace.h"
+#include "PMStartup.h"
 #if (TARGET_OS_OSX && TARGET_CPU_ARM64)
 #include "PMDisplay.h"
 #endif
@@ -36,8 +36,16 @@ static io_connect_t             _pm_ack_port                        = 0;
 
 static int                      gCPUPowerNotificationToken          = 0;
 static bool                     gExpectingWakeFromSleepClockResync  = false;
-static CFAbsoluteTime           *gLastWakeTime                      = NULL;
-static CFTimeInterval           *gLastSMCS3S0WakeInterval           = NULL;
+/*
+ * Last wake time and SMC wake interval. The main queue publishes both with one
+ * atomic store, so the read queue never pairs fields from two different wakes.
+ */
+typedef struct {
+    CFAbsoluteTime              wakeTime;
+    CFTimeInterval              smcS3S0WakeInterval;
+} lastWakeTime_t;
+
+static lastWakeTime_t           gLastWakeTime                       = { 0, 0 };
 static CFStringRef              gCachedNextSleepWakeUUIDString      = NULL;
 static int                      gLastWakeTimeToken                  = -1;
 static int                      gLastSMCS3S0WakeIntervalToken       = -1;
@@ -51,6 +59,7 @@ static bool                     gDisplayIsAsleep = false;
 static struct timeval           gLastSleepTime                      = {0, 0};
 
 static mach_port_t              serverPort                          = MACH_PORT_NULL;
+static dispatch_queue_t         gListenerQueue                      = NULL;
 static dispatch_mach_t          gListener;
 static bool                     gSMCSupportsWakeupTimer             = true;
 static int                      _darkWakeThermalEventCount          = 0;
@@ -58,6 +67,9 @@ static bool                     gEvaluateDWThermalEmergency = false;
 
 static natural_t                lastSleepWakeMsg                    = 0;
 
+static uint64_t                 gLaunchTime                         = 0;
+static bool                     gFirstRequestServed                 = false;
+
 
 // foward declarations
 static void initializeESPrefsNotification(void);
@@ -108,20 +120,145 @@ static dispatch_mach_t gListener;
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
+/*
+ * MIG routines that only read published state. These are served on the
+ * concurrent read queue, so that monitoring clients never queue up behind
+ * sleep/wake processing or assertion updates on the main queue.
+ */
+static const char * const gReadOnlyMIGRoutineNames[] = {
+    "io_pm_assertion_copy_details",
+    "io_pm_last_wake_time",
+};
+
+static mach_msg_id_t            gReadOnlyMIGMsgIDs[sizeof(gReadOnlyMIGRoutineNames) / sizeof(gReadOnlyMIGRoutineNames[0])];
+static int                      gReadOnlyMIGMsgIDCnt = 0;
+
+static void initializeReadOnlyMIGMsgIDs(void)
+{
+    static const struct {
+        const char      *name;
+        mach_msg_id_t   id;
+    } nameMap[] = { subsystem_to_name_map_powermanagement };
+
+    for (size_t i = 0; i < sizeof(nameMap) / sizeof(nameMap[0]); i++) {
+        for (size_t j = 0; j < sizeof(gReadOnlyMIGRoutineNames) / sizeof(gReadOnlyMIGRoutineNames[0]); j++) {
+            if (!strcmp(nameMap[i].name, gReadOnlyMIGRoutineNames[j])) {
+                gReadOnlyMIGMsgIDs[gReadOnlyMIGMsgIDCnt++] = nameMap[i].id;
+                break;
+            }
+        }
+    }
+}
+
+static bool isReadOnlyMIGMsg(mach_msg_id_t msgID)
+{
+    for (int i = 0; i < gReadOnlyMIGMsgIDCnt; i++) {
+        if (gReadOnlyMIGMsgIDs[i] == msgID) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Logs the launch to first-served-request latency once.
+ */
+static void noteRequestServed(void)
+{
+    if (!__atomic_load_n(&gFirstRequestServed, __ATOMIC_RELAXED) &&
+        !__atomic_exchange_n(&gFirstRequestServed, true, __ATOMIC_RELAXED)) {
+        INFO_LOG("First request served %lluus after launch\n",
+                 intervalInNanoseconds(gLaunchTime, mach_absolute_time()) / NSEC_PER_USEC);
+    }
+}
+
+static void pmDemuxMIGMsg(dispatch_mach_msg_t msg)
+{
+    static const struct mig_subsystem *const subsystems[] = {
+        (mig_subsystem_t)&_powermanagement_subsystem,
+    };
+    if (!dispatch_mach_mig_demux(NULL, subsystems, 1, msg)) {
+        mach_msg_destroy(dispatch_mach_msg_get_msg(msg, NULL));
+    }
+    noteRequestServed();
+}
+
 static void
 pmListenerHandler(void *context, dispatch_mach_reason_t reason,
                   dispatch_mach_msg_t msg, mach_error_t error)
 {
     if (reason == DISPATCH_MACH_MESSAGE_RECEIVED) {
-        static const struct mig_subsystem *const subsystems[] = {
-            (mig_subsystem_t)&_powermanagement_subsystem,
-        };
-        if (!dispatch_mach_mig_demux(NULL, subsystems, 1, msg)) {
-            mach_msg_destroy(dispatch_mach_msg_get_msg(msg, NULL));
-        }
+        mach_msg_header_t   *hdr = dispatch_mach_msg_get_msg(msg, NULL);
+        dispatch_queue_t    q;
+
+        // Requests mutating state keep their arrival order on the main queue
+        q = isReadOnlyMIGMsg(hdr->msgh_id) ? _getPMReadQueue() : _getPMMainQueue();
+        dispatch_async(q, ^{
+            pmDemuxMIGMsg(msg);
+        });
     }
 }
 
+static void startGeneralPreferences(void)
+{
+    // General preferences are those that fall under the root '/Library/Preferences' path and are not under the control of regular users,
+    // and is different from energy settings preferences a.k.a ESPrefs which can be controlled by the user from Settings pane.
+    // General preferences to begin with, looks for 'Managed profiles' (MDM) controlled by an admin, however, may also be scaled up to include
+    // general powerd algorithms' preferences (such as battery health) for fine tuning of configs, but not under direct control of
+    // a non-root user.
+    initializeGeneralPreferences();
+}
+
+static void startUnclampSilentRunning(void)
+{
+    _unclamp_silent_running(false);
+}
+
+static void startAssertionReSync(void)
+{
+    notify_post(kIOUserAssertionReSync);
+}
+
+/*
+ * powerd startup sequence. Steps run in this order on the main queue, which
+ * is also the order their dependencies need. AutoWakePrefetch only starts a
+ * background read of the AutoWake prefs file; AutoWake waits for it.
+ */
+static const PMStartupStep gStartupSteps[] = {
+    { "AutoWakePrefetch",             AutoWake_prefetch },
+    { "PMStore",                      PMStoreLoad },
+    { "GeneralPreferences",           startGeneralPreferences },
+    { "ESPrefsNotification",          initializeESPrefsNotification },
+    { "InterestNotifications",        initializeInterestNotifications },
+    { "TimezoneNotifications",        initializeTimezoneChangeNotifications },
+    { "CalendarResyncNotification",   initializeCalendarResyncNotification },
+    { "ShutdownNotifications",        initializeShutdownNotifications },
+    { "RootDomainInterest",           initializeRootDomainInterestNotifications },
+    { "UserNotifications",            initializeUserNotifications },
+    { "OneOffHacks",                  _oneOffHacksSetup },
+    { "PMConnection",                 PMConnection_prime },
+    { "SleepWakeNotifications",       initializeSleepWakeNotifications },
+    // Prime the messagetracer UUID pump
+    { "SleepWakeUUID",                pushNewSleepWakeUUID },
+    { "BatteryTimeRemaining",         BatteryTimeRemaining_prime },
+    { "PMSettings",                   PMSettings_prime },
+    { "AutoWake",                     AutoWake_prime },
+    { "PMAssertions",                 PMAssertions_prime },
+    { "PMSystemEvents",               PMSystemEvents_prime },
+    { "SystemLoad",                   SystemLoad_prime },
+    { "UPSLowPower",                  UPSLowPower_prime },
+    { "TTYKeepAwake",                 TTYKeepAwake_prime },
+    { "ExternalMedia",                ExternalMedia_prime },
+    { "OnBootAssertions",             createOnBootAssertions },
+    { "SleepWakeWdog",                enableSleepWakeWdog },
+    { "AdaptiveDisplay",              ads_prime },
+    { "StandbyTimer",                 standbyTimer_prime },
+    { "UnclampSilentRunning",         startUnclampSilentRunning },
+    { "AssertionReSync",              startAssertionReSync },
+    { "PMStartLog",                   logASLMessagePMStart },
+    { "BatteryTimeRemainingFinish",   BatteryTimeRemaining_finish },
+};
+
 static void
 powerd_init(void *__unused context)
 {
@@ -141,60 +278,22 @@ powerd_init(void *__unused context)
 
     if (MACH_PORT_NULL != serverPort)
     {
-        gListener = dispatch_mach_create_f("PowerManagement", _getPMMainQueue(), NULL, pmListenerHandler);
+        initializeReadOnlyMIGMsgIDs();
+        gListenerQueue = dispatch_queue_create("Power Management MIG listener", NULL);
+        gListener = dispatch_mach_create_f("PowerManagement", gListenerQueue, NULL, pmListenerHandler);
         dispatch_mach_connect(gListener, serverPort, MACH_PORT_NULL, NULL);
     }
 
-    PMStoreLoad();
-
-    // General preferences are those that fall under the root '/Library/Preferences' path and are not under the control of regular users,
-    // and is different from energy settings preferences a.k.a ESPrefs which can be controlled by the user from Settings pane. 
-    // General preferences to begin with, looks for 'Managed profiles' (MDM) controlled by an admin, however, may also be scaled up to include
-    // general powerd algorithms' preferences (such as battery health) for fine tuning of configs, but not under direct control of
-    // a non-root user.
-    initializeGeneralPreferences();
-    initializeESPrefsNotification();
-    initializeInterestNotifications();
-    initializeTimezoneChangeNotifications();
-    initializeCalendarResyncNotification();
-    initializeShutdownNotifications();
-    initializeRootDomainInterestNotifications();
-
-    initializeUserNotifications();
-    _oneOffHacksSetup();
-
-    PMConnection_prime();
-    initializeSleepWakeNotifications();
-
-    // Prime the messagetracer UUID pump
-    pushNewSleepWakeUUID();
-
-    BatteryTimeRemaining_prime();
-    PMSettings_prime();
-    AutoWake_prime();
-    PMAssertions_prime();
-    PMSystemEvents_prime();
-    SystemLoad_prime();
-
-    UPSLowPower_prime();
-    TTYKeepAwake_prime();
-    ExternalMedia_prime();
-
-    createOnBootAssertions();
-    enableSleepWakeWdog();
-    ads_prime();
-    standbyTimer_prime();
-
-    _unclamp_silent_running(false);
-    notify_post(kIOUserAssertionReSync);
-    logASLMessagePMStart();
+    PMStartupRun(gStartupSteps, sizeof(gStartupSteps) / sizeof(gStartupSteps[0]));
 
-
-    BatteryTimeRemaining_finish();
+    // Start serving read-only requests now that published state is primed
+    dispatch_activate(_getPMReadQueue());
 }
 
 int main(int argc __unused, char *argv[] __unused)
 {
+    gLaunchTime = mach_absolute_time();
+
     /*
      * This dispatch_sync() ensures that no event can be received concurrently
      * to initializing services, and allow for launch at priority
@@ -229,7 +328,7 @@ ClockSleepWakeNotification(IOPMSystemPowerStateCapabilities old_cap,
 
         // The next clock resync occuring on wake from sleep shall be marked
         // as the wake time.
-        gExpectingWakeFromSleepClockResync = true;
+        __atomic_store_n(&gExpectingWakeFromSleepClockResync, true, __ATOMIC_RELEASE);
 
         // tell clients what our timezone offset is
         broadcastGMTOffset();
@@ -444,6 +543,10 @@ timeZoneChangedCallBack(
     if( CFEqual(notificationName, gTZNotificationNameString) )
     {
         broadcastGMTOffset();
+
+        // Repeating events are defined in local time; re-arm them
+        RepeatingAutoWake_timeChanged(true);
+        AutoWakeCalendarChange();
     }
 }
 
@@ -714,68 +817,10 @@ static void incoming_XPC_connection(xpc_connection_t peer)
 
                  if (xpc_get_type(event) == XPC_TYPE_DICTIONARY) {
 
-                     xpc_object_t inEvent;
-
-                     if((inEvent = xpc_dictionary_get_value(event, kUserActivityRegister))) {
-                        registerUserActivityClient(peer, inEvent);
-                     }
-                     else if((inEvent = xpc_dictionary_get_value(event, kUserActivityTimeoutUpdate))) {
-                        updateUserActivityTimeout(peer, inEvent);
-                     }
-                     else if ((inEvent = xpc_dictionary_get_value(event, kClaimSystemWakeEvent))) {
-                        appClaimWakeReason(peer, inEvent);
-                     }
-                     else if (xpc_dictionary_get_value(event, kAssertionCreateMsg)) {
-                        asyncAssertionCreate(peer, event);
-                     }
-                     else if (xpc_dictionary_get_value(event, kAssertionReleaseMsg)) {
-                        asyncAssertionRelease(peer, event);
-                     }
-                     else if (xpc_dictionary_get_value(event, kAssertionPropertiesMsg)) {
-                        asyncAssertionProperties(peer, event);
-                     }
-                     else if (xpc_dictionary_get_value(event, kPSAdapterDetails)) {
-                         sendAdapterDetails(peer, event);
-                     }
-#if TARGET_OS_OSX
-                     else if (xpc_dictionary_get_value(event, kReadPersistentBHData)) {
-                         getBatteryHealthPersistentData(peer, event);
-                     }
-                     else if (xpc_dictionary_get_value(event, kSetPermFaultStatus)) {
-                        setPermFaultStatus(peer, event);
-                     }
-#endif  // TARGET_OS_OSX
-                     else if (xpc_dictionary_get_value(event, kCustomBatteryProps)) {
-                         setCustomBatteryProps(peer, event);
-                     }
-                     else if (xpc_dictionary_get_value(event, kResetCustomBatteryProps)) {
-                         resetCustomBatteryProps(peer, event);
-                     }
-                     else if (xpc_dictionary_get_value(event, kAssertionSetStateMsg)) {
-                         processSetAssertionState(peer, event);
-                     }
-                     else if (xpc_dictionary_get_value(event, kIOPMPowerEventDataKey)) {
-                        getScheduledWake(peer, event);
-                     }
-#if TARGET_OS_IOS || TARGET_OS_WATCH || TARGET_OS_OSX
-                     else if (xpc_dictionary_get_value(event, kSetBHUpdateTimeDelta)) {
-                         setBHUpdateTimeDelta(peer, event);
-                     }
-#endif // TARGET_OS_IOS || TARGET_OS_WATCH || TARGET_OS_OSX
-                     else if (xpc_dictionary_get_value(event, kInactivityWindowKey)) {
-                         setInactivityWindow(peer, event);
-                     }
-#if (TARGET_OS_OSX && TARGET_CPU_ARM64)
-                     else if ((inEvent = xpc_dictionary_get_value(event, kSkylightCheckInKey))) {
-                         skylightCheckIn(peer, event);
-                     }
-                     else if ((inEvent = xpc_dictionary_get_value(event, kDesktopModeKey))) {
-                         updateDesktopMode(peer, event);
-                     }
-#endif
-                     else {
+                     if (!PMXPCRouterDispatch(peer, event)) {
                         os_log_error(OS_LOG_DEFAULT, "Unexpected xpc dictionary\n");
                      }
+                     noteRequestServed();
                  }
                  else if (xpc_get_type(event) == XPC_TYPE_ERROR) {
                     handle_xpc_error(peer, event);
@@ -791,10 +836,63 @@ static void incoming_XPC_connection(xpc_connection_t peer)
     return;
 }
 
+/*
+ * Adapters for handlers declared with an xpc_connection_t peer
+ */
+static void routeSetAssertionState(xpc_object_t peer, xpc_object_t msg)
+{
+    processSetAssertionState((xpc_connection_t)peer, msg);
+}
+
+static void routeClaimWakeReason(xpc_object_t peer, xpc_object_t claim)
+{
+    appClaimWakeReason((xpc_connection_t)peer, claim);
+}
+
+/*
+ * Built-in XPC message routes. Order matters only when a message carries more
+ * than one of these keys, and follows the order the keys used to be checked in.
+ * Subsystems outside this file register their own routes with PMXPCRouterRegister().
+ */
+static const struct {
+    const char          *key;
+    PMXPCRouteHandler   handler;
+    uint32_t            flags;
+} gBuiltinXPCRoutes[] = {
+    { kUserActivityRegister,        registerUserActivityClient,     kPMXPCRoutePassValue },
+    { kUserActivityTimeoutUpdate,   updateUserActivityTimeout,      kPMXPCRoutePassValue },
+    { kClaimSystemWakeEvent,        routeClaimWakeReason,           kPMXPCRoutePassValue },
+    { kPSAdapterDetails,            sendAdapterDetails,             0 },
+#if TARGET_OS_OSX
+    { kReadPersistentBHData,        getBatteryHealthPersistentData, 0 },
+    { kSetPermFaultStatus,          setPermFaultStatus,             0 },
+#endif  // TARGET_OS_OSX
+    { kCustomBatteryProps,          setCustomBatteryProps,          0 },
+    { kResetCustomBatteryProps,     resetCustomBatteryProps,        0 },
+    { kAssertionSetStateMsg,        routeSetAssertionState,         0 },
+    { kIOPMPowerEventDataKey,       getScheduledWake,               0 },
+#if TARGET_OS_IOS || TARGET_OS_WATCH || TARGET_OS_OSX
+    { kSetBHUpdateTimeDelta,        setBHUpdateTimeDelta,           0 },
+#endif // TARGET_OS_IOS || TARGET_OS_WATCH || TARGET_OS_OSX
+    { kInactivityWindowKey,         setInactivityWindow,            0 },
+    { kAssertionTraceMsg,           setAssertionTrace,              0 },
+#if (TARGET_OS_OSX && TARGET_CPU_ARM64)
+    { kSkylightCheckInKey,          skylightCheckIn,                0 },
+    { kDesktopModeKey,              updateDesktopMode,              0 },
+#endif
+};
+
 static void xpc_register(void)
 {
     xpc_connection_t        connection;
 
+    for (size_t i = 0; i < sizeof(gBuiltinXPCRoutes) / sizeof(gBuiltinXPCRoutes[0]); i++) {
+        PMXPCRouterRegister(gBuiltinXPCRoutes[i].key, gBuiltinXPCRoutes[i].handler, gBuiltinXPCRoutes[i].flags);
+    }
+    PMAssertionsRegisterXPCRoutes();
+    os_state_add_handler(_getPMMainQueue(), ^os_state_data_t(os_state_hints_t hints) {
+            PMXPCRouterLogStats(); return PMXPCRouterCopyStateData(); });
+
     connection = xpc_connection_create_mach_service(
                                                     "com.apple.iokit.powerdxpc",
                                                     _getPMMainQueue(),
@@ -1091,6 +1189,7 @@ exit:
 static bool calendarRTCDidResync_getSMCWakeInterval(void)
 {
     CFAbsoluteTime      lastWakeTime;
+    lastWakeTime_t      lastWake;
     struct timeval      lastSleepTime;
     size_t              len = sizeof(struct timeval);
 
@@ -1111,28 +1210,12 @@ static bool calendarRTCDidResync_getSMCWakeInterval(void)
         return false;
     }
 
-    // if needed, init standalone memory for last wake time data
-    if (!gLastSMCS3S0WakeInterval) {
-        size_t bufSize;
-
-        bufSize = sizeof(*gLastWakeTime) + sizeof(*gLastSMCS3S0WakeInterval);
-        if (0 != vm_allocate(mach_task_self(), (void*)&gLastWakeTime,
-                             bufSize, VM_FLAGS_ANYWHERE)) {
-            goto exit;
-        }
-        gLastSMCS3S0WakeInterval = gLastWakeTime + 1;
-    } else {
-        // validate pointers allocated earlier
-        if (!gLastWakeTime || !gLastSMCS3S0WakeInterval)
-            goto exit;
-    }
-
     // This is a wake-from-sleep resync, so commit the last wake time
-    *gLastWakeTime = lastWakeTime;
-    *gLastSMCS3S0WakeInterval = 0;
-    gExpectingWakeFromSleepClockResync = false;
+    lastWake.wakeTime = lastWakeTime;
+    lastWake.smcS3S0WakeInterval = 0;
+    __atomic_store(&gLastWakeTime, &lastWake, __ATOMIC_RELEASE);
+    __atomic_store_n(&gExpectingWakeFromSleepClockResync, false, __ATOMIC_RELEASE);
 
-exit:
     return true;
 }
 
@@ -1179,13 +1262,16 @@ kern_return_t _io_pm_last_wake_time(
     mach_msg_type_number_t  *out_delta_len,
     int                     *return_val)
 {
+    static __thread lastWakeTime_t  reply;
+
     *out_wake_data = 0;
     *out_wake_len = 0;
     *out_delta_data = 0;
     *out_delta_len = 0;
     *return_val = kIOReturnInvalid;
 
-    if (gExpectingWakeFromSleepClockResync) {
+    // Served on the read queue from the last published record
+    if (__atomic_load_n(&gExpectingWakeFromSleepClockResync, __ATOMIC_ACQUIRE)) {
         *return_val = kIOReturnNotReady;
         return KERN_SUCCESS;
     }
@@ -1195,10 +1281,18 @@ kern_return_t _io_pm_last_wake_time(
         return KERN_SUCCESS;
     };
 
-    *out_wake_data = (vm_offset_t)gLastWakeTime;
-    *out_wake_len = sizeof(*gLastWakeTime);
-    *out_delta_data = (vm_offset_t)gLastSMCS3S0WakeInterval;
-    *out_delta_len = sizeof(*gLastSMCS3S0WakeInterval);
+    // The reply is sent from this thread after we return, so it is built
+    // from a per-thread copy that no other request can overwrite meanwhile
+    __atomic_load(&gLastWakeTime, &reply, __ATOMIC_ACQUIRE);
+    if (reply.wakeTime == 0) {
+        *return_val = kIOReturnNotReady;
+        return KERN_SUCCESS;
+    }
+
+    *out_wake_data = (vm_offset_t)&reply.wakeTime;
+    *out_wake_len = sizeof(reply.wakeTime);
+    *out_delta_data = (vm_offset_t)&reply.smcS3S0WakeInterval;
+    *out_delta_len = sizeof(reply.smcS3S0WakeInterval);
 
     *return_val = kIOReturnSuccess;
 
@@ -1333,11 +1427,11 @@ static void handleDWThermalMsg(CFStringRef wakeType)
         getPlatformWakeReason(NULL, &wakeType);
 
     INFO_LOG("DarkWake Thermal Emergency message is received. BTWake: %d ssWake:%d ProxWake:%d NotificationWake:%d\n",
-            isA_BTMtnceWake(), isA_SleepSrvcWake(), checkForAppWakeReason(CFSTR(kProximityWakeReason)), isA_NotificationDisplayWake());
+            isA_BTMtnceWake(), isA_SleepSrvcWake(), checkForAppWakeReasonCString(kProximityWakeReason), isA_NotificationDisplayWake());
 #if !(TARGET_OS_OSX && TARGET_CPU_ARM64)
     gateProximityDarkWakeState(kPMAllowSleep);
 #endif
-    if ( (isA_BTMtnceWake() || isA_SleepSrvcWake() || checkForAppWakeReason(CFSTR(kProximityWakeReason))) &&
+    if ( (isA_BTMtnceWake() || isA_SleepSrvcWake() || checkForAppWakeReasonCString(kProximityWakeReason)) &&
             (!isA_NotificationDisplayWake()) && (CFEqual(wakeType, kIOPMRootDomainWakeTypeMaintenance) ||
                         CFEqual(wakeType, kIOPMRootDomainWakeTypeSleepService))
             && !((getTCPKeepAliveState(NULL, 0) == kActive) && checkForActivesByType(kInteractivePushServiceType)) ) {
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * PMAssertionTraceTests checks the on-disk format written by the recorder.
+ *
+ * PMAssertionTraceReplay records the assertion traffic that the pmtool
+ * --createassertion commands generate, then feeds the trace back into the
+ * assertion engine on the virtual clock and checks that the engine reaches
+ * the same kernel bits and aggregates. A trace captured elsewhere can be
+ * replayed too:
+ *   PMTRACE_REPLAY=<path> xctest -XCTest PMAssertionTraceReplay powerd_test.xctest
+ */
+
+#import <XCTest/XCTest.h>
+#include <unistd.h>
+
+#include "PrivateLib.h"
+#include "PMAssertions.h"
+#include "PMAssertionTrace.h"
+#include "PMClock.h"
+#include "XCTest_FunctionDefinitions.h"
+
+#define kWallStart          700000000.0
+#define kTracePid           24000
+
+// PMAssertions.c entry points exposed to XCTest
+IOReturn    doCreate(pid_t pid, CFMutableDictionaryRef newProperties, IOPMAssertionID *assertion_id,
+                     ProcessInfo **pinfo, int *enTrIntensity);
+IOReturn    doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt);
+IOReturn    doSetProperties(pid_t pid, IOPMAssertionID id, CFDictionaryRef props, int *enTrIntensity);
+void        HandleProcessExit(pid_t deadPID);
+
+@interface PMAssertionTraceTests : XCTestCase
+@end
+
+@implementation PMAssertionTraceTests
+
+- (void)testRecordRoundTrip
+{
+    char                path[] = "/tmp/pmtrace_test.XXXXXX";
+    NSDictionary        *props = @{ @kIOPMAssertionTypeKey : @kIOPMAssertionTypeNeedsCPU,
+                                    @kIOPMAssertionNameKey : @"trace test" };
+    NSData              *file;
+    const uint8_t       *bytes;
+    pmTraceHeader_t     hdr;
+    pmTraceRecord_t     rec;
+    size_t              off;
+    const char          *tracePath = path;     // Blocks can't capture arrays
+    int                 fd;
+
+    fd = mkstemp(path);
+    XCTAssertGreaterThanOrEqual(fd, 0);
+    close(fd);
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        // An existing file is never overwritten
+        XCTAssertEqual(PMAssertionTraceStart(tracePath), kIOReturnError);
+        XCTAssertFalse(gAssertionTraceActive);
+
+        unlink(tracePath);
+        XCTAssertEqual(PMAssertionTraceStart(tracePath), kIOReturnSuccess);
+        XCTAssertTrue(gAssertionTraceActive);
+
+        PMAssertionTraceRecord(kPMTraceCreate, XCTEST_PID, 42, kIOReturnSuccess,
+                               PMAssertionTraceBegin(), (__bridge CFDictionaryRef)props);
+        PMAssertionTraceRecord(kPMTraceAggregate, 0, kIOPMNullAssertionID, 0x5, 0, NULL);
+        PMAssertionTraceRecord(kPMTraceRelease, XCTEST_PID, 42, kIOReturnSuccess,
+                               PMAssertionTraceBegin(), NULL);
+        PMAssertionTraceStop();
+        XCTAssertFalse(gAssertionTraceActive);
+        XCTAssertEqual(PMAssertionTraceBegin(), 0);
+    });
+
+    file = [NSData dataWithContentsOfFile:@(path)];
+    unlink(path);
+    XCTAssertNotNil(file);
+    bytes = file.bytes;
+
+    XCTAssertGreaterThanOrEqual(file.length, sizeof(hdr));
+    memcpy(&hdr, bytes, sizeof(hdr));
+    XCTAssertEqual(hdr.magic, kPMTraceMagic);
+    XCTAssertEqual(hdr.version, kPMTraceVersion);
+    XCTAssertEqual(hdr.headerSize, sizeof(hdr));
+    off = hdr.headerSize;
+
+    memcpy(&rec, bytes + off, sizeof(rec));
+    XCTAssertEqual(rec.op, kPMTraceCreate);
+    XCTAssertEqual(rec.pid, XCTEST_PID);
+    XCTAssertEqual(rec.id, 42);
+    XCTAssertGreaterThan(rec.payloadLen, 0);
+    NSDictionary *recorded = [NSPropertyListSerialization
+                              propertyListWithData:[file subdataWithRange:NSMakeRange(off + sizeof(rec), rec.payloadLen)]
+                              options:0 format:NULL error:NULL];
+    XCTAssertEqualObjects(recorded, props);
+    off += sizeof(rec) + rec.payloadLen;
+
+    memcpy(&rec, bytes + off, sizeof(rec));
+    XCTAssertEqual(rec.op, kPMTraceAggregate);
+    XCTAssertEqual(rec.value, 0x5);
+    XCTAssertEqual(rec.payloadLen, 0);
+    off += sizeof(rec);
+
+    memcpy(&rec, bytes + off, sizeof(rec));
+    XCTAssertEqual(rec.op, kPMTraceRelease);
+    XCTAssertEqual(rec.id, 42);
+    off += sizeof(rec);
+
+    XCTAssertEqual(off, file.length);
+}
+
+@end
+
+
+@interface PMAssertionTraceReplay : XCTestCase
+@end
+
+@implementation PMAssertionTraceReplay
+
++ (void)setUp
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        PMAssertions_prime();
+    });
+}
+
++ (void)tearDown
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        PMAssertionsResetForTest();
+    });
+}
+
+- (void)setUp
+{
+    XCTAssert(PMClockSetVirtual(kWallStart));
+}
+
+/*
+ * What 'pmtool --createassertion <type> --assertiontimeout <secs>' asks of
+ * powerd: a timed assertion per type with the release timeout action, some
+ * of them turned off and on again or released early, then the process exits.
+ */
+- (void)recordPMToolCommands
+{
+    CFStringRef types[] = {
+        kIOPMAssertionTypePreventUserIdleSystemSleep,
+        kIOPMAssertionTypePreventUserIdleDisplaySleep,
+        kIOPMAssertionTypePreventSystemSleep,
+        kIOPMAssertionTypeNeedsCPU,
+    };
+    const int       cnt = sizeof(types) / sizeof(types[0]);
+    IOPMAssertionID ids[cnt];
+
+    for (int i = 0; i < cnt; i++) {
+        NSMutableDictionary *props = [@{
+            @kIOPMAssertionTypeKey          : (__bridge NSString *)types[i],
+            @kIOPMAssertionNameKey          : @"com.apple.darkmaintenance",
+            @kIOPMAssertionLevelKey         : @(kIOPMAssertionLevelOn),
+            @kIOPMAssertionTimeoutKey       : @(5 * (i + 1)),
+            @kIOPMAssertionTimeoutActionKey : @kIOPMAssertionTimeoutActionRelease,
+        } mutableCopy];
+
+        ids[i] = kIOPMNullAssertionID;
+        doCreate(kTracePid, (__bridge CFMutableDictionaryRef)props, &ids[i], NULL, NULL);
+        PMClockAdvance(NSEC_PER_SEC);
+    }
+
+    doSetProperties(kTracePid, ids[0], (__bridge CFDictionaryRef)@{
+        @kIOPMAssertionLevelKey : @(kIOPMAssertionLevelOff) }, NULL);
+    PMClockAdvance(NSEC_PER_SEC);
+    doSetProperties(kTracePid, ids[0], (__bridge CFDictionaryRef)@{
+        @kIOPMAssertionLevelKey : @(kIOPMAssertionLevelOn) }, NULL);
+    doRelease(kTracePid, ids[1], NULL);
+
+    // Let the shorter timeouts expire, then exit with the rest still held
+    PMClockAdvance(15 * NSEC_PER_SEC);
+    HandleProcessExit(kTracePid);
+    PMClockAdvance(NSEC_PER_SEC);
+}
+
+- (void)replay:(const char *)path
+{
+    __block IOReturn                ret;
+    __block pmTraceReplayResult_t   result;
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        ret = PMAssertionTraceReplay(path, &result);
+    });
+    XCTAssertEqual(ret, kIOReturnSuccess);
+
+    NSLog(@"PMTrace replay: calls:%u skipped:%u span:%llums wall:%llums\n",
+          result.apiCalls, result.skippedRecords, result.tracedSpanNs / NSEC_PER_MSEC,
+          result.replayWallNs / NSEC_PER_MSEC);
+    NSLog(@"PMTrace outputs: kernel %u/%u aggregate %u/%u max skew:%lluus\n",
+          result.replayedKernelUpdates, result.recordedKernelUpdates,
+          result.replayedAggregateUpdates, result.recordedAggregateUpdates,
+          result.maxSkewNs / NSEC_PER_USEC);
+
+    XCTAssertGreaterThan(result.apiCalls, 0u);
+    XCTAssertEqual(result.returnMismatches, 0u);
+    XCTAssertEqual(result.replayedKernelUpdates, result.recordedKernelUpdates);
+    XCTAssertEqual(result.replayedAggregateUpdates, result.recordedAggregateUpdates);
+    XCTAssertEqual(result.kernelMismatchAt, -1, @"Kernel assertion bits diverge at update %d", result.kernelMismatchAt);
+    XCTAssertEqual(result.aggregateMismatchAt, -1, @"Aggregate diverges at update %d", result.aggregateMismatchAt);
+}
+
+- (void)testReplayPMToolCommands
+{
+    char            path[] = "/tmp/pmtrace_replay.XXXXXX";
+    const char      *tracePath = path;     // Blocks can't capture arrays
+    __block IOReturn ret;
+    int             fd;
+
+    fd = mkstemp(path);
+    XCTAssertGreaterThanOrEqual(fd, 0);
+    close(fd);
+    unlink(path);
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        ret = PMAssertionTraceStart(tracePath);
+        if (ret == kIOReturnSuccess) {
+            [self recordPMToolCommands];
+            PMAssertionTraceStop();
+        }
+    });
+    XCTAssertEqual(ret, kIOReturnSuccess);
+
+    [self replay:path];
+    unlink(path);
+}
+
+- (void)testReplayFile
+{
+    const char              *path = getenv("PMTRACE_REPLAY");
+    pmTraceHeader_t         hdr;
+
+    if (!path) {
+        XCTSkip(@"PMTRACE_REPLAY is not set");
+    }
+    XCTAssertEqual(PMAssertionTraceReadHeader(path, &hdr), kIOReturnSuccess);
+    XCTAssert(PMClockSetVirtual(hdr.wallStart));
+    [self replay:path];
+}
+
+@end
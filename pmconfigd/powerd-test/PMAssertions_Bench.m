@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Load generator and microbenchmarks for the assertion engine.
+ *
+ * Runs against the PMAssertions core linked into powerd_test, with every
+ * operation issued on the PM main queue the way the XPC handlers issue them.
+ * Synthetic processes are registered with processInfoCreateForTest(), so no
+ * real pids, process-exit sources or clients are involved.
+ *
+ * Tunables (environment):
+ *   PMBENCH_PIDS          synthetic processes                 (default 256)
+ *   PMBENCH_OPS           operations in the mixed run         (default 200000)
+ *   PMBENCH_PER_PID       max live assertions per process     (default 16)
+ *   PMBENCH_SEED          PRNG seed                           (default 1)
+ *   PMBENCH_MIX           op weights, e.g. "create=40,retain=10,release=35,set=10,update=5"
+ *   PMBENCH_MIN_OPS_SEC   fail a run below this throughput    (default: no check)
+ *   PMBENCH_MAX_P99_US    fail a run above this p99 latency   (default: no check)
+ *
+ * Each run logs one "PMBench" line with ops/sec, p50/p99 latency, resident
+ * size and the number of assertion level updates sent to the kernel.
+ */
+
+#import <XCTest/XCTest.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+
+#include "PrivateLib.h"
+#include "PMAssertions.h"
+#include "XCTest_FunctionDefinitions.h"
+
+// PMAssertions.c entry points exposed to XCTest
+ProcessInfo*                processInfoCreateForTest(pid_t p, CFStringRef name);
+void                        processInfoRelease(pid_t p);
+IOReturn                    doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
+                                     IOPMAssertionID *assertion_id, ProcessInfo **pinfo,
+                                     int *enTrIntensity);
+IOReturn                    doRetain(pid_t pid, IOPMAssertionID id, int *retainCnt);
+IOReturn                    doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt);
+IOReturn                    doSetProperties(pid_t pid, IOPMAssertionID id,
+                                            CFDictionaryRef props, int *enTrIntensity);
+IOReturn                    doUpdateProperties(pid_t pid, IOPMAssertionID id,
+                                               const assertionUpdate_t *update);
+void                        HandleProcessExit(pid_t deadPID);
+void                        evaluateForPSChange(void);
+
+#define kBenchPidBase           20000
+#define kBenchWallStart         700000000.0
+
+typedef enum {
+    kBenchCreate,
+    kBenchRetain,
+    kBenchRelease,
+    kBenchSetProps,
+    kBenchUpdate,
+    kBenchOpCount
+} benchOp_t;
+
+static const char *gBenchOpNames[kBenchOpCount] = {
+    "create", "retain", "release", "set", "update"
+};
+
+typedef struct {
+    uint32_t    pids;
+    uint32_t    ops;
+    uint32_t    perPid;
+    uint64_t    seed;
+    uint32_t    mix[kBenchOpCount];
+    double      minOpsPerSec;
+    uint64_t    maxP99Ns;
+} benchConfig_t;
+
+typedef struct {
+    IOPMAssertionID id;
+    int             retainCnt;
+} benchAssertion_t;
+
+typedef struct {
+    uint32_t            cnt;
+    benchAssertion_t    *live;
+} benchProc_t;
+
+typedef struct {
+    uint64_t    *samples;       // per-op latency in mach time units
+    uint32_t    cnt;
+    uint32_t    max;
+    uint64_t    start;
+    uint64_t    rssStart;
+    uint64_t    kernelStart;
+} benchRun_t;
+
+static benchConfig_t                gConfig;
+static mach_timebase_info_data_t    gTimebase;
+
+// Assertion types exercised by the load; all are handled without entitlements
+static CFStringRef                  gBenchTypes[4];
+
+
+static uint32_t envUInt(const char *name, uint32_t def)
+{
+    const char *val = getenv(name);
+    return val ? (uint32_t)strtoul(val, NULL, 0) : def;
+}
+
+static void parseMix(const char *spec, uint32_t *mix)
+{
+    char *copy, *cursor, *tok;
+
+    if (!spec) {
+        return;
+    }
+    bzero(mix, sizeof(uint32_t) * kBenchOpCount);
+    copy = cursor = strdup(spec);
+    while ((tok = strsep(&cursor, ",")) != NULL) {
+        char *eq = strchr(tok, '=');
+        if (!eq) {
+            continue;
+        }
+        *eq = '\0';
+        for (int i = 0; i < kBenchOpCount; i++) {
+            if (!strcmp(tok, gBenchOpNames[i])) {
+                mix[i] = (uint32_t)strtoul(eq + 1, NULL, 0);
+            }
+        }
+    }
+    free(copy);
+}
+
+/* xorshift64*; runs are reproducible for a given seed */
+static inline uint64_t benchRand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+static uint64_t residentBytes(void)
+{
+    mach_task_basic_info_data_t     info;
+    mach_msg_type_number_t          cnt = MACH_TASK_BASIC_INFO_COUNT;
+
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &cnt) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size;
+}
+
+static CFMutableDictionaryRef createBenchProperties(uint32_t typeIdx, uint32_t seq, CFTimeInterval timeout)
+{
+    CFMutableDictionaryRef  props;
+    CFStringRef             name;
+    CFNumberRef             num;
+    int                     level = kIOPMAssertionLevelOn;
+
+    props = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    name = CFStringCreateWithFormat(0, NULL, CFSTR("pmbench assertion %u"), seq);
+    num = CFNumberCreate(0, kCFNumberIntType, &level);
+
+    CFDictionarySetValue(props, kIOPMAssertionTypeKey, gBenchTypes[typeIdx % 4]);
+    CFDictionarySetValue(props, kIOPMAssertionNameKey, name);
+    CFDictionarySetValue(props, kIOPMAssertionLevelKey, num);
+    CFRelease(name);
+    CFRelease(num);
+
+    if (timeout > 0) {
+        num = CFNumberCreate(0, kCFNumberDoubleType, &timeout);
+        CFDictionarySetValue(props, kIOPMAssertionTimeoutKey, num);
+        CFDictionarySetValue(props, kIOPMAssertionTimeoutActionKey, kIOPMAssertionTimeoutActionRelease);
+        CFRelease(num);
+    }
+    return props;
+}
+
+static void benchRunBegin(benchRun_t *run, uint32_t maxSamples)
+{
+    run->samples = calloc(maxSamples, sizeof(uint64_t));
+    run->cnt = 0;
+    run->max = maxSamples;
+    run->rssStart = residentBytes();
+    run->kernelStart = getKernelAssertionUpdateCount();
+    run->start = mach_absolute_time();
+}
+
+static inline void benchRecord(benchRun_t *run, uint64_t start)
+{
+    if (run->cnt < run->max) {
+        run->samples[run->cnt++] = mach_absolute_time() - start;
+    }
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static inline uint64_t toNs(uint64_t abs)
+{
+    return abs * gTimebase.numer / gTimebase.denom;
+}
+
+
+@interface PMAssertionsBench : XCTestCase
+@end
+
+@implementation PMAssertionsBench
+
++ (void)setUp
+{
+    static dispatch_once_t onceToken;
+
+    dispatch_once(&onceToken, ^{
+        mach_timebase_info(&gTimebase);
+
+        gBenchTypes[0] = kIOPMAssertionTypeNeedsCPU;
+        gBenchTypes[1] = kIOPMAssertionTypePreventUserIdleSystemSleep;
+        gBenchTypes[2] = kIOPMAssertionTypePreventSystemSleep;
+        gBenchTypes[3] = kIOPMAssertionTypeDisableLowBatteryWarnings;
+
+        gConfig.pids = MAX(envUInt("PMBENCH_PIDS", 256), 1);
+        gConfig.ops = envUInt("PMBENCH_OPS", 200000);
+        gConfig.perPid = MAX(envUInt("PMBENCH_PER_PID", 16), 1);
+        gConfig.seed = envUInt("PMBENCH_SEED", 1) | 1;
+        gConfig.mix[kBenchCreate] = 40;
+        gConfig.mix[kBenchRetain] = 10;
+        gConfig.mix[kBenchRelease] = 35;
+        gConfig.mix[kBenchSetProps] = 10;
+        gConfig.mix[kBenchUpdate] = 5;
+        parseMix(getenv("PMBENCH_MIX"), gConfig.mix);
+        gConfig.minOpsPerSec = envUInt("PMBENCH_MIN_OPS_SEC", 0);
+        gConfig.maxP99Ns = (uint64_t)envUInt("PMBENCH_MAX_P99_US", 0) * NSEC_PER_USEC;
+
+        // Keep live assertions below the engine-wide limit
+        if ((uint64_t)gConfig.pids * gConfig.perPid > kMaxAssertions / 2) {
+            gConfig.perPid = MAX((kMaxAssertions / 2) / gConfig.pids, 1);
+        }
+    });
+    dispatch_sync(_getPMMainQueue(), ^{
+        PMAssertions_prime();
+    });
+}
+
++ (void)tearDown
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        PMAssertionsResetForTest();
+    });
+}
+
+- (void)setUp
+{
+    // Assertion timeouts run on the virtual clock, so expiry needs no sleeping
+    XCTAssert(PMClockSetVirtual(kBenchWallStart));
+}
+
+- (void)endRun:(benchRun_t *)run label:(const char *)label
+{
+    uint64_t    elapsedNs = toNs(mach_absolute_time() - run->start);
+    uint64_t    rss = residentBytes();
+    uint64_t    p50 = 0, p99 = 0;
+    double      opsPerSec = 0;
+
+    if (run->cnt) {
+        qsort(run->samples, run->cnt, sizeof(uint64_t), compareSamples);
+        p50 = toNs(run->samples[run->cnt / 2]);
+        p99 = toNs(run->samples[(run->cnt * 99) / 100]);
+    }
+    if (elapsedNs) {
+        opsPerSec = (double)run->cnt * NSEC_PER_SEC / elapsedNs;
+    }
+
+    NSLog(@"PMBench %s: ops:%u ops/sec:%.0f p50:%lluns p99:%lluns rss:%lluKB (%+lldKB) kernel updates:%llu\n",
+          label, run->cnt, opsPerSec, p50, p99, rss / 1024,
+          (long long)((int64_t)rss - (int64_t)run->rssStart) / 1024,
+          getKernelAssertionUpdateCount() - run->kernelStart);
+
+    if (gConfig.minOpsPerSec > 0) {
+        XCTAssertGreaterThanOrEqual(opsPerSec, gConfig.minOpsPerSec, @"%s throughput regressed", label);
+    }
+    if (gConfig.maxP99Ns) {
+        XCTAssertLessThanOrEqual(p99, gConfig.maxP99Ns, @"%s p99 latency regressed", label);
+    }
+
+    free(run->samples);
+    run->samples = NULL;
+}
+
+- (void)createProcs
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        for (uint32_t i = 0; i < gConfig.pids; i++) {
+            CFStringRef name = CFStringCreateWithFormat(0, NULL, CFSTR("pmbench-%u"), i);
+            processInfoCreateForTest(kBenchPidBase + i, name);
+            CFRelease(name);
+        }
+    });
+}
+
+- (void)killProcs
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        for (uint32_t i = 0; i < gConfig.pids; i++) {
+            HandleProcessExit(kBenchPidBase + i);
+            processInfoRelease(kBenchPidBase + i);
+        }
+    });
+}
+
+/*
+ * Fills each synthetic process with 'perPid' assertions. Returns the
+ * number created.
+ */
+- (uint32_t)populate:(uint32_t)perPid timeout:(CFTimeInterval)timeout run:(benchRun_t *)run
+{
+    __block uint32_t created = 0;
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        for (uint32_t n = 0; n < perPid; n++) {
+            for (uint32_t i = 0; i < gConfig.pids; i++) {
+                CFMutableDictionaryRef props = createBenchProperties(i + n, created, timeout);
+                IOPMAssertionID id = kIOPMNullAssertionID;
+                uint64_t start = mach_absolute_time();
+
+                if (doCreate(kBenchPidBase + i, props, &id, NULL, NULL) == kIOReturnSuccess) {
+                    created++;
+                }
+                if (run) {
+                    benchRecord(run, start);
+                }
+                CFRelease(props);
+            }
+        }
+    });
+    return created;
+}
+
+- (void)testAssertionOpMix
+{
+    benchProc_t     *procs = calloc(gConfig.pids, sizeof(benchProc_t));
+    uint32_t        mixTotal = 0;
+    uint32_t        opCntBuf[kBenchOpCount] = {0};
+    uint32_t        *opCnt = opCntBuf;
+    __block benchRun_t run;
+
+    for (int i = 0; i < kBenchOpCount; i++) {
+        mixTotal += gConfig.mix[i];
+    }
+    XCTAssertGreaterThan(mixTotal, 0, @"PMBENCH_MIX selects no operations");
+    if (!mixTotal) {
+        free(procs);
+        return;
+    }
+    for (uint32_t i = 0; i < gConfig.pids; i++) {
+        procs[i].live = calloc(gConfig.perPid, sizeof(benchAssertion_t));
+    }
+
+    [self createProcs];
+    benchRunBegin(&run, gConfig.ops);
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        uint64_t    rng = gConfig.seed;
+        int         level = kIOPMAssertionLevelOff;
+        CFNumberRef levelOff = CFNumberCreate(0, kCFNumberIntType, &level);
+        CFDictionaryRef setProps = CFDictionaryCreate(0, (const void **)&kIOPMAssertionLevelKey,
+                                                      (const void **)&levelOff, 1,
+                                                      &kCFTypeDictionaryKeyCallBacks,
+                                                      &kCFTypeDictionaryValueCallBacks);
+        CFRelease(levelOff);
+
+        for (uint32_t n = 0; n < gConfig.ops; n++) {
+            uint64_t        r = benchRand(&rng);
+            uint32_t        procIdx = (uint32_t)(r % gConfig.pids);
+            uint32_t        pick = (uint32_t)((r >> 32) % mixTotal);
+            benchProc_t     *proc = &procs[procIdx];
+            pid_t           pid = kBenchPidBase + procIdx;
+            benchOp_t       op = kBenchCreate;
+            benchAssertion_t *a = NULL;
+            uint64_t        start;
+
+            while (pick >= gConfig.mix[op]) {
+                pick -= gConfig.mix[op];
+                op++;
+            }
+
+            // Keep every op meaningful: grow empty procs, shrink full ones
+            if ((op != kBenchCreate) && !proc->cnt) {
+                op = kBenchCreate;
+            }
+            else if ((op == kBenchCreate) && (proc->cnt == gConfig.perPid)) {
+                op = kBenchRelease;
+            }
+            if (proc->cnt) {
+                a = &proc->live[(r >> 16) % proc->cnt];
+            }
+            opCnt[op]++;
+
+            start = mach_absolute_time();
+            switch (op) {
+                case kBenchCreate: {
+                    CFMutableDictionaryRef props = createBenchProperties((uint32_t)(r >> 8), n, 0);
+                    IOPMAssertionID id = kIOPMNullAssertionID;
+
+                    if (doCreate(pid, props, &id, NULL, NULL) == kIOReturnSuccess) {
+                        proc->live[proc->cnt].id = id;
+                        proc->live[proc->cnt].retainCnt = 1;
+                        proc->cnt++;
+                    }
+                    CFRelease(props);
+                    break;
+                }
+                case kBenchRetain:
+                    doRetain(pid, a->id, &a->retainCnt);
+                    break;
+
+                case kBenchRelease:
+                    if ((doRelease(pid, a->id, &a->retainCnt) != kIOReturnSuccess) || (a->retainCnt <= 0)) {
+                        *a = proc->live[--proc->cnt];
+                    }
+                    break;
+
+                case kBenchSetProps:
+                    doSetProperties(pid, a->id, setProps, NULL);
+                    break;
+
+                case kBenchUpdate: {
+                    assertionUpdate_t update = {
+                        .fields = kAssertionUpdateLevel,
+                        .level = kIOPMAssertionLevelOn,
+                    };
+                    doUpdateProperties(pid, a->id, &update);
+                    break;
+                }
+                default:
+                    break;
+            }
+            benchRecord(&run, start);
+        }
+        CFRelease(setProps);
+    });
+
+    [self endRun:&run label:"op mix"];
+    NSLog(@"PMBench op mix: pids:%u create:%u retain:%u release:%u set:%u update:%u\n",
+          gConfig.pids, opCnt[kBenchCreate], opCnt[kBenchRetain], opCnt[kBenchRelease],
+          opCnt[kBenchSetProps], opCnt[kBenchUpdate]);
+
+    [self killProcs];
+    for (uint32_t i = 0; i < gConfig.pids; i++) {
+        free(procs[i].live);
+    }
+    free(procs);
+}
+
+- (void)testTimeoutExpiry
+{
+    __block benchRun_t                  run;
+    __block assertionAdmissionStats_t   before, after;
+    uint32_t                            created;
+
+    [self createProcs];
+    created = [self populate:gConfig.perPid timeout:1 run:NULL];
+
+    // One sample: the virtual clock fires every type's expiry timer in a single advance
+    benchRunBegin(&run, 1);
+    dispatch_sync(_getPMMainQueue(), ^{
+        uint64_t start;
+
+        getAssertionAdmissionStats(&before);
+        start = mach_absolute_time();
+        PMClockAdvance(2 * NSEC_PER_SEC);
+        benchRecord(&run, start);
+        getAssertionAdmissionStats(&after);
+    });
+    NSLog(@"PMBench timeout expiry: %u assertions expired across %u types\n",
+          created, kIOPMNumAssertionTypes);
+    [self endRun:&run label:"timeout expiry"];
+    XCTAssertEqual(before.liveCnt - after.liveCnt, created);
+
+    [self killProcs];
+}
+
+- (void)testProcessExitCleanup
+{
+    __block benchRun_t  run;
+    uint32_t            created;
+
+    [self createProcs];
+    created = [self populate:gConfig.perPid timeout:0 run:NULL];
+
+    benchRunBegin(&run, gConfig.pids);
+    dispatch_sync(_getPMMainQueue(), ^{
+        for (uint32_t i = 0; i < gConfig.pids; i++) {
+            uint64_t start = mach_absolute_time();
+            HandleProcessExit(kBenchPidBase + i);
+            benchRecord(&run, start);
+            processInfoRelease(kBenchPidBase + i);
+        }
+    });
+    NSLog(@"PMBench process exit: %u assertions across %u processes\n", created, gConfig.pids);
+    [self endRun:&run label:"process exit"];
+}
+
+- (void)testAggregateEvaluation
+{
+    __block benchRun_t  run;
+    const uint32_t      rounds = 1000;
+    uint32_t            created;
+
+    [self createProcs];
+
+    benchRunBegin(&run, gConfig.pids * gConfig.perPid);
+    created = [self populate:gConfig.perPid timeout:0 run:&run];
+    [self endRun:&run label:"populate"];
+
+    benchRunBegin(&run, rounds);
+    dispatch_sync(_getPMMainQueue(), ^{
+        for (uint32_t n = 0; n < rounds; n++) {
+            uint64_t start = mach_absolute_time();
+            evaluateForPSChange();
+            benchRecord(&run, start);
+        }
+    });
+    NSLog(@"PMBench aggregate evaluation: %u active assertions\n", created);
+    [self endRun:&run label:"aggregate evaluation"];
+
+    [self killProcs];
+}
+
+@end
@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * Correctness tests for the assertion engine, run against the PMAssertions
+ * core linked into powerd_test. Operations are issued on the PM main queue
+ * the way the XPC handlers issue them.
+ */
+
+#import <XCTest/XCTest.h>
+#include <CoreFoundation/CFXPCBridge.h>
+#include <xpc/xpc.h>
+
+#include "PrivateLib.h"
+#include "PMAssertions.h"
+#include "PMClock.h"
+#include "BatteryTimeRemaining.h"
+#include "PMXPCRouter.h"
+#include "XCTest_FunctionDefinitions.h"
+
+#define kWallStart          700000000.0
+#define kTestPid            21000
+
+// PMAssertions.c entry points exposed to XCTest
+int                         assertionTypeIndexForName(CFStringRef type);
+ProcessInfo*                processInfoCreateForTest(pid_t p, CFStringRef name);
+void                        processInfoRelease(pid_t p);
+void                        HandleProcessExit(pid_t deadPID);
+IOReturn                    doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
+                                     IOPMAssertionID *assertion_id, ProcessInfo **pinfo,
+                                     int *enTrIntensity);
+IOReturn                    doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt);
+IOReturn                    copyAssertionForID(pid_t inPID, int inID,
+                                               CFMutableDictionaryRef *outAssertion);
+kern_return_t               _io_pm_assertion_copy_details(mach_port_t server, audit_token_t token,
+                                                          int assertion_id, int whichData,
+                                                          vm_offset_t props, mach_msg_type_number_t propsCnt,
+                                                          vm_offset_t *assertions,
+                                                          mach_msg_type_number_t *assertionsCnt,
+                                                          int *return_val);
+
+static CFMutableDictionaryRef createProperties(CFStringRef type, uint32_t seq)
+{
+    CFMutableDictionaryRef  props;
+    CFStringRef             name;
+    CFNumberRef             num;
+    int                     level = kIOPMAssertionLevelOn;
+
+    props = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    name = CFStringCreateWithFormat(0, NULL, CFSTR("pmtest assertion %u"), seq);
+    num = CFNumberCreate(0, kCFNumberIntType, &level);
+
+    CFDictionarySetValue(props, kIOPMAssertionTypeKey, type);
+    CFDictionarySetValue(props, kIOPMAssertionNameKey, name);
+    CFDictionarySetValue(props, kIOPMAssertionLevelKey, num);
+    CFRelease(name);
+    CFRelease(num);
+    return props;
+}
+
+static IOPMAssertionID createAssertion(pid_t pid, CFStringRef type)
+{
+    CFMutableDictionaryRef  props = createProperties(type, 0);
+    IOPMAssertionID         id = kIOPMNullAssertionID;
+
+    doCreate(pid, props, &id, NULL, NULL);
+    CFRelease(props);
+    return id;
+}
+
+// Number of assertions in a kIOPMAssertionMIGCopyAll reply held by 'pid'
+static NSUInteger countForPid(NSArray *byPid, pid_t pid)
+{
+    for (NSDictionary *process in byPid) {
+        if ([process[@kIOPMAssertionPIDKey] intValue] == pid) {
+            return [process[@"PerTaskAssertions"] count];
+        }
+    }
+    return 0;
+}
+
+@interface PMAssertionsTests : XCTestCase
+@end
+
+@implementation PMAssertionsTests
+
++ (void)setUp
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        PMAssertions_prime();
+        PMAssertionsRegisterXPCRoutes();
+    });
+}
+
++ (void)tearDown
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        PMAssertionsResetForTest();
+    });
+}
+
+/*
+ * Routes 'msg' as powerd does for a client message and returns the
+ * kMsgReturnCode the handler left in it, or kIOReturnNotFound if no
+ * handler ran.
+ */
+- (IOReturn)dispatch:(xpc_object_t)msg
+{
+    __block bool routed;
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        routed = PMXPCRouterDispatch(NULL, msg);
+    });
+    XCTAssertTrue(routed);
+    if (!xpc_dictionary_get_value(msg, kMsgReturnCode)) {
+        return kIOReturnNotFound;
+    }
+    return (IOReturn)xpc_dictionary_get_uint64(msg, kMsgReturnCode);
+}
+
+- (NSDictionary *)copyAssertion:(IOPMAssertionID)id
+{
+    __block CFMutableDictionaryRef props = NULL;
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        copyAssertionForID(XCTEST_PID, id, &props);
+    });
+    return CFBridgingRelease(props);
+}
+
+- (void)setUp
+{
+    XCTAssert(PMClockSetVirtual(kWallStart));
+}
+
+/*
+ * Asks for 'whichData' from the read queue as a MIG client would and returns
+ * the unserialized reply. 'type' is sent along for kIOPMAssertionMIGCopyByType.
+ */
+- (id)copyDetails:(int)whichData type:(CFStringRef)type
+{
+    __block CFPropertyListRef   details = NULL;
+
+    dispatch_sync(_getPMReadQueue(), ^{
+        audit_token_t           token = { { 0 } };
+        vm_offset_t             props = 0, reply = 0;
+        mach_msg_type_number_t  propsCnt = 0, replyCnt = 0;
+        int                     ret = kIOReturnError;
+
+        if (type) {
+            CFDataRef data = CFPropertyListCreateData(0, type, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+
+            // The handler deallocates the request, as MIG would
+            propsCnt = (mach_msg_type_number_t)CFDataGetLength(data);
+            vm_allocate(mach_task_self(), (vm_address_t *)&props, propsCnt, TRUE);
+            memcpy((void *)props, CFDataGetBytePtr(data), propsCnt);
+            CFRelease(data);
+        }
+        _io_pm_assertion_copy_details(MACH_PORT_NULL, token, 0, whichData, props, propsCnt,
+                                      &reply, &replyCnt, &ret);
+        XCTAssertEqual(ret, kIOReturnSuccess);
+        if (reply && replyCnt) {
+            CFDataRef data = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)reply, replyCnt, kCFAllocatorNull);
+
+            details = CFPropertyListCreateWithData(0, data, 0, NULL, NULL);
+            CFRelease(data);
+            vm_deallocate(mach_task_self(), reply, replyCnt);
+        }
+    });
+    return CFBridgingRelease(details);
+}
+
+/*
+ * The status, by-type and all-assertions views are served from the read
+ * queue, but a client reading right after a change on the main queue must
+ * see that change.
+ */
+- (void)testCopyDetailsReadsOwnChanges
+{
+    CFStringRef         type = kIOPMAssertionTypePreventUserIdleSystemSleep;
+    NSString            *typeKey = (__bridge NSString *)type;
+    __block IOPMAssertionID id = kIOPMNullAssertionID;
+    NSDictionary        *status;
+    NSArray             *byType, *all;
+    NSUInteger          byTypeBefore, allBefore;
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        processInfoCreateForTest(kTestPid, CFSTR("pmreadwrites"));
+    });
+    byTypeBefore = [[self copyDetails:kIOPMAssertionMIGCopyByType type:type] count];
+    allBefore = countForPid([self copyDetails:kIOPMAssertionMIGCopyAll type:NULL], kTestPid);
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        id = createAssertion(kTestPid, type);
+    });
+    XCTAssertNotEqual(id, kIOPMNullAssertionID);
+    status = [self copyDetails:kIOPMAssertionMIGCopyStatus type:NULL];
+    byType = [self copyDetails:kIOPMAssertionMIGCopyByType type:type];
+    all = [self copyDetails:kIOPMAssertionMIGCopyAll type:NULL];
+    XCTAssertEqualObjects(status[typeKey], @(kIOPMAssertionLevelOn));
+    XCTAssertEqual(byType.count, byTypeBefore + 1);
+    XCTAssertEqual(countForPid(all, kTestPid), allBefore + 1);
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        doRelease(kTestPid, id, NULL);
+    });
+    byType = [self copyDetails:kIOPMAssertionMIGCopyByType type:type];
+    all = [self copyDetails:kIOPMAssertionMIGCopyAll type:NULL];
+    XCTAssertEqual(byType.count, byTypeBefore);
+    XCTAssertEqual(countForPid(all, kTestPid), allBefore);
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        HandleProcessExit(kTestPid);
+        processInfoRelease(kTestPid);
+    });
+}
+
+/*
+ * kIOPMAssertionMIGCopyByType maps the type name from a published snapshot.
+ * The lookup must answer while the main queue is busy.
+ */
+- (void)testByTypeLookupOffMainQueue
+{
+    dispatch_semaphore_t    holdMain = dispatch_semaphore_create(0);
+    dispatch_semaphore_t    mainHeld = dispatch_semaphore_create(0);
+    dispatch_semaphore_t    looked = dispatch_semaphore_create(0);
+    __block int             preventIdle = -2, preventDisplay = -2, unknown = -2;
+
+    // Publish the map once, then keep the main queue busy
+    XCTAssertEqual(assertionTypeIndexForName(kIOPMAssertionTypePreventUserIdleSystemSleep), kPreventIdleType);
+    dispatch_async(_getPMMainQueue(), ^{
+        dispatch_semaphore_signal(mainHeld);
+        dispatch_semaphore_wait(holdMain, DISPATCH_TIME_FOREVER);
+    });
+    dispatch_semaphore_wait(mainHeld, DISPATCH_TIME_FOREVER);
+
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^{
+        preventIdle = assertionTypeIndexForName(kIOPMAssertionTypePreventUserIdleSystemSleep);
+        preventDisplay = assertionTypeIndexForName(kIOPMAssertionTypePreventUserIdleDisplaySleep);
+        unknown = assertionTypeIndexForName(CFSTR("NotAnAssertionType"));
+        dispatch_semaphore_signal(looked);
+    });
+    long blocked = dispatch_semaphore_wait(looked, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC));
+    dispatch_semaphore_signal(holdMain);
+    if (blocked) {
+        dispatch_semaphore_wait(looked, DISPATCH_TIME_FOREVER);
+    }
+    XCTAssertEqual(blocked, 0, @"By-type lookup waited for the main queue");
+
+    XCTAssertEqual(preventIdle, kPreventIdleType);
+    XCTAssertEqual(preventDisplay, kPreventDisplaySleepType);
+    XCTAssertEqual(unknown, -1);
+}
+
+/*
+ * An aggregate limit is reported when a held effect crosses it, not at the
+ * next periodic audit, and each effect is reported once per window.
+ */
+- (void)testAggregateLimitPostsAtDeadline
+{
+    dispatch_sync(_getPMMainQueue(), ^{
+        ProcessInfo     *pinfo;
+        IOPMAssertionID idleId, displayId;
+
+        xctSetPowerSource(kBatteryPowered);
+        setAssertionActivityAggregate(getpid(), 1);
+        pinfo = processInfoCreateForTest(kTestPid, CFSTR("pmaggregate"));
+        pinfo->aggAssertLength = 60;
+
+        idleId = createAssertion(kTestPid, kIOPMAssertionTypePreventUserIdleSystemSleep);
+        PMClockAdvance(30 * NSEC_PER_SEC);
+        displayId = createAssertion(kTestPid, kIOPMAssertionTypePreventUserIdleDisplaySleep);
+        XCTAssertEqual((uint32_t)pinfo->aggExceptionSent, 0u);
+
+        PMClockAdvance(30 * NSEC_PER_SEC);
+        XCTAssertEqual((uint32_t)pinfo->aggExceptionSent, 1u << kPrevIdleSlpEffect);
+
+        PMClockAdvance(30 * NSEC_PER_SEC);
+        XCTAssertEqual((uint32_t)pinfo->aggExceptionSent,
+                       (1u << kPrevIdleSlpEffect) | (1u << kPrevDisplaySlpEffect));
+
+        doRelease(kTestPid, idleId, NULL);
+        doRelease(kTestPid, displayId, NULL);
+
+        HandleProcessExit(kTestPid);
+        processInfoRelease(kTestPid);
+        setAssertionActivityAggregate(getpid(), 0);
+        xctSetPowerSource(kACPowered);
+    });
+}
+
+/*
+ * Each async assertion message reaches its own handler: create, properties,
+ * the typed update and release each leave their result in the message and
+ * their change on the assertion.
+ */
+- (void)testAssertionMessageRoutes
+{
+    NSDictionary        *createProps, *setProps, *assertion;
+    xpc_object_t        msg, body;
+    IOPMAssertionID     id;
+
+    // kAssertionCreateMsg
+    createProps = @{
+        @kIOPMAssertionTypeKey  : (__bridge NSString *)kIOPMAssertionTypePreventUserIdleSystemSleep,
+        @kIOPMAssertionNameKey  : @"pmtest route",
+        @kIOPMAssertionLevelKey : @(kIOPMAssertionLevelOn),
+    };
+    msg = xpc_dictionary_create(NULL, NULL, 0);
+    body = _CFXPCCreateXPCMessageWithCFObject((__bridge CFDictionaryRef)createProps);
+    xpc_dictionary_set_value(msg, kAssertionCreateMsg, body);
+    XCTAssertEqual([self dispatch:msg], kIOReturnSuccess);
+    id = (IOPMAssertionID)xpc_dictionary_get_uint64(msg, kAssertionIdKey);
+    XCTAssertNotEqual(id, kIOPMNullAssertionID);
+    assertion = [self copyAssertion:id];
+    XCTAssertEqualObjects(assertion[@kIOPMAssertionNameKey], @"pmtest route");
+
+    // kAssertionPropertiesMsg
+    setProps = @{
+        @kIOPMAssertionIdKey    : @(id),
+        @kIOPMAssertionLevelKey : @(kIOPMAssertionLevelOff),
+    };
+    msg = xpc_dictionary_create(NULL, NULL, 0);
+    body = _CFXPCCreateXPCMessageWithCFObject((__bridge CFDictionaryRef)setProps);
+    xpc_dictionary_set_value(msg, kAssertionPropertiesMsg, body);
+    XCTAssertEqual([self dispatch:msg], kIOReturnSuccess);
+    assertion = [self copyAssertion:id];
+    XCTAssertEqualObjects(assertion[@kIOPMAssertionLevelKey], @(kIOPMAssertionLevelOff));
+
+    // kAssertionUpdateMsg
+    msg = xpc_dictionary_create(NULL, NULL, 0);
+    body = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_uint64(body, kAssertionUpdateIdKey, id);
+    xpc_dictionary_set_int64(body, kAssertionUpdateLevelKey, kIOPMAssertionLevelOn);
+    xpc_dictionary_set_string(body, kAssertionUpdateNameKey, "pmtest route updated");
+    xpc_dictionary_set_value(msg, kAssertionUpdateMsg, body);
+    XCTAssertEqual([self dispatch:msg], kIOReturnSuccess);
+    assertion = [self copyAssertion:id];
+    XCTAssertEqualObjects(assertion[@kIOPMAssertionLevelKey], @(kIOPMAssertionLevelOn));
+    XCTAssertEqualObjects(assertion[@kIOPMAssertionNameKey], @"pmtest route updated");
+
+    // A mistyped level is rejected instead of read as off
+    msg = xpc_dictionary_create(NULL, NULL, 0);
+    body = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_uint64(body, kAssertionUpdateIdKey, id);
+    xpc_dictionary_set_string(body, kAssertionUpdateLevelKey, "off");
+    xpc_dictionary_set_value(msg, kAssertionUpdateMsg, body);
+    XCTAssertEqual([self dispatch:msg], kIOReturnBadArgument);
+    assertion = [self copyAssertion:id];
+    XCTAssertEqualObjects(assertion[@kIOPMAssertionLevelKey], @(kIOPMAssertionLevelOn));
+
+    // kAssertionReleaseMsg
+    msg = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_uint64(msg, kAssertionReleaseMsg, id);
+    XCTAssertEqual([self dispatch:msg], kIOReturnSuccess);
+    XCTAssertNil([self copyAssertion:id]);
+}
+
+/*
+ * Floods the engine from processes that ignore their quota: two types are
+ * pushed past kMaxAssertionsPerType and a third fills the shared part of
+ * the table. powerd's own assertions must still be admitted from the
+ * reserved part afterwards.
+ */
+- (void)testAssertionFlood
+{
+    const uint32_t                      floodPids = 6;
+    const uint32_t                      attempts = kMaxAssertionsPerProcess + 256;
+    const pid_t                         floodBase = kTestPid + 100;
+    __block uint32_t                    otherErrors = 0;
+    __block assertionAdmissionStats_t   before, after;
+    __block IOReturn                    internalRet = kIOReturnSuccess;
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        CFStringRef types[3] = {
+            kIOPMAssertionTypeNeedsCPU,
+            kIOPMAssertionTypePreventUserIdleSystemSleep,
+            kIOPMAssertionTypePreventSystemSleep,
+        };
+
+        getAssertionAdmissionStats(&before);
+        for (uint32_t i = 0; i < floodPids; i++) {
+            CFStringRef name = CFStringCreateWithFormat(0, NULL, CFSTR("pmflood-%u"), i);
+            processInfoCreateForTest(floodBase + i, name);
+            CFRelease(name);
+        }
+
+        for (uint32_t i = 0; i < floodPids; i++) {
+            CFStringRef type = types[(i < floodPids - 1) ? (i % 2) : 2];
+
+            for (uint32_t n = 0; n < attempts; n++) {
+                CFMutableDictionaryRef  props = createProperties(type, n);
+                IOPMAssertionID         id;
+                IOReturn                ret = doCreate(floodBase + i, props, &id, NULL, NULL);
+
+                if ((ret != kIOReturnSuccess) && (ret != kIOReturnNoResources)) {
+                    otherErrors++;
+                }
+                CFRelease(props);
+            }
+        }
+        getAssertionAdmissionStats(&after);
+
+        // powerd's own assertions come out of the reserved part of the table
+        for (uint32_t n = 0; n < kReservedAssertions / 2; n++) {
+            CFMutableDictionaryRef  props = createProperties(types[0], n);
+            IOPMAssertionID         id;
+            IOReturn                ret = doCreate(getpid(), props, &id, NULL, NULL);
+
+            CFRelease(props);
+            if (ret != kIOReturnSuccess) {
+                internalRet = ret;
+                break;
+            }
+            doRelease(getpid(), id, NULL);
+        }
+    });
+
+    XCTAssertEqual(otherErrors, 0);
+    XCTAssertGreaterThan(after.rejectCnt[kAdmitRejectTable], before.rejectCnt[kAdmitRejectTable]);
+    XCTAssertGreaterThan(after.rejectCnt[kAdmitRejectType], before.rejectCnt[kAdmitRejectType]);
+    XCTAssertGreaterThan(after.rejectCnt[kAdmitRejectProcess], before.rejectCnt[kAdmitRejectProcess]);
+    XCTAssertLessThanOrEqual(after.liveCnt, kMaxAssertions - kReservedAssertions);
+    XCTAssertEqual(internalRet, kIOReturnSuccess, @"Internal assertion refused during flood");
+
+    dispatch_sync(_getPMMainQueue(), ^{
+        for (uint32_t i = 0; i < floodPids; i++) {
+            HandleProcessExit(floodBase + i);
+            processInfoRelease(floodBase + i);
+        }
+        getAssertionAdmissionStats(&after);
+    });
+    XCTAssertEqual(after.liveCnt, before.liveCnt);
+}
+
+/*
+ * Assertions from one process that share a name must share one interned
+ * string, and copies handed to clients must still carry the keys that are
+ * no longer kept in assertion->props.
+ */
+- (void)testAssertionStringSharing
+{
+    const uint32_t              cnt = 256;
+    const pid_t                 pid = kTestPid + 200;
+    __block uint32_t            stringsBefore = 0, stringsDuring = 0, stringsAfter = 0;
+    IOPMAssertionID             *ids = calloc(cnt, sizeof(IOPMAssertionID));
+    __block CFMutableDictionaryRef copy = NULL;
+
+    XCTAssert(ids != NULL);
+    dispatch_sync(_getPMMainQueue(), ^{
+        processInfoCreateForTest(pid, CFSTR("pmintern"));
+        PMInternGetStats(&stringsBefore, NULL);
+        for (uint32_t i = 0; i < cnt; i++) {
+            ids[i] = createAssertion(pid, kIOPMAssertionTypeNeedsCPU);
+        }
+        PMInternGetStats(&stringsDuring, NULL);
+        copyAssertionForID(pid, ids[cnt - 1], &copy);
+
+        for (uint32_t i = 0; i < cnt; i++) {
+            doRelease(pid, ids[i], NULL);
+        }
+        HandleProcessExit(pid);
+        processInfoRelease(pid);
+        PMInternGetStats(&stringsAfter, NULL);
+    });
+
+    // One name and at most one type not already in use
+    XCTAssertLessThanOrEqual(stringsDuring - stringsBefore, 2u);
+    XCTAssertEqual(stringsAfter, stringsBefore);
+
+    XCTAssert(copy != NULL);
+    NSDictionary *dict = (__bridge NSDictionary *)copy;
+    XCTAssertEqualObjects(dict[@kIOPMAssertionNameKey], @"pmtest assertion 0");
+    XCTAssertEqualObjects(dict[@kIOPMAssertionTypeKey], (__bridge NSString *)kIOPMAssertionTypeNeedsCPU);
+    XCTAssertEqualObjects(dict[@kIOPMAssertionPIDKey], @(pid));
+    XCTAssertEqualObjects(dict[@kIOPMAssertionProcessNameKey], @"pmintern");
+    XCTAssertNotNil(dict[@kIOPMAssertionGlobalUniqueIDKey]);
+    XCTAssertNotNil(dict[@kIOPMAssertionCreateDateKey]);
+    if (copy) {
+        CFRelease(copy);
+    }
+    free(ids);
+}
+
+@end
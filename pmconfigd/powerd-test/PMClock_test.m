@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * PMClockTests drives the virtual clock directly: time only moves on
+ * PMClockAdvance(), and due timers fire in deadline order on the caller's
+ * stack.
+ */
+
+#import <XCTest/XCTest.h>
+
+#include "PrivateLib.h"
+#include "PMClock.h"
+
+#define kWallStart      700000000.0
+
+@interface PMClockTests : XCTestCase
+@end
+
+@implementation PMClockTests
+
+- (void)setUp
+{
+    XCTAssert(PMClockSetVirtual(kWallStart));
+    XCTAssert(PMClockIsVirtual());
+    // Nothing may be left armed by an earlier test
+    XCTAssertFalse(PMClockAdvanceToNextTimer());
+}
+
+- (void)testAdvance
+{
+    uint64_t start = PMClockMonotonicNs();
+
+    XCTAssertEqual(PMClockAbsoluteTime(), kWallStart);
+    XCTAssertEqual(PMClockMonotonicNs(), start);
+
+    PMClockAdvance(1500 * NSEC_PER_MSEC);
+    XCTAssertEqual(PMClockMonotonicNs(), start + 1500 * NSEC_PER_MSEC);
+    XCTAssertEqualWithAccuracy(PMClockAbsoluteTime(), kWallStart + 1.5, 1e-6);
+}
+
+- (void)testTimersFireInDeadlineOrder
+{
+    NSMutableArray  *fired = [NSMutableArray array];
+    __block int     repeats = 0;
+    __block uint64_t lateFiredAt = 0;
+    uint64_t        start = PMClockMonotonicNs();
+
+    PMTimerRef late = PMTimerCreate(dispatch_get_main_queue(), ^{
+        [fired addObject:@"late"];
+        lateFiredAt = PMClockMonotonicNs();
+    });
+    PMTimerRef early = PMTimerCreate(dispatch_get_main_queue(), ^{ [fired addObject:@"early"]; });
+    PMTimerRef periodic = PMTimerCreate(dispatch_get_main_queue(), ^{ repeats++; });
+
+    PMTimerSchedule(late, 3 * NSEC_PER_SEC, kPMTimerForever);
+    PMTimerSchedule(early, 1 * NSEC_PER_SEC, kPMTimerForever);
+    PMTimerSchedule(periodic, 500 * NSEC_PER_MSEC, 500 * NSEC_PER_MSEC);
+
+    PMClockAdvance(2 * NSEC_PER_SEC);
+    XCTAssertEqualObjects(fired, @[ @"early" ]);
+    XCTAssertEqual(repeats, 4);
+
+    // A handler sees the clock at its own deadline, not at the advance target
+    PMClockAdvance(2 * NSEC_PER_SEC);
+    XCTAssertEqualObjects(fired, (@[ @"early", @"late" ]));
+    XCTAssertEqual(lateFiredAt, start + 3 * NSEC_PER_SEC);
+    XCTAssertEqual(repeats, 8);
+
+    // Disarmed and one-shot timers stay quiet
+    PMTimerDisarm(periodic);
+    PMClockAdvance(10 * NSEC_PER_SEC);
+    XCTAssertEqual(repeats, 8);
+    XCTAssertEqual(fired.count, 2u);
+
+    PMTimerCancel(late);
+    PMTimerCancel(early);
+    PMTimerCancel(periodic);
+}
+
+- (void)testAdvanceToNextTimer
+{
+    __block int fired = 0;
+    uint64_t    start = PMClockMonotonicNs();
+    PMTimerRef  timer = PMTimerCreate(dispatch_get_main_queue(), ^{ fired++; });
+
+    PMTimerSchedule(timer, 90 * NSEC_PER_SEC, kPMTimerForever);
+    XCTAssert(PMClockAdvanceToNextTimer());
+    XCTAssertEqual(fired, 1);
+    XCTAssertEqual(PMClockMonotonicNs(), start + 90 * NSEC_PER_SEC);
+    XCTAssertFalse(PMClockAdvanceToNextTimer());
+
+    PMTimerCancel(timer);
+}
+
+- (void)testScheduleAtDate
+{
+    __block int             fired = 0;
+    __block CFAbsoluteTime  firedAt = 0;
+    PMTimerRef              timer = PMTimerCreate(dispatch_get_main_queue(), ^{
+        fired++;
+        firedAt = PMClockAbsoluteTime();
+    });
+
+    PMTimerScheduleAtDate(timer, kWallStart + 60);
+    PMClockAdvance(59 * NSEC_PER_SEC);
+    XCTAssertEqual(fired, 0);
+    PMClockAdvance(2 * NSEC_PER_SEC);
+    XCTAssertEqual(fired, 1);
+    XCTAssertEqualWithAccuracy(firedAt, kWallStart + 60, 1e-6);
+
+    // A date in the past fires on the next advance
+    PMTimerScheduleAtDate(timer, kWallStart);
+    PMClockAdvance(0);
+    XCTAssertEqual(fired, 2);
+
+    PMTimerCancel(timer);
+}
+
+- (void)testCancelFromHandler
+{
+    __block int         fired = 0;
+    __block PMTimerRef  timer = NULL;
+
+    timer = PMTimerCreate(dispatch_get_main_queue(), ^{
+        fired++;
+        PMTimerCancel(timer);
+    });
+    PMTimerSchedule(timer, NSEC_PER_SEC, NSEC_PER_SEC);
+    PMClockAdvance(5 * NSEC_PER_SEC);
+    XCTAssertEqual(fired, 1);
+    XCTAssertFalse(PMClockAdvanceToNextTimer());
+}
+
+@end
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * PMDisplayCoalescerTests runs traces of display state requests through the
+ * coalescer with a mock sink and checks the sequence of requests that reach
+ * it, and when. Time is simulated: the mock timer records its deadline and
+ * the trace runner fires it when the trace moves past it.
+ */
+
+#import <XCTest/XCTest.h>
+
+#include "PrivateLib.h"
+#include "PMDisplayCoalescer.h"
+#include "PMTestSupport.h"
+
+// Any distinct values will do; the coalescer doesn't interpret states
+#define kDim            1
+#define kUnblank        2
+#define kFlush          UINT64_MAX      // Trace step that flushes instead of submitting
+
+#define kWindowMs       50
+#define kMaxSteps       8
+
+typedef struct {
+    uint64_t        tMs;
+    uint64_t        state;
+    int             timeout;
+    bool            hold;
+} coalescerInput_t;
+
+typedef struct {
+    uint64_t        tMs;
+    uint64_t        state;
+    int             timeout;
+} coalescerOutput_t;
+
+typedef struct {
+    const char          *name;
+    uint64_t            windowMs;
+    coalescerInput_t    inputs[kMaxSteps];
+    uint32_t            inputCnt;
+    coalescerOutput_t   outputs[kMaxSteps];
+    uint32_t            outputCnt;
+} coalescerCase_t;
+
+enum {
+    kOpEmit,
+    kOpArm,
+    kOpDisarm,
+};
+
+static PMTestCallLog    gCalls;
+static struct {
+    bool                armed;
+    uint64_t            deadlineMs;
+} gTimer;
+
+PMTestMockOp2(gCalls, mockEmit, kOpEmit, uint64_t, int)
+
+static void mockArm(uint64_t delayNs)
+{
+    PMTestRecordCall(&gCalls, kOpArm, delayNs, 0);
+    gTimer.armed = true;
+    gTimer.deadlineMs = gCalls.nowMs + delayNs / NSEC_PER_MSEC;
+}
+
+static void mockDisarm(void)
+{
+    PMTestRecordCall(&gCalls, kOpDisarm, 0, 0);
+    gTimer.armed = false;
+}
+
+static const PMDisplayCoalescerOps gMockOps = {
+    .emit   = mockEmit,
+    .arm    = mockArm,
+    .disarm = mockDisarm,
+};
+
+static void resetMock(void)
+{
+    PMTestCallLogReset(&gCalls);
+    bzero(&gTimer, sizeof(gTimer));
+}
+
+static void advanceTo(uint64_t tMs)
+{
+    if (gTimer.armed && (gTimer.deadlineMs <= tMs)) {
+        gCalls.nowMs = gTimer.deadlineMs;
+        gTimer.armed = false;
+        PMDisplayCoalescerFire();
+    }
+    gCalls.nowMs = tMs;
+}
+
+static const coalescerCase_t gCases[] = {
+    { "dim then off", kWindowMs,
+      { { 0, kDim, -1, true }, { 10, kDim, 0, false } }, 2,
+      { { 10, kDim, 0 } }, 1 },
+    { "dim alone", kWindowMs,
+      { { 0, kDim, -1, true } }, 1,
+      { { 50, kDim, -1 } }, 1 },
+    { "repeated dims keep the first deadline", kWindowMs,
+      { { 0, kDim, -1, true }, { 30, kDim, -1, true }, { 60, kDim, -1, true } }, 3,
+      { { 50, kDim, -1 }, { 110, kDim, -1 } }, 2 },
+    { "dim then unblank", kWindowMs,
+      { { 0, kDim, -1, true }, { 5, kUnblank, -1, false } }, 2,
+      { { 5, kUnblank, -1 } }, 1 },
+    { "off after the window", kWindowMs,
+      { { 0, kDim, -1, true }, { 70, kDim, 0, false } }, 2,
+      { { 50, kDim, -1 }, { 70, kDim, 0 } }, 2 },
+    { "requests that aren't held keep their order", kWindowMs,
+      { { 0, kUnblank, -1, false }, { 1, kDim, 0, false }, { 2, kUnblank, -1, false } }, 3,
+      { { 0, kUnblank, -1 }, { 1, kDim, 0 }, { 2, kUnblank, -1 } }, 3 },
+    { "flush sends the held request first", kWindowMs,
+      { { 0, kDim, -1, true }, { 20, kFlush, 0, false }, { 30, kUnblank, -1, false } }, 3,
+      { { 20, kDim, -1 }, { 30, kUnblank, -1 } }, 2 },
+    { "no window", 0,
+      { { 0, kDim, -1, true }, { 10, kDim, 0, false } }, 2,
+      { { 0, kDim, -1 }, { 10, kDim, 0 } }, 2 },
+};
+
+@interface PMDisplayCoalescerTests : XCTestCase
+@end
+
+@implementation PMDisplayCoalescerTests
+
+- (void)tearDown
+{
+    PMDisplayCoalescerInit(NULL);
+    PMDisplayCoalescerSetWindow(kPMDisplayCoalesceWindowNs);
+}
+
+- (void)testTraces
+{
+    for (uint32_t c = 0; c < PMTestCount(gCases); c++) {
+        const coalescerCase_t *tc = &gCases[c];
+        NSString *name = @(tc->name);
+        uint32_t emitted = 0;
+
+        resetMock();
+        PMDisplayCoalescerInit(&gMockOps);
+        PMDisplayCoalescerSetWindow(tc->windowMs * NSEC_PER_MSEC);
+
+        for (uint32_t i = 0; i < tc->inputCnt; i++) {
+            const coalescerInput_t *in = &tc->inputs[i];
+
+            advanceTo(in->tMs);
+            if (in->state == kFlush) {
+                PMDisplayCoalescerFlush();
+            }
+            else {
+                PMDisplayCoalescerSubmit(in->state, in->timeout, in->hold);
+            }
+        }
+        advanceTo(UINT64_MAX);
+
+        XCTAssertFalse(PMDisplayCoalescerHeld(NULL), @"%@", name);
+        XCTAssertLessThanOrEqual(gCalls.callCnt, (uint32_t)kPMTestMaxCalls, @"%@", name);
+        XCTAssertEqual(gCalls.opCnt[kOpEmit], tc->outputCnt, @"%@", name);
+        for (uint32_t i = 0; (i < gCalls.callCnt) && (i < kPMTestMaxCalls); i++) {
+            const PMTestCall *call = &gCalls.calls[i];
+
+            if ((call->op != kOpEmit) || (emitted == tc->outputCnt)) {
+                continue;
+            }
+            XCTAssertEqual(call->tMs, tc->outputs[emitted].tMs, @"%@: output %u", name, emitted);
+            XCTAssertEqual(call->arg0, tc->outputs[emitted].state, @"%@: output %u", name, emitted);
+            XCTAssertEqual((int)call->arg1, tc->outputs[emitted].timeout, @"%@: output %u", name, emitted);
+            emitted++;
+        }
+    }
+}
+
+- (void)testHeldState
+{
+    PMDisplayCoalescerStats stats;
+    uint64_t state = 0;
+
+    resetMock();
+    PMDisplayCoalescerInit(&gMockOps);
+
+    PMDisplayCoalescerSubmit(kDim, -1, true);
+    XCTAssertTrue(PMDisplayCoalescerHeld(&state));
+    XCTAssertEqual(state, (uint64_t)kDim);
+    XCTAssertTrue(gTimer.armed);
+
+    PMDisplayCoalescerSubmit(kUnblank, -1, false);
+    XCTAssertFalse(PMDisplayCoalescerHeld(&state));
+    XCTAssertFalse(gTimer.armed);
+
+    PMDisplayCoalescerGetStats(&stats);
+    XCTAssertEqual(stats.submitted, 2u);
+    XCTAssertEqual(stats.emitted, 1u);
+    XCTAssertEqual(stats.superseded, 1u);
+
+    // Re-initializing drops a held request without sending it
+    PMDisplayCoalescerSubmit(kDim, -1, true);
+    PMDisplayCoalescerInit(&gMockOps);
+    XCTAssertFalse(PMDisplayCoalescerHeld(NULL));
+    XCTAssertFalse(gTimer.armed);
+    XCTAssertEqual(gCalls.opCnt[kOpEmit], 1u);
+}
+
+- (void)testNoOps
+{
+    PMDisplayCoalescerStats stats;
+
+    PMDisplayCoalescerInit(NULL);
+    PMDisplayCoalescerSubmit(kDim, -1, true);
+    PMDisplayCoalescerSubmit(kUnblank, -1, false);
+    XCTAssertFalse(PMDisplayCoalescerHeld(NULL));
+
+    PMDisplayCoalescerGetStats(&stats);
+    XCTAssertEqual(stats.submitted, 2u);
+    XCTAssertEqual(stats.emitted, 0u);
+    XCTAssertEqual(stats.dropped, 2u);
+}
+
+@end
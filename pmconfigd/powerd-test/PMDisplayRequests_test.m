@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * PMDisplayRequestsTests checks how in-flight WindowServer requests are
+ * matched to their acks, superseded, expired and evicted.
+ *
+ * testChurnBench drives thousands of synthetic requests through the table,
+ * acking some in order and dropping the rest the way WindowServer drops
+ * overridden dims, and compares it with the list it replaced.
+ */
+
+#import <XCTest/XCTest.h>
+#include <sys/queue.h>
+
+#include "PrivateLib.h"
+#include "PMDisplayRequests.h"
+#include "PMTestSupport.h"
+
+#define kBenchRequests      20000
+
+@interface PMDisplayRequestsTests : XCTestCase
+@end
+
+@implementation PMDisplayRequestsTests
+
+- (void)setUp
+{
+    PMDisplayRequestReset();
+}
+
+- (void)testAckOrder
+{
+    PMDisplayRequestStats stats;
+
+    PMDisplayRequestAdd(100, 0);
+    PMDisplayRequestAdd(101, 0);
+    PMDisplayRequestAdd(102, 0);
+    XCTAssertEqual(PMDisplayRequestInFlight(), 3u);
+
+    // Acking 101 supersedes 100
+    XCTAssertEqual(PMDisplayRequestAck(101, 0), kPMDisplayAckValid);
+    XCTAssertEqual(PMDisplayRequestAck(100, 0), kPMDisplayAckSuperseded);
+    XCTAssertEqual(PMDisplayRequestAck(100, 0), kPMDisplayAckUnknown);
+    XCTAssertEqual(PMDisplayRequestAck(102, 0), kPMDisplayAckValid);
+    XCTAssertEqual(PMDisplayRequestAck(7, 0), kPMDisplayAckUnknown);
+    XCTAssertEqual(PMDisplayRequestInFlight(), 0u);
+
+    PMDisplayRequestGetStats(&stats);
+    XCTAssertEqual(stats.added, 3u);
+    XCTAssertEqual(stats.acked, 2u);
+    XCTAssertEqual(stats.superseded, 1u);
+    XCTAssertEqual(stats.unknown, 2u);
+    XCTAssertEqual(stats.maxInFlight, 3u);
+}
+
+- (void)testRemoveFromProbeRuns
+{
+    // Requests stay reachable after removals from the middle of their probe runs
+    for (uint64_t i = 0; i < 32; i++) {
+        PMDisplayRequestAdd(i * 128, 0);
+    }
+    for (uint64_t i = 0; i < 32; i += 2) {
+        XCTAssertEqual(PMDisplayRequestAck(i * 128, 0), kPMDisplayAckValid);
+    }
+    XCTAssertEqual(PMDisplayRequestInFlight(), 16u);
+    for (uint64_t i = 1; i < 32; i += 2) {
+        XCTAssertNotEqual(PMDisplayRequestAck(i * 128, 0), kPMDisplayAckUnknown, @"uuid %llu", i * 128);
+    }
+    XCTAssertEqual(PMDisplayRequestInFlight(), 0u);
+}
+
+- (void)testExpiry
+{
+    PMDisplayRequestStats stats;
+
+    PMDisplayRequestAdd(1, 0);
+    PMDisplayRequestAdd(2, 0);
+    PMDisplayRequestAdd(3, kPMDisplayRequestExpiryNs);
+    XCTAssertEqual(PMDisplayRequestInFlight(), 1u);
+    XCTAssertEqual(PMDisplayRequestAck(1, kPMDisplayRequestExpiryNs), kPMDisplayAckUnknown);
+    XCTAssertEqual(PMDisplayRequestAck(3, kPMDisplayRequestExpiryNs), kPMDisplayAckValid);
+
+    PMDisplayRequestGetStats(&stats);
+    XCTAssertEqual(stats.expired, 2u);
+}
+
+- (void)testEviction
+{
+    PMDisplayRequestStats stats;
+
+    for (uint64_t i = 1; i <= kPMDisplayRequestMax + 10; i++) {
+        PMDisplayRequestAdd(i, i);
+    }
+    XCTAssertEqual(PMDisplayRequestInFlight(), (uint32_t)kPMDisplayRequestMax);
+    XCTAssertEqual(PMDisplayRequestAck(10, 100), kPMDisplayAckUnknown);
+    XCTAssertEqual(PMDisplayRequestAck(11, 100), kPMDisplayAckValid);
+
+    PMDisplayRequestGetStats(&stats);
+    XCTAssertEqual(stats.evicted, 10u);
+}
+
+- (void)testAckedRequestsDontEvict
+{
+    PMDisplayRequestStats stats;
+
+    // Ring entries of acked requests must not push out the one left in flight
+    PMDisplayRequestAdd(1, 0);
+    for (uint64_t i = 2; i <= 4 * kPMDisplayRequestMax; i++) {
+        PMDisplayRequestAdd(i, 0);
+        XCTAssertEqual(PMDisplayRequestAck(i, 0), kPMDisplayAckValid);
+    }
+    XCTAssertEqual(PMDisplayRequestInFlight(), 1u);
+    XCTAssertEqual(PMDisplayRequestAck(1, 0), kPMDisplayAckSuperseded);
+
+    PMDisplayRequestGetStats(&stats);
+    XCTAssertEqual(stats.evicted, 0u);
+}
+
+/*
+ * The list PMDisplay used before: append on request, walk from the head on
+ * ack and invalidate everything in front of the match.
+ */
+struct listEntry {
+    uint64_t uuid;
+    bool valid;
+    STAILQ_ENTRY(listEntry) entries;
+};
+STAILQ_HEAD(listHead, listEntry);
+
+static void listAdd(struct listHead *head, uint64_t uuid)
+{
+    struct listEntry *e = malloc(sizeof(*e));
+    e->uuid = uuid;
+    e->valid = true;
+    STAILQ_INSERT_TAIL(head, e, entries);
+}
+
+static void listAck(struct listHead *head, uint64_t uuid)
+{
+    struct listEntry *e;
+    STAILQ_FOREACH(e, head, entries) {
+        if (e->uuid == uuid) {
+            break;
+        }
+        e->valid = false;
+    }
+    if (e) {
+        STAILQ_REMOVE(head, e, listEntry, entries);
+        free(e);
+    }
+}
+
+- (void)testChurnBench
+{
+    struct listHead         list = STAILQ_HEAD_INITIALIZER(list);
+    PMDisplayRequestStats   stats;
+    uint64_t                start, tableNs, listNs;
+    struct listEntry        *e;
+    uint32_t                listLeft = 0;
+
+    // Lid flapping: every fourth request gets acked, the dims before it never do
+    start = PMTestNowNs();
+    for (uint64_t i = 1; i <= kBenchRequests; i++) {
+        PMDisplayRequestAdd(i, i * NSEC_PER_MSEC);
+        if ((i % 4) == 0) {
+            PMDisplayRequestAck(i, i * NSEC_PER_MSEC);
+        }
+    }
+    tableNs = PMTestNowNs() - start;
+
+    start = PMTestNowNs();
+    for (uint64_t i = 1; i <= kBenchRequests; i++) {
+        listAdd(&list, i);
+        if ((i % 4) == 0) {
+            listAck(&list, i);
+        }
+    }
+    listNs = PMTestNowNs() - start;
+
+    while ((e = STAILQ_FIRST(&list))) {
+        STAILQ_REMOVE_HEAD(&list, entries);
+        free(e);
+        listLeft++;
+    }
+
+    PMDisplayRequestGetStats(&stats);
+    PMTestBenchLog(@"display requests churn: %u requests table:%lluns/req (%u left, max %u) list:%lluns/req (%u left)",
+                   kBenchRequests, tableNs / kBenchRequests, PMDisplayRequestInFlight(), stats.maxInFlight,
+                   listNs / kBenchRequests, listLeft);
+
+    XCTAssertLessThanOrEqual(stats.maxInFlight, (uint32_t)kPMDisplayRequestMax);
+    XCTAssertEqual(stats.acked, kBenchRequests / 4);
+    XCTAssertEqual(stats.unknown, 0u);
+
+    // The list never forgets the dims that were never acked; the table stays bounded
+    XCTAssertEqual(listLeft, 3u * kBenchRequests / 4);
+    XCTAssertLessThanOrEqual(PMDisplayRequestInFlight(), (uint32_t)kPMDisplayRequestMax);
+}
+
+@end
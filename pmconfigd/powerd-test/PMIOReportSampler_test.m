@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * PMIOReportSamplerTests feeds made-up cumulative counters to a sampler
+ * running on the virtual clock, and checks the per-interval deltas, totals
+ * and quantiles it derives from them.
+ */
+
+#import <XCTest/XCTest.h>
+
+#include "PrivateLib.h"
+#include "PMClock.h"
+#include "PMIOReportSampler.h"
+
+#define kWallStart      700000000.0
+#define kInterval       (60 * NSEC_PER_SEC)
+
+enum {
+    kChannelPower = 0,      // Simple
+    kChannelState,          // Two states
+    kChannelCount
+};
+
+@interface PMIOReportSamplerTests : XCTestCase
+{
+    PMIOReportCounters      counters[kChannelCount];
+    PMIOReportSamplerRef    sampler;
+    int                     intervals;
+}
+@end
+
+@implementation PMIOReportSamplerTests
+
+- (void)setUp
+{
+    PMIOReportSamplerConfig config = {
+        .channelCount   = kChannelCount,
+        .intervalNs     = kInterval,
+        .historyDepth   = 4,
+        .queue          = dispatch_get_main_queue(),
+    };
+    PMIOReportCounters      *cnt = counters;
+
+    XCTAssert(PMClockSetVirtual(kWallStart));
+    bzero(counters, sizeof(counters));
+    for (int i = 0; i < kChannelCount; i++) {
+        counters[i].valid = true;
+    }
+    counters[kChannelState].stateCount = 2;
+    intervals = 0;
+
+    sampler = PMIOReportSamplerCreateWithReader(&config, ^bool(uint32_t index, PMIOReportCounters *out) {
+        *out = cnt[index];
+        return true;
+    });
+    XCTAssert(sampler != NULL);
+
+    __block int *intervalsRef = &intervals;
+    PMIOReportSamplerStart(sampler, ^(PMIOReportSamplerRef s) {
+        (*intervalsRef)++;
+    });
+}
+
+- (void)tearDown
+{
+    PMIOReportSamplerDestroy(sampler);
+    XCTAssertFalse(PMClockAdvanceToNextTimer());
+}
+
+// Runs one interval in which the counters grow by the given amounts
+- (void)intervalWithPower:(int64_t)power residency:(uint64_t)ms transitions:(uint64_t)transitions
+{
+    counters[kChannelPower].value += power;
+    counters[kChannelState].residencyMs[1] += ms;
+    counters[kChannelState].residencyMs[0] += 60000 - ms;
+    counters[kChannelState].transitions[1] += transitions;
+    PMClockAdvance(kInterval);
+}
+
+- (void)testDeltasOnEveryInterval
+{
+    PMIOReportDelta delta;
+
+    // Nothing is reported before the first interval is over
+    PMClockAdvance(kInterval - 1);
+    XCTAssertEqual(intervals, 0);
+    XCTAssertFalse(PMIOReportSamplerGetLastDelta(sampler, kChannelPower, &delta));
+
+    counters[kChannelPower].value = 40;
+    PMClockAdvance(1);
+    XCTAssertEqual(intervals, 1);
+    XCTAssert(PMIOReportSamplerGetLastDelta(sampler, kChannelPower, &delta));
+    XCTAssertEqual(delta.value, 40);
+
+    [self intervalWithPower:25 residency:15000 transitions:3];
+    XCTAssertEqual(intervals, 2);
+    XCTAssert(PMIOReportSamplerGetLastDelta(sampler, kChannelPower, &delta));
+    XCTAssertEqual(delta.value, 25);
+    XCTAssert(PMIOReportSamplerGetLastDelta(sampler, kChannelState, &delta));
+    XCTAssertEqual(delta.stateCount, 2u);
+    XCTAssertEqual(delta.residencyMs[0], 45000u);
+    XCTAssertEqual(delta.residencyMs[1], 15000u);
+    XCTAssertEqual(delta.transitions[1], 3u);
+
+    XCTAssert(PMIOReportSamplerGetTotal(sampler, kChannelPower, &delta));
+    XCTAssertEqual(delta.value, 65);
+}
+
+- (void)testCounterReset
+{
+    PMIOReportDelta delta;
+
+    [self intervalWithPower:0 residency:20000 transitions:5];
+
+    // The driver restarted: counters start over from zero
+    bzero(counters[kChannelState].residencyMs, sizeof(counters[kChannelState].residencyMs));
+    bzero(counters[kChannelState].transitions, sizeof(counters[kChannelState].transitions));
+    [self intervalWithPower:0 residency:7000 transitions:2];
+
+    XCTAssert(PMIOReportSamplerGetLastDelta(sampler, kChannelState, &delta));
+    XCTAssertEqual(delta.residencyMs[1], 7000u);
+    XCTAssertEqual(delta.transitions[1], 2u);
+}
+
+- (void)testInvalidIntervalsAreSkipped
+{
+    PMIOReportDelta delta;
+    int64_t         q;
+
+    [self intervalWithPower:10 residency:0 transitions:0];
+    counters[kChannelPower].valid = false;
+    [self intervalWithPower:1000 residency:0 transitions:0];
+    counters[kChannelPower].valid = true;
+    [self intervalWithPower:30 residency:0 transitions:0];
+
+    XCTAssert(PMIOReportSamplerGetTotal(sampler, kChannelPower, &delta));
+    XCTAssertEqual(delta.value, 40);
+    XCTAssert(PMIOReportSamplerGetQuantile(sampler, kChannelPower, kPMIOReportFieldValue, 0, 1.0, &q));
+    XCTAssertEqual(q, 30);
+}
+
+- (void)testQuantilesOverHistory
+{
+    int64_t q;
+
+    // History is 4 deep, so the first interval drops out
+    [self intervalWithPower:1000 residency:1000 transitions:1];
+    [self intervalWithPower:10 residency:2000 transitions:1];
+    [self intervalWithPower:20 residency:4000 transitions:1];
+    [self intervalWithPower:30 residency:8000 transitions:1];
+    [self intervalWithPower:40 residency:16000 transitions:1];
+    XCTAssertEqual(intervals, 5);
+
+    XCTAssert(PMIOReportSamplerGetQuantile(sampler, kChannelPower, kPMIOReportFieldValue, 0, 1.0, &q));
+    XCTAssertEqual(q, 40);
+    XCTAssert(PMIOReportSamplerGetQuantile(sampler, kChannelPower, kPMIOReportFieldValue, 0, 0.5, &q));
+    XCTAssertEqual(q, 20);
+    XCTAssert(PMIOReportSamplerGetQuantile(sampler, kChannelState, kPMIOReportFieldResidency, 1, 0.0, &q));
+    XCTAssertEqual(q, 2000);
+    XCTAssertFalse(PMIOReportSamplerGetQuantile(sampler, kChannelState, kPMIOReportFieldResidency,
+                                                kPMIOReportSamplerMaxStates, 0.5, &q));
+}
+
+@end
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * PMLingerPolicyTests checks how the darkwake linger duration follows the
+ * way recent lingers were used.
+ *
+ * PMLingerPolicyReplay feeds sequences of sleep reasons, user returns and
+ * background work through the policy and through the fixed duration it
+ * replaces, and reports the darkwake time spent lingering (energy) against
+ * the user returns that found the system asleep (latency). A recorded
+ * sequence can be replayed by pointing PMLINGER_REPLAY at a file with one
+ * "reason,userActive,returnSecs,workSecs" line per FullWake --> DarkWake
+ * transition; use -1 for no return or no work.
+ */
+
+#import <XCTest/XCTest.h>
+
+#include "PrivateLib.h"
+#include "PMLingerPolicy.h"
+#include "PMTestSupport.h"
+
+#define kBase               kPMTestTimeBase
+#define kMaxLinger          15
+#define kTransitionGap      3600.0          // Time between recorded transitions
+#define kWakeFromSleepSecs  2.0             // Extra latency when the user finds the system asleep
+
+typedef struct {
+    const char      *reason;
+    bool            userActive;
+    double          returnSecs;             // < 0 if the user didn't come back
+    double          workSecs;               // < 0 if no background work was running
+} lingerEvent_t;
+
+typedef struct {
+    uint32_t        lingers;
+    double          lingerSecs;             // Darkwake time spent lingering
+    uint32_t        caught;                 // Returns while still in darkwake
+    uint32_t        missed;                 // Returns after the system slept
+} lingerReplayResult_t;
+
+static PMLingerRequest makeRequest(const lingerEvent_t *e)
+{
+    PMLingerRequest req = {
+        .userWasActive  = e->userActive,
+        .emergencySleep = !strcmp(e->reason, kIOPMLowPowerSleepKey) ||
+                          !strcmp(e->reason, kIOPMThermalEmergencySleepKey),
+        .clamshellSleep = !strcmp(e->reason, kIOPMClamshellSleepKey),
+        .btCapable      = true,
+        .workPending    = (e->workSecs >= 0),
+        .maxSecs        = kMaxLinger,
+    };
+    return req;
+}
+
+static void replay(const lingerEvent_t *events, uint32_t cnt, bool adaptive, lingerReplayResult_t *result)
+{
+    CFAbsoluteTime  now = kBase;
+
+    PMLingerPolicyReset();
+    bzero(result, sizeof(*result));
+
+    for (uint32_t i = 0; i < cnt; i++, now += kTransitionGap) {
+        const lingerEvent_t *e = &events[i];
+        PMLingerRequest req = makeRequest(e);
+        uint32_t        secs = PMLingerPolicyBegin(&req, now);
+
+        if (secs && !adaptive) {
+            secs = kMaxLinger;
+        }
+        if (secs) {
+            result->lingers++;
+        }
+
+        if ((e->returnSecs >= 0) && (e->returnSecs <= secs)) {
+            result->lingerSecs += e->returnSecs;
+            result->caught++;
+        }
+        else {
+            result->lingerSecs += secs;
+            if ((e->workSecs >= 0) && (e->workSecs <= secs)) {
+                PMLingerPolicyWorkDone(now + e->workSecs);
+            }
+            PMLingerPolicySleep(e->workSecs > secs);
+            if ((e->returnSecs >= 0) && (e->returnSecs <= kMaxLinger)) {
+                result->missed++;
+            }
+        }
+        if (e->returnSecs >= 0) {
+            PMLingerPolicyUserReturned(now + e->returnSecs);
+        }
+    }
+}
+
+static void logResults(const char *name, const lingerReplayResult_t *fixed, const lingerReplayResult_t *adaptive)
+{
+    PMTestBenchLog(@"linger %s: fixed linger:%.0fs missed:%u latency:%.0fs | adaptive linger:%.0fs missed:%u latency:%.0fs",
+                   name, fixed->lingerSecs, fixed->missed, fixed->missed * kWakeFromSleepSecs,
+                   adaptive->lingerSecs, adaptive->missed, adaptive->missed * kWakeFromSleepSecs);
+}
+
+@interface PMLingerPolicyTests : XCTestCase
+@end
+
+@implementation PMLingerPolicyTests
+
+- (void)setUp
+{
+    PMLingerPolicyReset();
+}
+
+- (uint32_t)beginAt:(CFAbsoluteTime)now reason:(const char *)reason work:(bool)work
+{
+    lingerEvent_t   e = { reason, true, -1, work ? 1 : -1 };
+    PMLingerRequest req = makeRequest(&e);
+
+    return PMLingerPolicyBegin(&req, now);
+}
+
+- (void)testNoLinger
+{
+    lingerEvent_t   events[] = {
+        { kIOPMIdleSleepKey,        false,  -1, -1 },
+        { kIOPMLowPowerSleepKey,    true,   -1, -1 },
+    };
+    PMLingerRequest req;
+    PMLingerStats   stats;
+
+    for (uint32_t i = 0; i < PMTestCount(events); i++) {
+        req = makeRequest(&events[i]);
+        XCTAssertEqual(PMLingerPolicyBegin(&req, kBase), 0u, @"event %u", i);
+    }
+
+    req = makeRequest(&(lingerEvent_t){ kIOPMClamshellSleepKey, true, -1, -1 });
+    req.btCapable = false;
+    XCTAssertEqual(PMLingerPolicyBegin(&req, kBase), 0u);
+    req.btCapable = true;
+    XCTAssertEqual(PMLingerPolicyBegin(&req, kBase), (uint32_t)kMaxLinger);
+    req.maxSecs = 0;
+    XCTAssertEqual(PMLingerPolicyBegin(&req, kBase), 0u);
+
+    PMLingerPolicyGetStats(&stats);
+    XCTAssertEqual(stats.lingerCnt, 1u);
+}
+
+- (void)testShrinksWhenUnused
+{
+    CFAbsoluteTime  now = kBase;
+    PMLingerStats   stats;
+
+    for (uint32_t i = 0; i < 4; i++, now += kTransitionGap) {
+        XCTAssertEqual([self beginAt:now reason:kIOPMIdleSleepKey work:false], (uint32_t)kMaxLinger);
+        PMLingerPolicySleep(false);
+    }
+    XCTAssertEqual([self beginAt:now reason:kIOPMIdleSleepKey work:false], 2u);
+
+    PMLingerPolicyGetStats(&stats);
+    XCTAssertEqual(stats.lingerCnt, 5u);
+    XCTAssertEqual(stats.lingerSecs, 4u * kMaxLinger + 2);
+    XCTAssertEqual(stats.shortenedCnt, 1u);
+}
+
+- (void)testCoversUserReturns
+{
+    CFAbsoluteTime  now = kBase;
+    PMLingerStats   stats;
+
+    for (uint32_t i = 0; i < 4; i++, now += kTransitionGap) {
+        [self beginAt:now reason:kIOPMClamshellSleepKey work:false];
+        if (i == 1) {
+            PMLingerPolicyUserReturned(now + 4.5);
+        }
+        else {
+            PMLingerPolicySleep(false);
+        }
+    }
+    // Longest return took 5 secs, plus slack
+    XCTAssertEqual([self beginAt:now reason:kIOPMClamshellSleepKey work:false], 7u);
+
+    // A return after the shorter linger slept still counts, and grows the next one
+    PMLingerPolicySleep(false);
+    PMLingerPolicyUserReturned(now + 10.2);
+    now += kTransitionGap;
+    XCTAssertEqual([self beginAt:now reason:kIOPMClamshellSleepKey work:false], 13u);
+
+    // Returns after the longest linger don't
+    PMLingerPolicySleep(false);
+    PMLingerPolicyUserReturned(now + kMaxLinger + 30);
+    now += kTransitionGap;
+    XCTAssertEqual([self beginAt:now reason:kIOPMClamshellSleepKey work:false], 13u);
+
+    PMLingerPolicyGetStats(&stats);
+    XCTAssertEqual(stats.returnsCaught, 1u);
+    XCTAssertEqual(stats.returnsMissed, 1u);
+}
+
+- (void)testKeepsLingerForWork
+{
+    CFAbsoluteTime  now = kBase;
+    PMLingerStats   stats;
+
+    for (uint32_t i = 0; i < 4; i++, now += kTransitionGap) {
+        [self beginAt:now reason:kIOPMIdleSleepKey work:(i == 2)];
+        PMLingerPolicySleep(false);
+    }
+    XCTAssertEqual([self beginAt:now reason:kIOPMIdleSleepKey work:false], (uint32_t)kMaxLinger);
+
+    // Work that outlives the linger doesn't count
+    PMLingerPolicyReset();
+    for (uint32_t i = 0; i < 4; i++, now += kTransitionGap) {
+        [self beginAt:now reason:kIOPMIdleSleepKey work:true];
+        PMLingerPolicySleep(true);
+    }
+    XCTAssertEqual([self beginAt:now reason:kIOPMIdleSleepKey work:false], 2u);
+
+    PMLingerPolicyGetStats(&stats);
+    XCTAssertEqual(stats.workDoneCnt, 0u);
+}
+
+- (void)testRecordsWorkTime
+{
+    CFAbsoluteTime  now = kBase;
+
+    // Work that finished 3 secs in needs a 3 sec linger, plus slack
+    for (uint32_t i = 0; i < 4; i++, now += kTransitionGap) {
+        [self beginAt:now reason:kIOPMIdleSleepKey work:true];
+        PMLingerPolicyWorkDone(now + 2.5);
+        PMLingerPolicySleep(false);
+    }
+    XCTAssertEqual([self beginAt:now reason:kIOPMIdleSleepKey work:false], 5u);
+
+    // Without a finish time the work counts as needing the longest linger, not the shortened one
+    PMLingerPolicyReset();
+    for (uint32_t i = 0; i < 4; i++, now += kTransitionGap) {
+        [self beginAt:now reason:kIOPMIdleSleepKey work:false];
+        PMLingerPolicySleep(false);
+    }
+    XCTAssertEqual([self beginAt:now reason:kIOPMIdleSleepKey work:true], 2u);
+    PMLingerPolicySleep(false);
+    now += kTransitionGap;
+    XCTAssertEqual([self beginAt:now reason:kIOPMIdleSleepKey work:false], (uint32_t)kMaxLinger);
+}
+
+@end
+
+
+@interface PMLingerPolicyReplay : XCTestCase
+@end
+
+@implementation PMLingerPolicyReplay
+
+- (void)testBuiltinSequences
+{
+    const uint32_t          cnt = 500;
+    lingerEvent_t           *events = calloc(cnt, sizeof(lingerEvent_t));
+    lingerReplayResult_t    fixed, adaptive;
+    uint32_t                seed;
+
+    // Idle sleeps at a desk; the user rarely comes back right away
+    seed = 1;
+    for (uint32_t i = 0; i < cnt; i++) {
+        events[i] = (lingerEvent_t){ kIOPMIdleSleepKey, true,
+                                     (PMTestRandRange(&seed, 0, 1) < 0.03) ? PMTestRandRange(&seed, 20, 120) : -1, -1 };
+    }
+    replay(events, cnt, false, &fixed);
+    replay(events, cnt, true, &adaptive);
+    logResults("desk", &fixed, &adaptive);
+    XCTAssertLessThan(adaptive.lingerSecs, fixed.lingerSecs / 4);
+    XCTAssertEqual(adaptive.missed, fixed.missed);
+
+    // Lid closes that are often reopened within a few seconds
+    seed = 2;
+    for (uint32_t i = 0; i < cnt; i++) {
+        events[i] = (lingerEvent_t){ kIOPMClamshellSleepKey, true,
+                                     (PMTestRandRange(&seed, 0, 1) < 0.4) ? PMTestRandRange(&seed, 1, 8) : -1, -1 };
+    }
+    replay(events, cnt, false, &fixed);
+    replay(events, cnt, true, &adaptive);
+    logResults("lid", &fixed, &adaptive);
+    XCTAssertLessThan(adaptive.lingerSecs, fixed.lingerSecs);
+    XCTAssertLessThanOrEqual(adaptive.missed, fixed.missed + cnt / 25);
+
+    // Background work running when the display goes off
+    seed = 3;
+    for (uint32_t i = 0; i < cnt; i++) {
+        events[i] = (lingerEvent_t){ kIOPMSoftwareSleepKey, true, -1,
+                                     (PMTestRandRange(&seed, 0, 1) < 0.5) ? PMTestRandRange(&seed, 2, 12) : -1 };
+    }
+    replay(events, cnt, false, &fixed);
+    replay(events, cnt, true, &adaptive);
+    logResults("work", &fixed, &adaptive);
+    XCTAssertEqual(adaptive.lingers, fixed.lingers);
+    XCTAssertLessThanOrEqual(adaptive.lingerSecs, fixed.lingerSecs);
+
+    free(events);
+}
+
+- (void)testRecordedSequence
+{
+    const char              *path = getenv("PMLINGER_REPLAY");
+    FILE                    *f;
+    char                    line[256];
+    char                    reasons[64][64];
+    uint32_t                reasonCnt = 0;
+    lingerEvent_t           *events = NULL;
+    uint32_t                cnt = 0, cap = 0;
+    lingerReplayResult_t    fixed, adaptive;
+
+    if (!path) {
+        XCTSkip(@"PMLINGER_REPLAY is not set");
+    }
+    f = fopen(path, "r");
+    XCTAssert(f != NULL, @"Can't open %s", path);
+    if (!f) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char    reason[64];
+        int     active;
+        double  ret, work;
+        uint32_t r;
+
+        if ((line[0] == '#') || (sscanf(line, "%63[^,],%d,%lf,%lf", reason, &active, &ret, &work) != 4)) {
+            continue;
+        }
+        // Events point at interned reason strings
+        for (r = 0; r < reasonCnt; r++) {
+            if (!strcmp(reasons[r], reason)) {
+                break;
+            }
+        }
+        if (r == reasonCnt) {
+            if (reasonCnt == 64) {
+                continue;
+            }
+            strlcpy(reasons[reasonCnt++], reason, sizeof(reasons[0]));
+        }
+        if (cnt == cap) {
+            cap = cap ? cap * 2 : 256;
+            events = reallocf(events, cap * sizeof(lingerEvent_t));
+            XCTAssert(events != NULL);
+            if (!events) {
+                fclose(f);
+                return;
+            }
+        }
+        events[cnt++] = (lingerEvent_t){ reasons[r], active != 0, ret, work };
+    }
+    fclose(f);
+
+    replay(events, cnt, false, &fixed);
+    replay(events, cnt, true, &adaptive);
+    logResults(path, &fixed, &adaptive);
+    PMTestBenchLog(@"linger %s: %u transitions, %u lingers, %u returns caught",
+                   path, cnt, adaptive.lingers, adaptive.caught);
+
+    // Both policies linger on the same transitions; the adaptive one never for longer
+    XCTAssertEqual(adaptive.lingers, fixed.lingers);
+    XCTAssertLessThanOrEqual(adaptive.lingerSecs, fixed.lingerSecs);
+    XCTAssertEqual(adaptive.caught + adaptive.missed, fixed.caught + fixed.missed);
+
+    free(events);
+}
+
+@end
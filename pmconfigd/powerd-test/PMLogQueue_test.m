@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * PMLogQueueTests checks that staged log records carry the time they were
+ * created at, and which records the pool and per-category budgets drop.
+ * Budgets are per second of PMClock time, so the tests run on the virtual
+ * clock.
+ */
+
+#import <XCTest/XCTest.h>
+#include <asl.h>
+#include <time.h>
+
+#include "PrivateLib.h"
+#include "PMClock.h"
+#include "PMLogQueue.h"
+
+#define kWallStart      700000000.0
+#define kPoolSize       64          // kLogRecordCnt
+#define kAssertionsBudget 64        // Assertions records per second
+
+@interface PMLogQueueTests : XCTestCase
+{
+    NSMutableArray  *emitted;
+}
+@end
+
+@implementation PMLogQueueTests
+
+- (void)setUp
+{
+    NSMutableArray *sink = [NSMutableArray array];
+
+    XCTAssert(PMClockSetVirtual(kWallStart));
+
+    // Start in a fresh budget window, with drops left by earlier tests reported
+    PMClockAdvance(NSEC_PER_SEC);
+    pmlog_set_sink(^(aslmsg m) { });
+    for (int i = 0; i < kPMLogCategoryCount; i++) {
+        pmlog_send(pmlog_new(i));
+    }
+    pmlog_flush();
+    PMClockAdvance(NSEC_PER_SEC);
+
+    emitted = sink;
+    pmlog_set_sink(^(aslmsg m) {
+        const char *msg = asl_get(m, ASL_KEY_MSG);
+        const char *sec = asl_get(m, ASL_KEY_TIME);
+        const char *nsec = asl_get(m, ASL_KEY_TIME_NSEC);
+
+        [sink addObject:@{
+            @"msg"  : msg ? @(msg) : @"",
+            @"time" : @((sec ? strtoll(sec, NULL, 10) : 0) * NSEC_PER_SEC + (nsec ? strtoll(nsec, NULL, 10) : 0)),
+        }];
+    });
+}
+
+- (void)tearDown
+{
+    pmlog_flush();
+    pmlog_set_sink(NULL);
+}
+
+static uint64_t wallNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+- (void)testTimeIsTakenAtCreation
+{
+    uint64_t    before, between, after;
+    pmlogmsg_t  first, second;
+
+    before = wallNs();
+    first = pmlog_new(kPMLogCategorySleepWake);
+    pmlog_set(first, ASL_KEY_MSG, "first");
+    between = wallNs();
+    second = pmlog_new(kPMLogCategorySleepWake);
+    pmlog_set(second, ASL_KEY_MSG, "second");
+    after = wallNs();
+
+    // Sent in the opposite order, each keeps its own creation time
+    pmlog_send(second);
+    usleep(1000);
+    pmlog_send(first);
+    pmlog_flush();
+
+    XCTAssertEqual(emitted.count, 2u);
+    XCTAssertEqualObjects(emitted[0][@"msg"], @"second");
+    XCTAssertEqualObjects(emitted[1][@"msg"], @"first");
+    XCTAssertGreaterThanOrEqual([emitted[1][@"time"] unsignedLongLongValue], before);
+    XCTAssertLessThanOrEqual([emitted[1][@"time"] unsignedLongLongValue], between);
+    XCTAssertGreaterThanOrEqual([emitted[0][@"time"] unsignedLongLongValue], between);
+    XCTAssertLessThanOrEqual([emitted[0][@"time"] unsignedLongLongValue], after);
+}
+
+- (void)testBudgetDropsAreReported
+{
+    pmlogmsg_t  m;
+    int         admitted = 0;
+
+    for (int i = 0; i < kAssertionsBudget + 10; i++) {
+        m = pmlog_new(kPMLogCategoryAssertions);
+        if (m) {
+            admitted++;
+            pmlog_discard(m);
+        }
+    }
+    XCTAssertEqual(admitted, kAssertionsBudget);
+    XCTAssertEqual(pmlog_dropped(kPMLogCategoryAssertions), 10u);
+    XCTAssert(pmlog_new(kPMLogCategoryAssertions) == NULL);
+
+    // The next second has a new budget, and its first record reports the drops
+    PMClockAdvance(NSEC_PER_SEC);
+    m = pmlog_new(kPMLogCategoryAssertions);
+    XCTAssert(m != NULL);
+    pmlog_set(m, ASL_KEY_MSG, "after");
+    pmlog_send(m);
+    pmlog_flush();
+
+    XCTAssertEqual(emitted.count, 2u);
+    XCTAssertEqualObjects(emitted[0][@"msg"], @"11 Assertions log messages were dropped");
+    XCTAssertEqualObjects(emitted[1][@"msg"], @"after");
+    XCTAssertEqual(pmlog_dropped(kPMLogCategoryAssertions), 0u);
+}
+
+- (void)testSleepWakeIsNeverDropped
+{
+    pmlogmsg_t  held[2 * kPoolSize];
+    pmlogmsg_t  m;
+
+    // More sleep/wake records than the pool holds, all in the same second
+    for (int i = 0; i < 2 * kPoolSize; i++) {
+        held[i] = pmlog_new(kPMLogCategorySleepWake);
+        XCTAssert(held[i] != NULL);
+        pmlog_set(held[i], ASL_KEY_MSG, "wake");
+    }
+    XCTAssertEqual(pmlog_dropped(kPMLogCategorySleepWake), 0u);
+
+    // Other categories still can't get past the empty pool
+    m = pmlog_new(kPMLogCategoryAppResponse);
+    XCTAssert(m == NULL);
+    XCTAssertEqual(pmlog_dropped(kPMLogCategoryAppResponse), 1u);
+
+    for (int i = 0; i < 2 * kPoolSize; i++) {
+        pmlog_send(held[i]);
+    }
+    pmlog_flush();
+    XCTAssertEqual(emitted.count, (NSUInteger)(2 * kPoolSize));
+
+    // The pool is whole again, and the drop is reported
+    m = pmlog_new(kPMLogCategoryAppResponse);
+    XCTAssert(m != NULL);
+    pmlog_set(m, ASL_KEY_MSG, "response");
+    pmlog_send(m);
+    pmlog_flush();
+    XCTAssertEqual(emitted.count, (NSUInteger)(2 * kPoolSize + 2));
+    XCTAssertEqualObjects(emitted[2 * kPoolSize][@"msg"], @"1 AppResponse log messages were dropped");
+    XCTAssertEqualObjects(emitted.lastObject[@"msg"], @"response");
+    XCTAssertEqual(pmlog_dropped(kPMLogCategoryAppResponse), 0u);
+}
+
+@end
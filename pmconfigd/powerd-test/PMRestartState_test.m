@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * PMRestartStateTests checks that a saved section is only handed back while
+ * the file it was derived from is unchanged.
+ */
+
+#import <XCTest/XCTest.h>
+#include <unistd.h>
+
+#include "PrivateLib.h"
+#include "PMRestartState.h"
+
+@interface PMRestartStateTests : XCTestCase
+{
+    char    sourcePath[64];
+}
+@end
+
+@implementation PMRestartStateTests
+
+- (void)writeSource:(const char *)contents
+{
+    FILE *f = fopen(sourcePath, "w");
+
+    XCTAssert(f != NULL);
+    fputs(contents, f);
+    fclose(f);
+}
+
+// Saves 'plist' as derived from the source file as it is now
+- (void)save:(NSDictionary *)plist
+{
+    PMRestartSource source;
+
+    if (PMRestartStateFingerprintSource(sourcePath, &source)) {
+        PMRestartStateSetSection(kPMRestartSectionSettings, &source, (__bridge CFPropertyListRef)plist);
+    }
+}
+
+- (void)setUp
+{
+    strlcpy(sourcePath, "/tmp/PMRestartStateTest.XXXXXX", sizeof(sourcePath));
+    close(mkstemp(sourcePath));
+    [self writeSource:"<plist>original</plist>"];
+}
+
+- (void)tearDown
+{
+    PMRestartStateSetSection(kPMRestartSectionSettings, NULL, NULL);
+    unlink(sourcePath);
+}
+
+- (void)testEditedSourceIsStale
+{
+    NSDictionary        *plist = @{ @"wake" : @[ @1, @2 ] };
+    CFPropertyListRef   saved;
+
+    [self save:plist];
+
+    saved = PMRestartStateCopySection(kPMRestartSectionSettings, sourcePath);
+    XCTAssertEqualObjects((__bridge id)saved, plist);
+    if (saved) CFRelease(saved);
+
+    // Any edit changes size or mtime, and the saved section is rejected
+    [self writeSource:"<plist>edited by someone else</plist>"];
+    saved = PMRestartStateCopySection(kPMRestartSectionSettings, sourcePath);
+    XCTAssert(saved == NULL);
+    if (saved) CFRelease(saved);
+}
+
+- (void)testMissingSourceIsStale
+{
+    NSDictionary        *plist = @{ @"wake" : @[ @1 ] };
+    PMRestartSource     source;
+    CFPropertyListRef   saved;
+
+    [self save:plist];
+    unlink(sourcePath);
+
+    saved = PMRestartStateCopySection(kPMRestartSectionSettings, sourcePath);
+    XCTAssert(saved == NULL);
+    if (saved) CFRelease(saved);
+
+    // Nothing is saved for a source that doesn't exist
+    XCTAssertFalse(PMRestartStateFingerprintSource(sourcePath, &source));
+    [self save:plist];
+    saved = PMRestartStateCopySection(kPMRestartSectionSettings, sourcePath);
+    XCTAssert(saved == NULL);
+    if (saved) CFRelease(saved);
+}
+
+/*
+ * The fingerprint is taken before the source is read. An edit that lands
+ * between the two must leave the saved section stale.
+ */
+- (void)testEditDuringReadIsStale
+{
+    NSDictionary        *plist = @{ @"wake" : @[ @3 ] };
+    PMRestartSource     source;
+    CFPropertyListRef   saved;
+
+    XCTAssertTrue(PMRestartStateFingerprintSource(sourcePath, &source));
+    [self writeSource:"<plist>edited while it was being read</plist>"];
+    PMRestartStateSetSection(kPMRestartSectionSettings, &source, (__bridge CFPropertyListRef)plist);
+
+    saved = PMRestartStateCopySection(kPMRestartSectionSettings, sourcePath);
+    XCTAssert(saved == NULL);
+    if (saved) CFRelease(saved);
+}
+
+@end
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Drives the SleepService session state machine with fake side effects and
+ * checks what each transition publishes and reconfigures.
+ */
+
+#import <XCTest/XCTest.h>
+
+#include "PrivateLib.h"
+#include "PMSleepService.h"
+#include "PMTestSupport.h"
+
+enum {
+    kOpPublish,
+    kOpSetCap,
+    kOpSessionChanged,
+    kOpHold,
+};
+
+static PMTestCallLog gCalls;
+
+PMTestMockOp1(gCalls, fakePublish, kOpPublish, bool)
+PMTestMockOp1(gCalls, fakeSetCap, kOpSetCap, uint32_t)
+PMTestMockOp1(gCalls, fakeSessionChanged, kOpSessionChanged, bool)
+PMTestMockOp(gCalls, fakeHold, kOpHold)
+
+static const PMSleepServiceOps gFakeOps = {
+    .publish            = fakePublish,
+    .setCap             = fakeSetCap,
+    .sessionChanged     = fakeSessionChanged,
+    .holdForClients     = fakeHold,
+};
+
+@interface PMSleepServiceTests : XCTestCase
+@end
+
+@implementation PMSleepServiceTests
+
+- (void)setUp
+{
+    PMTestCallLogReset(&gCalls);
+    PMSleepServiceInit(&gFakeOps);
+}
+
+- (void)tearDown
+{
+    PMSleepServiceInit(NULL);
+}
+
+- (void)testSessionLifecycle
+{
+    CFStringRef firstUUID;
+
+    XCTAssertFalse(PMSleepServiceBegin(0));
+    XCTAssertFalse(PMSleepServiceSetCap(1000));
+    XCTAssertEqual(gCalls.callCnt, 0u);
+
+    XCTAssertTrue(PMSleepServiceBegin(30000));
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceCapped);
+    XCTAssertEqual(PMSleepServiceGetCapTime(), 30000u);
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 1u);
+    XCTAssertTrue(gCalls.last[kOpPublish].arg0);
+    XCTAssertEqual(gCalls.last[kOpSetCap].arg0, 30000u);
+    XCTAssertTrue(gCalls.last[kOpSessionChanged].arg0);
+    XCTAssertEqual(gCalls.opCnt[kOpHold], 1u);
+    firstUUID = PMSleepServiceGetUUID();
+    XCTAssert(firstUUID != NULL);
+    CFRetain(firstUUID);
+
+    // Cap changes don't change what is published
+    XCTAssertTrue(PMSleepServiceSetCap(60000));
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceExtended);
+    XCTAssertEqual(gCalls.last[kOpSetCap].arg0, 60000u);
+    XCTAssertTrue(PMSleepServiceSetCap(60000));
+    XCTAssertEqual(gCalls.opCnt[kOpSetCap], 2u);
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 1u);
+
+    PMSleepServiceExpire();
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceExpired);
+    XCTAssertEqual(PMSleepServiceGetCapTime(), 0u);
+    XCTAssertEqual(gCalls.last[kOpSetCap].arg0, 0u);
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 2u);
+    XCTAssertFalse(gCalls.last[kOpPublish].arg0);
+    PMSleepServiceExpire();
+    XCTAssertEqual(gCalls.opCnt[kOpSetCap], 3u);
+    XCTAssertFalse(PMSleepServiceSetCap(1000));
+
+    PMSleepServiceEnd();
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceIdle);
+    XCTAssertFalse(gCalls.last[kOpSessionChanged].arg0);
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 2u);
+
+    // A new session gets a new UUID, which the last End made ahead of time
+    XCTAssertTrue(PMSleepServiceBegin(10000));
+    XCTAssertFalse(CFEqual(firstUUID, PMSleepServiceGetUUID()));
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 3u);
+    CFRelease(firstUUID);
+}
+
+- (void)testEndWhileActive
+{
+    XCTAssertTrue(PMSleepServiceBegin(30000));
+    PMSleepServiceEnd();
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceIdle);
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 2u);
+    XCTAssertFalse(gCalls.last[kOpPublish].arg0);
+    XCTAssertEqual(gCalls.opCnt[kOpSessionChanged], 2u);
+    XCTAssertEqual(PMSleepServiceGetCapTime(), 0u);
+}
+
+- (void)testBackToBackSessions
+{
+    CFStringRef uuid;
+
+    XCTAssertTrue(PMSleepServiceBegin(30000));
+    uuid = CFRetain(PMSleepServiceGetUUID());
+    XCTAssertTrue(PMSleepServiceBegin(45000));
+
+    // A wake before the window closed: same power state, but its own UUID and hold
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceCapped);
+    XCTAssertEqual(gCalls.last[kOpSetCap].arg0, 45000u);
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 1u);
+    XCTAssertEqual(gCalls.opCnt[kOpSessionChanged], 1u);
+    XCTAssertEqual(gCalls.opCnt[kOpHold], 2u);
+    XCTAssert(PMSleepServiceGetUUID() != NULL);
+    XCTAssertFalse(CFEqual(uuid, PMSleepServiceGetUUID()));
+    CFRelease(uuid);
+}
+
+- (void)testBeginAfterExpiry
+{
+    CFStringRef uuid;
+
+    XCTAssertTrue(PMSleepServiceBegin(30000));
+    uuid = CFRetain(PMSleepServiceGetUUID());
+    PMSleepServiceExpire();
+
+    // A new session, still in the SleepService power state from the last one
+    XCTAssertTrue(PMSleepServiceBegin(30000));
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceCapped);
+    XCTAssertEqual(gCalls.opCnt[kOpPublish], 3u);
+    XCTAssertEqual(gCalls.opCnt[kOpSessionChanged], 1u);
+    XCTAssertEqual(gCalls.opCnt[kOpHold], 2u);
+    XCTAssert(PMSleepServiceGetUUID() != NULL);
+    XCTAssertFalse(CFEqual(uuid, PMSleepServiceGetUUID()));
+    CFRelease(uuid);
+}
+
+- (void)testEndOnlyLeavesSessions
+{
+    PMSleepServiceEnd();
+    XCTAssertEqual(gCalls.callCnt, 0u);
+
+    XCTAssertTrue(PMSleepServiceBegin(30000));
+    PMSleepServiceExpire();
+    PMSleepServiceEnd();
+    XCTAssertEqual(gCalls.opCnt[kOpSessionChanged], 2u);
+    XCTAssertFalse(gCalls.last[kOpSessionChanged].arg0);
+
+    PMSleepServiceEnd();
+    XCTAssertEqual(gCalls.opCnt[kOpSessionChanged], 2u);
+    XCTAssertEqual(PMSleepServiceGetState(), kPMSleepServiceIdle);
+}
+
+@end
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Helpers shared by the powerd unit tests: a common starting point for made
+ * up and virtual clocks, repeatable random input, a call log for mock ops
+ * tables and tagged benchmark output.
+ */
+
+#ifndef PMTestSupport_h
+#define PMTestSupport_h
+
+#import <Foundation/Foundation.h>
+#include <time.h>
+
+// CFAbsoluteTime the tests start their clocks at
+#define kPMTestTimeBase         700000000.0
+
+#define PMTestCount(array)      (sizeof(array) / sizeof((array)[0]))
+
+// Prints a benchmark result in a form that can be pulled out of the test log
+#define PMTestBenchLog(fmt, ...) NSLog(@"PMBench " fmt @"\n", ##__VA_ARGS__)
+
+static inline uint64_t PMTestNowNs(void)
+{
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+/*
+ * Linear congruential generator, so that benches and replays see the same
+ * input on every run and platform.
+ */
+static inline uint32_t PMTestRandom(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8) & 0xffff;
+}
+
+static inline double PMTestRandRange(uint32_t *seed, double lo, double hi)
+{
+    return lo + (hi - lo) * PMTestRandom(seed) / 65535.0;
+}
+
+/*
+ * Calls made into a mock ops table. Mocks record each call with an op of
+ * their choosing and up to two arguments; tests then check the counts, the
+ * last call of an op or the whole sequence.
+ */
+#define kPMTestMaxOps           8
+#define kPMTestMaxCalls         16
+
+typedef struct {
+    uint32_t        op;
+    uint64_t        tMs;            // Test time of the call, if the test keeps one
+    uint64_t        arg0;
+    uint64_t        arg1;
+} PMTestCall;
+
+typedef struct {
+    uint64_t        nowMs;
+    PMTestCall      calls[kPMTestMaxCalls];
+    uint32_t        callCnt;        // May exceed kPMTestMaxCalls; later calls are only counted
+    uint32_t        opCnt[kPMTestMaxOps];
+    PMTestCall      last[kPMTestMaxOps];
+} PMTestCallLog;
+
+static inline void PMTestCallLogReset(PMTestCallLog *log)
+{
+    bzero(log, sizeof(*log));
+}
+
+static inline void PMTestRecordCall(PMTestCallLog *log, uint32_t op, uint64_t arg0, uint64_t arg1)
+{
+    PMTestCall call = { op, log->nowMs, arg0, arg1 };
+
+    if (log->callCnt < kPMTestMaxCalls) {
+        log->calls[log->callCnt] = call;
+    }
+    log->callCnt++;
+    if (op < kPMTestMaxOps) {
+        log->opCnt[op]++;
+        log->last[op] = call;
+    }
+}
+
+/*
+ * Define a mock op named 'fn' that only records 'op' in 'log', along with
+ * its arguments. Signed arguments are sign extended, so -1 reads back as
+ * (uint64_t)-1. Mocks that do more than record are written out by hand.
+ */
+#define PMTestMockOp(log, fn, op) \
+    static void fn(void) { PMTestRecordCall(&(log), (op), 0, 0); }
+
+#define PMTestMockOp1(log, fn, op, T0) \
+    static void fn(T0 a0) { PMTestRecordCall(&(log), (op), (uint64_t)(int64_t)a0, 0); }
+
+#define PMTestMockOp2(log, fn, op, T0, T1) \
+    static void fn(T0 a0, T1 a1) { PMTestRecordCall(&(log), (op), (uint64_t)(int64_t)a0, (uint64_t)(int64_t)a1); }
+
+#endif /* PMTestSupport_h */
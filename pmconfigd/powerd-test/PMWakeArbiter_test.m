@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * PMWakeArbiterTests runs tables of wake candidates through the arbiter and
+ * checks which wake gets scheduled. Times are made up, so the arbiter runs
+ * without a powerd instance or a real clock.
+ *
+ * testMergeBench counts the wakes needed to serve a day of random requests
+ * with and without tolerance, and how long arbitration takes.
+ */
+
+#import <XCTest/XCTest.h>
+
+#include "PrivateLib.h"
+#include "PMWakeArbiter.h"
+#include "PMTestSupport.h"
+
+#define kBase           kPMTestTimeBase
+
+typedef struct {
+    const char      *source;
+    CFTimeInterval  deadline;       // Relative to kBase
+    CFTimeInterval  tolerance;
+    CFTimeInterval  notBefore;      // Relative to kBase; 0 for none
+    uint32_t        priority;
+    wakeType_e      type;
+} arbiterInput_t;
+
+typedef struct {
+    const char      *name;
+    arbiterInput_t  inputs[4];
+    bool            disableDarkWakes;
+    CFTimeInterval  wakeTime;       // Relative to kBase
+    int             chosenIdx;
+    wakeType_e      type;
+    uint32_t        mergedCnt;
+} arbiterCase_t;
+
+#define DARK(src, t, tol, nb, ty)   { src, t, tol, nb, kPMWakePriorityDarkWake, ty }
+#define USER(t)                     { "UserWake", t, 0, 0, kPMWakePriorityUserWake, kChooseFullWake }
+
+static const arbiterCase_t gCases[] = {
+    { "user wake wins a tie",
+      { DARK("Maintenance", 100, 0, 0, kChooseMaintenance), USER(100) },
+      false, 100, 1, kChooseFullWake, 2 },
+    { "earlier dark wake wins",
+      { DARK("Maintenance", 100, 0, 0, kChooseMaintenance), USER(200) },
+      false, 100, 0, kChooseMaintenance, 1 },
+    { "first of equal dark wakes wins",
+      { DARK("TimerPlugin", 100, 0, 0, kChooseTimerPlugin), DARK("Maintenance", 100, 0, 0, kChooseMaintenance) },
+      false, 100, 0, kChooseTimerPlugin, 2 },
+    { "dark wake held off by notBefore",
+      { DARK("Maintenance", 10, 0, 60, kChooseMaintenance), USER(30) },
+      false, 30, 1, kChooseFullWake, 1 },
+    { "TCPKA wins at the notBefore floor",
+      { DARK("Maintenance", 10, 0, 60, kChooseMaintenance),
+        { "TCPKATurnOff", 60, 0, 60, kPMWakePriorityTCPKA, kChooseMaintenance } },
+      false, 60, 1, kChooseMaintenance, 2 },
+    { "shutdown wins a tie with user wake",
+      { USER(100), { "Shutdown/Restart", 100, 0, 0, kPMWakePriorityShutdownRestart, kChooseMaintenance } },
+      false, 100, 1, kChooseMaintenance, 2 },
+    { "dark wakes disabled",
+      { DARK("Maintenance", 100, 0, 0, kChooseMaintenance), USER(500) },
+      true, 500, 1, kChooseFullWake, 1 },
+    { "tolerance merges nearby wakes",
+      { DARK("AdaptiveWake", 100, 60, 0, kChooseSleepServiceWake), DARK("Maintenance", 130, 0, 0, kChooseMaintenance) },
+      false, 130, 0, kChooseSleepServiceWake, 2 },
+    { "merged dark wake rides on user wake",
+      { DARK("AdaptiveWake", 100, 60, 0, kChooseSleepServiceWake), USER(150) },
+      false, 150, 1, kChooseFullWake, 2 },
+    { "no merge past tolerance",
+      { DARK("AdaptiveWake", 100, 60, 0, kChooseSleepServiceWake), DARK("Maintenance", 200, 0, 0, kChooseMaintenance) },
+      false, 100, 0, kChooseSleepServiceWake, 1 },
+};
+
+static void registerInput(const arbiterInput_t *in)
+{
+    PMWakeCandidate c;
+
+    bzero(&c, sizeof(c));
+    c.deadline = kBase + in->deadline;
+    c.tolerance = in->tolerance;
+    c.notBefore = in->notBefore ? (kBase + in->notBefore) : 0;
+    c.priority = in->priority;
+    c.flags = (in->priority == kPMWakePriorityUserWake || in->priority == kPMWakePriorityShutdownRestart) ?
+                0 : kPMWakeCandidateDarkWake;
+    c.type = in->type;
+    c.source = in->source;
+    PMWakeArbiterRegister(&c);
+}
+
+@interface PMWakeArbiterTests : XCTestCase
+@end
+
+@implementation PMWakeArbiterTests
+
+- (void)testArbitrationTable
+{
+    for (size_t i = 0; i < PMTestCount(gCases); i++) {
+        const arbiterCase_t *tc = &gCases[i];
+        PMWakeChoice        choice;
+
+        PMWakeArbiterReset();
+        for (size_t n = 0; n < PMTestCount(tc->inputs) && tc->inputs[n].source; n++) {
+            registerInput(&tc->inputs[n]);
+        }
+        if (tc->disableDarkWakes) {
+            PMWakeArbiterDisableDarkWakes();
+        }
+
+        XCTAssertTrue(PMWakeArbiterChoose(&choice), @"%s", tc->name);
+        XCTAssertEqual(choice.wakeTime, kBase + tc->wakeTime, @"%s", tc->name);
+        XCTAssertEqual(choice.chosenIdx, tc->chosenIdx, @"%s", tc->name);
+        XCTAssertEqual(choice.chosen->type, tc->type, @"%s", tc->name);
+        XCTAssertEqual(choice.mergedCnt, tc->mergedCnt, @"%s", tc->name);
+    }
+    PMWakeArbiterReset();
+}
+
+- (void)testChooseDrainsInOrder
+{
+    PMWakeChoice            choice;
+    CFAbsoluteTime          last = 0;
+    uint32_t                served = 0;
+    const arbiterInput_t    inputs[] = {
+        DARK("Maintenance", 300, 0, 0, kChooseMaintenance),
+        USER(100),
+        DARK("TimerPlugin", 200, 0, 0, kChooseTimerPlugin),
+    };
+
+    PMWakeArbiterReset();
+    for (size_t n = 0; n < PMTestCount(inputs); n++) {
+        registerInput(&inputs[n]);
+    }
+    while (PMWakeArbiterChoose(&choice)) {
+        XCTAssertGreaterThan(choice.wakeTime, last);
+        last = choice.wakeTime;
+        served += choice.mergedCnt;
+    }
+    XCTAssertEqual(served, 3u);
+    XCTAssertFalse(PMWakeArbiterChoose(&choice));
+}
+
+- (void)testEventTypeOutlivesEvent
+{
+    PMWakeCandidate     c;
+    PMWakeChoice        choice;
+    CFMutableStringRef  type = CFStringCreateMutableCopy(0, 0, CFSTR(kIOPMAutoWakeOrPowerOn));
+
+    // PMConnection releases the event the type came from before it logs the chosen wake
+    bzero(&c, sizeof(c));
+    c.deadline = kBase + 100;
+    c.priority = kPMWakePriorityUserWake;
+    c.source = "UserWake";
+    c.eventType = type;
+    PMWakeArbiterReset();
+    PMWakeArbiterRegister(&c);
+    XCTAssertEqual(CFGetRetainCount(type), 2L);
+    CFRelease(type);
+
+    XCTAssertTrue(PMWakeArbiterChoose(&choice));
+    XCTAssertTrue(CFEqual(choice.chosen->eventType, CFSTR(kIOPMAutoWakeOrPowerOn)));
+    PMWakeArbiterReset();
+}
+
+- (uint32_t)countWakes:(uint32_t)cnt tolerance:(CFTimeInterval)tolerance ns:(uint64_t *)arbitrationNs
+{
+    PMWakeChoice    choice;
+    uint32_t        wakes = 0;
+    uint32_t        served = 0;
+    uint32_t        seed = 0x5eed;
+    uint64_t        start;
+
+    start = PMTestNowNs();
+    PMWakeArbiterReset();
+    for (uint32_t i = 0; i < cnt; i++) {
+        CFTimeInterval  t = PMTestRandRange(&seed, 0, 86400);
+        arbiterInput_t  in = DARK("Maintenance", t, tolerance, 0, kChooseMaintenance);
+        registerInput(&in);
+    }
+    while (PMWakeArbiterChoose(&choice)) {
+        wakes++;
+        served += choice.mergedCnt;
+    }
+    *arbitrationNs = PMTestNowNs() - start;
+
+    // Every request is served exactly once, whatever the tolerance
+    XCTAssertEqual(served, cnt);
+    return wakes;
+}
+
+- (void)testMergeBench
+{
+    const uint32_t  cnt = 20000;
+    uint64_t        exactNs, mergedNs;
+    uint32_t        exact = [self countWakes:cnt tolerance:0 ns:&exactNs];
+    uint32_t        merged = [self countWakes:cnt tolerance:120 ns:&mergedNs];
+
+    PMTestBenchLog(@"wake arbitration: %u requests over a day, %u wakes exact (%llu us), %u wakes with 120s tolerance (%llu us)",
+                   cnt, exact, exactNs / NSEC_PER_USEC, merged, mergedNs / NSEC_PER_USEC);
+
+    // Without tolerance only deadlines that coincide share a wake, and few do
+    XCTAssertGreaterThan(exact, cnt / 2);
+    // With 120s of tolerance a day needs at most one wake per two minutes
+    XCTAssertLessThanOrEqual(merged, 86400u / 120 + 1);
+    XCTAssertLessThan(merged, exact);
+    PMWakeArbiterReset();
+}
+
+@end
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * PMWakeReasonTests checks how wake reasons longer than the fixed-size
+ * PMWakeReasonInfo buffers are decoded, and how app wake claims are kept.
+ */
+
+#import <XCTest/XCTest.h>
+
+#include "PrivateLib.h"
+
+@interface PMWakeReasonTests : XCTestCase
+@end
+
+@implementation PMWakeReasonTests
+
+- (void)testLongReason
+{
+    const PMWakeReasonInfo  *info = getWakeReasonInfo();
+    NSMutableString         *reason = [NSMutableString string];
+
+    // The RTC mention is past the end of wakeInfo.reason
+    while (reason.length < 2 * kWakeReasonStrLen) {
+        [reason appendString:@"EC.LidOpen/Lid "];
+    }
+    [reason appendString:@"RTC/Alarm"];
+
+    decodeWakeReasonInfo((__bridge CFStringRef)reason, CFSTR(kIOPMRootDomainWakeTypeMaintenance), NULL);
+
+    XCTAssertEqual(strlen(info->reason), (size_t)kWakeReasonStrLen - 1);
+    XCTAssertEqual(strncmp(info->reason, reason.UTF8String, kWakeReasonStrLen - 1), 0);
+    XCTAssert(info->flags & kWakeReasonRTCFlag);
+    XCTAssert(info->flags & kWakeTypeMaintenanceFlag);
+    XCTAssertEqual(info->claimedBy[0], 0);
+}
+
+- (void)testLongReasonKeepsWholeCharacters
+{
+    const PMWakeReasonInfo  *info = getWakeReasonInfo();
+    NSMutableString         *reason = [NSMutableString string];
+
+    // Two-byte characters can't fill the odd number of bytes available
+    while (reason.length < kWakeReasonStrLen) {
+        [reason appendString:@"é"];
+    }
+
+    decodeWakeReasonInfo((__bridge CFStringRef)reason, CFSTR(""), NULL);
+
+    XCTAssertEqual(strlen(info->reason), (size_t)kWakeReasonStrLen - 2);
+    XCTAssertNotNil([NSString stringWithUTF8String:info->reason]);
+    XCTAssertFalse(info->flags & kWakeReasonRTCFlag);
+}
+
+- (void)testManyAppClaims
+{
+    const uint32_t  cnt = 100;
+
+    _resetWakeReason();
+    for (uint32_t i = 0; i < cnt; i++) {
+        setAppWakeReason((__bridge CFStringRef)[NSString stringWithFormat:@"pmtest.claim.%u", i]);
+    }
+    for (uint32_t i = 0; i < cnt; i++) {
+        XCTAssert(checkForAppWakeReasonCString([NSString stringWithFormat:@"pmtest.claim.%u", i].UTF8String),
+                  @"Claim %u was dropped", i);
+    }
+    XCTAssertFalse(checkForAppWakeReasonCString("pmtest.claim.none"));
+    XCTAssertEqual(getWakeReasonInfo()->appClaimCount, cnt);
+
+    _resetWakeReason();
+    XCTAssertFalse(checkForAppWakeReasonCString("pmtest.claim.0"));
+}
+
+- (void)testLongAppClaimMatchesAcrossStringTypes
+{
+    NSMutableString *reason = [NSMutableString string];
+    NSMutableString *other;
+
+    // Two-byte characters that don't end on the truncation boundary
+    while (reason.length < kWakeReasonStrLen) {
+        [reason appendString:@"é"];
+    }
+    other = [reason mutableCopy];
+    [other appendString:@"x"];
+
+    _resetWakeReason();
+    setAppWakeReason((__bridge CFStringRef)reason);
+    XCTAssert(checkForAppWakeReasonCString(reason.UTF8String));
+    XCTAssert(checkForAppWakeReason((__bridge CFStringRef)reason));
+
+    // Reasons that only differ past the limit are the same claim
+    XCTAssert(checkForAppWakeReasonCString(other.UTF8String));
+    _resetWakeReason();
+}
+
+@end
@@ -61,6 +61,7 @@ struct args_struct {
     char    *batteryPropsPath;
     long    nccpUpdateDelta;
     int64_t pfStatus;
+    char    *assertionTracePath;
     
     /* If takeAssertionNamed != NULL; that implies our action is to take an assertion */
     CFStringRef         takeAssertionNamed;
@@ -265,6 +266,11 @@ static DTOption pmtool_options[] =
           no_argument, &args.doAction[kGetAgingDataFromPrefsIndex], 1}, kActionType,
         "Gets the aging controller data from CFPrefs and returns it as an XML plist.\n",
         { NULL }, {NULL}},
+    { {kActionAssertionTrace,
+          required_argument, &args.doAction[kAssertionTraceIndex], 1}, kActionType,
+        "<path|off> Starts recording assertion API calls made to powerd into a new binary trace file at the specified path, or stops recording with \'off\'.\n\
+            The trace can be replayed against the assertion engine by the powerd_test PMAssertionTraceReplay tests.\n",
+        { NULL }, {NULL}},
 #if TARGET_OS_OSX
     { {kActionGetVactSupported,
           no_argument, &args.doAction[kGetVactSupportedIndex], 1}, kActionType,
@@ -331,6 +337,10 @@ int main(int argc, char *argv[])
         sendAgingDataFromCFPrefs();
         exit(1);
     }
+    if (args.doAction[kAssertionTraceIndex]) {
+        sendAssertionTraceCommand(args.assertionTracePath);
+        exit(1);
+    }
 
 #if TARGET_OS_OSX
 
@@ -686,6 +696,9 @@ static bool parse_it_all(int argc, char *argv[]) {
         else if (arg && !strcmp(arg, kActionSetBattProps)) {
             args.batteryPropsPath = strdup(optarg);
         }
+        else if (arg && !strcmp(arg, kActionAssertionTrace)) {
+            args.assertionTracePath = strdup(strcmp(optarg, "off") ? optarg : "");
+        }
         else if (arg && !strcmp(arg, kActionSetBHUpdateDelta)) {
             args.nccpUpdateDelta = (int)strtol(optarg, NULL, 0);
         }
@@ -1722,6 +1735,64 @@ static void sendInactivityWindowCommand(long start, long duration, long delay)
 }
 #endif
 
+static void sendAssertionTraceCommand(const char *path)
+{
+    xpc_object_t            msg = NULL;
+    xpc_object_t            connection;
+
+    if (geteuid() != 0) {
+        printf("Error: This command must be issued as root\n");
+        return;
+    }
+    if (!path) {
+        printf("Error: No trace path specified\n");
+        return;
+    }
+    connection = xpc_connection_create_mach_service(POWERD_XPC_ID, dispatch_get_main_queue(), 0);
+    if (!connection) {
+        printf("Failed to open connection\n");
+        return;
+    }
+    xpc_connection_set_target_queue(connection, dispatch_get_main_queue());
+
+    xpc_connection_set_event_handler(connection,
+        ^(xpc_object_t msg ) {processXpcEvent(msg); });
+
+    xpc_connection_resume(connection);
+
+    msg = xpc_dictionary_create(NULL, NULL, 0);
+    if (msg) {
+        xpc_dictionary_set_string(msg, kAssertionTraceMsg, path);
+
+        xpc_connection_send_message_with_reply(connection, msg, dispatch_get_main_queue(), ^(xpc_object_t reply) {
+            if (xpc_get_type(reply) == XPC_TYPE_DICTIONARY) {
+                uint64_t err = xpc_dictionary_get_uint64(reply, kMsgReturnCode);
+                if (err == 0) {
+                    printf("Assertion trace %s\n", path[0] ? "started" : "stopped");
+                }
+                else {
+                    printf("Failed to change assertion trace state(err:0x%llx)\n", err);
+                }
+            }
+            else {
+                printf("Received unknown response\n");
+            }
+            xpc_connection_cancel(connection);
+            exit(0);
+        });
+
+        dispatch_main();
+    }
+    else {
+        printf("Failed to create xpc objects to send message\n");
+    }
+    if (msg) {
+        xpc_release(msg);
+    }
+
+    xpc_release(connection);
+}
+
 CFPropertyListRef createPlistLoadFile(const char* plistFilename)
 {
 	CFURLRef fileURL = NULL;
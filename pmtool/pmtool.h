@@ -70,6 +70,9 @@ typedef struct DTAssertionOption DTAssertionOption;
 
 #define POWERD_XPC_ID "com.apple.iokit.powerdxpc"
 
+/* Must match kAssertionTraceMsg in pmconfigd/PMAssertionTrace.h */
+#define kAssertionTraceMsg "assertionTrace"
+
 /*************************************************************************/
 static void usage(void);
 static struct option *long_opts_from_pmtool_opts(int *);
@@ -120,6 +123,7 @@ static void sendCustomBatteryProperties(char *path);
 static void sendBHUpdateTimeDelta(long timeDelta);
 static void sendBHDataFromCFPrefs(void);
 static void sendAgingDataFromCFPrefs(void);
+static void sendAssertionTraceCommand(const char *path);
 #if TARGET_OS_OSX
 static void isVactSupported(void);
 static void setPermFaultStatus(int64_t pfStatus);
@@ -177,6 +181,7 @@ typedef enum {
     kGetAgingDataFromPrefsIndex,
     kGetVactSupportedIndex,
     kSetPermFaultStatusIndex,
+    kAssertionTraceIndex,
     kActionsCount   // kActionsCount must always be the last item in this list
 } pmtoolActions;
 
@@ -260,6 +265,7 @@ enum {
 #define kActionGetAgingDataFromPrefs                    "getagingdatafromprefs"
 #define kActionGetVactSupported                         "isvactsupported"
 #define kActionSetPermFaultStatus                       "setpermfaultstatus"
+#define kActionAssertionTrace                           "assertiontrace"
 
 #define kArgIOPMConnection                              "iopmconnection"
 #define kArgIORegisterForSystemPower                    "ioregisterforsystempower"